@@ -16,7 +16,14 @@
 #include <stdbool.h>
 #endif
 
+/**
+ * Number of entries in the ring.  May be overridden at build time (the
+ * benchmarks build several sizes); in_offs/out_offs are uint8_t so it must
+ * stay at or below 255.
+ */
+#ifndef AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED
 #define AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED 10
+#endif
 
 struct aesd_buffer_entry
 {
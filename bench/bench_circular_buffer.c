@@ -0,0 +1,193 @@
+/**
+ * @file bench_circular_buffer.c
+ * @brief Microbenchmarks for the aesd circular buffer
+ *
+ * Measures aesd_circular_buffer_add_entry, find_entry_offset_for_fpos with
+ * sequential and random offsets, and a full walk of the ring, for several
+ * entry size distributions.  The ring size is fixed at compile time by
+ * AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED, so CMake builds one executable per
+ * size.  Results are printed as a single JSON object on stdout.
+ *
+ * Usage: bench_circular_buffer_<ring> [iterations]
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "aesd-circular-buffer.h"
+
+#define RING_SIZE AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED
+#define DEFAULT_ITERATIONS 2000000UL
+#define MAX_ENTRY_SIZE 65536
+
+struct size_dist {
+    const char *name;
+    size_t (*next)(uint64_t *rng);
+};
+
+/* Keeps results observable so the compiler cannot drop the measured work */
+static volatile size_t g_sink;
+
+static char g_payload[MAX_ENTRY_SIZE];
+
+static uint64_t xorshift64(uint64_t *s)
+{
+    uint64_t x = *s;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    *s = x;
+    return x;
+}
+
+static size_t dist_fixed64(uint64_t *rng)
+{
+    (void)rng;
+    return 64;
+}
+
+static size_t dist_uniform(uint64_t *rng)
+{
+    return 1 + (size_t)(xorshift64(rng) % 4096);
+}
+
+/* Mostly short lines with the occasional large one, like a log with dumps */
+static size_t dist_skewed(uint64_t *rng)
+{
+    return (xorshift64(rng) % 10 == 0) ? MAX_ENTRY_SIZE : 16;
+}
+
+static const struct size_dist g_dists[] = {
+    { "fixed64", dist_fixed64 },
+    { "uniform_1_4096", dist_uniform },
+    { "skewed_16_64k", dist_skewed },
+};
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+/* Fill every slot of the ring and return the total number of bytes it holds */
+static size_t fill_ring(struct aesd_circular_buffer *buffer, const struct size_dist *dist, uint64_t *rng)
+{
+    struct aesd_buffer_entry entry;
+    size_t total = 0;
+    size_t i;
+
+    aesd_circular_buffer_init(buffer);
+    for (i = 0; i < RING_SIZE; i++) {
+        entry.buffptr = g_payload;
+        entry.size = dist->next(rng);
+        total += entry.size;
+        aesd_circular_buffer_add_entry(buffer, &entry);
+    }
+    return total;
+}
+
+static void print_result(int *first, const char *bench, const char *dist,
+                         unsigned long iterations, uint64_t elapsed_ns)
+{
+    printf("%s\n    {\"bench\": \"%s\", \"dist\": \"%s\", \"iterations\": %lu, \"ns_per_op\": %.3f}",
+           *first ? "" : ",", bench, dist, iterations,
+           iterations ? (double)elapsed_ns / (double)iterations : 0.0);
+    *first = 0;
+}
+
+static uint64_t bench_add_entry(const struct size_dist *dist, unsigned long iterations)
+{
+    struct aesd_circular_buffer buffer;
+    struct aesd_buffer_entry entry = { .buffptr = g_payload, .size = 0 };
+    uint64_t rng = 0x9e3779b97f4a7c15ull;
+    unsigned long i;
+    uint64_t t0;
+
+    aesd_circular_buffer_init(&buffer);
+    t0 = now_ns();
+    for (i = 0; i < iterations; i++) {
+        entry.size = dist->next(&rng);
+        aesd_circular_buffer_add_entry(&buffer, &entry);
+    }
+    g_sink += buffer.in_offs;
+    return now_ns() - t0;
+}
+
+static uint64_t bench_find(const struct size_dist *dist, unsigned long iterations, int random)
+{
+    struct aesd_circular_buffer buffer;
+    uint64_t rng = 0x2545f4914f6cdd1dull;
+    size_t total = fill_ring(&buffer, dist, &rng);
+    size_t offset = 0, entry_offset = 0;
+    unsigned long i;
+    uint64_t t0;
+
+    t0 = now_ns();
+    for (i = 0; i < iterations; i++) {
+        if (random) {
+            offset = (size_t)(xorshift64(&rng) % total);
+        } else if (++offset >= total) {
+            offset = 0;
+        }
+        g_sink += (size_t)aesd_circular_buffer_find_entry_offset_for_fpos(&buffer, offset, &entry_offset);
+        g_sink += entry_offset;
+    }
+    return now_ns() - t0;
+}
+
+static uint64_t bench_iterate(const struct size_dist *dist, unsigned long iterations)
+{
+    struct aesd_circular_buffer buffer;
+    struct aesd_buffer_entry *entry;
+    uint64_t rng = 0xda942042e4dd58b5ull;
+    uint8_t index;
+    unsigned long i;
+    uint64_t t0;
+
+    fill_ring(&buffer, dist, &rng);
+    t0 = now_ns();
+    for (i = 0; i < iterations; i++) {
+        size_t sum = 0;
+        AESD_CIRCULAR_BUFFER_FOREACH(entry, &buffer, index) {
+            sum += entry->size;
+        }
+        g_sink += sum;
+    }
+    return now_ns() - t0;
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned long iterations = DEFAULT_ITERATIONS;
+    unsigned long passes;
+    int first = 1;
+    size_t d;
+
+    if (argc > 1) {
+        iterations = strtoul(argv[1], NULL, 10);
+        if (iterations == 0) {
+            fprintf(stderr, "Usage: %s [iterations]\n", argv[0]);
+            return 1;
+        }
+    }
+    memset(g_payload, 'x', sizeof(g_payload));
+    /* A full walk touches every slot, so scale it to a similar amount of work */
+    passes = iterations / RING_SIZE ? iterations / RING_SIZE : 1;
+
+    printf("{\n  \"ring_size\": %d,\n  \"results\": [", RING_SIZE);
+    for (d = 0; d < sizeof(g_dists) / sizeof(g_dists[0]); d++) {
+        const struct size_dist *dist = &g_dists[d];
+        print_result(&first, "add_entry", dist->name, iterations, bench_add_entry(dist, iterations));
+        print_result(&first, "find_sequential", dist->name, iterations, bench_find(dist, iterations, 0));
+        print_result(&first, "find_random", dist->name, iterations, bench_find(dist, iterations, 1));
+        print_result(&first, "iterate_ring", dist->name, passes, bench_iterate(dist, passes));
+    }
+    printf("\n  ]\n}\n");
+    return 0;
+}
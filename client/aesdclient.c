@@ -0,0 +1,520 @@
+/**
+ * aesdclient.c
+ *
+ * - Pool of connections; a submission goes to the connection with the
+ *   fewest unanswered lines and reconnects it first if it has died
+ * - Per connection: a ring of pending callbacks in wire order, a send lock
+ *   that keeps ring order and wire order the same, and a reader thread
+ *   that parses "AESDACK <end>" / "AESDR <len>" replies and completes the
+ *   oldest pending line
+ * - Replays nobody asked for are skipped through a fixed buffer
+ * - The ring lock is never held across a send, so a reader draining
+ *   replies is never stuck behind a writer blocked on a full socket
+*/
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "aesdclient.h"
+
+#define DEFAULT_HOST "127.0.0.1"
+#define DEFAULT_PORT "9000"
+#define DEFAULT_MAX_INFLIGHT 256
+#define READ_BUF (64 * 1024)
+#define HEADER_MAX 64
+
+struct pending_req {
+    aesd_client_cb cb;
+    void *arg;
+    unsigned flags;
+};
+
+struct pool_conn {
+    struct aesd_client *client;
+    int fd;
+    bool dead;                  // reader has exited; reconnect before use
+    bool reader_started;
+    pthread_t reader;
+    pthread_mutex_t send_lock;  // one submitter on the wire at a time
+
+    pthread_mutex_t lock;       // protects the ring and 'dead'
+    pthread_cond_t cond;        // ring shrank or connection died
+    struct pending_req *ring;
+    size_t head;
+    size_t count;
+
+    // Reader state, touched only by the reader thread
+    char *buf;
+    size_t boff;
+    size_t blen;
+    char *replay;
+    size_t replay_cap;
+};
+
+struct aesd_client {
+    struct aesd_client_config cfg;
+    struct pool_conn *conns;
+    int nconns;
+    atomic_uint next;           // round-robin start for the least-loaded scan
+    atomic_int failed;          // completions with an error since the last flush
+};
+
+// ---------- connection ----------
+
+static int connect_to(const char *host, const char *port)
+{
+    struct addrinfo hints, *res = NULL, *rp;
+    int fd = -1, one = 1;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    int rc = getaddrinfo(host, port, &hints, &res);
+    if (rc != 0) {
+        errno = EHOSTUNREACH;
+        return -1;
+    }
+    for (rp = res; rp; rp = rp->ai_next) {
+        fd = socket(rp->ai_family, rp->ai_socktype | SOCK_CLOEXEC, rp->ai_protocol);
+        if (fd < 0) continue;
+        if (connect(fd, rp->ai_addr, rp->ai_addrlen) == 0) break;
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+    // Lines are already coalesced by the batch API; don't let Nagle add 40 ms
+    if (fd >= 0) setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return fd;
+}
+
+static int send_all(int fd, const char *buf, size_t len)
+{
+    while (len > 0) {
+        ssize_t s = send(fd, buf, len, MSG_NOSIGNAL);
+        if (s < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        buf += s;
+        len -= (size_t)s;
+    }
+    return 0;
+}
+
+static int writev_all(int fd, struct iovec *iov, int n)
+{
+    struct msghdr msg = { .msg_iov = iov, .msg_iovlen = (size_t)n };
+    while (msg.msg_iovlen > 0) {
+        ssize_t s = sendmsg(fd, &msg, MSG_NOSIGNAL);
+        if (s < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        while (msg.msg_iovlen > 0 && (size_t)s >= msg.msg_iov->iov_len) {
+            s -= (ssize_t)msg.msg_iov->iov_len;
+            msg.msg_iov++;
+            msg.msg_iovlen--;
+        }
+        if (msg.msg_iovlen > 0) {
+            msg.msg_iov->iov_base = (char *)msg.msg_iov->iov_base + s;
+            msg.msg_iov->iov_len -= (size_t)s;
+        }
+    }
+    return 0;
+}
+
+// ---------- reader ----------
+
+// Make at least one more byte available in pc->buf; 0 (errno ECONNRESET) at EOF
+static ssize_t fill(struct pool_conn *pc)
+{
+    if (pc->boff == pc->blen) {
+        pc->boff = pc->blen = 0;
+    } else if (pc->blen == READ_BUF) {
+        memmove(pc->buf, pc->buf + pc->boff, pc->blen - pc->boff);
+        pc->blen -= pc->boff;
+        pc->boff = 0;
+    }
+    for (;;) {
+        ssize_t r = recv(pc->fd, pc->buf + pc->blen, READ_BUF - pc->blen, 0);
+        if (r < 0 && errno == EINTR) continue;
+        if (r > 0) pc->blen += (size_t)r;
+        if (r == 0) errno = ECONNRESET;
+        return r;
+    }
+}
+
+// Copy one header line (without '\n') into line; -1 on EOF or a bad header
+static int read_header(struct pool_conn *pc, char *line)
+{
+    for (;;) {
+        char *nl = memchr(pc->buf + pc->boff, '\n', pc->blen - pc->boff);
+        if (nl) {
+            size_t n = (size_t)(nl - (pc->buf + pc->boff));
+            if (n >= HEADER_MAX) {
+                errno = EPROTO;
+                return -1;
+            }
+            memcpy(line, pc->buf + pc->boff, n);
+            line[n] = '\0';
+            pc->boff += n + 1;
+            return 0;
+        }
+        if (pc->blen - pc->boff >= HEADER_MAX) {
+            errno = EPROTO;
+            return -1;
+        }
+        if (fill(pc) <= 0) return -1;
+    }
+}
+
+// Consume a len byte replay, copying it into pc->replay if keep
+static int read_payload(struct pool_conn *pc, size_t len, bool keep)
+{
+    if (keep && len > pc->replay_cap) {
+        char *p = realloc(pc->replay, len);
+        if (!p) return -1;
+        pc->replay = p;
+        pc->replay_cap = len;
+    }
+    size_t got = 0;
+    while (got < len) {
+        if (pc->boff == pc->blen && fill(pc) <= 0) return -1;
+        size_t n = pc->blen - pc->boff;
+        if (n > len - got) n = len - got;
+        if (keep) memcpy(pc->replay + got, pc->buf + pc->boff, n);
+        pc->boff += n;
+        got += n;
+    }
+    return 0;
+}
+
+// Complete the oldest pending line
+static void complete(struct pool_conn *pc, int status, off_t end, const char *replay, size_t len)
+{
+    struct aesd_client *c = pc->client;
+    pthread_mutex_lock(&pc->lock);
+    struct pending_req req = pc->ring[pc->head];
+    pthread_mutex_unlock(&pc->lock);
+
+    if (status != 0) atomic_fetch_add(&c->failed, 1);
+    if (req.cb) req.cb(req.arg, status, end, replay, len);
+
+    // Free the slot only now, so flush() returns after the last callback
+    pthread_mutex_lock(&pc->lock);
+    pc->head = (pc->head + 1) % (size_t)c->cfg.max_inflight;
+    pc->count--;
+    pthread_cond_broadcast(&pc->cond);
+    pthread_mutex_unlock(&pc->lock);
+}
+
+static void *reader_thread(void *arg)
+{
+    struct pool_conn *pc = arg;
+    char line[HEADER_MAX];
+    int status = ECONNRESET;
+
+    for (;;) {
+        long long v;
+        if (read_header(pc, line) != 0) {
+            status = errno;
+            break;
+        }
+
+        pthread_mutex_lock(&pc->lock);
+        bool idle = pc->count == 0;
+        bool keep = !idle && (pc->ring[pc->head].flags & AESD_CLIENT_WANT_REPLAY);
+        pthread_mutex_unlock(&pc->lock);
+        if (idle) {
+            status = EPROTO;            // a reply nobody asked for
+            break;
+        }
+
+        if (sscanf(line, "AESDACK %lld", &v) == 1) {
+            complete(pc, 0, (off_t)v, NULL, 0);
+        } else if (sscanf(line, "AESDR %lld", &v) == 1 && v >= 0) {
+            // Replays of appends start at 0, so the length is the end offset
+            if (read_payload(pc, (size_t)v, keep) != 0) {
+                status = errno;
+                break;
+            }
+            complete(pc, 0, (off_t)v, keep ? pc->replay : NULL, keep ? (size_t)v : 0);
+        } else {
+            status = EPROTO;
+            break;
+        }
+    }
+
+    // Fail whatever is still outstanding; new submissions reconnect
+    pthread_mutex_lock(&pc->lock);
+    pc->dead = true;
+    while (pc->count > 0) {
+        pthread_mutex_unlock(&pc->lock);
+        complete(pc, status, -1, NULL, 0);
+        pthread_mutex_lock(&pc->lock);
+    }
+    pthread_cond_broadcast(&pc->cond);
+    pthread_mutex_unlock(&pc->lock);
+    return NULL;
+}
+
+// (Re)connect pc, negotiate the reply mode and start its reader
+static int conn_start(struct pool_conn *pc)
+{
+    const struct aesd_client_config *cfg = &pc->client->cfg;
+    const char *mode = cfg->reply == AESD_CLIENT_REPLY_FRAMED ? "framed" : "ack";
+    char line[HEADER_MAX], want[HEADER_MAX];
+    int saved;
+
+    if (pc->reader_started) {
+        pthread_join(pc->reader, NULL);
+        pc->reader_started = false;
+    }
+    if (pc->fd >= 0) close(pc->fd);
+    pc->boff = pc->blen = 0;
+    pc->fd = connect_to(cfg->host, cfg->port);
+    if (pc->fd < 0) return -1;
+
+    // The answer names the mode the server settled on
+    int n = snprintf(line, sizeof(line), "AESDSOCKET_OPTION:reply=%s\n", mode);
+    snprintf(want, sizeof(want), "AESDSOCKET_OPTION:reply=%s", mode);
+    if (send_all(pc->fd, line, (size_t)n) != 0 || read_header(pc, line) != 0) goto fail;
+    if (strcmp(line, want) != 0) {
+        errno = ENOTSUP;            // e.g. the chardev backend: no stable offsets
+        goto fail;
+    }
+
+    pc->dead = false;
+    if ((errno = pthread_create(&pc->reader, NULL, reader_thread, pc)) != 0) goto fail;
+    pc->reader_started = true;
+    return 0;
+
+fail:
+    saved = errno;
+    close(pc->fd);
+    pc->fd = -1;
+    pc->dead = true;
+    errno = saved;
+    return -1;
+}
+
+// ---------- API ----------
+
+struct aesd_client *aesd_client_open(const struct aesd_client_config *cfg)
+{
+    struct aesd_client *c = calloc(1, sizeof(*c));
+    int ok = 0;
+    if (!c) return NULL;
+
+    c->cfg = *cfg;
+    if (!c->cfg.host) c->cfg.host = DEFAULT_HOST;
+    if (!c->cfg.port) c->cfg.port = DEFAULT_PORT;
+    if (c->cfg.connections < 1) c->cfg.connections = 1;
+    if (c->cfg.max_inflight < 1) c->cfg.max_inflight = DEFAULT_MAX_INFLIGHT;
+
+    c->conns = calloc((size_t)c->cfg.connections, sizeof(*c->conns));
+    if (!c->conns) {
+        free(c);
+        return NULL;
+    }
+    c->nconns = c->cfg.connections;
+    for (int i = 0; i < c->nconns; i++) {
+        struct pool_conn *pc = &c->conns[i];
+        pc->client = c;
+        pc->fd = -1;
+        pc->dead = true;
+        pthread_mutex_init(&pc->send_lock, NULL);
+        pthread_mutex_init(&pc->lock, NULL);
+        pthread_cond_init(&pc->cond, NULL);
+        pc->ring = calloc((size_t)c->cfg.max_inflight, sizeof(*pc->ring));
+        pc->buf = malloc(READ_BUF);
+        if (pc->ring && pc->buf && conn_start(pc) == 0) ok++;
+    }
+    // Dead members are retried on use; with none alive there is nothing to use
+    if (ok == 0) {
+        int saved = errno;
+        aesd_client_close(c);
+        errno = saved;
+        return NULL;
+    }
+    return c;
+}
+
+static bool valid_line(const char *line, size_t len)
+{
+    return len > 0 && line[len - 1] == '\n' && !memchr(line, '\n', len - 1);
+}
+
+// Least loaded connection, scanning from a rotating start so ties spread out
+static struct pool_conn *pick(struct aesd_client *c)
+{
+    unsigned start = atomic_fetch_add(&c->next, 1);
+    struct pool_conn *best = NULL;
+    size_t best_count = 0;
+    for (int i = 0; i < c->nconns; i++) {
+        struct pool_conn *pc = &c->conns[(start + (unsigned)i) % (unsigned)c->nconns];
+        pthread_mutex_lock(&pc->lock);
+        size_t count = pc->count;
+        pthread_mutex_unlock(&pc->lock);
+        if (!best || count < best_count) {
+            best = pc;
+            best_count = count;
+        }
+    }
+    return best;
+}
+
+int aesd_client_submit_batch(struct aesd_client *c, const struct iovec *lines, int n,
+                             unsigned flags, aesd_client_cb cb, void *arg)
+{
+    struct iovec iov[AESD_CLIENT_MAX_BATCH];
+    int rc = -1;
+
+    if (n < 1 || n > AESD_CLIENT_MAX_BATCH) {
+        errno = EINVAL;
+        return -1;
+    }
+    for (int i = 0; i < n; i++) {
+        if (!valid_line(lines[i].iov_base, lines[i].iov_len)) {
+            errno = EINVAL;
+            return -1;
+        }
+        iov[i] = lines[i];
+    }
+
+    struct pool_conn *pc = pick(c);
+    pthread_mutex_lock(&pc->send_lock);
+    pthread_mutex_lock(&pc->lock);
+    bool dead = pc->dead;
+    pthread_mutex_unlock(&pc->lock);
+    if (dead && conn_start(pc) != 0) goto out;
+
+    // Room for the whole batch, or an empty ring for one larger than it
+    size_t cap = (size_t)c->cfg.max_inflight;
+    pthread_mutex_lock(&pc->lock);
+    while (!pc->dead && pc->count > 0 && pc->count + (size_t)n > cap) {
+        pthread_cond_wait(&pc->cond, &pc->lock);
+    }
+    if (pc->dead || (size_t)n > cap) {
+        pthread_mutex_unlock(&pc->lock);
+        errno = pc->dead ? ECONNRESET : EINVAL;
+        goto out;
+    }
+    for (int i = 0; i < n; i++) {
+        struct pending_req *r = &pc->ring[(pc->head + pc->count) % cap];
+        r->cb = cb;
+        r->arg = arg;
+        r->flags = flags;
+        pc->count++;
+    }
+    pthread_mutex_unlock(&pc->lock);
+
+    // A failed send leaves the entries queued; the reader fails them on EOF
+    if (writev_all(pc->fd, iov, n) != 0) {
+        shutdown(pc->fd, SHUT_RDWR);
+        goto out;
+    }
+    rc = 0;
+out:
+    pthread_mutex_unlock(&pc->send_lock);
+    return rc;
+}
+
+int aesd_client_submit(struct aesd_client *c, const char *line, size_t len,
+                       unsigned flags, aesd_client_cb cb, void *arg)
+{
+    struct iovec iov = { .iov_base = (void *)line, .iov_len = len };
+    return aesd_client_submit_batch(c, &iov, 1, flags, cb, arg);
+}
+
+int aesd_client_flush(struct aesd_client *c)
+{
+    for (int i = 0; i < c->nconns; i++) {
+        struct pool_conn *pc = &c->conns[i];
+        pthread_mutex_lock(&pc->lock);
+        while (pc->count > 0) pthread_cond_wait(&pc->cond, &pc->lock);
+        pthread_mutex_unlock(&pc->lock);
+    }
+    if (atomic_exchange(&c->failed, 0) > 0) {
+        errno = EIO;
+        return -1;
+    }
+    return 0;
+}
+
+struct sync_wait {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    bool done;
+    int status;
+    off_t end;
+};
+
+static void sync_done(void *arg, int status, off_t end, const char *replay, size_t len)
+{
+    struct sync_wait *w = arg;
+    (void)replay;
+    (void)len;
+    pthread_mutex_lock(&w->lock);
+    w->done = true;
+    w->status = status;
+    w->end = end;
+    pthread_cond_signal(&w->cond);
+    pthread_mutex_unlock(&w->lock);
+}
+
+int aesd_client_append(struct aesd_client *c, const char *line, size_t len, off_t *end)
+{
+    struct sync_wait w = { .done = false };
+    pthread_mutex_init(&w.lock, NULL);
+    pthread_cond_init(&w.cond, NULL);
+
+    int rc = aesd_client_submit(c, line, len, 0, sync_done, &w);
+    if (rc == 0) {
+        pthread_mutex_lock(&w.lock);
+        while (!w.done) pthread_cond_wait(&w.cond, &w.lock);
+        pthread_mutex_unlock(&w.lock);
+        if (w.status != 0) {
+            errno = w.status;
+            rc = -1;
+        } else if (end) {
+            *end = w.end;
+        }
+    }
+    pthread_cond_destroy(&w.cond);
+    pthread_mutex_destroy(&w.lock);
+    return rc;
+}
+
+void aesd_client_close(struct aesd_client *c)
+{
+    if (!c) return;
+    aesd_client_flush(c);
+    for (int i = 0; i < c->nconns; i++) {
+        struct pool_conn *pc = &c->conns[i];
+        // The server closes once it sees EOF, which ends the reader
+        if (pc->fd >= 0) shutdown(pc->fd, SHUT_WR);
+        if (pc->reader_started) pthread_join(pc->reader, NULL);
+        if (pc->fd >= 0) close(pc->fd);
+        pthread_cond_destroy(&pc->cond);
+        pthread_mutex_destroy(&pc->lock);
+        pthread_mutex_destroy(&pc->send_lock);
+        free(pc->ring);
+        free(pc->buf);
+        free(pc->replay);
+    }
+    free(c->conns);
+    free(c);
+}
@@ -0,0 +1,74 @@
+/*
+ * aesdclient.h
+ *
+ * libaesdclient: producer side of the aesdsocket protocol.  A client keeps
+ * a small pool of long-lived connections and pipelines lines over them
+ * instead of opening a socket per line and reading a full replay back.
+ *
+ * Each connection negotiates "AESDSOCKET_OPTION:reply=ack" (or
+ * "reply=framed" when replays are wanted), so the server answers every
+ * line with its end offset, or with a length-prefixed replay that the
+ * reader can skip without scanning.  Completions are delivered in
+ * submission order per connection, on that connection's reader thread.
+ *
+ * All functions returning int return 0 on success and -1 with errno set.
+ */
+
+#ifndef AESDCLIENT_H
+#define AESDCLIENT_H
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+struct aesd_client;
+
+enum aesd_client_reply {
+    AESD_CLIENT_REPLY_ACK,      /* end offsets only; replays never sent */
+    AESD_CLIENT_REPLY_FRAMED,   /* full replay per line, handed over or skipped */
+};
+
+struct aesd_client_config {
+    const char *host;           /* default 127.0.0.1 */
+    const char *port;           /* default 9000 */
+    int connections;            /* pool size, default 1 */
+    int max_inflight;           /* unanswered lines per connection, default 256 */
+    enum aesd_client_reply reply;
+};
+
+/* aesd_client_submit() flag: pass the replay to the callback (framed mode) */
+#define AESD_CLIENT_WANT_REPLAY 0x1
+/* Most lines aesd_client_submit_batch() takes at once */
+#define AESD_CLIENT_MAX_BATCH 64
+
+/*
+ * Completion callback.  status is 0 or an errno value; end is the store
+ * offset just past the line.  replay/replay_len are only set for requests
+ * submitted with AESD_CLIENT_WANT_REPLAY and are valid during the call.
+ */
+typedef void (*aesd_client_cb)(void *arg, int status, off_t end,
+                               const char *replay, size_t replay_len);
+
+/* Connect the whole pool; NULL if no connection could be set up */
+struct aesd_client *aesd_client_open(const struct aesd_client_config *cfg);
+/*
+ * Queue one line (ending in its only '\n') and return once it is on the
+ * wire; blocks while the chosen connection has max_inflight lines
+ * unanswered.  cb may be NULL.
+ */
+int aesd_client_submit(struct aesd_client *c, const char *line, size_t len,
+                       unsigned flags, aesd_client_cb cb, void *arg);
+/*
+ * Queue n lines with a single writev() on one connection; cb runs once per
+ * line.  The server stores lines that arrive together with one append.
+ */
+int aesd_client_submit_batch(struct aesd_client *c, const struct iovec *lines, int n,
+                             unsigned flags, aesd_client_cb cb, void *arg);
+/* Wait until every submitted line has completed; -1 if any failed */
+int aesd_client_flush(struct aesd_client *c);
+/* Submit and wait: the blocking convenience call; *end (if set) gets the offset */
+int aesd_client_append(struct aesd_client *c, const char *line, size_t len, off_t *end);
+/* Flush, disconnect and free */
+void aesd_client_close(struct aesd_client *c);
+
+#endif /* AESDCLIENT_H */
@@ -0,0 +1,324 @@
+/**
+ * aesdclientbench.c
+ *
+ * - Naive producers vs libaesdclient, same lines against the same server
+ * - naive: -c threads, each line on a fresh connection, then read the
+ *   replay until the line comes back (what ad-hoc producers do today)
+ * - pooled: one producer pipelining over -c pooled connections with
+ *   reply=ack, at most -w lines in flight per connection
+ * - batch: as pooled, -b lines per submit_batch() call
+ * - framed: as pooled, but the server sends every replay and the library
+ *   skips it, to separate the cost of the replay from the round trips
+ * - Prints one "RESULT key=value" line so scripts can parse it
+*/
+
+#define _POSIX_C_SOURCE 200809L
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "aesdclient.h"
+
+#define DEFAULT_HOST "127.0.0.1"
+#define DEFAULT_PORT "9000"
+#define RECV_CHUNK 65536
+#define RECV_TIMEOUT_S 10
+
+struct bench_config {
+    const char *host;
+    const char *port;
+    const char *mode;
+    int clients;
+    int lines;
+    size_t size;
+    int window;
+    int batch;
+};
+
+struct bench_state {
+    const struct bench_config *cfg;
+    uint64_t *start_ns;         // per line
+    uint64_t *lat_ns;           // per line, 0 until completed
+    atomic_int errors;
+    atomic_int next_line;       // naive threads claim lines from here
+};
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+// Build "l<seq> xxxx...\n" of exactly len bytes
+static void make_line(char *line, size_t len, int seq)
+{
+    int n = snprintf(line, len, "l%08d ", seq);
+    size_t used = (n > 0 && (size_t)n < len) ? (size_t)n : len - 1;
+    memset(line + used, 'x', len - 1 - used);
+    line[len - 1] = '\n';
+}
+
+// ---------- naive ----------
+
+static int connect_to(const char *host, const char *port)
+{
+    struct addrinfo hints, *res = NULL, *rp;
+    int fd = -1;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host, port, &hints, &res) != 0) return -1;
+    for (rp = res; rp; rp = rp->ai_next) {
+        fd = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol);
+        if (fd < 0) continue;
+        if (connect(fd, rp->ai_addr, rp->ai_addrlen) == 0) break;
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+    if (fd < 0) return -1;
+    struct timeval tv = { .tv_sec = RECV_TIMEOUT_S, .tv_usec = 0 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    return fd;
+}
+
+// One line the ad-hoc way: connect, send, read the replay up to our line
+static int naive_line(const struct bench_config *cfg, const char *line, char *win)
+{
+    int fd = connect_to(cfg->host, cfg->port);
+    size_t carry = 0;
+    int rc = -1;
+    if (fd < 0) return -1;
+    if (send(fd, line, cfg->size, MSG_NOSIGNAL) != (ssize_t)cfg->size) goto out;
+    for (;;) {
+        ssize_t r = recv(fd, win + carry, RECV_CHUNK, 0);
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) goto out;
+        size_t have = carry + (size_t)r;
+        if (memmem(win, have, line, cfg->size)) break;
+        carry = have >= cfg->size ? cfg->size - 1 : have;
+        memmove(win, win + have - carry, carry);
+    }
+    rc = 0;
+out:
+    close(fd);
+    return rc;
+}
+
+static void *naive_thread(void *arg)
+{
+    struct bench_state *st = arg;
+    const struct bench_config *cfg = st->cfg;
+    char *line = malloc(cfg->size);
+    char *win = malloc(RECV_CHUNK + cfg->size);
+    int seq;
+
+    while (line && win && (seq = atomic_fetch_add(&st->next_line, 1)) < cfg->lines) {
+        make_line(line, cfg->size, seq);
+        st->start_ns[seq] = now_ns();
+        if (naive_line(cfg, line, win) != 0) {
+            atomic_fetch_add(&st->errors, 1);
+            break;
+        }
+        st->lat_ns[seq] = now_ns() - st->start_ns[seq];
+    }
+    free(win);
+    free(line);
+    return NULL;
+}
+
+static int run_naive(struct bench_state *st)
+{
+    int n = st->cfg->clients;
+    pthread_t *tids = calloc((size_t)n, sizeof(*tids));
+    if (!tids) return -1;
+    for (int i = 0; i < n; i++) {
+        if (pthread_create(&tids[i], NULL, naive_thread, st) != 0) n = i;
+    }
+    for (int i = 0; i < n; i++) pthread_join(tids[i], NULL);
+    free(tids);
+    return 0;
+}
+
+// ---------- library ----------
+
+struct line_ctx {
+    struct bench_state *st;
+    int seq;
+};
+
+static void line_done(void *arg, int status, off_t end, const char *replay, size_t len)
+{
+    struct line_ctx *lc = arg;
+    (void)end;
+    (void)replay;
+    (void)len;
+    if (status != 0) {
+        atomic_fetch_add(&lc->st->errors, 1);
+        return;
+    }
+    lc->st->lat_ns[lc->seq] = now_ns() - lc->st->start_ns[lc->seq];
+}
+
+// batch: one callback per line, all sharing the batch's first context
+static void batch_done(void *arg, int status, off_t end, const char *replay, size_t len)
+{
+    struct line_ctx *lc = arg;
+    line_done(lc, status, end, replay, len);
+    lc->seq++;
+}
+
+static int run_pooled(struct bench_state *st, bool framed, int batch)
+{
+    const struct bench_config *cfg = st->cfg;
+    struct aesd_client_config ccfg = {
+        .host = cfg->host, .port = cfg->port, .connections = cfg->clients,
+        .max_inflight = cfg->window,
+        .reply = framed ? AESD_CLIENT_REPLY_FRAMED : AESD_CLIENT_REPLY_ACK,
+    };
+    struct aesd_client *c = aesd_client_open(&ccfg);
+    if (!c) {
+        fprintf(stderr, "aesd_client_open: %s\n", strerror(errno));
+        return -1;
+    }
+    char *lines = malloc((size_t)cfg->lines * cfg->size);
+    struct line_ctx *ctx = calloc((size_t)cfg->lines, sizeof(*ctx));
+    struct iovec iov[AESD_CLIENT_MAX_BATCH];
+    if (!lines || !ctx) {
+        free(lines);
+        free(ctx);
+        aesd_client_close(c);
+        return -1;
+    }
+    for (int seq = 0; seq < cfg->lines; seq++) make_line(lines + (size_t)seq * cfg->size, cfg->size, seq);
+
+    for (int seq = 0; seq < cfg->lines; seq += batch) {
+        int n = cfg->lines - seq < batch ? cfg->lines - seq : batch;
+        uint64_t t = now_ns();
+        for (int i = 0; i < n; i++) {
+            iov[i].iov_base = lines + (size_t)(seq + i) * cfg->size;
+            iov[i].iov_len = cfg->size;
+            st->start_ns[seq + i] = t;
+        }
+        ctx[seq].st = st;
+        ctx[seq].seq = seq;
+        int rc = batch > 1 ? aesd_client_submit_batch(c, iov, n, 0, batch_done, &ctx[seq])
+                           : aesd_client_submit(c, iov[0].iov_base, cfg->size, 0, line_done, &ctx[seq]);
+        if (rc != 0) {
+            fprintf(stderr, "submit: %s\n", strerror(errno));
+            atomic_fetch_add(&st->errors, 1);
+            break;
+        }
+    }
+    aesd_client_flush(c);
+    aesd_client_close(c);
+    free(ctx);
+    free(lines);
+    return 0;
+}
+
+// ---------- main ----------
+
+static int cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "Usage: %s [-m mode] [-H host] [-p port] [-c conns] [-n lines] [-s size] [-w window] [-b batch]\n"
+            "  -m mode      naive, pooled, batch or framed (default pooled)\n"
+            "  -c conns     naive threads / pool connections (default 4)\n"
+            "  -n lines     lines to append in total (default 2000)\n"
+            "  -s size      bytes per line including '\\n' (default 64)\n"
+            "  -w window    lines in flight per pooled connection (default 64)\n"
+            "  -b batch     lines per submit_batch() in batch mode (default 16)\n",
+            prog);
+}
+
+int main(int argc, char *argv[])
+{
+    struct bench_config cfg = {
+        .host = DEFAULT_HOST, .port = DEFAULT_PORT, .mode = "pooled",
+        .clients = 4, .lines = 2000, .size = 64, .window = 64, .batch = 16,
+    };
+    int opt;
+    while ((opt = getopt(argc, argv, "m:H:p:c:n:s:w:b:h")) != -1) {
+        switch (opt) {
+        case 'm': cfg.mode = optarg; break;
+        case 'H': cfg.host = optarg; break;
+        case 'p': cfg.port = optarg; break;
+        case 'c': cfg.clients = atoi(optarg); break;
+        case 'n': cfg.lines = atoi(optarg); break;
+        case 's': cfg.size = (size_t)strtoul(optarg, NULL, 10); break;
+        case 'w': cfg.window = atoi(optarg); break;
+        case 'b': cfg.batch = atoi(optarg); break;
+        default: usage(argv[0]); return EXIT_FAILURE;
+        }
+    }
+    if (cfg.clients < 1 || cfg.lines < 1 || cfg.size < 16 || cfg.window < 1 ||
+        cfg.batch < 1 || cfg.batch > AESD_CLIENT_MAX_BATCH) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    struct bench_state st = { .cfg = &cfg };
+    st.start_ns = calloc((size_t)cfg.lines, sizeof(uint64_t));
+    st.lat_ns = calloc((size_t)cfg.lines, sizeof(uint64_t));
+    if (!st.start_ns || !st.lat_ns) {
+        fprintf(stderr, "calloc failed\n");
+        return EXIT_FAILURE;
+    }
+
+    uint64_t t0 = now_ns();
+    int rc;
+    if (strcmp(cfg.mode, "naive") == 0) rc = run_naive(&st);
+    else if (strcmp(cfg.mode, "pooled") == 0) rc = run_pooled(&st, false, 1);
+    else if (strcmp(cfg.mode, "batch") == 0) rc = run_pooled(&st, false, cfg.batch);
+    else if (strcmp(cfg.mode, "framed") == 0) rc = run_pooled(&st, true, 1);
+    else {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    double elapsed = (double)(now_ns() - t0) / 1e9;
+    if (rc != 0) return EXIT_FAILURE;
+
+    // Completed lines only; a failed run reports how far it got
+    size_t done = 0;
+    for (int i = 0; i < cfg.lines; i++) {
+        if (st.lat_ns[i]) st.lat_ns[done++] = st.lat_ns[i];
+    }
+    qsort(st.lat_ns, done, sizeof(uint64_t), cmp_u64);
+    double p50 = done ? (double)st.lat_ns[(size_t)(0.50 * (double)(done - 1) + 0.5)] / 1e3 : 0.0;
+    double p99 = done ? (double)st.lat_ns[(size_t)(0.99 * (double)(done - 1) + 0.5)] / 1e3 : 0.0;
+    double lps = elapsed > 0 ? (double)done / elapsed : 0.0;
+    int errors = atomic_load(&st.errors);
+
+    printf("%zu lines over %d connections in %.3f s: %.1f lines/s, p50 %.1f us, p99 %.1f us, errors %d\n",
+           done, cfg.clients, elapsed, lps, p50, p99, errors);
+    printf("RESULT mode=%s conns=%d lines=%zu size=%zu window=%d batch=%d elapsed_s=%.3f "
+           "lines_per_s=%.1f lat_p50_us=%.1f lat_p99_us=%.1f errors=%d\n",
+           cfg.mode, cfg.clients, done, cfg.size, cfg.window,
+           strcmp(cfg.mode, "batch") == 0 ? cfg.batch : 1, elapsed, lps, p50, p99, errors);
+
+    free(st.lat_ns);
+    free(st.start_ns);
+    return errors ? EXIT_FAILURE : EXIT_SUCCESS;
+}
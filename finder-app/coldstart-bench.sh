@@ -0,0 +1,92 @@
+#!/bin/bash
+# Cold start benchmark for aesdsocket on localhost: time from launching the
+# server to the first reply a client gets (aesdbench -w).
+#   running    server already up, a new client connects (the floor)
+#   classic    aesdsocket started, the client retries until it binds
+#   activated  systemd-socket-activate holds the port and execs aesdsocket -i
+#              on the first connection, the way aesdsocket.socket does
+# The *-keep variants reopen a store kept with -c -k, so the start also
+# validates KEEP_MB of records.
+# Usage: coldstart-bench.sh [port]
+
+set -e
+set -u
+
+PORT=${1:-9700}
+RUNS=${RUNS:-5}
+KEEP_MB=${KEEP_MB:-64}
+
+FINDER_APP_DIR=$(realpath $(dirname $0))
+SERVER_DIR=${FINDER_APP_DIR}/../server
+WORKDIR=$(mktemp -d /tmp/aesdcold.XXXXXX)
+PID=""
+
+cleanup() {
+    [ -n "${PID}" ] && kill ${PID} 2>/dev/null
+    wait 2>/dev/null || true
+    rm -rf ${WORKDIR}
+}
+trap cleanup EXIT
+
+echo "********* Building aesdsocket and aesdbench *********"
+make -C ${SERVER_DIR} all bench >/dev/null
+
+ACTIVATOR=$(command -v systemd-socket-activate || true)
+
+stop() {
+    kill ${PID}
+    wait ${PID} 2>/dev/null || true
+    PID=""
+}
+
+first_reply() {
+    ${SERVER_DIR}/aesdbench -p ${PORT} -w 5000 | grep '^RESULT'
+}
+
+# run <label> <running|classic|activated> [aesdsocket args...]
+run() {
+    local label=$1 how=$2
+    shift 2
+    for i in $(seq ${RUNS}); do
+        case ${how} in
+        running)
+            ${SERVER_DIR}/aesdsocket -p ${PORT} "$@" &
+            PID=$!
+            ${SERVER_DIR}/aesdbench -p ${PORT} -w 5000 >/dev/null
+            first_reply | sed "s/^/${label} /"
+            ;;
+        classic)
+            ${SERVER_DIR}/aesdsocket -p ${PORT} "$@" &
+            PID=$!
+            first_reply | sed "s/^/${label} /"
+            ;;
+        activated)
+            ${ACTIVATOR} -l ${PORT} ${SERVER_DIR}/aesdsocket -i "$@" 2>/dev/null &
+            PID=$!
+            # Only the activator has to be listening before the clock starts
+            sleep 0.2
+            first_reply | sed "s/^/${label} /"
+            ;;
+        esac
+        stop
+    done
+}
+
+echo "********* Time to first reply, ${RUNS} runs each *********"
+run running running -b file -s ${WORKDIR}/store
+run classic classic -b file -s ${WORKDIR}/store
+if [ -n "${ACTIVATOR}" ]; then
+    run activated activated -b file -s ${WORKDIR}/store
+else
+    echo "systemd-socket-activate not found, skipping activated runs"
+fi
+
+echo "********* Same with a ${KEEP_MB} MiB kept store *********"
+${SERVER_DIR}/aesdsocket -p ${PORT} -b file -s ${WORKDIR}/kept -c -k &
+PID=$!
+${SERVER_DIR}/aesdbench -a -p ${PORT} -c 4 -n $((KEEP_MB * 64)) -s 4096 >/dev/null
+stop
+run classic-keep classic -b file -s ${WORKDIR}/kept -c -k
+if [ -n "${ACTIVATOR}" ]; then
+    run activated-keep activated -b file -s ${WORKDIR}/kept -c -k
+fi
@@ -0,0 +1,55 @@
+#!/bin/sh
+# Guest side of the aesdchar dev loop, started as rdinit by start-qemu-dev.sh.
+# Brings up the network and the 9p share, starts aesdsocket, then watches
+# /mnt/aesd/reload-request.  Each new sequence number written there by
+# dev-loop-aesdchar.sh reloads aesdchar.ko from the share and is acknowledged
+# in /mnt/aesd/reload-done as "<seq> <rc>".
+
+SHARE=/mnt/aesd
+MODDIR=/lib/modules/aesd
+
+mount -t proc proc /proc
+mount -t sysfs sysfs /sys
+mkdir -p /var/run /var/tmp ${SHARE}
+
+ifconfig lo 127.0.0.1 up
+ifconfig eth0 10.0.2.15 netmask 255.255.255.0 up
+route add default gw 10.0.2.2
+
+if ! mount -t 9p -o trans=virtio,version=9p2000.L aesdshare ${SHARE}; then
+    echo "dev-agent: mounting 9p share failed, reloads disabled"
+fi
+
+reload_module() {
+    /etc/init.d/S99aesdsocket stop > /dev/null
+    if lsmod | grep -q "^aesdchar"; then
+        ${MODDIR}/aesdchar_unload || return 1
+    fi
+    cp ${SHARE}/aesdchar.ko ${MODDIR}/aesdchar.ko || return 1
+    ${MODDIR}/aesdchar_load || return 1
+    /etc/init.d/S99aesdsocket start > /dev/null
+}
+
+watch_reloads() {
+    last=""
+    while true; do
+        if [ -f ${SHARE}/reload-request ]; then
+            seq=$(cat ${SHARE}/reload-request)
+            if [ -n "${seq}" ] && [ "${seq}" != "${last}" ]; then
+                reload_module
+                rc=$?
+                echo "dev-agent: reload ${seq} finished with rc=${rc}"
+                echo "${seq} ${rc}" > ${SHARE}/reload-done
+                last=${seq}
+            fi
+        fi
+        usleep 200000
+    done
+}
+
+${MODDIR}/aesdchar_load
+/etc/init.d/S99aesdsocket start
+watch_reloads &
+
+echo "dev-agent ready, dropping to terminal"
+exec /bin/sh
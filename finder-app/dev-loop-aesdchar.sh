@@ -0,0 +1,82 @@
+#!/bin/bash
+# Edit-to-measure loop for the aesdchar driver.
+# Builds aesdchar.ko against the kernel tree kept by manual-linux.sh, pushes it
+# to a guest booted with start-qemu-dev.sh over the 9p share, waits for the
+# guest to reload it and then runs aesdbench against the forwarded port.
+# Usage: dev-loop-aesdchar.sh [outdir] [-- aesdbench args]
+
+set -e
+set -u
+
+OUTDIR=/tmp/aeld
+if [ $# -gt 0 ] && [ "$1" != "--" ]; then
+    OUTDIR=$1
+    shift
+fi
+[ $# -gt 0 ] && [ "$1" = "--" ] && shift
+
+FINDER_APP_DIR=$(realpath $(dirname $0))
+DRIVER_DIR=$(realpath ${FINDER_APP_DIR}/../aesd-char-driver)
+SERVER_DIR=$(realpath ${FINDER_APP_DIR}/../server)
+ARCH=arm64
+CROSS_COMPILE=aarch64-none-linux-gnu-
+SHARE_DIR=${OUTDIR}/share
+HOST_PORT=${AESD_HOST_PORT:-9000}
+RELOAD_TIMEOUT=${RELOAD_TIMEOUT:-30}
+
+CROSS_CC="${CROSS_COMPILE}gcc"
+if command -v ccache > /dev/null 2>&1; then
+    export CCACHE_DIR=${CCACHE_DIR:-${OUTDIR}/.ccache}
+    CROSS_CC="ccache ${CROSS_COMPILE}gcc"
+fi
+
+if [ ! -e ${OUTDIR}/.config ]; then
+    echo "No kernel build tree in ${OUTDIR}, run manual-linux.sh first"
+    exit 1
+fi
+mkdir -p ${SHARE_DIR}
+
+t_start=$(date +%s%N)
+
+echo "********* Building aesdchar.ko *********"
+make -C ${DRIVER_DIR} KERNELDIR=${OUTDIR} ARCH=${ARCH} \
+    CROSS_COMPILE=${CROSS_COMPILE} CC="${CROSS_CC}" modules
+t_built=$(date +%s%N)
+
+echo "********* Pushing module to guest *********"
+seq=$(date +%s%N)
+cp ${DRIVER_DIR}/aesdchar.ko ${SHARE_DIR}/aesdchar.ko
+# write via rename so the guest never reads a partial sequence number
+echo ${seq} > ${SHARE_DIR}/reload-request.tmp
+mv ${SHARE_DIR}/reload-request.tmp ${SHARE_DIR}/reload-request
+
+deadline=$(( $(date +%s) + RELOAD_TIMEOUT ))
+while true; do
+    if [ -f ${SHARE_DIR}/reload-done ]; then
+        read done_seq done_rc < ${SHARE_DIR}/reload-done || true
+        if [ "${done_seq:-}" = "${seq}" ]; then
+            break
+        fi
+    fi
+    if [ $(date +%s) -ge ${deadline} ]; then
+        echo "Guest did not acknowledge reload within ${RELOAD_TIMEOUT}s, is start-qemu-dev.sh running?"
+        exit 1
+    fi
+    sleep 0.1
+done
+if [ "${done_rc}" != "0" ]; then
+    echo "Guest failed to reload aesdchar (rc=${done_rc}), see ${OUTDIR}/serial.log"
+    exit 1
+fi
+t_loaded=$(date +%s%N)
+
+echo "********* Running aesdbench *********"
+make -C ${SERVER_DIR} CROSS_COMPILE= bench > /dev/null
+${SERVER_DIR}/aesdbench -H 127.0.0.1 -p ${HOST_PORT} "$@"
+t_done=$(date +%s%N)
+
+echo "********* Cycle timing *********"
+printf 'build  %6d ms\n' $(( (t_built - t_start) / 1000000 ))
+printf 'reload %6d ms\n' $(( (t_loaded - t_built) / 1000000 ))
+printf 'bench  %6d ms\n' $(( (t_done - t_loaded) / 1000000 ))
+printf 'total  %6d ms\n' $(( (t_done - t_start) / 1000000 ))
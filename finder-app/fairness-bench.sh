@@ -0,0 +1,71 @@
+#!/bin/bash
+# Mixed-workload fairness benchmark for aesdsocket on localhost.
+# A light client (small acked appends) is measured alone, then next to
+# heavy writers (large acked appends) and heavy readers (full replays),
+# first with the default first-come locking, then with the DRR scheduler
+# (-q) and finally with the scheduler plus per-connection limits (-l).
+# Usage: fairness-bench.sh [base port]
+
+set -e
+set -u
+
+BASE_PORT=${1:-9500}
+BACKEND=${BACKEND:-file}
+SLOTS=${SLOTS:-1}
+LIMIT=${LIMIT:-64000000,4000}
+HEAVY_WRITERS=${HEAVY_WRITERS:-4}
+HEAVY_READERS=${HEAVY_READERS:-2}
+
+FINDER_APP_DIR=$(realpath $(dirname $0))
+SERVER_DIR=${FINDER_APP_DIR}/../server
+WORKDIR=$(mktemp -d /tmp/aesdfair.XXXXXX)
+PID=""
+
+cleanup() {
+    [ -n "${PID}" ] && kill ${PID} 2>/dev/null
+    wait 2>/dev/null || true
+    rm -rf ${WORKDIR}
+}
+trap cleanup EXIT
+
+echo "********* Building aesdsocket and aesdbench *********"
+make -C ${SERVER_DIR} all bench >/dev/null
+
+light() {
+    ${SERVER_DIR}/aesdbench -a -p ${PORT} -c 2 -n 5000 -s 64 | grep '^RESULT'
+}
+
+# run <label> <with heavy load: 0/1> [aesdsocket args...]
+run() {
+    local label=$1 heavy=$2
+    shift 2
+    PORT=$((PORT + 1))
+    ${SERVER_DIR}/aesdsocket -b ${BACKEND} -s ${WORKDIR}/store -p ${PORT} "$@" &
+    PID=$!
+    sleep 1
+    local bench_pids=""
+    if [ ${heavy} -eq 1 ]; then
+        ${SERVER_DIR}/aesdbench -a -p ${PORT} -c ${HEAVY_WRITERS} -n 200 -s $((256 * 1024)) \
+            > ${WORKDIR}/writers.out &
+        bench_pids="${bench_pids} $!"
+        ${SERVER_DIR}/aesdbench -r -p ${PORT} -c ${HEAVY_READERS} -n 5 > ${WORKDIR}/readers.out &
+        bench_pids="${bench_pids} $!"
+        sleep 0.1
+    fi
+    light | sed "s/^/${label} light /"
+    if [ ${heavy} -eq 1 ]; then
+        wait ${bench_pids} || true
+        grep '^RESULT' ${WORKDIR}/writers.out | sed "s/^/${label} writers /"
+        grep '^RESULT' ${WORKDIR}/readers.out | sed "s/^/${label} readers /"
+    fi
+    kill ${PID}
+    wait ${PID} 2>/dev/null || true
+    PID=""
+}
+
+PORT=${BASE_PORT}
+echo "********* Light client: alone, contended, DRR, DRR + limits *********"
+run alone 0
+run contended 1
+run fair 1 -q ${SLOTS}
+run fair-limited 1 -q ${SLOTS} -l ${LIMIT}
@@ -0,0 +1,94 @@
+#!/bin/bash
+# Huge-page benchmark for the in-memory stores on localhost.
+# For each -H policy (none, thp, thp+prefault+mlock with a reserve) the store
+# is filled by acked writers, then replayed by readers; the replay p99 is
+# taken from aesdbench and the TLB misses and page faults of the server from
+# perf stat, or only the faults plus AnonHugePages from /proc without perf.
+# The in-process view without sockets: aesdstorebench -b mem,dedup -H <spec>.
+# Usage: hugepage-bench.sh [base port]
+
+set -e
+set -u
+
+BASE_PORT=${1:-9600}
+BACKEND=${BACKEND:-mem}
+FILL=${FILL:-20000}
+FILL_SIZE=${FILL_SIZE:-4096}
+READERS=${READERS:-2}
+READS=${READS:-20}
+RESERVE=${RESERVE:-256}
+
+FINDER_APP_DIR=$(realpath $(dirname $0))
+SERVER_DIR=${FINDER_APP_DIR}/../server
+WORKDIR=$(mktemp -d /tmp/aesdhuge.XXXXXX)
+PID=""
+PERF_PID=""
+
+cleanup() {
+    [ -n "${PERF_PID}" ] && kill -INT ${PERF_PID} 2>/dev/null
+    [ -n "${PID}" ] && kill ${PID} 2>/dev/null
+    wait 2>/dev/null || true
+    rm -rf ${WORKDIR}
+}
+trap cleanup EXIT
+
+echo "********* Building aesdsocket and aesdbench *********"
+make -C ${SERVER_DIR} all bench >/dev/null
+
+echo "********* System huge page settings *********"
+echo "thp: $(cat /sys/kernel/mm/transparent_hugepage/enabled 2>/dev/null || echo unavailable)"
+grep -E 'HugePages_(Total|Free)|Hugepagesize' /proc/meminfo || true
+echo "memlock limit: $(ulimit -l)"
+
+HAVE_PERF=0
+if command -v perf >/dev/null && perf stat -e dTLB-load-misses true >/dev/null 2>&1; then
+    HAVE_PERF=1
+fi
+
+minflt() {
+    awk '{ print $10 }' /proc/$1/stat
+}
+
+anon_huge_kb() {
+    awk '/^AnonHugePages:/ { print $2 }' /proc/$1/smaps_rollup 2>/dev/null || echo 0
+}
+
+# run <label> [aesdsocket args...]
+run() {
+    local label=$1
+    shift
+    PORT=$((PORT + 1))
+    ${SERVER_DIR}/aesdsocket -b ${BACKEND} -p ${PORT} "$@" &
+    PID=$!
+    sleep 1
+    ${SERVER_DIR}/aesdbench -a -p ${PORT} -c 4 -n $((FILL / 4)) -s ${FILL_SIZE} \
+        | grep '^RESULT' | sed "s/^/${label} fill /"
+
+    local flt_before=$(minflt ${PID})
+    if [ ${HAVE_PERF} -eq 1 ]; then
+        perf stat -x, -e dTLB-load-misses,dTLB-loads,page-faults -p ${PID} -o ${WORKDIR}/perf.out &
+        PERF_PID=$!
+        sleep 0.2
+    fi
+    ${SERVER_DIR}/aesdbench -r -p ${PORT} -c ${READERS} -n ${READS} \
+        | grep '^RESULT' | sed "s/^/${label} replay /"
+    if [ -n "${PERF_PID}" ]; then
+        kill -INT ${PERF_PID}
+        wait ${PERF_PID} 2>/dev/null || true
+        PERF_PID=""
+        awk -F, -v l="${label}" 'NF > 2 && $1 ~ /^[0-9]+$/ { printf "%s perf %s=%s\n", l, $3, $1 }' \
+            ${WORKDIR}/perf.out
+    fi
+    echo "${label} proc replay_minflt=$(( $(minflt ${PID}) - flt_before )) anon_huge_kb=$(anon_huge_kb ${PID})"
+
+    kill ${PID}
+    wait ${PID} 2>/dev/null || true
+    PID=""
+}
+
+PORT=${BASE_PORT}
+echo "********* ${BACKEND} store: 4 KiB pages, THP, THP + prefault + mlock + reserve *********"
+[ ${HAVE_PERF} -eq 1 ] || echo "perf not available: reporting page faults and AnonHugePages only"
+run none
+run thp -H thp
+run reserved -H thp,prefault,mlock,reserve=${RESERVE}
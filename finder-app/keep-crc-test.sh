@@ -0,0 +1,66 @@
+#!/bin/bash
+# Kept store test for aesdsocket's file backend (-k, -c).
+# Restarts the server on one store path, switching CRC framing on and off
+# between runs, and checks that every record written survives each reopen:
+# a framed run, an unframed run that appends past the old frames, then a
+# framed run again, which must keep the unframed records.
+# Usage: keep-crc-test.sh [port]
+
+set -e
+set -u
+
+PORT=${1:-9300}
+
+FINDER_APP_DIR=$(realpath $(dirname $0))
+SERVER_DIR=${FINDER_APP_DIR}/../server
+WORKDIR=$(mktemp -d /tmp/aesdkeep.XXXXXX)
+STORE=${WORKDIR}/store
+PID=""
+
+cleanup() {
+    [ -n "${PID}" ] && kill ${PID} 2>/dev/null
+    wait 2>/dev/null || true
+    rm -rf ${WORKDIR}
+}
+trap cleanup EXIT
+
+echo "********* Building aesdsocket *********"
+make -C ${SERVER_DIR} all >/dev/null
+
+# run <label> <aesdsocket flags> <lines to write...>
+run() {
+    local label=$1 flags=$2
+    shift 2
+    echo "********* ${label}: aesdsocket ${flags} *********"
+    ${SERVER_DIR}/aesdsocket -b file -s ${STORE} -p ${PORT} ${flags} &
+    PID=$!
+    sleep 0.5
+    for line in "$@"; do
+        exec 3<>/dev/tcp/127.0.0.1/${PORT}
+        printf '%s\n' "${line}" >&3
+        timeout 0.5 cat <&3 >/dev/null || true
+        exec 3<&-
+    done
+    kill ${PID}
+    wait ${PID} || true
+    PID=""
+}
+
+# expect <lines...>: the store holds exactly these lines
+expect() {
+    if printf '%s\n' "$@" | cmp -s - ${STORE}; then
+        echo "store: $* - ok"
+    else
+        echo "store: expected '$*', found '$(tr '\n' ' ' < ${STORE})'"
+        exit 1
+    fi
+}
+
+run "framed" "-c -k" one two
+expect one two
+run "unframed" "-k" three
+expect one two three
+run "framed again" "-c -k" four
+expect one two three four
+run "reopen" "-c -k"
+expect one two three four
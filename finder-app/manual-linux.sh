@@ -1,6 +1,12 @@
 #!/bin/bash
 # Script outline to install and build kernel.
 # Author: Siddhant Jajoo.
+#
+# The build is split into stages (kernel, busybox, modules, rootfs).  Each
+# stage records a content hash of its inputs in ${OUTDIR}/.stamps and is
+# skipped when nothing it depends on has changed, so re-running the script
+# after a driver edit only rebuilds the module and repacks the rootfs.
+# Set FORCE_REBUILD=1 to ignore the stamps.
 
 set -e
 set -u
@@ -10,8 +16,12 @@ KERNEL_REPO=git://git.kernel.org/pub/scm/linux/kernel/git/stable/linux-stable.gi
 KERNEL_VERSION=v5.15.163
 BUSYBOX_VERSION=1_33_1
 FINDER_APP_DIR=$(realpath $(dirname $0))
+DRIVER_DIR=$(realpath ${FINDER_APP_DIR}/../aesd-char-driver)
+SERVER_DIR=$(realpath ${FINDER_APP_DIR}/../server)
 ARCH=arm64
 CROSS_COMPILE=aarch64-none-linux-gnu-
+JOBS=$(nproc)
+FORCE_REBUILD=${FORCE_REBUILD:-0}
 
 if [ $# -lt 1 ]
 then
@@ -22,6 +32,82 @@ else
 fi
 
 mkdir -p ${OUTDIR}
+STAMPDIR=${OUTDIR}/.stamps
+mkdir -p ${STAMPDIR}
+
+# Route every cross compile through ccache when it is installed, and keep the
+# cache next to the build output so it survives between runs.
+CROSS_CC="${CROSS_COMPILE}gcc"
+if command -v ccache > /dev/null 2>&1; then
+	export CCACHE_DIR=${CCACHE_DIR:-${OUTDIR}/.ccache}
+	CROSS_CC="ccache ${CROSS_COMPILE}gcc"
+	echo "Using ccache in ${CCACHE_DIR}"
+fi
+
+# ---------- stage helpers ----------
+
+STAGE_NAMES=()
+STAGE_TIMES=()
+STAGE_RESULTS=()
+
+now_ms() {
+	echo $(( $(date +%s%N) / 1000000 ))
+}
+
+# hash_inputs <strings...>: hash a list of literal inputs (versions, flags)
+hash_inputs() {
+	printf '%s\n' "$@" | sha256sum | cut -d' ' -f1
+}
+
+# hash_tree <dir> [find args...]: hash the contents of every file under dir
+hash_tree() {
+	local dir=$1
+	shift
+	(cd "${dir}" && find . -type f "$@" -print0 | sort -z | xargs -0 -r sha256sum) \
+		| sha256sum | cut -d' ' -f1
+}
+
+# stage_is_current <name> <hash>: true when the stamp matches and we may skip
+stage_is_current() {
+	[ "${FORCE_REBUILD}" = "0" ] && [ -f "${STAMPDIR}/$1" ] && \
+		[ "$(cat "${STAMPDIR}/$1")" = "$2" ]
+}
+
+# run_stage <name> <hash> <function> [artifact]: run the stage function unless
+# the stamp matches and the artifact (if given) is still present.
+run_stage() {
+	local name=$1 hash=$2 fn=$3 artifact=${4:-}
+	local start=$(now_ms)
+	if stage_is_current "${name}" "${hash}" && { [ -z "${artifact}" ] || [ -e "${artifact}" ]; }; then
+		echo "********* Stage ${name}: up to date, skipping *********"
+		STAGE_RESULTS+=("skipped")
+	else
+		echo "********* Stage ${name}: building *********"
+		rm -f "${STAMPDIR}/${name}"
+		"${fn}"
+		echo "${hash}" > "${STAMPDIR}/${name}"
+		STAGE_RESULTS+=("built")
+	fi
+	STAGE_NAMES+=("${name}")
+	STAGE_TIMES+=($(( $(now_ms) - start )))
+}
+
+# Background jobs used for parallel rootfs assembly; wait_jobs fails if any did
+BG_PIDS=()
+run_bg() {
+	"$@" &
+	BG_PIDS+=($!)
+}
+wait_jobs() {
+	local rc=0 pid
+	for pid in "${BG_PIDS[@]}"; do
+		wait ${pid} || rc=1
+	done
+	BG_PIDS=()
+	return ${rc}
+}
+
+# ---------- kernel ----------
 
 cd "$OUTDIR"
 if [ ! -d "${OUTDIR}/linux-stable" ]; then
@@ -31,20 +117,28 @@ if [ ! -d "${OUTDIR}/linux-stable" ]; then
 	echo "CLONING GIT LINUX STABLE VERSION ${KERNEL_VERSION} IN ${OUTDIR}"
 	git clone ${KERNEL_REPO} --depth 1 --single-branch --branch ${KERNEL_VERSION}
 fi
-if [ ! -e ${OUTDIR}/linux-stable/arch/${ARCH}/boot/Image ]; then
-    cd linux-stable
+
+KERNEL_HASH=$(hash_inputs "${KERNEL_VERSION}" "${ARCH}" "${CROSS_COMPILE}")
+
+build_kernel() {
+    cd ${OUTDIR}/linux-stable
     echo "Checking out version ${KERNEL_VERSION}"
     git checkout ${KERNEL_VERSION}
 
     # TODO: Add your kernel build steps here
     echo "********* Building Kernal *********"
     # we'll use the O var to point to our output directory for kbuild
-    # Using mrproper to "deep clean" (Removes all gen'd files + config +various backup files)
-    make O="${OUTDIR}" ARCH=${ARCH} CROSS_COMPILE=${CROSS_COMPILE} mrproper
+    # Only "deep clean" with mrproper when the kernel inputs changed since the
+    # last build (or there never was one); otherwise let kbuild work incrementally
+    if [ -f "${STAMPDIR}/kernel.prev" ] && [ "$(cat "${STAMPDIR}/kernel.prev")" != "${KERNEL_HASH}" ]; then
+        make O="${OUTDIR}" ARCH=${ARCH} CROSS_COMPILE=${CROSS_COMPILE} mrproper
+    fi
     # Run with defconfig to configure our "virt" arm dev board we'll sim in QEMU
-    make O="${OUTDIR}" ARCH=${ARCH} CROSS_COMPILE=${CROSS_COMPILE} defconfig
+    if [ ! -e "${OUTDIR}/.config" ]; then
+        make O="${OUTDIR}" ARCH=${ARCH} CROSS_COMPILE=${CROSS_COMPILE} defconfig
+    fi
     # now run the build using multiple jobs to try and speed things up -j"${nproc}" to match cores
-    make -j$(nproc) O="${OUTDIR}" ARCH=${ARCH} CROSS_COMPILE=${CROSS_COMPILE} all
+    make -j${JOBS} O="${OUTDIR}" ARCH=${ARCH} CROSS_COMPILE=${CROSS_COMPILE} CC="${CROSS_CC}" all
 
     # check if we have our kernal image, if not exit with a 1 status (we can't move on without an image)
     if [ ! -e "${OUTDIR}/arch/${ARCH}/boot/Image" ]; then
@@ -52,31 +146,19 @@ if [ ! -e ${OUTDIR}/linux-stable/arch/${ARCH}/boot/Image ]; then
 	echo "Check for artifacts at: ${OUTDIR}/arch/${ARCH}/boot/Image"
 	exit 1
     fi
-    echo "********* Moving Kernal Image *********"
-    # We have a valid image now lets move it to the ${OUTDIR}/image like required
-    mv "${OUTDIR}/arch/${ARCH}/boot/Image" "${OUTDIR}/Image"
-    # remove un-needed build artifacts (deletes from arch/ folder down)
-    rm -rf "${OUTDIR}/arch"
+    echo "********* Copying Kernal Image *********"
+    # We have a valid image now lets copy it to the ${OUTDIR}/image like required.
+    # The build tree is kept so the next run is incremental and modules can
+    # be built against it.
+    cp "${OUTDIR}/arch/${ARCH}/boot/Image" "${OUTDIR}/Image"
+    echo "${KERNEL_HASH}" > "${STAMPDIR}/kernel.prev"
     echo "Kernal image build complete!"
-fi
+}
+run_stage kernel "${KERNEL_HASH}" build_kernel "${OUTDIR}/Image"
 
 echo "Adding the Image in outdir"
 
-echo "Creating the staging directory for the root filesystem"
-cd "$OUTDIR"
-if [ -d "${OUTDIR}/rootfs" ]
-then
-	echo "Deleting rootfs directory at ${OUTDIR}/rootfs and starting over"
-    sudo rm  -rf ${OUTDIR}/rootfs
-fi
-
-# TODO: Create necessary base directories
-echo "********* Creating rootfs *********"
-# create a basic set of folders for the rootfs
-echo "Creating rootfs and changing to dir"
-mkdir -p ${OUTDIR}/rootfs/{bin,dev,etc,home,lib,lib64,proc,sbin,sys,tmp,usr,var}
-mkdir -p ${OUTDIR}/rootfs/usr/{bin,lib,sbin}
-mkdir -p ${OUTDIR}/rootfs/var/{log}
+# ---------- busybox ----------
 
 cd "$OUTDIR"
 if [ ! -d "${OUTDIR}/busybox" ]
@@ -85,58 +167,161 @@ git clone git://busybox.net/busybox.git
     cd busybox
     git checkout ${BUSYBOX_VERSION}
     # TODO:  Configure busybox
-else
-    cd busybox
 fi
 
-# TODO: Make and install busybox
-echo "********* Building busybox *********"
-echo "cleaning busybox"
-make ARCH=${ARCH} CROSS_COMPILE=${CROSS_COMPILE} distclean
-make ARCH=${ARCH} CROSS_COMPILE=${CROSS_COMPILE} defconfig
-make -j$(nproc) ARCH=${ARCH} CROSS_COMPILE=${CROSS_COMPILE} all
-make ARCH=${ARCH} CROSS_COMPILE=${CROSS_COMPILE} CONFIG_PREFIX=${OUTDIR}/rootfs install
+BUSYBOX_HASH=$(hash_inputs "${BUSYBOX_VERSION}" "${ARCH}" "${CROSS_COMPILE}")
 
-# According to comments during last run I may need busybox to have setuid root
-#chmod u+s ${OUTDIR}/rootfs/bin/busybox
+build_busybox() {
+    cd ${OUTDIR}/busybox
+    # TODO: Make and install busybox
+    echo "********* Building busybox *********"
+    # Only start from distclean when the version/toolchain changed
+    if [ ! -e .config ] || [ ! -f "${STAMPDIR}/busybox.prev" ] || \
+       [ "$(cat "${STAMPDIR}/busybox.prev")" != "${BUSYBOX_HASH}" ]; then
+        echo "cleaning busybox"
+        git checkout ${BUSYBOX_VERSION}
+        make ARCH=${ARCH} CROSS_COMPILE=${CROSS_COMPILE} distclean
+        make ARCH=${ARCH} CROSS_COMPILE=${CROSS_COMPILE} defconfig
+    fi
+    make -j${JOBS} ARCH=${ARCH} CROSS_COMPILE=${CROSS_COMPILE} CC="${CROSS_CC}" all
+    echo "${BUSYBOX_HASH}" > "${STAMPDIR}/busybox.prev"
+}
+run_stage busybox "${BUSYBOX_HASH}" build_busybox "${OUTDIR}/busybox/busybox"
+
+# ---------- modules ----------
+
+MODULES_HASH=$(hash_inputs "$(cat ${STAMPDIR}/kernel)" \
+    "$(hash_tree ${DRIVER_DIR} \( -name '*.c' -o -name '*.h' -o -name Makefile -o -name 'aesdchar_*' \))")
 
-echo "********* Checking Library dependencies *********"
-cd ${OUTDIR}/rootfs
-${CROSS_COMPILE}readelf -a bin/busybox | grep "program interpreter"
-${CROSS_COMPILE}readelf -a bin/busybox | grep "Shared library"
+build_modules() {
+    echo "********* Building aesdchar module *********"
+    # Build out of tree against the kernel build kept in ${OUTDIR}
+    make -C ${DRIVER_DIR} KERNELDIR=${OUTDIR} ARCH=${ARCH} \
+        CROSS_COMPILE=${CROSS_COMPILE} CC="${CROSS_CC}" modules
+    mkdir -p ${OUTDIR}/modules
+    cp ${DRIVER_DIR}/aesdchar.ko ${DRIVER_DIR}/aesdchar_load ${DRIVER_DIR}/aesdchar_unload ${OUTDIR}/modules
+}
+run_stage modules "${MODULES_HASH}" build_modules "${OUTDIR}/modules/aesdchar.ko"
+
+# ---------- rootfs ----------
 
-# TODO: Add library dependencies to rootfs
-echo "********* Setting up SYSROOT and Library dependencies *********"
 SYSROOT=$(${CROSS_COMPILE}gcc -print-sysroot)
+ROOTFS_HASH=$(hash_inputs "$(cat ${STAMPDIR}/busybox)" "$(cat ${STAMPDIR}/modules)" "${SYSROOT}" \
+    "$(hash_tree ${FINDER_APP_DIR} ! -name '*.o' ! -name writer)" \
+    "$(hash_tree ${FINDER_APP_DIR}/../conf)" \
+    "$(hash_tree ${SERVER_DIR} \( -name '*.c' -o -name '*.h' -o -name Makefile -o -name '*-start-stop' \))")
+
+install_busybox() {
+    cd ${OUTDIR}/busybox
+    make ARCH=${ARCH} CROSS_COMPILE=${CROSS_COMPILE} CONFIG_PREFIX=${OUTDIR}/rootfs install
+
+    # According to comments during last run I may need busybox to have setuid root
+    #chmod u+s ${OUTDIR}/rootfs/bin/busybox
+
+    echo "********* Checking Library dependencies *********"
+    cd ${OUTDIR}/rootfs
+    ${CROSS_COMPILE}readelf -a bin/busybox | grep "program interpreter"
+    ${CROSS_COMPILE}readelf -a bin/busybox | grep "Shared library"
+}
+
+install_libraries() {
+    # TODO: Add library dependencies to rootfs
+    echo "********* Setting up SYSROOT and Library dependencies *********"
+    cp -a ${SYSROOT}/lib/ld-linux-aarch64.so.1 ${OUTDIR}/rootfs/lib &
+    cp -a ${SYSROOT}/lib64/libm.so.* ${OUTDIR}/rootfs/lib64 &
+    cp -a ${SYSROOT}/lib64/libresolv.so.* ${OUTDIR}/rootfs/lib64 &
+    cp -a ${SYSROOT}/lib64/libc.so.* ${OUTDIR}/rootfs/lib64 &
+    # aesdsocket needs libpthread on toolchains older than glibc 2.34
+    cp -a ${SYSROOT}/lib64/libpthread.so.* ${OUTDIR}/rootfs/lib64 2>/dev/null &
+    # Compression codecs, only linked in when the toolchain provides them
+    cp -a ${SYSROOT}/lib64/libz.so.* ${SYSROOT}/lib64/libzstd.so.* ${OUTDIR}/rootfs/lib64 2>/dev/null &
+    # TLS listener, same rule
+    cp -a ${SYSROOT}/lib64/libssl.so.* ${SYSROOT}/lib64/libcrypto.so.* ${OUTDIR}/rootfs/lib64 2>/dev/null &
+    wait
+}
+
+install_finder_app() {
+    # TODO: Clean and build the writer utility
+    echo "********* Build writer util *********"
+    cd ${FINDER_APP_DIR}
+    make clean
+    make CROSS_COMPILE=${CROSS_COMPILE} CC="${CROSS_CC}"
+
+    # TODO: Copy the finder related scripts and executables to the /home directory
+    echo "********* Copy finder and related exec to target rootfs /home *********"
+    # change to finder app dir, this lets us copy recursively
+    cp -r * ${OUTDIR}/rootfs/home
+    # we need to back up one dir to get the conf folder
+    cp -r ../conf ${OUTDIR}/rootfs
+}
+
+install_server() {
+    echo "********* Build aesdsocket *********"
+    make -C ${SERVER_DIR} clean
+    make -C ${SERVER_DIR} CC="${CROSS_CC}" all bench
+    cp ${SERVER_DIR}/aesdsocket ${SERVER_DIR}/aesdbench ${OUTDIR}/rootfs/usr/bin
+    mkdir -p ${OUTDIR}/rootfs/etc/init.d
+    cp ${SERVER_DIR}/aesdsocket-start-stop ${OUTDIR}/rootfs/etc/init.d/S99aesdsocket
+}
+
+install_modules() {
+    mkdir -p ${OUTDIR}/rootfs/lib/modules/aesd
+    cp ${OUTDIR}/modules/* ${OUTDIR}/rootfs/lib/modules/aesd
+}
+
+build_rootfs() {
+    echo "Creating the staging directory for the root filesystem"
+    cd "$OUTDIR"
+    if [ -d "${OUTDIR}/rootfs" ]
+    then
+	echo "Deleting rootfs directory at ${OUTDIR}/rootfs and starting over"
+        sudo rm  -rf ${OUTDIR}/rootfs
+    fi
+
+    # TODO: Create necessary base directories
+    echo "********* Creating rootfs *********"
+    # create a basic set of folders for the rootfs
+    mkdir -p ${OUTDIR}/rootfs/{bin,dev,etc,home,lib,lib64,proc,sbin,sys,tmp,usr,var}
+    mkdir -p ${OUTDIR}/rootfs/usr/{bin,lib,sbin}
+    mkdir -p ${OUTDIR}/rootfs/var/log
+
+    # The install steps touch disjoint parts of the tree, so run them together
+    echo "********* Assembling rootfs in parallel *********"
+    run_bg install_busybox
+    run_bg install_libraries
+    run_bg install_finder_app
+    run_bg install_server
+    run_bg install_modules
+
+    # TODO: Make device nodes
+    echo "********* Make Device Nodes *********"
+    sudo mknod -m 666 ${OUTDIR}/rootfs/dev/null c 1 3
+    sudo mknod -m 600 ${OUTDIR}/rootfs/dev/console c 5 1
+
+    if ! wait_jobs; then
+        echo "rootfs assembly failed"
+        exit 1
+    fi
+
+    # TODO: Chown the root directory
+    echo "********* Chown root directory *********"
+    cd ${OUTDIR}/rootfs
+    sudo chown -R root:root *
+    # TODO: Create initramfs.cpio.gz
+    echo "********* Create initramfs.cpio.gz *********"
+    # pigz compresses on every core when it is available
+    GZIP=gzip
+    command -v pigz > /dev/null 2>&1 && GZIP=pigz
+    find . | cpio -H newc -o | ${GZIP} -9 > ${OUTDIR}/initramfs.cpio.gz
+}
+run_stage rootfs "${ROOTFS_HASH}" build_rootfs "${OUTDIR}/initramfs.cpio.gz"
+
+# ---------- report ----------
 
-cp -a ${SYSROOT}/lib/ld-linux-aarch64.so.1 ${OUTDIR}/rootfs/lib
-cp -a ${SYSROOT}/lib64/libm.so.* ${OUTDIR}/rootfs/lib64
-cp -a ${SYSROOT}/lib64/libresolv.so.* ${OUTDIR}/rootfs/lib64
-cp -a ${SYSROOT}/lib64/libc.so.* ${OUTDIR}/rootfs/lib64
-
-# TODO: Make device nodes
-echo "********* Make Device Nodes *********"
-sudo mknod -m 666 ${OUTDIR}/rootfs/dev/null c 1 3
-sudo mknod -m 600 ${OUTDIR}/rootfs/dev/console c 5 1
-
-# TODO: Clean and build the writer utility
-echo "********* Build writer util *********"
-cd ${FINDER_APP_DIR}
-make clean
-make CROSS_COMPILE=${CROSS_COMPILE}
-
-# TODO: Copy the finder related scripts and executables to the /home directory
-echo "********* Copy finder and related exec to target rootfs /home *********"
-# change to finder app dir, this lets us copy recursively
-cd ${FINDER_APP_DIR}
-cp -r * ${OUTDIR}/rootfs/home
-# we need to back up one dir to get the conf folder
-cp -r ../conf ${OUTDIR}/rootfs
-
-# TODO: Chown the root directory
-echo "********* Chown root directory *********"
-cd ${OUTDIR}/rootfs
-sudo chown -R root:root *
-# TODO: Create initramfs.cpio.gz
-echo "********* Create initramfs.cpio.gz *********"
-find . | cpio -H newc -o | gzip -9 > ${OUTDIR}/initramfs.cpio.gz
+echo "********* Stage timing *********"
+total=0
+for i in "${!STAGE_NAMES[@]}"; do
+    printf '%-10s %-8s %8d ms\n' "${STAGE_NAMES[$i]}" "${STAGE_RESULTS[$i]}" "${STAGE_TIMES[$i]}"
+    total=$(( total + STAGE_TIMES[$i] ))
+done
+printf '%-10s %-8s %8d ms\n' "total" "" "${total}"
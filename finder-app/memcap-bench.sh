@@ -0,0 +1,61 @@
+#!/bin/bash
+# Memory cap benchmark for aesdsocket on localhost.
+# CLIENTS ack-mode clients append SIZE byte packets, once without a cap
+# (accounting only) and once with -M CAP_MIB, so clients beyond what fits
+# wait in the backlog and readers pause near the cap.  For each run the
+# throughput, the budget's peak and counters (METRICS) and the server's
+# peak RSS (VmHWM, which includes the store) are printed.
+# Usage: memcap-bench.sh [port]
+
+set -e
+set -u
+
+PORT=${1:-9900}
+CLIENTS=${CLIENTS:-64}
+REQUESTS=${REQUESTS:-200}
+SIZE=${SIZE:-32768}
+CAP_MIB=${CAP_MIB:-8}
+
+FINDER_APP_DIR=$(realpath $(dirname $0))
+SERVER_DIR=${FINDER_APP_DIR}/../server
+WORKDIR=$(mktemp -d /tmp/aesdmemcap.XXXXXX)
+PID=""
+
+cleanup() {
+    [ -n "${PID}" ] && kill ${PID} 2>/dev/null
+    wait 2>/dev/null || true
+    rm -rf ${WORKDIR}
+}
+trap cleanup EXIT
+
+echo "********* Building aesdsocket and aesdbench *********"
+make -C ${SERVER_DIR} all bench >/dev/null
+
+metrics() {
+    exec 3<>/dev/tcp/127.0.0.1/${PORT}
+    printf 'METRICS\n' >&3
+    timeout 1 cat <&3 | grep '^mem\.' | tr '\n' ' ' || true
+    exec 3<&-
+    echo
+}
+
+# run <label> <cap MiB, 0 for none>
+run() {
+    local label=$1 cap=$2
+    PORT=$((PORT + 1))
+    ${SERVER_DIR}/aesdsocket -b file -s ${WORKDIR}/store -p ${PORT} -M ${cap} &
+    PID=$!
+    sleep 0.5
+    ${SERVER_DIR}/aesdbench -a -p ${PORT} -c ${CLIENTS} -n ${REQUESTS} -s ${SIZE} | grep '^RESULT' |
+        sed "s/^/${label} /"
+    echo "${label} $(metrics)"
+    echo "${label} server $(grep VmHWM /proc/${PID}/status | tr -s ' \t' ' ')"
+    kill ${PID}
+    wait ${PID} 2>/dev/null || true
+    PID=""
+    rm -f ${WORKDIR}/store
+}
+
+echo "********* ${CLIENTS} clients, ${SIZE} byte packets *********"
+run uncapped 0
+run capped ${CAP_MIB}
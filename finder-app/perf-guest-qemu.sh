@@ -0,0 +1,51 @@
+#!/bin/sh
+# Guest side of perf-test.sh, started as rdinit.
+# Loads aesdchar, starts aesdsocket through its init script, runs each
+# aesdbench workload locally and prints "PERF workload=<name> key=value..."
+# lines on the console, including kmalloc slab usage before and after.
+# Powers the VM off when done so qemu exits.
+
+MODDIR=/lib/modules/aesd
+
+mount -t proc proc /proc
+mount -t sysfs sysfs /sys
+mkdir -p /var/run /var/tmp
+ifconfig lo 127.0.0.1 up
+
+# Sum of active_objs * objsize over the kmalloc caches, in KiB
+slab_kmalloc_kb() {
+    awk '/^kmalloc-/ { total += $2 * $4 } END { printf "%d", total / 1024 }' /proc/slabinfo
+}
+
+run_workload() {
+    name=$1
+    shift
+    slab_before=$(slab_kmalloc_kb)
+    # aesdbench's status, not grep's
+    aesdbench "$@" > /var/tmp/aesdbench.out
+    rc=$?
+    result=$(grep '^RESULT ' /var/tmp/aesdbench.out)
+    slab_after=$(slab_kmalloc_kb)
+    if [ ${rc} -ne 0 ] || [ -z "${result}" ]; then
+        echo "PERF workload=${name} errors=1"
+        return
+    fi
+    echo "PERF workload=${name} ${result#RESULT } slab_kb_before=${slab_before}" \
+         "slab_kb_after=${slab_after} slab_kb_delta=$(( slab_after - slab_before ))"
+}
+
+echo "PERF-BEGIN"
+if ! ${MODDIR}/aesdchar_load; then
+    echo "PERF-ABORT aesdchar_load failed"
+    poweroff -f
+fi
+/etc/init.d/S99aesdsocket start
+sleep 1
+
+run_workload single -c 1 -n 500 -s 64
+run_workload multi  -c 4 -n 200 -s 64
+run_workload large  -c 1 -n 100 -s 4096
+
+/etc/init.d/S99aesdsocket stop
+echo "PERF-END"
+poweroff -f
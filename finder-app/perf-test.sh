@@ -0,0 +1,114 @@
+#!/bin/bash
+# Performance test for aesdchar and aesdsocket under QEMU.
+# Boots the image built by manual-linux.sh with perf-guest-qemu.sh as init,
+# collects the PERF lines from the serial log and checks them against
+# perf-baseline.txt.  The report is written to ${OUTDIR}/perf-report.txt.
+# Exits 1 when a metric regressed or a workload failed, and 2 when every
+# workload passed but some metric has no baseline to check against yet.
+# Usage: perf-test.sh [outdir] [--update-baseline]
+
+set -e
+set -u
+
+OUTDIR=/tmp/aeld
+UPDATE_BASELINE=0
+for arg in "$@"; do
+    case "${arg}" in
+        --update-baseline) UPDATE_BASELINE=1 ;;
+        *) OUTDIR=${arg} ;;
+    esac
+done
+
+FINDER_APP_DIR=$(realpath $(dirname $0))
+BASELINE=${FINDER_APP_DIR}/perf-baseline.txt
+KERNEL_IMAGE=${OUTDIR}/Image
+INITRD_IMAGE=${OUTDIR}/initramfs.cpio.gz
+SERIAL_LOG=${OUTDIR}/perf-serial.log
+REPORT=${OUTDIR}/perf-report.txt
+PERF_TIMEOUT=${PERF_TIMEOUT:-600}
+
+if [ ! -e ${KERNEL_IMAGE} ] || [ ! -e ${INITRD_IMAGE} ]; then
+    echo "Missing ${KERNEL_IMAGE} or ${INITRD_IMAGE}, run manual-linux.sh first"
+    exit 1
+fi
+
+echo "Booting the kernel for the perf run (timeout ${PERF_TIMEOUT}s)"
+rm -f ${SERIAL_LOG}
+timeout ${PERF_TIMEOUT} qemu-system-aarch64 \
+        -m 256M \
+        -M virt \
+        -cpu cortex-a53 \
+        -smp 1 \
+        -display none \
+        -monitor none \
+        -no-reboot \
+        -serial file:${SERIAL_LOG} \
+        -kernel ${KERNEL_IMAGE} \
+        -append "rdinit=/home/perf-guest-qemu.sh console=ttyAMA0" -initrd ${INITRD_IMAGE} \
+    || true
+
+if ! grep -q '^PERF-END' ${SERIAL_LOG}; then
+    echo "Perf run did not complete, see ${SERIAL_LOG}"
+    grep '^PERF-ABORT' ${SERIAL_LOG} || true
+    exit 1
+fi
+
+# value_of <workload> <metric>: pick a metric out of the PERF lines
+value_of() {
+    grep "^PERF workload=$1 " ${SERIAL_LOG} | tr -d '\r' | tr ' ' '\n' | \
+        awk -F= -v key="$2" '$1 == key { print $2; exit }'
+}
+
+{
+    echo "aesd perf report $(date)"
+    echo
+    printf '%-8s %-14s %12s %12s %8s  %s\n' workload metric value baseline change result
+    while read -r workload metric direction tolerance baseline; do
+        case "${workload}" in ''|\#*) continue ;; esac
+        value=$(value_of ${workload} ${metric})
+        errors=$(value_of ${workload} errors)
+        if [ -z "${value}" ] || [ "${errors:-0}" != "0" ]; then
+            printf '%-8s %-14s %12s %12s %8s  %s\n' ${workload} ${metric} "-" ${baseline} "-" FAIL
+            continue
+        fi
+        if [ "${baseline}" = "-" ]; then
+            printf '%-8s %-14s %12s %12s %8s  %s\n' ${workload} ${metric} ${value} "-" "-" "NO BASELINE"
+            continue
+        fi
+        verdict=$(awk -v v="${value}" -v b="${baseline}" -v t="${tolerance}" -v d="${direction}" 'BEGIN {
+            change = (b != 0) ? (v - b) * 100.0 / b : 0
+            bad = (d == "higher") ? (change < -t) : (change > t)
+            printf "%+.1f%% %s", change, bad ? "FAIL" : "ok"
+        }')
+        printf '%-8s %-14s %12s %12s %8s  %s\n' ${workload} ${metric} ${value} ${baseline} ${verdict}
+    done < ${BASELINE}
+} | tee ${REPORT}
+
+# the table is built in a pipeline subshell, so take the verdict from it
+failed=0
+grep -q 'FAIL$' ${REPORT} && failed=1
+missing=0
+grep -q 'NO BASELINE$' ${REPORT} && missing=1
+
+if [ ${UPDATE_BASELINE} -eq 1 ]; then
+    tmp=$(mktemp)
+    while IFS= read -r line; do
+        set -- ${line}
+        case "${1:-#}" in \#*) echo "${line}"; continue ;; esac
+        value=$(value_of $1 $2)
+        printf '%-6s %-13s %-6s %-2s %s\n' $1 $2 $3 $4 ${value:-$5}
+    done < ${BASELINE} > ${tmp}
+    mv ${tmp} ${BASELINE}
+    echo "Baselines updated in ${BASELINE}"
+    exit 0
+fi
+
+if [ ${failed} -ne 0 ]; then
+    echo "Perf test failed, report in ${REPORT}"
+    exit 1
+fi
+if [ ${missing} -ne 0 ]; then
+    echo "Perf test incomplete: metrics without a baseline, record them with --update-baseline"
+    exit 2
+fi
+echo "Perf test passed, report in ${REPORT}"
@@ -0,0 +1,95 @@
+#!/bin/bash
+# Throughput of the normal, LTO-only and PGO+LTO builds side by side
+# (server/Makefile 'pgo-report').  Every variant serves the same aesdbench
+# load, from the normal build, on a fresh mem store; aesdstorebench runs
+# in-process.  Each workload is run RUNS times per variant, interleaved so
+# drift hits all of them alike, and the median is reported with the gain
+# over the normal build.  "noise" is the normal build's spread (max - min)
+# over its median: gains below it are not worth much.
+# Usage: pgo-report.sh <normal dir> <lto dir> <pgo dir> [port]
+
+set -e
+set -u
+
+NORMAL=$(realpath $1)
+LTO=$(realpath $2)
+PGO=$(realpath $3)
+PORT=${4:-9980}
+RUNS=${RUNS:-5}
+
+WORKDIR=$(mktemp -d /tmp/aesdpgorep.XXXXXX)
+PID=""
+
+cleanup() {
+    [ -n "${PID}" ] && kill ${PID} 2>/dev/null
+    wait 2>/dev/null || true
+    rm -rf ${WORKDIR}
+}
+trap cleanup EXIT
+
+# value_of <key>: pick key=value out of a RESULT line on stdin
+value_of() {
+    tr ' ' '\n' | awk -F= -v key="$1" '$1 == key { print $2; exit }'
+}
+
+# server <bindir> <key> <aesdbench args...>
+server() {
+    local dir=$1 key=$2
+    shift 2
+    PORT=$((PORT + 1))
+    ${dir}/aesdsocket -b mem -p ${PORT} &
+    PID=$!
+    sleep 0.3
+    ${NORMAL}/aesdbench -p ${PORT} "$@" | grep '^RESULT' | value_of ${key}
+    kill ${PID}
+    wait ${PID} 2>/dev/null || true
+    PID=""
+}
+
+# store <bindir> <key> <aesdstorebench args...>
+store() {
+    local dir=$1 key=$2
+    shift 2
+    ${dir}/aesdstorebench "$@" | grep '^RESULT mode=store' | value_of ${key}
+}
+
+median() {
+    sort -g | awk '{ v[NR] = $1 } END { print (NR % 2) ? v[(NR + 1) / 2] : (v[NR / 2] + v[NR / 2 + 1]) / 2 }'
+}
+
+spread() {
+    sort -g | awk '{ v[NR] = $1 } END { print v[NR] - v[1] }'
+}
+
+# workload <label> <server|store> <key> <args...>
+workload() {
+    local label=$1 how=$2 key=$3
+    shift 3
+    for run in $(seq ${RUNS}); do
+        for variant in normal lto pgo; do
+            case ${variant} in
+            normal) dir=${NORMAL} ;;
+            lto) dir=${LTO} ;;
+            pgo) dir=${PGO} ;;
+            esac
+            ${how} ${dir} ${key} "$@" >> ${WORKDIR}/${label}.${variant}
+        done
+    done
+    local n=$(median < ${WORKDIR}/${label}.normal)
+    local l=$(median < ${WORKDIR}/${label}.lto)
+    local p=$(median < ${WORKDIR}/${label}.pgo)
+    local s=$(spread < ${WORKDIR}/${label}.normal)
+    awk -v w="${label} ${key}" -v n="${n}" -v l="${l}" -v p="${p}" -v s="${s}" 'BEGIN {
+        printf "%-28s %12.0f %12.0f %12.0f %+7.1f%% %+7.1f%% %6.1f%%\n", w, n, l, p,
+               (l - n) * 100.0 / n, (p - n) * 100.0 / n, s * 100.0 / n
+    }'
+}
+
+echo "********* PGO report, median of ${RUNS} runs *********"
+printf '%-28s %12s %12s %12s %8s %8s %7s\n' workload normal lto pgo+lto lto pgo+lto noise
+workload ack-appends server req_per_s -a -c 8 -n 5000 -s 128
+workload ack-large server req_per_s -a -c 2 -n 200 -s 100000
+workload replays server req_per_s -c 4 -n 300 -s 256
+workload store-mem store appends_per_s -b mem -t 1 -n 1000000 -s 64
+workload store-file store appends_per_s -b file -t 1 -n 500000 -s 64
+workload store-dedup store appends_per_s -b dedup -t 1 -n 1000000 -s 64 -u 256
@@ -0,0 +1,97 @@
+#!/bin/bash
+# Training workload for the profile-guided build (server/Makefile 'pgo').
+# Runs the instrumented aesdsocket in BINDIR under the load benchmark from
+# BENCHDIR across the backends and request types a deployment sees (ack
+# appends, full replays, compressed replies, commands, TLS when built
+# with it), then the instrumented aesdstorebench.  The server is stopped
+# with SIGTERM so it exits through main() and writes its profile.
+# TLS runs when HAVE_OPENSSL=1 (the Makefile passes its own setting), with
+# a throwaway self-signed certificate.
+# Usage: [HAVE_OPENSSL=1] pgo-train.sh <bindir> <benchdir> [port]
+
+set -e
+set -u
+
+BINDIR=$(realpath $1)
+BENCHDIR=$(realpath $2)
+PORT=${3:-9950}
+HAVE_OPENSSL=${HAVE_OPENSSL:-0}
+WORKDIR=$(mktemp -d /tmp/aesdpgo.XXXXXX)
+PID=""
+
+cleanup() {
+    [ -n "${PID}" ] && kill ${PID} 2>/dev/null
+    wait 2>/dev/null || true
+    rm -rf ${WORKDIR}
+}
+trap cleanup EXIT
+
+bench() {
+    ${BENCHDIR}/aesdbench -p ${PORT} "$@" 2>/dev/null | grep '^RESULT' || true
+}
+
+commands() {
+    exec 3<>/dev/tcp/127.0.0.1/${PORT}
+    printf 'LINES:0,10\nSINCE:0\nFILTER:n1\nAESDCHAR_IOCSEEKTO:1,0\nMETRICS\n' >&3
+    timeout 1 cat <&3 >/dev/null || true
+    exec 3<&-
+}
+
+# train <backend> [aesdsocket args...]
+train() {
+    local backend=$1
+    shift
+    PORT=$((PORT + 1))
+    ${BINDIR}/aesdsocket -b ${backend} -s ${WORKDIR}/store -p ${PORT} "$@" &
+    PID=$!
+    sleep 0.5
+    echo "********* Training with the ${backend} backend *********"
+    bench -a -c 8 -n 2000 -s 128
+    bench -c 4 -n 200 -s 256
+    # Codecs this build lacks are refused at setup, which costs nothing
+    for codec in gzip zstd; do
+        bench -c 2 -n 50 -s 256 -z ${codec}
+    done
+    bench -r -c 2 -n 100
+    commands
+    # Last, so the replays above stay small
+    bench -a -c 2 -n 50 -s 100000
+    kill ${PID}
+    wait ${PID} || true
+    PID=""
+    rm -f ${WORKDIR}/store*
+}
+
+# train_tls [aesdsocket args...]: TLS appends and replays on the mem backend
+train_tls() {
+    local tls_port=$((PORT + 1))
+    PORT=$((PORT + 2))
+    ${BINDIR}/aesdsocket -b mem -p ${PORT} -T ${tls_port} \
+        -C ${WORKDIR}/cert.pem -K ${WORKDIR}/key.pem "$@" &
+    PID=$!
+    sleep 0.5
+    echo "********* Training the TLS listener $* *********"
+    bench -T -p ${tls_port} -a -c 4 -n 500 -s 128
+    bench -T -p ${tls_port} -c 2 -n 100 -s 256
+    bench -T -p ${tls_port} -a -c 1 -n 20 -s 100000
+    kill ${PID}
+    wait ${PID} || true
+    PID=""
+}
+
+train file
+train file -c
+train mem
+train dedup
+
+if [ "${HAVE_OPENSSL}" = "1" ]; then
+    openssl req -x509 -newkey rsa:2048 -nodes -days 1 -subj /CN=localhost \
+        -keyout ${WORKDIR}/key.pem -out ${WORKDIR}/cert.pem 2>/dev/null
+    train_tls
+    # -u keeps records in userspace, so OpenSSL's own record path is trained too
+    train_tls -u
+fi
+
+echo "********* Training aesdstorebench *********"
+${BINDIR}/aesdstorebench -b file,mem,dedup -t 2 -n 20000 -s 128 -u 64 -f n1 | grep '^RESULT'
+${BINDIR}/aesdstorebench -b file -t 1 -n 2000 -s 4096 -c | grep '^RESULT'
@@ -0,0 +1,72 @@
+#!/bin/bash
+# Leader/follower replication test for aesdsocket on localhost.
+# Starts one leader and N followers (file backend, private store paths),
+# writes through the leader with aesdbench, checks every follower store is
+# byte-identical to the leader's and then runs read load against all of them.
+# Usage: repl-test.sh [followers] [base port]
+
+set -e
+set -u
+
+FOLLOWERS=${1:-2}
+BASE_PORT=${2:-9200}
+REPL_PORT=$((BASE_PORT + 100))
+SYNC_TIMEOUT=${SYNC_TIMEOUT:-10}
+
+FINDER_APP_DIR=$(realpath $(dirname $0))
+SERVER_DIR=${FINDER_APP_DIR}/../server
+WORKDIR=$(mktemp -d /tmp/aesdrepl.XXXXXX)
+PIDS=""
+
+cleanup() {
+    [ -n "${PIDS}" ] && kill ${PIDS} 2>/dev/null
+    wait 2>/dev/null || true
+    rm -rf ${WORKDIR}
+}
+trap cleanup EXIT
+
+echo "********* Building aesdsocket and aesdbench *********"
+make -C ${SERVER_DIR} all bench >/dev/null
+
+echo "********* Starting leader on ${BASE_PORT} (replication port ${REPL_PORT}) *********"
+${SERVER_DIR}/aesdsocket -b file -s ${WORKDIR}/leader -p ${BASE_PORT} -L ${REPL_PORT} &
+PIDS="${PIDS} $!"
+for i in $(seq 1 ${FOLLOWERS}); do
+    echo "********* Starting follower ${i} on $((BASE_PORT + i)) *********"
+    ${SERVER_DIR}/aesdsocket -b file -s ${WORKDIR}/follower${i} -p $((BASE_PORT + i)) \
+        -F 127.0.0.1:${REPL_PORT} &
+    PIDS="${PIDS} $!"
+done
+sleep 1
+
+echo "********* Writing through the leader *********"
+${SERVER_DIR}/aesdbench -p ${BASE_PORT} -c 4 -n 200 -s 128 | grep '^RESULT'
+
+# Followers apply asynchronously; wait for them to reach the leader's size
+leader_size=$(stat -c %s ${WORKDIR}/leader)
+rc=0
+for i in $(seq 1 ${FOLLOWERS}); do
+    waited=0
+    while [ "$(stat -c %s ${WORKDIR}/follower${i} 2>/dev/null || echo 0)" -lt ${leader_size} ] && \
+          [ ${waited} -lt $((SYNC_TIMEOUT * 10)) ]; do
+        sleep 0.1
+        waited=$((waited + 1))
+    done
+    if cmp -n ${leader_size} ${WORKDIR}/leader ${WORKDIR}/follower${i}; then
+        echo "follower ${i}: in sync at ${leader_size} bytes after ~$((waited * 100)) ms"
+    else
+        echo "follower ${i}: NOT in sync with the leader"
+        rc=1
+    fi
+done
+
+echo "********* Read load: leader alone, then every node in parallel *********"
+${SERVER_DIR}/aesdbench -r -p ${BASE_PORT} -c 4 -n 200 | grep '^RESULT' | sed 's/^/leader-only /'
+BENCH_PIDS=""
+for i in $(seq 0 ${FOLLOWERS}); do
+    ${SERVER_DIR}/aesdbench -r -p $((BASE_PORT + i)) -c 4 -n 200 | grep '^RESULT' | sed "s/^/node${i} /" &
+    BENCH_PIDS="${BENCH_PIDS} $!"
+done
+wait ${BENCH_PIDS} || rc=1
+
+exit ${rc}
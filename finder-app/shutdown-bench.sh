@@ -0,0 +1,101 @@
+#!/bin/bash
+# Shutdown latency benchmark for aesdsocket on localhost.
+# CONNS idle connections are opened and confirmed (aesdbench -k), then
+# SIGTERM is sent and the time until the server has exited is measured,
+# once with only idle connections and once with readers replaying a
+# FILL_MB store while the signal arrives, so the drain has replies to finish.
+# aesdsocket logs "Drained N connections in X ms" to syslog as well; with
+# per-connection syslog lines enabled, syslog speed dominates at 10k.
+# Usage: shutdown-bench.sh [port]
+
+set -e
+set -u
+
+PORT=${1:-9800}
+CONNS=${CONNS:-10000}
+FILL_MB=${FILL_MB:-64}
+DRAIN_MS=${DRAIN_MS:-5000}
+HOLD_TIMEOUT=${HOLD_TIMEOUT:-60}
+
+FINDER_APP_DIR=$(realpath $(dirname $0))
+SERVER_DIR=${FINDER_APP_DIR}/../server
+WORKDIR=$(mktemp -d /tmp/aesdstop.XXXXXX)
+PID=""
+
+cleanup() {
+    [ -n "${PID}" ] && kill ${PID} 2>/dev/null
+    wait 2>/dev/null || true
+    rm -rf ${WORKDIR}
+}
+trap cleanup EXIT
+
+echo "********* Building aesdsocket and aesdbench *********"
+make -C ${SERVER_DIR} all bench >/dev/null
+
+# Both ends of every connection live on this host
+if ! ulimit -n $((CONNS * 2 + 256)) 2>/dev/null; then
+    echo "cannot raise the descriptor limit to $((CONNS * 2 + 256)), using $(ulimit -n)"
+fi
+
+now_ms() {
+    echo $(( $(date +%s%N) / 1000000 ))
+}
+
+# run <label> <with readers: 0/1>
+run() {
+    local label=$1 readers=$2
+    PORT=$((PORT + 1))
+    ${SERVER_DIR}/aesdsocket -b mem -p ${PORT} -g ${DRAIN_MS} &
+    PID=$!
+    sleep 0.5
+    if [ ${readers} -eq 1 ]; then
+        ${SERVER_DIR}/aesdbench -a -p ${PORT} -c 4 -n $((FILL_MB * 64)) -s 4096 >/dev/null
+    fi
+
+    ${SERVER_DIR}/aesdbench -k -p ${PORT} -c ${CONNS} > ${WORKDIR}/hold.out &
+    local hold=$!
+    # Gives up if aesdbench -k dies before confirming or takes too long
+    local waited=0
+    until grep -q 'connections=' ${WORKDIR}/hold.out 2>/dev/null; do
+        if ! kill -0 ${hold} 2>/dev/null; then
+            # it may have written the line just before exiting
+            grep -q 'connections=' ${WORKDIR}/hold.out && break
+            echo "${label}: aesdbench -k exited before confirming its connections"
+            cat ${WORKDIR}/hold.out
+            exit 1
+        fi
+        if [ ${waited} -ge $((HOLD_TIMEOUT * 10)) ]; then
+            echo "${label}: aesdbench -k did not confirm ${CONNS} connections within ${HOLD_TIMEOUT}s"
+            cat ${WORKDIR}/hold.out
+            kill ${hold} 2>/dev/null || true
+            exit 1
+        fi
+        sleep 0.1
+        waited=$((waited + 1))
+    done
+    grep '^RESULT' ${WORKDIR}/hold.out | sed "s/^/${label} /"
+
+    local reader=""
+    if [ ${readers} -eq 1 ]; then
+        ${SERVER_DIR}/aesdbench -r -p ${PORT} -c 2 -n 1000 > ${WORKDIR}/readers.out 2>&1 &
+        reader=$!
+        sleep 0.5
+    fi
+
+    local t0=$(now_ms)
+    kill -TERM ${PID}
+    wait ${PID} || true
+    echo "${label} RESULT mode=shutdown connections=${CONNS} shutdown_ms=$(( $(now_ms) - t0 ))"
+    PID=""
+    wait ${hold} || true
+    grep 'closed=' ${WORKDIR}/hold.out | sed "s/^/${label} /"
+    if [ -n "${reader}" ]; then
+        wait ${reader} || true
+        grep '^RESULT' ${WORKDIR}/readers.out | sed "s/^/${label} readers /"
+    fi
+    rm -f ${WORKDIR}/hold.out
+}
+
+echo "********* SIGTERM with ${CONNS} connections *********"
+run idle 0
+run replaying 1
@@ -0,0 +1,45 @@
+#!/bin/bash
+# Script to boot the qemu image for the aesdchar dev loop.
+# Same machine as start-qemu-app.sh, plus a virtio-9p share of ${OUTDIR}/share
+# (mounted at /mnt/aesd in the guest) and port 9000 forwarded to the host.
+# Use dev-loop-aesdchar.sh from another terminal to push driver builds.
+
+set -e
+
+OUTDIR=$1
+
+if [ -z "${OUTDIR}" ]; then
+    OUTDIR=/tmp/aeld
+    echo "No outdir specified, using ${OUTDIR}"
+fi
+
+KERNEL_IMAGE=${OUTDIR}/Image
+INITRD_IMAGE=${OUTDIR}/initramfs.cpio.gz
+SHARE_DIR=${OUTDIR}/share
+HOST_PORT=${AESD_HOST_PORT:-9000}
+
+if [ ! -e ${KERNEL_IMAGE} ]; then
+    echo "Missing kernel image at ${KERNEL_IMAGE}"
+    exit 1
+fi
+if [ ! -e ${INITRD_IMAGE} ]; then
+    echo "Missing initrd image at ${INITRD_IMAGE}"
+    exit 1
+fi
+mkdir -p ${SHARE_DIR}
+rm -f ${SHARE_DIR}/reload-request ${SHARE_DIR}/reload-done
+
+echo "Booting the kernel"
+qemu-system-aarch64 \
+        -m 256M \
+        -M virt \
+        -cpu cortex-a53 \
+        -nographic \
+        -smp 1 \
+        -kernel ${KERNEL_IMAGE} \
+        -chardev stdio,id=char0,mux=on,logfile=${OUTDIR}/serial.log,signal=off \
+        -serial chardev:char0 -mon chardev=char0 \
+        -virtfs local,path=${SHARE_DIR},mount_tag=aesdshare,security_model=none,id=aesdshare \
+        -netdev user,id=net0,hostfwd=tcp::${HOST_PORT}-:9000 \
+        -device virtio-net-device,netdev=net0 \
+        -append "rdinit=/home/dev-agent-qemu.sh console=ttyAMA0" -initrd ${INITRD_IMAGE}
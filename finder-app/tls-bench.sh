@@ -0,0 +1,67 @@
+#!/bin/bash
+# Plaintext vs TLS replay throughput for aesdsocket on localhost.
+# Fills the store with STORE_MB of 1 MiB packets, then runs aesdbench read
+# mode (one connection, one full replay per request) against the plain port,
+# a TLS port with OpenSSL doing the crypto (-u) and a TLS port that asks for
+# kTLS.  Only the kTLS run can keep sendfile() for replays; when the kernel
+# has no TLS support it falls back to OpenSSL and matches the -u numbers.
+# Usage: tls-bench.sh [clients] [requests] [base port]
+
+set -e
+set -u
+
+CLIENTS=${1:-2}
+REQUESTS=${2:-50}
+BASE_PORT=${3:-9400}
+STORE_MB=${STORE_MB:-8}
+
+FINDER_APP_DIR=$(realpath $(dirname $0))
+SERVER_DIR=${FINDER_APP_DIR}/../server
+WORKDIR=$(mktemp -d /tmp/aesdtls.XXXXXX)
+PID=""
+
+cleanup() {
+    [ -n "${PID}" ] && kill ${PID} 2>/dev/null
+    wait 2>/dev/null || true
+    rm -rf ${WORKDIR}
+}
+trap cleanup EXIT
+
+echo "********* Building aesdsocket and aesdbench *********"
+make -C ${SERVER_DIR} all bench >/dev/null
+
+echo "********* Generating a self-signed certificate *********"
+openssl req -x509 -newkey rsa:2048 -nodes -days 1 -subj /CN=localhost \
+    -keyout ${WORKDIR}/key.pem -out ${WORKDIR}/cert.pem 2>/dev/null
+
+if [ -e /proc/net/tls_stat ]; then
+    echo "kernel TLS available"
+else
+    echo "kernel TLS not available (no tls module); the ktls run will use OpenSSL"
+fi
+
+# run <label> <aesdbench port> [extra aesdsocket args...]
+run() {
+    local label=$1 port=$2
+    shift 2
+    ${SERVER_DIR}/aesdsocket -b file -s ${WORKDIR}/store -p ${BASE_PORT} "$@" &
+    PID=$!
+    sleep 1
+    # The store starts empty on every run; fill it over the plain port
+    ${SERVER_DIR}/aesdbench -p ${BASE_PORT} -n ${STORE_MB} -s $((1024 * 1024)) >/dev/null
+    local tls_flag=""
+    [ ${port} -ne ${BASE_PORT} ] && tls_flag="-T"
+    ${SERVER_DIR}/aesdbench -r ${tls_flag} -p ${port} -c ${CLIENTS} -n ${REQUESTS} | \
+        grep '^RESULT' | sed "s/^/${label} /"
+    kill ${PID}
+    wait ${PID} 2>/dev/null || true
+    PID=""
+}
+
+TLS_PORT=$((BASE_PORT + 1))
+TLS_ARGS="-T ${TLS_PORT} -C ${WORKDIR}/cert.pem -K ${WORKDIR}/key.pem"
+
+echo "********* ${STORE_MB} MB replays: plaintext, userspace TLS, kTLS *********"
+run plain ${BASE_PORT}
+run tls-user ${TLS_PORT} ${TLS_ARGS} -u
+run tls-ktls ${TLS_PORT} ${TLS_ARGS}
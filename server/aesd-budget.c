@@ -0,0 +1,148 @@
+/**
+ * aesd-budget.c
+ *
+ * - Counters are atomics, so charging costs no lock; only paused readers
+ *   touch the mutex
+ * - The high watermark is 7/8 of the cap and the low one 3/4, so readers
+ *   do not flap around a single threshold
+ * - Fixed costs are admitted only up to the high watermark: the eighth
+ *   above it is headroom for requests, so connections alone cannot hold
+ *   the server in pressure
+ * - A release that drops below the low watermark wakes the paused readers;
+ *   they also recheck every timeout, so a wakeup racing with a new waiter
+ *   costs at most one timeout
+*/
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <time.h>
+
+#include "aesd-budget.h"
+
+static const char *const g_names[AESD_BUDGET_NCATS] = { "stack", "tls", "pending", "output" };
+
+static uint64_t g_cap;
+static uint64_t g_high;
+static uint64_t g_low;
+static atomic_uint_least64_t g_used[AESD_BUDGET_NCATS];
+static atomic_uint_least64_t g_total;
+static atomic_uint_least64_t g_peak;
+static atomic_uint_least64_t g_pressure_waits;
+static atomic_uint_least64_t g_refused;
+static atomic_uint g_waiters;
+static pthread_mutex_t g_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_room = PTHREAD_COND_INITIALIZER;
+
+void aesd_budget_init(uint64_t cap)
+{
+    g_cap = cap;
+    g_high = cap / 8 * 7;
+    g_low = cap / 4 * 3;
+}
+
+static void note_peak(uint64_t total)
+{
+    uint64_t peak = atomic_load_explicit(&g_peak, memory_order_relaxed);
+    while (total > peak &&
+           !atomic_compare_exchange_weak_explicit(&g_peak, &peak, total, memory_order_relaxed,
+                                                  memory_order_relaxed)) {
+    }
+}
+
+void aesd_budget_charge(enum aesd_budget_cat cat, size_t n)
+{
+    atomic_fetch_add_explicit(&g_used[cat], n, memory_order_relaxed);
+    note_peak(atomic_fetch_add_explicit(&g_total, n, memory_order_relaxed) + n);
+}
+
+bool aesd_budget_try_charge(enum aesd_budget_cat cat, size_t n)
+{
+    uint64_t total = atomic_load_explicit(&g_total, memory_order_relaxed);
+    do {
+        if (g_cap && total + n > g_cap) {
+            atomic_fetch_add_explicit(&g_refused, 1, memory_order_relaxed);
+            return false;
+        }
+    } while (!atomic_compare_exchange_weak_explicit(&g_total, &total, total + n, memory_order_relaxed,
+                                                    memory_order_relaxed));
+    atomic_fetch_add_explicit(&g_used[cat], n, memory_order_relaxed);
+    note_peak(total + n);
+    return true;
+}
+
+void aesd_budget_release(enum aesd_budget_cat cat, size_t n)
+{
+    atomic_fetch_sub_explicit(&g_used[cat], n, memory_order_relaxed);
+    uint64_t total = atomic_fetch_sub_explicit(&g_total, n, memory_order_relaxed) - n;
+    if (g_cap && total < g_low && atomic_load(&g_waiters) > 0) {
+        pthread_mutex_lock(&g_lock);
+        pthread_cond_broadcast(&g_room);
+        pthread_mutex_unlock(&g_lock);
+    }
+}
+
+bool aesd_budget_room(size_t n)
+{
+    return !g_cap || atomic_load_explicit(&g_total, memory_order_relaxed) + n <= g_high;
+}
+
+static uint64_t transient(void)
+{
+    return atomic_load_explicit(&g_used[AESD_BUDGET_PENDING], memory_order_relaxed) +
+           atomic_load_explicit(&g_used[AESD_BUDGET_OUTPUT], memory_order_relaxed);
+}
+
+bool aesd_budget_pressure(void)
+{
+    // Pausing readers cannot shrink fixed costs, so those alone never cause it
+    return g_cap && atomic_load_explicit(&g_total, memory_order_relaxed) >= g_high && transient() > 0;
+}
+
+/* Pressure until usage is back under the low watermark */
+static bool still_pressed(void)
+{
+    return atomic_load_explicit(&g_total, memory_order_relaxed) >= g_low && transient() > 0;
+}
+
+bool aesd_budget_wait_room(int timeout_ms)
+{
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += timeout_ms / 1000;
+    deadline.tv_nsec += (long)(timeout_ms % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    atomic_fetch_add(&g_pressure_waits, 1);
+    atomic_fetch_add(&g_waiters, 1);
+    pthread_mutex_lock(&g_lock);
+    bool pressed;
+    while ((pressed = still_pressed()) && pthread_cond_timedwait(&g_room, &g_lock, &deadline) != ETIMEDOUT) {
+    }
+    pressed = still_pressed();
+    pthread_mutex_unlock(&g_lock);
+    atomic_fetch_sub(&g_waiters, 1);
+    return !pressed;
+}
+
+void aesd_budget_stats(struct aesd_budget_stats *out)
+{
+    memset(out, 0, sizeof(*out));
+    for (int i = 0; i < AESD_BUDGET_NCATS; i++) out->used[i] = atomic_load(&g_used[i]);
+    out->total = atomic_load(&g_total);
+    out->peak = atomic_load(&g_peak);
+    out->cap = g_cap;
+    out->pressure_waits = atomic_load(&g_pressure_waits);
+    out->refused = atomic_load(&g_refused);
+}
+
+const char *aesd_budget_name(enum aesd_budget_cat cat)
+{
+    return cat < AESD_BUDGET_NCATS ? g_names[cat] : "?";
+}
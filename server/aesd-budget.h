@@ -0,0 +1,58 @@
+/*
+ * aesd-budget.h
+ *
+ * Process-wide accounting of the memory connections hold, by category,
+ * against an optional cap (aesdsocket -M).  Store contents and the
+ * compressed caches are not counted: they are sized by the data, not by
+ * how many clients there are or how they behave.
+ *
+ * Fixed costs (thread stacks, TLS pumps) are charged when a connection
+ * starts; aesdsocket stops accepting while another one would not fit
+ * under the high watermark, leaving the rest of the cap to requests.
+ * Transient costs (partial packets in memory, staging buffers for output)
+ * come and go with requests; above the high watermark readers pause until
+ * usage is back under the low one, so TCP pushes back on the clients.
+ */
+
+#ifndef AESD_BUDGET_H
+#define AESD_BUDGET_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+enum aesd_budget_cat {
+    AESD_BUDGET_STACK,      /* client thread stacks, as reserved */
+    AESD_BUDGET_TLS,        /* TLS pump thread stacks and buffers */
+    AESD_BUDGET_PENDING,    /* packets held in memory until their '\n' or until stored */
+    AESD_BUDGET_OUTPUT,     /* staging buffers of replies being sent */
+    AESD_BUDGET_NCATS
+};
+
+struct aesd_budget_stats {
+    uint64_t used[AESD_BUDGET_NCATS];
+    uint64_t total;
+    uint64_t peak;
+    uint64_t cap;               /* 0: unlimited, accounting only */
+    uint64_t pressure_waits;    /* aesd_budget_wait_room() calls, each up to its timeout */
+    uint64_t refused;           /* aesd_budget_try_charge() failures */
+};
+
+/* Set the cap in bytes, 0 for none; call before any connection starts */
+void aesd_budget_init(uint64_t cap);
+/* Charge unconditionally, for costs that cannot be refused */
+void aesd_budget_charge(enum aesd_budget_cat cat, size_t n);
+/* Charge only if it keeps the total within the cap */
+bool aesd_budget_try_charge(enum aesd_budget_cat cat, size_t n);
+void aesd_budget_release(enum aesd_budget_cat cat, size_t n);
+/* Whether n more bytes of fixed cost fit under the high watermark */
+bool aesd_budget_room(size_t n);
+/* Above the high watermark with transient memory outstanding: readers should pause */
+bool aesd_budget_pressure(void);
+/* Wait up to timeout_ms for the pressure to end; true once it has */
+bool aesd_budget_wait_room(int timeout_ms);
+void aesd_budget_stats(struct aesd_budget_stats *out);
+/* "stack", "tls", "pending", "output" */
+const char *aesd_budget_name(enum aesd_budget_cat cat);
+
+#endif /* AESD_BUDGET_H */
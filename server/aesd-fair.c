@@ -0,0 +1,164 @@
+/**
+ * aesd-fair.c
+ *
+ * - Token buckets refill lazily from CLOCK_MONOTONIC on every call
+ * - DRR dispatch runs under the scheduler lock whenever a slot frees up or
+ *   a flow queues; each flow waits on its own condition variable, so a
+ *   grant wakes exactly one thread
+ * - Rounds in which no waiting flow could run are skipped in one step, so
+ *   a huge replay does not cost one loop iteration per quantum
+*/
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <time.h>
+
+#include "aesd-fair.h"
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+// ---------- token bucket ----------
+
+void aesd_bucket_init(struct aesd_bucket *b, double rate, double burst)
+{
+    b->rate = rate;
+    b->burst = burst > 0 ? burst : rate;
+    b->tokens = b->burst;
+    b->last_ns = now_ns();
+}
+
+static void refill(struct aesd_bucket *b)
+{
+    uint64_t now = now_ns();
+    b->tokens += b->rate * (double)(now - b->last_ns) / 1e9;
+    if (b->tokens > b->burst) b->tokens = b->burst;
+    b->last_ns = now;
+}
+
+uint64_t aesd_bucket_wait_ns(struct aesd_bucket *b)
+{
+    if (b->rate <= 0) return 0;
+    refill(b);
+    return b->tokens >= 0 ? 0 : (uint64_t)(-b->tokens / b->rate * 1e9);
+}
+
+uint64_t aesd_bucket_charge(struct aesd_bucket *b, double n)
+{
+    if (b->rate <= 0) return 0;
+    refill(b);
+    b->tokens -= n;
+    return b->tokens >= 0 ? 0 : (uint64_t)(-b->tokens / b->rate * 1e9);
+}
+
+// ---------- deficit round robin ----------
+
+int aesd_fair_init(struct aesd_fair *f, unsigned slots, uint64_t quantum)
+{
+    if (slots == 0 || quantum == 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    pthread_mutex_init(&f->lock, NULL);
+    TAILQ_INIT(&f->runq);
+    f->slots_free = slots;
+    f->quantum = quantum;
+    f->grants = 0;
+    f->queued = 0;
+    return 0;
+}
+
+void aesd_fair_destroy(struct aesd_fair *f)
+{
+    pthread_mutex_destroy(&f->lock);
+}
+
+void aesd_fair_flow_init(struct aesd_fair_flow *flow)
+{
+    pthread_cond_init(&flow->cond, NULL);
+    flow->deficit = 0;
+    flow->cost = 0;
+    flow->granted = false;
+    flow->queued = 0;
+    flow->wait_ns = 0;
+}
+
+void aesd_fair_flow_destroy(struct aesd_fair_flow *flow)
+{
+    pthread_cond_destroy(&flow->cond);
+}
+
+static void grant(struct aesd_fair *f, struct aesd_fair_flow *flow)
+{
+    TAILQ_REMOVE(&f->runq, flow, link);
+    // A flow with nothing left queued starts its next turn from zero
+    flow->deficit = 0;
+    flow->granted = true;
+    f->slots_free--;
+    f->grants++;
+    pthread_cond_signal(&flow->cond);
+}
+
+// Hand free slots to waiting flows in DRR order; called with f->lock held
+static void dispatch(struct aesd_fair *f)
+{
+    while (f->slots_free > 0 && !TAILQ_EMPTY(&f->runq)) {
+        // Fast-forward over rounds where nobody's credit would suffice
+        uint64_t rounds = UINT64_MAX;
+        struct aesd_fair_flow *flow;
+        TAILQ_FOREACH(flow, &f->runq, link) {
+            uint64_t short_by = flow->cost > flow->deficit ? flow->cost - flow->deficit : 0;
+            uint64_t r = (short_by + f->quantum - 1) / f->quantum;
+            if (r < rounds) rounds = r;
+        }
+        if (rounds > 1) {
+            TAILQ_FOREACH(flow, &f->runq, link) flow->deficit += (rounds - 1) * f->quantum;
+        }
+
+        // One round: the head gets a quantum and runs or goes to the back
+        flow = TAILQ_FIRST(&f->runq);
+        flow->deficit += f->quantum;
+        if (flow->deficit >= flow->cost) {
+            grant(f, flow);
+        } else {
+            TAILQ_REMOVE(&f->runq, flow, link);
+            TAILQ_INSERT_TAIL(&f->runq, flow, link);
+        }
+    }
+}
+
+void aesd_fair_enter(struct aesd_fair *f, struct aesd_fair_flow *flow, uint64_t cost)
+{
+    pthread_mutex_lock(&f->lock);
+    if (f->slots_free > 0 && TAILQ_EMPTY(&f->runq)) {
+        f->slots_free--;
+        f->grants++;
+        pthread_mutex_unlock(&f->lock);
+        return;
+    }
+
+    uint64_t t0 = now_ns();
+    flow->cost = cost;
+    flow->granted = false;
+    TAILQ_INSERT_TAIL(&f->runq, flow, link);
+    f->queued++;
+    dispatch(f);
+    while (!flow->granted) pthread_cond_wait(&flow->cond, &f->lock);
+    pthread_mutex_unlock(&f->lock);
+
+    flow->queued++;
+    flow->wait_ns += now_ns() - t0;
+}
+
+void aesd_fair_leave(struct aesd_fair *f)
+{
+    pthread_mutex_lock(&f->lock);
+    f->slots_free++;
+    dispatch(f);
+    pthread_mutex_unlock(&f->lock);
+}
@@ -0,0 +1,73 @@
+/*
+ * aesd-fair.h
+ *
+ * Per-connection rate limits and fair scheduling of store operations.
+ *
+ * A token bucket (struct aesd_bucket) runs per connection and per unit
+ * (bytes, packets).  Charges may overdraw it, so a packet bigger than the
+ * burst is never stuck; the connection then waits out the debt before it
+ * reads again, which pushes back on the client through TCP.
+ *
+ * The scheduler (struct aesd_fair) hands out a fixed number of slots for
+ * appends and replays by deficit round robin.  Each connection is a flow
+ * with at most one operation waiting, and the operation's cost is its
+ * size in bytes.  While a slot is free and nobody is queued, an operation
+ * starts at once.  Otherwise, every round gives each waiting flow one
+ * quantum of credit, and a flow runs once its credit covers its cost.  A
+ * client replaying megabytes thus waits its turn behind many small
+ * appends instead of winning every race for the store lock.
+ */
+
+#ifndef AESD_FAIR_H
+#define AESD_FAIR_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/queue.h>
+
+#define AESD_FAIR_DEFAULT_QUANTUM (64 * 1024)
+
+struct aesd_bucket {
+    double rate;            /* units per second; 0 disables the bucket */
+    double burst;
+    double tokens;          /* may go negative: debt */
+    uint64_t last_ns;
+};
+
+/* Unlimited if rate is 0; burst 0 means one second's worth */
+void aesd_bucket_init(struct aesd_bucket *b, double rate, double burst);
+/* Charge n units; returns how long to wait (ns) before the next charge */
+uint64_t aesd_bucket_charge(struct aesd_bucket *b, double n);
+/* Nanoseconds until the bucket is out of debt, 0 if it is not in debt */
+uint64_t aesd_bucket_wait_ns(struct aesd_bucket *b);
+
+struct aesd_fair_flow {
+    TAILQ_ENTRY(aesd_fair_flow) link;   /* on the run queue while waiting */
+    pthread_cond_t cond;
+    uint64_t deficit;
+    uint64_t cost;
+    bool granted;
+    uint64_t queued;        /* operations that had to wait for their turn */
+    uint64_t wait_ns;       /* total time spent waiting */
+};
+
+struct aesd_fair {
+    pthread_mutex_t lock;
+    TAILQ_HEAD(, aesd_fair_flow) runq;
+    unsigned slots_free;
+    uint64_t quantum;
+    uint64_t grants;
+    uint64_t queued;
+};
+
+int  aesd_fair_init(struct aesd_fair *f, unsigned slots, uint64_t quantum);
+void aesd_fair_destroy(struct aesd_fair *f);
+void aesd_fair_flow_init(struct aesd_fair_flow *flow);
+void aesd_fair_flow_destroy(struct aesd_fair_flow *flow);
+/* Block until flow may run an operation of cost bytes */
+void aesd_fair_enter(struct aesd_fair *f, struct aesd_fair_flow *flow, uint64_t cost);
+/* The operation is done; its slot goes to the next flow in DRR order */
+void aesd_fair_leave(struct aesd_fair *f);
+
+#endif /* AESD_FAIR_H */
@@ -0,0 +1,268 @@
+/**
+ * aesd-filter.c
+ *
+ * - Line starts live in an aesd_lineindex, the same index the file store
+ *   seeks with; offset 0 of the store and every byte after a '\n' is a
+ *   line start
+ * - The index grows under the write lock up to the end a query asks for;
+ *   searches take the read lock one window at a time and drop it before
+ *   sending, so a slow client never holds up another query
+ * - A window is one segment plus len-1 bytes of lookahead, so a match
+ *   straddling two segments is found in the first
+ * - SSE2 search: compare 16 candidate positions at once against the
+ *   pattern's first and last byte, then memcmp() the survivors
+*/
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "aesd-budget.h"
+#include "aesd-filter.h"
+#include "aesd-lineindex.h"
+
+#define SEG AESD_FILTER_SEGMENT
+
+struct aesd_filter {
+    struct aesd_store *st;
+    pthread_rwlock_t lock;
+    struct aesd_lineindex lines;    // starts below indexed, and at it after a '\n'
+    off_t indexed;                  // bytes already scanned for line starts
+};
+
+struct range {
+    off_t from;
+    off_t to;
+};
+
+struct range_list {
+    struct range *r;
+    size_t n;
+    size_t cap;
+};
+
+// ---------- search ----------
+
+#ifdef __SSE2__
+static const char *find(const char *s, size_t n, const char *p, size_t m)
+{
+    if (m == 0) return s;
+    if (n < m) return NULL;
+
+    const __m128i first = _mm_set1_epi8(p[0]);
+    const __m128i last = _mm_set1_epi8(p[m - 1]);
+    size_t i = 0;
+    for (; i + m - 1 + 16 <= n; i += 16) {
+        __m128i bf = _mm_loadu_si128((const __m128i *)(s + i));
+        __m128i bl = _mm_loadu_si128((const __m128i *)(s + i + m - 1));
+        unsigned mask = (unsigned)_mm_movemask_epi8(
+            _mm_and_si128(_mm_cmpeq_epi8(bf, first), _mm_cmpeq_epi8(bl, last)));
+        while (mask) {
+            unsigned bit = (unsigned)__builtin_ctz(mask);
+            if (memcmp(s + i + bit, p, m) == 0) return s + i + bit;
+            mask &= mask - 1;
+        }
+    }
+    return memmem(s + i, n - i, p, m);
+}
+
+const char *aesd_filter_impl(void)
+{
+    return "sse2";
+}
+#else
+static const char *find(const char *s, size_t n, const char *p, size_t m)
+{
+    return memmem(s, n, p, m);
+}
+
+const char *aesd_filter_impl(void)
+{
+    return "memmem";
+}
+#endif
+
+// ---------- line index ----------
+
+struct aesd_filter *aesd_filter_new(struct aesd_store *st)
+{
+    if (!st->ops->stable_offsets) {
+        errno = ENOTSUP;
+        return NULL;
+    }
+    struct aesd_filter *f = calloc(1, sizeof(*f));
+    if (!f) return NULL;
+    if (aesd_lineindex_init(&f->lines) != 0) {
+        free(f);
+        return NULL;
+    }
+    f->st = st;
+    pthread_rwlock_init(&f->lock, NULL);
+    return f;
+}
+
+void aesd_filter_free(struct aesd_filter *f)
+{
+    if (!f) return;
+    aesd_lineindex_free(&f->lines);
+    pthread_rwlock_destroy(&f->lock);
+    free(f);
+}
+
+// Extend the index over [indexed, end); buf holds SEG bytes
+static int index_to(struct aesd_filter *f, off_t end, char *buf)
+{
+    int rc = 0;
+    pthread_rwlock_wrlock(&f->lock);
+    if (f->lines.broken) {
+        // Short of memory earlier; the index cannot be trusted
+        errno = ENOMEM;
+        rc = -1;
+    }
+    while (rc == 0 && f->indexed < end) {
+        size_t want = end - f->indexed < SEG ? (size_t)(end - f->indexed) : SEG;
+        ssize_t n = aesd_store_read_at(f->st, f->indexed, buf, want);
+        if (n <= 0) {
+            if (n == 0) errno = EIO;
+            rc = -1;
+            break;
+        }
+        rc = aesd_lineindex_scan(&f->lines, f->indexed, buf, (size_t)n);
+        f->indexed += n;
+    }
+    pthread_rwlock_unlock(&f->lock);
+    return rc;
+}
+
+// Start of the line holding pos; read lock held, pos < indexed
+static off_t line_start(const struct aesd_filter *f, off_t pos)
+{
+    return aesd_lineindex_start(&f->lines, aesd_lineindex_find(&f->lines, pos));
+}
+
+// Start of the line after the one holding pos, or end
+static off_t line_end(const struct aesd_filter *f, off_t pos, off_t end)
+{
+    off_t next = aesd_lineindex_start(&f->lines, aesd_lineindex_find(&f->lines, pos) + 1);
+    return next >= 0 && next < end ? next : end;
+}
+
+// ---------- filtering ----------
+
+static int add_range(struct range_list *rl, off_t from, off_t to)
+{
+    if (rl->n && rl->r[rl->n - 1].to == from) {
+        rl->r[rl->n - 1].to = to;
+        return 0;
+    }
+    if (rl->n == rl->cap) {
+        size_t cap = rl->cap ? rl->cap * 2 : 64;
+        struct range *p = realloc(rl->r, cap * sizeof(*p));
+        if (!p) return -1;
+        rl->r = p;
+        rl->cap = cap;
+    }
+    rl->r[rl->n++] = (struct range){ from, to };
+    return 0;
+}
+
+static int read_full(struct aesd_store *st, off_t off, char *buf, size_t len)
+{
+    while (len > 0) {
+        ssize_t n = aesd_store_read_at(st, off, buf, len);
+        if (n <= 0) {
+            if (n == 0) errno = EIO;
+            return -1;
+        }
+        off += n;
+        buf += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+/*
+ * Collect the matching lines that start in or overlap [w, wend) into rl;
+ * buf holds the window from w.  *next skips lines already taken.
+ */
+static int search_window(const struct aesd_filter *f, const char *buf, size_t blen, off_t w, off_t wend,
+                         off_t end, const char *pat, size_t plen, bool anchored, off_t *next,
+                         struct range_list *rl)
+{
+    if (anchored) {
+        off_t from = *next > w ? *next : w;
+        uint64_t i = aesd_lineindex_find(&f->lines, from);
+        if (aesd_lineindex_start(&f->lines, i) < from) i++;
+        for (off_t s; (s = aesd_lineindex_start(&f->lines, i)) >= 0 && s < wend; i++) {
+            if (s + (off_t)plen > end || memcmp(buf + (s - w), pat, plen) != 0) continue;
+            *next = line_end(f, s, end);
+            if (add_range(rl, s, *next) != 0) return -1;
+        }
+        return 0;
+    }
+
+    off_t pos = *next > w ? *next : w;
+    while (pos < wend) {
+        // Only matches starting before wend belong to this window
+        size_t hay = (size_t)(wend - pos) + (plen ? plen - 1 : 0);
+        if (hay > blen - (size_t)(pos - w)) hay = blen - (size_t)(pos - w);
+        const char *hit = find(buf + (pos - w), hay, pat, plen);
+        if (!hit) break;
+        off_t p = w + (hit - buf);
+        off_t ls = line_start(f, p);
+        *next = line_end(f, p, end);
+        if (add_range(rl, ls, *next) != 0) return -1;
+        pos = *next;
+    }
+    return 0;
+}
+
+off_t aesd_filter_send(struct aesd_filter *f, const char *pattern, size_t len, off_t end, int out_fd)
+{
+    bool anchored = len > 0 && pattern[0] == '^';
+    const char *pat = anchored ? pattern + 1 : pattern;
+    size_t plen = anchored ? len - 1 : len;
+    struct range_list rl = { 0 };
+    off_t total = 0, next = 0;
+    int rc = 0;
+
+    char *buf = malloc(SEG + plen);
+    if (!buf) return -1;
+    aesd_budget_charge(AESD_BUDGET_OUTPUT, SEG + plen);
+    if (index_to(f, end, buf) != 0) {
+        free(buf);
+        aesd_budget_release(AESD_BUDGET_OUTPUT, SEG + plen);
+        return -1;
+    }
+
+    for (off_t w = 0; rc == 0 && w < end; w += SEG) {
+        off_t wend = end - w < SEG ? end : w + SEG;
+        off_t bend = wend + (off_t)(plen ? plen - 1 : 0);
+        if (bend > end) bend = end;
+        if (read_full(f->st, w, buf, (size_t)(bend - w)) != 0) {
+            rc = -1;
+            break;
+        }
+
+        pthread_rwlock_rdlock(&f->lock);
+        rc = search_window(f, buf, (size_t)(bend - w), w, wend, end, pat, plen, anchored, &next, &rl);
+        pthread_rwlock_unlock(&f->lock);
+
+        for (size_t i = 0; rc == 0 && i < rl.n; i++) {
+            total += rl.r[i].to - rl.r[i].from;
+            if (out_fd >= 0) rc = aesd_store_replay(f->st, rl.r[i].from, rl.r[i].to, out_fd);
+        }
+        rl.n = 0;
+    }
+    free(rl.r);
+    free(buf);
+    aesd_budget_release(AESD_BUDGET_OUTPUT, SEG + plen);
+    return rc == 0 ? total : -1;
+}
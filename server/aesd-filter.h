@@ -0,0 +1,38 @@
+/*
+ * aesd-filter.h
+ *
+ * Server-side filtered replay: send only the lines of the store that
+ * contain a pattern, or start with it when the pattern begins with '^'.
+ *
+ * The store is searched one AESD_FILTER_SEGMENT at a time with a vector
+ * substring search (SSE2 where the compiler targets it, memmem()
+ * otherwise).  A hit is widened to its line through an aesd_lineindex of
+ * line starts; anchored patterns only look at those starts.  The index is
+ * built incrementally, so each byte is scanned for '\n' once
+ * no matter how many queries run, and matching lines go out with
+ * aesd_store_replay() (sendfile for the file backend).
+ *
+ * Only backends with stable offsets can be filtered.
+ */
+
+#ifndef AESD_FILTER_H
+#define AESD_FILTER_H
+
+#include "aesd-store.h"
+
+#define AESD_FILTER_SEGMENT (1024 * 1024)
+
+struct aesd_filter;
+
+/* Line index for st; NULL with errno ENOTSUP for backends without stable offsets */
+struct aesd_filter *aesd_filter_new(struct aesd_store *st);
+/*
+ * Send the lines of [0, end) that match pattern to out_fd, adjacent lines
+ * in one replay.  out_fd < 0 only counts.  Returns the bytes matched.
+ */
+off_t aesd_filter_send(struct aesd_filter *f, const char *pattern, size_t len, off_t end, int out_fd);
+/* "sse2" or "memmem" */
+const char *aesd_filter_impl(void);
+void aesd_filter_free(struct aesd_filter *f);
+
+#endif /* AESD_FILTER_H */
@@ -0,0 +1,267 @@
+/**
+ * aesd-hash.c
+ *
+ * - With HAVE_XXHASH this is a thin wrapper over XXH3_64bits()
+ * - The fallback is XXH64 with seed 0: four 64-bit lanes over 32-byte
+ *   stripes, then the tail and the standard avalanche
+ * - CRC-32C: the crc32 instruction has a latency of three cycles but a
+ *   throughput of one, so blocks of 3 x CRC_STRIPE bytes are run as three
+ *   independent streams.  Their registers are joined with
+ *   crc(A|B|C) = shift2(a) ^ shift1(b) ^ c, where shiftN is the effect of
+ *   N x CRC_STRIPE zero bytes on a register; being linear, each shift is
+ *   four lookups in tables built once from the software CRC
+ * - All tables are built on first use under pthread_once()
+*/
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "aesd-hash.h"
+
+#ifdef HAVE_XXHASH
+#include <xxhash.h>
+
+uint64_t aesd_hash64(const void *data, size_t len)
+{
+    return XXH3_64bits(data, len);
+}
+
+const char *aesd_hash64_impl(void)
+{
+    return "xxh3";
+}
+#else
+#define P1 0x9E3779B185EBCA87ull
+#define P2 0xC2B2AE3D27D4EB4Full
+#define P3 0x165667B19E3779F9ull
+#define P4 0x85EBCA77C2B2AE63ull
+#define P5 0x27D4EB2F165667C5ull
+
+static inline uint64_t rotl(uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t rd64(const unsigned char *p)
+{
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint32_t rd32(const unsigned char *p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint64_t round64(uint64_t acc, uint64_t in)
+{
+    acc += in * P2;
+    return rotl(acc, 31) * P1;
+}
+
+static inline uint64_t merge64(uint64_t acc, uint64_t v)
+{
+    acc ^= round64(0, v);
+    return acc * P1 + P4;
+}
+
+uint64_t aesd_hash64(const void *data, size_t len)
+{
+    const unsigned char *p = data, *end = p + len;
+    uint64_t h;
+
+    if (len >= 32) {
+        uint64_t v1 = P1 + P2, v2 = P2, v3 = 0, v4 = -P1;
+        for (; p + 32 <= end; p += 32) {
+            v1 = round64(v1, rd64(p));
+            v2 = round64(v2, rd64(p + 8));
+            v3 = round64(v3, rd64(p + 16));
+            v4 = round64(v4, rd64(p + 24));
+        }
+        h = rotl(v1, 1) + rotl(v2, 7) + rotl(v3, 12) + rotl(v4, 18);
+        h = merge64(merge64(merge64(merge64(h, v1), v2), v3), v4);
+    } else {
+        h = P5;
+    }
+    h += (uint64_t)len;
+
+    for (; p + 8 <= end; p += 8) h = rotl(h ^ round64(0, rd64(p)), 27) * P1 + P4;
+    if (p + 4 <= end) {
+        h = rotl(h ^ (uint64_t)rd32(p) * P1, 23) * P2 + P3;
+        p += 4;
+    }
+    for (; p < end; p++) h = rotl(h ^ *p * P5, 11) * P1;
+
+    h ^= h >> 33;
+    h *= P2;
+    h ^= h >> 29;
+    h *= P3;
+    h ^= h >> 32;
+    return h;
+}
+
+const char *aesd_hash64_impl(void)
+{
+    return "xxh64";
+}
+#endif
+
+// ---------- CRC-32C ----------
+
+#if defined(__x86_64__)
+#define CRC_X86 1
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#define CRC_ARM 1
+#endif
+
+#ifndef CRC_ARM
+#define CRC_POLY   0x82f63b78u      // Castagnoli, bit reflected
+#define CRC_STRIPE 1024
+
+static uint32_t g_slice[8][256];
+static pthread_once_t g_crc_once = PTHREAD_ONCE_INIT;
+
+/* Advance a raw register over len bytes, slicing-by-8 */
+static uint32_t crc_sw(uint32_t c, const unsigned char *p, size_t len)
+{
+    for (; len >= 8; p += 8, len -= 8) {
+        uint32_t lo, hi;
+        memcpy(&lo, p, 4);
+        memcpy(&hi, p + 4, 4);
+        lo ^= c;
+        c = g_slice[7][lo & 0xff] ^ g_slice[6][(lo >> 8) & 0xff] ^
+            g_slice[5][(lo >> 16) & 0xff] ^ g_slice[4][lo >> 24] ^
+            g_slice[3][hi & 0xff] ^ g_slice[2][(hi >> 8) & 0xff] ^
+            g_slice[1][(hi >> 16) & 0xff] ^ g_slice[0][hi >> 24];
+    }
+    while (len--) c = g_slice[0][(c ^ *p++) & 0xff] ^ (c >> 8);
+    return c;
+}
+
+static void crc_init(void)
+{
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++) c = c & 1 ? (c >> 1) ^ CRC_POLY : c >> 1;
+        g_slice[0][i] = c;
+    }
+    for (int t = 1; t < 8; t++) {
+        for (int i = 0; i < 256; i++) {
+            g_slice[t][i] = (g_slice[t - 1][i] >> 8) ^ g_slice[0][g_slice[t - 1][i] & 0xff];
+        }
+    }
+}
+#endif
+
+#if defined(CRC_X86)
+#include <nmmintrin.h>
+
+static uint32_t g_shift[2][4][256];   // CRC_STRIPE and 2 x CRC_STRIPE zero bytes
+static bool g_have_hw;
+
+static inline uint32_t shift(int which, uint32_t c)
+{
+    return g_shift[which][0][c & 0xff] ^ g_shift[which][1][(c >> 8) & 0xff] ^
+           g_shift[which][2][(c >> 16) & 0xff] ^ g_shift[which][3][c >> 24];
+}
+
+static void crc_setup(void)
+{
+    crc_init();
+    g_have_hw = __builtin_cpu_supports("sse4.2");
+
+    // A shift is linear in the register: find it for each bit, then XOR
+    static const unsigned char zeros[2 * CRC_STRIPE];
+    for (int w = 0; w < 2; w++) {
+        uint32_t basis[32];
+        for (int bit = 0; bit < 32; bit++) basis[bit] = crc_sw(1u << bit, zeros, (size_t)(w + 1) * CRC_STRIPE);
+        for (int byte = 0; byte < 4; byte++) {
+            for (int v = 0; v < 256; v++) {
+                uint32_t c = 0;
+                for (int bit = 0; bit < 8; bit++) {
+                    if (v & (1 << bit)) c ^= basis[byte * 8 + bit];
+                }
+                g_shift[w][byte][v] = c;
+            }
+        }
+    }
+}
+
+__attribute__((target("sse4.2")))
+static uint32_t crc_hw(uint32_t c, const unsigned char *p, size_t len)
+{
+    uint64_t a = c;
+    while (len >= 3 * CRC_STRIPE) {
+        uint64_t b = 0, d = 0;
+        for (size_t i = 0; i < CRC_STRIPE; i += 8) {
+            uint64_t x, y, z;
+            memcpy(&x, p + i, 8);
+            memcpy(&y, p + CRC_STRIPE + i, 8);
+            memcpy(&z, p + 2 * CRC_STRIPE + i, 8);
+            a = _mm_crc32_u64(a, x);
+            b = _mm_crc32_u64(b, y);
+            d = _mm_crc32_u64(d, z);
+        }
+        a = shift(1, (uint32_t)a) ^ shift(0, (uint32_t)b) ^ (uint32_t)d;
+        p += 3 * CRC_STRIPE;
+        len -= 3 * CRC_STRIPE;
+    }
+    for (; len >= 8; p += 8, len -= 8) {
+        uint64_t x;
+        memcpy(&x, p, 8);
+        a = _mm_crc32_u64(a, x);
+    }
+    while (len--) a = _mm_crc32_u8((uint32_t)a, *p++);
+    return (uint32_t)a;
+}
+
+uint32_t aesd_crc32c(uint32_t crc, const void *data, size_t len)
+{
+    pthread_once(&g_crc_once, crc_setup);
+    return ~(g_have_hw ? crc_hw : crc_sw)(~crc, data, len);
+}
+
+const char *aesd_crc32c_impl(void)
+{
+    pthread_once(&g_crc_once, crc_setup);
+    return g_have_hw ? "sse4.2" : "slice8";
+}
+#elif defined(CRC_ARM)
+#include <arm_acle.h>
+
+static uint32_t crc_hw(uint32_t c, const unsigned char *p, size_t len)
+{
+    for (; len >= 8; p += 8, len -= 8) {
+        uint64_t x;
+        memcpy(&x, p, 8);
+        c = __crc32cd(c, x);
+    }
+    while (len--) c = __crc32cb(c, *p++);
+    return c;
+}
+
+uint32_t aesd_crc32c(uint32_t crc, const void *data, size_t len)
+{
+    return ~crc_hw(~crc, data, len);
+}
+
+const char *aesd_crc32c_impl(void)
+{
+    return "armv8";
+}
+#else
+uint32_t aesd_crc32c(uint32_t crc, const void *data, size_t len)
+{
+    pthread_once(&g_crc_once, crc_init);
+    return ~crc_sw(~crc, data, len);
+}
+
+const char *aesd_crc32c_impl(void)
+{
+    return "slice8";
+}
+#endif
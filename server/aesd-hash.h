@@ -0,0 +1,32 @@
+/*
+ * aesd-hash.h
+ *
+ * Fast non-cryptographic hashing for content addressing.  aesd_hash64()
+ * is XXH3 from libxxhash when the build finds it (HAVE_XXHASH), and a
+ * built-in XXH64 otherwise.  Values are only ever compared within one
+ * process, so the two never have to agree.
+ *
+ * aesd_crc32c() is CRC-32C (Castagnoli), the checksum stored with framed
+ * records, so unlike aesd_hash64() every implementation agrees bit for
+ * bit: SSE4.2 crc32 instructions on x86-64 when the CPU has them (three
+ * interleaved streams, joined with precomputed shift tables), the ARMv8
+ * CRC instructions when the compiler targets them, slicing-by-8 tables
+ * otherwise.
+ */
+
+#ifndef AESD_HASH_H
+#define AESD_HASH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+uint64_t aesd_hash64(const void *data, size_t len);
+/* "xxh3" or "xxh64" */
+const char *aesd_hash64_impl(void);
+
+/* Extend crc (0 to start) over data, zlib style: aesd_crc32c(0, "123456789", 9) == 0xe3069283 */
+uint32_t aesd_crc32c(uint32_t crc, const void *data, size_t len);
+/* "sse4.2", "armv8" or "slice8" */
+const char *aesd_crc32c_impl(void);
+
+#endif /* AESD_HASH_H */
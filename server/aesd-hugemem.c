@@ -0,0 +1,193 @@
+/**
+ * aesd-hugemem.c
+ *
+ * - With no spec, chunks come from malloc() and nothing else here runs
+ * - thp chunks are carved out of a mapping twice their size so they start
+ *   on a 2 MiB boundary; the kernel can only use a huge page for an
+ *   aligned, fully covered 2 MiB range
+ * - Prefaulting uses MADV_POPULATE_WRITE (Linux 5.14) and touches one byte
+ *   per page where that is missing; it runs after madvise() so the faults
+ *   already get huge pages
+ * - Freed chunks refill the pool up to the reserve, the rest are unmapped
+*/
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include "aesd-hugemem.h"
+
+#define CHUNK AESD_HUGEMEM_CHUNK
+
+#ifndef MADV_POPULATE_WRITE
+#define MADV_POPULATE_WRITE 23
+#endif
+
+#define HM_THP      0x1
+#define HM_HUGETLB  0x2
+#define HM_PREFAULT 0x4
+#define HM_MLOCK    0x8
+
+static unsigned g_flags;
+static char g_spec[128] = "malloc";
+static pthread_mutex_t g_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static void **g_pool;
+static size_t g_npool;
+static size_t g_reserve;        // chunks to keep pooled
+static atomic_uint_least64_t g_chunks;
+static atomic_uint_least64_t g_hugetlb;
+static atomic_uint_least64_t g_lock_failures;
+
+/* 2 MiB-aligned anonymous chunk; *hugetlb tells which kind it is */
+static void *map_chunk(bool *hugetlb)
+{
+    void *p;
+
+    *hugetlb = false;
+    if (g_flags & HM_HUGETLB) {
+        p = mmap(NULL, CHUNK, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (p != MAP_FAILED) {
+            *hugetlb = true;
+            return p;
+        }
+    }
+
+    char *raw = mmap(NULL, 2 * CHUNK, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (raw == MAP_FAILED) return NULL;
+    char *aligned = (char *)(((uintptr_t)raw + CHUNK - 1) & ~(uintptr_t)(CHUNK - 1));
+    if (aligned > raw) munmap(raw, (size_t)(aligned - raw));
+    if (aligned + CHUNK < raw + 2 * CHUNK) munmap(aligned + CHUNK, (size_t)(raw + 2 * CHUNK - (aligned + CHUNK)));
+    if (g_flags & (HM_THP | HM_HUGETLB)) madvise(aligned, CHUNK, MADV_HUGEPAGE);
+    return aligned;
+}
+
+static void *new_chunk(void)
+{
+    bool hugetlb;
+    char *p = map_chunk(&hugetlb);
+    if (!p) return NULL;
+
+    if ((g_flags & HM_PREFAULT) && !hugetlb && madvise(p, CHUNK, MADV_POPULATE_WRITE) != 0) {
+        long page = sysconf(_SC_PAGESIZE);
+        for (size_t off = 0; off < CHUNK; off += (size_t)page) ((volatile char *)p)[off] = 0;
+    }
+    if ((g_flags & HM_MLOCK) && mlock(p, CHUNK) != 0) {
+        if (atomic_fetch_add(&g_lock_failures, 1) == 0) {
+            syslog(LOG_WARNING, "hugemem: mlock failed (%s), chunks stay pageable", strerror(errno));
+        }
+    }
+    if (hugetlb) atomic_fetch_add(&g_hugetlb, 1);
+    return p;
+}
+
+int aesd_hugemem_configure(const char *spec)
+{
+    char buf[sizeof(g_spec)];
+    unsigned flags = 0;
+    unsigned long reserve_mb = 0;
+    char *save = NULL;
+
+    if (strlen(spec) >= sizeof(buf)) {
+        errno = EINVAL;
+        return -1;
+    }
+    strcpy(buf, spec);
+    for (char *w = strtok_r(buf, ",", &save); w; w = strtok_r(NULL, ",", &save)) {
+        if (strcmp(w, "thp") == 0) flags |= HM_THP;
+        else if (strcmp(w, "hugetlb") == 0) flags |= HM_HUGETLB;
+        else if (strcmp(w, "prefault") == 0) flags |= HM_PREFAULT;
+        else if (strcmp(w, "mlock") == 0) flags |= HM_MLOCK;
+        else if (sscanf(w, "reserve=%lu", &reserve_mb) == 1) continue;
+        else {
+            errno = EINVAL;
+            return -1;
+        }
+    }
+    g_flags = flags;
+    snprintf(g_spec, sizeof(g_spec), "%s", spec);
+
+    // A reserve is pooled mappings, faulted in now so it costs nothing later
+    if (reserve_mb) g_flags |= HM_PREFAULT;
+    g_reserve = (size_t)(reserve_mb * 1024 * 1024 / CHUNK);
+    if (g_reserve) {
+        g_pool = calloc(g_reserve, sizeof(*g_pool));
+        if (!g_pool) return -1;
+        while (g_npool < g_reserve) {
+            void *p = new_chunk();
+            if (!p) {
+                syslog(LOG_WARNING, "hugemem: reserved %zu of %zu chunks", g_npool, g_reserve);
+                break;
+            }
+            g_pool[g_npool++] = p;
+        }
+    }
+    return 0;
+}
+
+void *aesd_hugemem_alloc(void)
+{
+    void *p = NULL;
+
+    if (!g_flags) {
+        p = malloc(CHUNK);
+    } else {
+        pthread_mutex_lock(&g_pool_lock);
+        if (g_npool) p = g_pool[--g_npool];
+        pthread_mutex_unlock(&g_pool_lock);
+        if (!p) p = new_chunk();
+        if (!p) errno = ENOMEM;
+    }
+    if (p) atomic_fetch_add(&g_chunks, 1);
+    return p;
+}
+
+void aesd_hugemem_free(void *p)
+{
+    if (!p) return;
+    atomic_fetch_sub(&g_chunks, 1);
+    if (!g_flags) {
+        free(p);
+        return;
+    }
+    pthread_mutex_lock(&g_pool_lock);
+    if (g_npool < g_reserve) {
+        g_pool[g_npool++] = p;
+        p = NULL;
+    }
+    pthread_mutex_unlock(&g_pool_lock);
+    if (p) munmap(p, CHUNK);
+}
+
+void aesd_hugemem_stats(struct aesd_hugemem_stats *out)
+{
+    out->chunks = atomic_load(&g_chunks);
+    out->hugetlb = atomic_load(&g_hugetlb);
+    pthread_mutex_lock(&g_pool_lock);
+    out->pooled = g_npool;
+    pthread_mutex_unlock(&g_pool_lock);
+    out->lock_failures = atomic_load(&g_lock_failures);
+}
+
+const char *aesd_hugemem_describe(void)
+{
+    return g_spec;
+}
+
+void aesd_hugemem_cleanup(void)
+{
+    pthread_mutex_lock(&g_pool_lock);
+    for (size_t i = 0; i < g_npool; i++) munmap(g_pool[i], CHUNK);
+    free(g_pool);
+    g_pool = NULL;
+    g_npool = g_reserve = 0;
+    pthread_mutex_unlock(&g_pool_lock);
+}
@@ -0,0 +1,47 @@
+/*
+ * aesd-hugemem.h
+ *
+ * Backing for the large, long-lived buffers of the in-memory stores (mem
+ * log chunks, dedup arenas and record tables).  By default a chunk is a
+ * plain malloc(); aesdsocket -H can instead back chunks with huge pages,
+ * fault them in up front, lock them, and keep a pool reserved at startup,
+ * so a large replay neither walks 4 KiB TLB entries nor takes page faults
+ * the first time the store grows into new memory.
+ *
+ * Every chunk is AESD_HUGEMEM_CHUNK bytes, one 2 MiB huge page.  Spec
+ * words, comma separated:
+ *   thp          mmap() chunks aligned to 2 MiB and madvise(MADV_HUGEPAGE)
+ *   hugetlb      MAP_HUGETLB from the hugetlbfs pool (vm.nr_hugepages),
+ *                falling back to thp once the pool runs dry
+ *   prefault     fault every page in when the chunk is allocated
+ *   mlock        mlock() chunks; failures (RLIMIT_MEMLOCK) are logged once
+ *   reserve=<MiB> allocate that much at startup and keep it pooled
+ */
+
+#ifndef AESD_HUGEMEM_H
+#define AESD_HUGEMEM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define AESD_HUGEMEM_CHUNK (2 * 1024 * 1024)
+
+struct aesd_hugemem_stats {
+    uint64_t chunks;        /* chunks currently handed out */
+    uint64_t hugetlb;       /* chunks ever mapped from the hugetlbfs pool */
+    uint64_t pooled;        /* reserved chunks waiting in the pool */
+    uint64_t lock_failures;
+};
+
+/* Parse a spec (see above) and fill the reserve; call before opening a store */
+int  aesd_hugemem_configure(const char *spec);
+/* One chunk, NULL with errno set on failure */
+void *aesd_hugemem_alloc(void);
+void aesd_hugemem_free(void *p);
+void aesd_hugemem_stats(struct aesd_hugemem_stats *out);
+/* The active spec, "malloc" if none */
+const char *aesd_hugemem_describe(void);
+/* Release the pool */
+void aesd_hugemem_cleanup(void);
+
+#endif /* AESD_HUGEMEM_H */
@@ -0,0 +1,144 @@
+/**
+ * aesd-lineindex.c
+ *
+ * - Blocks are allocated one at a time and never move, only the array of
+ *   block pointers is grown, so appending a start is amortized O(1)
+ * - A lookup is one division plus an array access, or a binary search of
+ *   the out of line table when the delta was too wide for 32 bits
+ * - Finding the line at an offset bisects the block bases, then the block
+ * - Any allocation failure marks the index broken rather than leaving it
+ *   silently short
+*/
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "aesd-lineindex.h"
+
+#define BLOCK AESD_LINEINDEX_BLOCK
+#define WIDE UINT32_MAX         // rel[] marker: look the start up in wide[]
+
+static int add_start(struct aesd_lineindex *li, off_t start)
+{
+    uint64_t n = li->starts;
+    size_t b = (size_t)(n / BLOCK);
+    size_t i = (size_t)(n % BLOCK);
+
+    if (i == 0) {
+        if (b == li->nblocks_cap) {
+            size_t cap = li->nblocks_cap ? li->nblocks_cap * 2 : 64;
+            struct aesd_lineindex_block **p = realloc(li->blocks, cap * sizeof(*p));
+            if (!p) goto broken;
+            li->blocks = p;
+            li->nblocks_cap = cap;
+        }
+        li->blocks[b] = malloc(sizeof(**li->blocks));
+        if (!li->blocks[b]) goto broken;
+        li->blocks[b]->base = start;
+    } else {
+        struct aesd_lineindex_block *blk = li->blocks[b];
+        uint64_t delta = (uint64_t)(start - blk->base);
+        if (delta >= WIDE) {
+            if (li->nwide == li->nwide_cap) {
+                size_t cap = li->nwide_cap ? li->nwide_cap * 2 : 16;
+                struct aesd_lineindex_wide *p = realloc(li->wide, cap * sizeof(*p));
+                if (!p) goto broken;
+                li->wide = p;
+                li->nwide_cap = cap;
+            }
+            li->wide[li->nwide++] = (struct aesd_lineindex_wide){ n, start };
+            blk->rel[i - 1] = WIDE;
+        } else {
+            blk->rel[i - 1] = (uint32_t)delta;
+        }
+    }
+    li->starts++;
+    return 0;
+
+broken:
+    li->broken = true;
+    errno = ENOMEM;
+    return -1;
+}
+
+int aesd_lineindex_init(struct aesd_lineindex *li)
+{
+    memset(li, 0, sizeof(*li));
+    return add_start(li, 0);
+}
+
+void aesd_lineindex_free(struct aesd_lineindex *li)
+{
+    size_t nblocks = (size_t)((li->starts + BLOCK - 1) / BLOCK);
+    for (size_t b = 0; b < nblocks; b++) free(li->blocks[b]);
+    free(li->blocks);
+    free(li->wide);
+    memset(li, 0, sizeof(*li));
+}
+
+int aesd_lineindex_scan(struct aesd_lineindex *li, off_t off, const char *data, size_t len)
+{
+    if (li->broken) return -1;
+    for (const char *p = data, *e = data + len; (p = memchr(p, '\n', (size_t)(e - p))) != NULL; p++) {
+        if (add_start(li, off + (p - data) + 1) != 0) return -1;
+    }
+    return 0;
+}
+
+void aesd_lineindex_truncate(struct aesd_lineindex *li, uint64_t n)
+{
+    if (n == 0 || n >= li->starts) return;
+    size_t keep = (size_t)((n + BLOCK - 1) / BLOCK);
+    size_t nblocks = (size_t)((li->starts + BLOCK - 1) / BLOCK);
+    for (size_t b = keep; b < nblocks; b++) free(li->blocks[b]);
+    while (li->nwide && li->wide[li->nwide - 1].line >= n) li->nwide--;
+    li->starts = n;
+}
+
+off_t aesd_lineindex_start(const struct aesd_lineindex *li, uint64_t n)
+{
+    if (n >= li->starts) return -1;
+    const struct aesd_lineindex_block *blk = li->blocks[n / BLOCK];
+    size_t i = (size_t)(n % BLOCK);
+    if (i == 0) return blk->base;
+    if (blk->rel[i - 1] != WIDE) return blk->base + (off_t)blk->rel[i - 1];
+
+    size_t lo = 0, hi = li->nwide;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (li->wide[mid].line < n) lo = mid + 1;
+        else hi = mid;
+    }
+    return li->wide[lo].start;
+}
+
+uint64_t aesd_lineindex_find(const struct aesd_lineindex *li, off_t off)
+{
+    size_t lo = 0, hi = (size_t)((li->starts + BLOCK - 1) / BLOCK);
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (li->blocks[mid]->base <= off) lo = mid + 1;
+        else hi = mid;
+    }
+    if (lo == 0) return 0;
+
+    // Line lo - 1 of the blocks starts at or before off; bisect the rest of its block
+    uint64_t first = (uint64_t)(lo - 1) * BLOCK;
+    uint64_t l = first + 1, h = first + BLOCK < li->starts ? first + BLOCK : li->starts;
+    while (l < h) {
+        uint64_t mid = l + (h - l) / 2;
+        if (aesd_lineindex_start(li, mid) <= off) l = mid + 1;
+        else h = mid;
+    }
+    return l - 1;
+}
+
+size_t aesd_lineindex_bytes(const struct aesd_lineindex *li)
+{
+    size_t nblocks = (size_t)((li->starts + BLOCK - 1) / BLOCK);
+    return li->nblocks_cap * sizeof(*li->blocks) + nblocks * sizeof(**li->blocks) +
+           li->nwide_cap * sizeof(*li->wide);
+}
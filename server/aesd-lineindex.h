@@ -0,0 +1,66 @@
+/*
+ * aesd-lineindex.h
+ *
+ * Compact index of line start offsets, so the Nth packet of a store can be
+ * found without scanning everything before it, and the line holding any
+ * offset with a binary search (the file store's seeks, filtered replays).
+ *
+ * Starts are kept in blocks of AESD_LINEINDEX_BLOCK lines: the first start
+ * of a block as a full offset and the rest as 32-bit deltas from it, about
+ * 4 bytes per line instead of 8.  A delta that does not fit (a block
+ * spanning more than 4 GiB) is stored out of line in a small sorted table,
+ * so giant packets cost a binary search rather than breaking the index.
+ *
+ * Not thread safe: the owner serializes updates and lookups.
+ */
+
+#ifndef AESD_LINEINDEX_H
+#define AESD_LINEINDEX_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define AESD_LINEINDEX_BLOCK 64
+
+struct aesd_lineindex_block {
+    off_t base;                                 /* start of the block's first line */
+    uint32_t rel[AESD_LINEINDEX_BLOCK - 1];     /* later starts minus base */
+};
+
+struct aesd_lineindex_wide {
+    uint64_t line;
+    off_t start;
+};
+
+struct aesd_lineindex {
+    struct aesd_lineindex_block **blocks;
+    size_t nblocks_cap;
+    uint64_t starts;        /* line starts recorded, including line 0 */
+    struct aesd_lineindex_wide *wide;
+    size_t nwide;
+    size_t nwide_cap;
+    bool broken;            /* an update failed; callers must fall back to scanning */
+};
+
+/* Empty index holding the start of line 0 */
+int  aesd_lineindex_init(struct aesd_lineindex *li);
+void aesd_lineindex_free(struct aesd_lineindex *li);
+/* Record the line starts after every '\n' in data, which sits at off */
+int  aesd_lineindex_scan(struct aesd_lineindex *li, off_t off, const char *data, size_t len);
+/* Complete lines indexed so far */
+static inline uint64_t aesd_lineindex_lines(const struct aesd_lineindex *li)
+{
+    return li->starts - 1;
+}
+/* Forget every start after the first n, e.g. those of a record that failed validation */
+void aesd_lineindex_truncate(struct aesd_lineindex *li, uint64_t n);
+/* Start of line n, for n up to aesd_lineindex_lines() (the end of the last line); -1 if beyond */
+off_t aesd_lineindex_start(const struct aesd_lineindex *li, uint64_t n);
+/* The line holding off: the last one starting at or before it */
+uint64_t aesd_lineindex_find(const struct aesd_lineindex *li, off_t off);
+/* Heap bytes held by the index */
+size_t aesd_lineindex_bytes(const struct aesd_lineindex *li);
+
+#endif /* AESD_LINEINDEX_H */
@@ -0,0 +1,89 @@
+/**
+ * aesd-listenfds.c
+ *
+ * - Parses LISTEN_PID / LISTEN_FDS / LISTEN_FDNAMES without libsystemd
+ * - A LISTEN_PID for another process means the variables leaked from a
+ *   parent, so they are ignored
+ * - Descriptors beyond max are closed so they do not sit unused
+*/
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include "aesd-listenfds.h"
+
+#define MAX_NAMES 1024
+
+static char g_names[MAX_NAMES];
+
+static int parse_count(const char *s, long *out)
+{
+    char *end = NULL;
+    errno = 0;
+    long v = strtol(s, &end, 10);
+    if (errno || end == s || *end || v < 0) return -1;
+    *out = v;
+    return 0;
+}
+
+static int is_listener(int fd)
+{
+    int type = 0, listening = 0;
+    socklen_t len = sizeof(type);
+    if (getsockopt(fd, SOL_SOCKET, SO_TYPE, &type, &len) != 0) return 0;
+    len = sizeof(listening);
+    if (getsockopt(fd, SOL_SOCKET, SO_ACCEPTCONN, &listening, &len) != 0) return 0;
+    return type == SOCK_STREAM && listening;
+}
+
+int aesd_listenfds(int *fds, const char **names, int max)
+{
+    const char *pid_s = getenv("LISTEN_PID");
+    const char *fds_s = getenv("LISTEN_FDS");
+    const char *names_s = getenv("LISTEN_FDNAMES");
+    long pid, n;
+    int rc = 0;
+
+    if (!pid_s || !fds_s) return 0;
+    if (parse_count(pid_s, &pid) != 0 || pid != (long)getpid() || parse_count(fds_s, &n) != 0) {
+        goto out;
+    }
+
+    snprintf(g_names, sizeof(g_names), "%s", names_s ? names_s : "");
+    char *save = NULL;
+    char *name = names_s ? strtok_r(g_names, ":", &save) : NULL;
+    for (long i = 0; i < n; i++) {
+        int fd = AESD_LISTENFDS_START + (int)i;
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+        if (rc < 0) continue;
+        if (i >= max) {
+            syslog(LOG_WARNING, "ignoring passed socket %d, only %d are used", fd, max);
+            close(fd);
+            continue;
+        }
+        if (!is_listener(fd)) {
+            syslog(LOG_ERR, "passed descriptor %d is not a listening stream socket", fd);
+            errno = ENOTSOCK;
+            rc = -1;
+            continue;
+        }
+        fds[i] = fd;
+        names[i] = name ? name : "";
+        name = name ? strtok_r(NULL, ":", &save) : NULL;
+        rc++;
+    }
+
+out:
+    unsetenv("LISTEN_PID");
+    unsetenv("LISTEN_FDS");
+    unsetenv("LISTEN_FDNAMES");
+    return rc;
+}
@@ -0,0 +1,28 @@
+/*
+ * aesd-listenfds.h
+ *
+ * Listening sockets handed over by a service manager, following the
+ * systemd LISTEN_FDS protocol: descriptors start at 3, LISTEN_FDS says how
+ * many there are, LISTEN_PID names the process they are meant for and
+ * LISTEN_FDNAMES optionally labels them (FileDescriptorName= in the .socket
+ * unit).  systemd-socket-activate, or anything else that sets the same
+ * variables before exec(), works as a stand-in activator.
+ *
+ * The variables are removed once read so children do not take the sockets
+ * for theirs, and the descriptors are marked close-on-exec.
+ */
+
+#ifndef AESD_LISTENFDS_H
+#define AESD_LISTENFDS_H
+
+#define AESD_LISTENFDS_START 3
+
+/*
+ * Fill fds[] and names[] with up to max passed sockets; names[i] is "" when
+ * the activator gave none.  Returns how many there were, 0 when the process
+ * was not socket activated, -1 with errno set if a passed descriptor is not
+ * a listening stream socket.
+ */
+int aesd_listenfds(int *fds, const char **names, int max);
+
+#endif /* AESD_LISTENFDS_H */
@@ -0,0 +1,114 @@
+/**
+ * aesd-pending.c
+ *
+ * - Inline buffer grows by doubling up to AESD_PENDING_INLINE_MAX
+ * - Past that the inline bytes and everything after go to a spill file
+ *   created with O_TMPFILE (mkstemp + unlink where that is unsupported)
+ * - The inline buffer is charged to AESD_BUDGET_PENDING; growth the
+ *   budget refuses goes to the spill file instead
+*/
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "aesd-budget.h"
+#include "aesd-pending.h"
+#include "aesd-store.h"
+
+void aesd_pending_init(struct aesd_pending *p)
+{
+    memset(p, 0, sizeof(*p));
+    p->spill_fd = -1;
+}
+
+static int open_spill_file(void)
+{
+    int fd = open(AESD_PENDING_SPILL_DIR, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+    if (fd >= 0) return fd;
+
+    char path[] = AESD_PENDING_SPILL_DIR "/aesdpendingXXXXXX";
+    fd = mkostemp(path, O_CLOEXEC);
+    if (fd >= 0) unlink(path);
+    return fd;
+}
+
+static int spill(struct aesd_pending *p, const char *data, size_t len)
+{
+    if (p->spill_fd < 0) {
+        p->spill_fd = open_spill_file();
+        if (p->spill_fd < 0) return -1;
+    }
+    if (p->spill_len == 0 && p->len > 0) {
+        // First overflow: move what we have inline to the file
+        if (aesd_write_all(p->spill_fd, p->buf, p->len) != 0) return -1;
+        p->spill_len = (off_t)p->len;
+        p->len = 0;
+    }
+    if (aesd_write_all(p->spill_fd, data, len) != 0) return -1;
+    p->spill_len += (off_t)len;
+    return 0;
+}
+
+int aesd_pending_add(struct aesd_pending *p, const char *data, size_t len)
+{
+    if (aesd_pending_spilled(p) || p->len + len > AESD_PENDING_INLINE_MAX) {
+        return spill(p, data, len);
+    }
+    if (p->len + len > p->cap) {
+        size_t new_cap = p->cap ? p->cap : 1024;
+        while (new_cap < p->len + len) new_cap *= 2;
+        if (new_cap > AESD_PENDING_INLINE_MAX) new_cap = AESD_PENDING_INLINE_MAX;
+        if (!aesd_budget_try_charge(AESD_BUDGET_PENDING, new_cap - p->cap)) return spill(p, data, len);
+        char *tmp = realloc(p->buf, new_cap);
+        if (!tmp) {
+            aesd_budget_release(AESD_BUDGET_PENDING, new_cap - p->cap);
+            return spill(p, data, len);
+        }
+        p->buf = tmp;
+        p->cap = new_cap;
+    }
+    memcpy(p->buf + p->len, data, len);
+    p->len += len;
+    return 0;
+}
+
+void aesd_pending_reset(struct aesd_pending *p)
+{
+    p->len = 0;
+    if (p->spill_len > 0) {
+        // Reuse the file for the next oversized packet
+        if (ftruncate(p->spill_fd, 0) != 0 || lseek(p->spill_fd, 0, SEEK_SET) != 0) {
+            close(p->spill_fd);
+            p->spill_fd = -1;
+        }
+        p->spill_len = 0;
+    }
+}
+
+static void drop_buffer(struct aesd_pending *p)
+{
+    free(p->buf);
+    aesd_budget_release(AESD_BUDGET_PENDING, p->cap);
+    p->buf = NULL;
+    p->cap = 0;
+}
+
+int aesd_pending_shed(struct aesd_pending *p)
+{
+    if (p->len > 0 && spill(p, NULL, 0) != 0) return -1;
+    drop_buffer(p);
+    return 0;
+}
+
+void aesd_pending_free(struct aesd_pending *p)
+{
+    drop_buffer(p);
+    if (p->spill_fd >= 0) close(p->spill_fd);
+    aesd_pending_init(p);
+}
@@ -0,0 +1,39 @@
+/*
+ * aesd-pending.h
+ *
+ * Per-connection holding area for the bytes of a packet whose '\n' has not
+ * arrived yet.  Up to AESD_PENDING_INLINE_MAX bytes are kept in memory;
+ * anything longer is spilled to an unlinked temporary file, so a client
+ * sending one huge line costs bounded memory.
+ */
+
+#ifndef AESD_PENDING_H
+#define AESD_PENDING_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+#define AESD_PENDING_INLINE_MAX (64 * 1024)
+#define AESD_PENDING_SPILL_DIR "/var/tmp"
+
+struct aesd_pending {
+    char *buf;          /* inline bytes, only while not spilled */
+    size_t len;
+    size_t cap;
+    int spill_fd;       /* -1 until the packet outgrows the inline buffer */
+    off_t spill_len;
+};
+
+void aesd_pending_init(struct aesd_pending *p);
+/* Add bytes to the packet, spilling to disk past the inline limit */
+int  aesd_pending_add(struct aesd_pending *p, const char *data, size_t len);
+static inline bool aesd_pending_spilled(const struct aesd_pending *p) { return p->spill_len > 0; }
+static inline bool aesd_pending_empty(const struct aesd_pending *p) { return p->len == 0 && p->spill_len == 0; }
+/* Move inline bytes to the spill file and free the buffer, to give memory back while paused */
+int  aesd_pending_shed(struct aesd_pending *p);
+/* Forget the current packet, keeping buffers/spill file for the next one */
+void aesd_pending_reset(struct aesd_pending *p);
+void aesd_pending_free(struct aesd_pending *p);
+
+#endif /* AESD_PENDING_H */
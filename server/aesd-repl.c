@@ -0,0 +1,438 @@
+/**
+ * aesd-repl.c
+ *
+ * - Leader: one accept thread plus one thread per follower.  A follower
+ *   thread waits on the store's commit offset and sends the new bytes as a
+ *   frame: header with MSG_MORE, then the data via aesd_store_replay() so
+ *   the file backend still uses sendfile()
+ * - Acks are drained without blocking between frames; they only gate the
+ *   send window, so a slow follower never holds up appends
+ * - Follower: one thread that (re)connects to the leader, applies frames in
+ *   order with aesd_store_append() and acks each one
+ * - Replication frames show up as replays in the leader's store stats
+*/
+
+#define _GNU_SOURCE
+
+#include <arpa/inet.h>
+#include <endian.h>
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/queue.h>
+#include <sys/socket.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "aesd-repl.h"
+
+#define REPL_HELLO_LEN  16
+#define REPL_HEADER_LEN 12
+#define REPL_POLL_MS    200
+#define REPL_RETRY_MS   1000
+
+struct repl_conn {
+    pthread_t tid;
+    int fd;
+    char peer[64];
+    volatile bool done;
+    SLIST_ENTRY(repl_conn) entries;
+};
+
+static struct {
+    struct aesd_store *st;
+    atomic_bool stop;
+    pthread_mutex_t lock;           // protects conns and follower_fd
+    // leader
+    int listen_fd;
+    pthread_t accept_tid;
+    bool accept_started;
+    SLIST_HEAD(, repl_conn) conns;
+    // follower
+    char host[256];
+    char port[16];
+    int follower_fd;
+    pthread_t follower_tid;
+    bool follower_started;
+} g_repl = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .listen_fd = -1,
+    .conns = SLIST_HEAD_INITIALIZER(g_repl.conns),
+    .follower_fd = -1,
+};
+
+// ---------- utility ----------
+
+static void put_be32(unsigned char *p, uint32_t v) { v = htobe32(v); memcpy(p, &v, 4); }
+static void put_be64(unsigned char *p, uint64_t v) { v = htobe64(v); memcpy(p, &v, 8); }
+static uint32_t get_be32(const unsigned char *p) { uint32_t v; memcpy(&v, p, 4); return be32toh(v); }
+static uint64_t get_be64(const unsigned char *p) { uint64_t v; memcpy(&v, p, 8); return be64toh(v); }
+
+static int read_full(int fd, void *buf, size_t len)
+{
+    size_t off = 0;
+    while (off < len) {
+        ssize_t r = recv(fd, (char *)buf + off, len - off, 0);
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) return -1;
+        off += (size_t)r;
+    }
+    return 0;
+}
+
+// Sleep up to ms, returning early once stop is requested
+static void nap(int ms)
+{
+    struct timespec ts = { .tv_sec = 0, .tv_nsec = 100 * 1000000L };
+    for (int waited = 0; waited < ms && !atomic_load(&g_repl.stop); waited += 100) {
+        nanosleep(&ts, NULL);
+    }
+}
+
+static void set_nodelay(int fd)
+{
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+}
+
+// ---------- leader ----------
+
+static int send_frame(struct aesd_store *st, int fd, off_t from, off_t len)
+{
+    unsigned char hdr[REPL_HEADER_LEN];
+    put_be64(hdr, (uint64_t)from);
+    put_be32(hdr + 8, (uint32_t)len);
+
+    for (size_t off = 0; off < sizeof(hdr); ) {
+        ssize_t s = send(fd, hdr + off, sizeof(hdr) - off, MSG_MORE);
+        if (s < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        off += (size_t)s;
+    }
+    return aesd_store_replay(st, from, from + len, fd);
+}
+
+static void *leader_conn_thread(void *arg)
+{
+    struct repl_conn *c = arg;
+    struct aesd_store *st = g_repl.st;
+    unsigned char hello[REPL_HELLO_LEN];
+    unsigned char ackbuf[8];
+    size_t ack_have = 0;
+    off_t sent = 0, acked = 0;
+    uint64_t frames = 0;
+
+    if (read_full(c->fd, hello, sizeof(hello)) != 0) goto out;
+    if (get_be32(hello) != AESD_REPL_MAGIC || get_be32(hello + 4) != AESD_REPL_VERSION) {
+        syslog(LOG_ERR, "follower %s: bad hello", c->peer);
+        goto out;
+    }
+    sent = acked = (off_t)get_be64(hello + 8);
+    if (sent > aesd_store_committed(st)) {
+        syslog(LOG_ERR, "follower %s is ahead of the leader (%lld > %lld); was the leader restarted?",
+               c->peer, (long long)sent, (long long)aesd_store_committed(st));
+        goto out;
+    }
+    syslog(LOG_INFO, "follower %s attached at offset %lld", c->peer, (long long)sent);
+
+    while (!atomic_load(&g_repl.stop)) {
+        // Collect acknowledgements without blocking
+        for (;;) {
+            ssize_t r = recv(c->fd, ackbuf + ack_have, sizeof(ackbuf) - ack_have, MSG_DONTWAIT);
+            if (r > 0) {
+                ack_have += (size_t)r;
+                if (ack_have == sizeof(ackbuf)) {
+                    acked = (off_t)get_be64(ackbuf);
+                    ack_have = 0;
+                }
+                continue;
+            }
+            if (r == 0) goto out;
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            goto out;
+        }
+
+        off_t end = aesd_store_committed(st);
+        if (end > sent && sent - acked < AESD_REPL_WINDOW) {
+            off_t len = end - sent;
+            if (len > AESD_REPL_MAX_FRAME) len = AESD_REPL_MAX_FRAME;
+            if (send_frame(st, c->fd, sent, len) != 0) goto out;
+            sent += len;
+            frames++;
+            continue;
+        }
+        if (end > sent) {
+            // Window full: wait for acks
+            struct pollfd pfd = { .fd = c->fd, .events = POLLIN };
+            poll(&pfd, 1, REPL_POLL_MS);
+        } else if (atomic_load(&st->waking)) {
+            // Shutting down and caught up: commit waits return at once from here
+            // on, so leave instead of spinning through the drain; the follower
+            // resumes from its offset when it reattaches
+            break;
+        } else {
+            aesd_store_wait_commit(st, sent, REPL_POLL_MS);
+        }
+    }
+
+out:
+    syslog(LOG_INFO, "follower %s detached: sent to %lld, acked to %lld, %llu frames",
+           c->peer, (long long)sent, (long long)acked, (unsigned long long)frames);
+    c->done = true;
+    return NULL;
+}
+
+static void reap_conns(bool all)
+{
+    pthread_mutex_lock(&g_repl.lock);
+    struct repl_conn *it = SLIST_FIRST(&g_repl.conns), *next;
+    while (it) {
+        next = SLIST_NEXT(it, entries);
+        if (all || it->done) {
+            SLIST_REMOVE(&g_repl.conns, it, repl_conn, entries);
+            pthread_mutex_unlock(&g_repl.lock);
+            pthread_join(it->tid, NULL);
+            close(it->fd);
+            free(it);
+            pthread_mutex_lock(&g_repl.lock);
+        }
+        it = next;
+    }
+    pthread_mutex_unlock(&g_repl.lock);
+}
+
+static void *leader_accept_thread(void *arg)
+{
+    (void)arg;
+    while (!atomic_load(&g_repl.stop)) {
+        struct sockaddr_storage addr;
+        socklen_t alen = sizeof(addr);
+        int fd = accept(g_repl.listen_fd, (struct sockaddr *)&addr, &alen);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            if (!atomic_load(&g_repl.stop)) syslog(LOG_ERR, "replication accept failed: %s", strerror(errno));
+            break;
+        }
+        reap_conns(false);
+
+        struct repl_conn *c = calloc(1, sizeof(*c));
+        if (!c) {
+            close(fd);
+            continue;
+        }
+        c->fd = fd;
+        char host[INET6_ADDRSTRLEN], serv[8];
+        if (getnameinfo((struct sockaddr *)&addr, alen, host, sizeof(host), serv, sizeof(serv),
+                        NI_NUMERICHOST | NI_NUMERICSERV) == 0) {
+            snprintf(c->peer, sizeof(c->peer), "%s:%s", host, serv);
+        } else {
+            snprintf(c->peer, sizeof(c->peer), "?");
+        }
+        set_nodelay(fd);
+        // A hello that never arrives must not pin the thread forever
+        struct timeval tv = { .tv_sec = 5, .tv_usec = 0 };
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+        pthread_mutex_lock(&g_repl.lock);
+        if (pthread_create(&c->tid, NULL, leader_conn_thread, c) != 0) {
+            pthread_mutex_unlock(&g_repl.lock);
+            syslog(LOG_ERR, "replication thread create failed");
+            close(fd);
+            free(c);
+            continue;
+        }
+        SLIST_INSERT_HEAD(&g_repl.conns, c, entries);
+        pthread_mutex_unlock(&g_repl.lock);
+    }
+    return NULL;
+}
+
+int aesd_repl_leader_start(struct aesd_store *st, const char *port)
+{
+    struct addrinfo hints, *res = NULL, *rp;
+    int fd = -1;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family   = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags    = AI_PASSIVE;
+    int rc = getaddrinfo(NULL, port, &hints, &res);
+    if (rc != 0) {
+        syslog(LOG_ERR, "replication getaddrinfo: %s", gai_strerror(rc));
+        errno = EINVAL;
+        return -1;
+    }
+    for (rp = res; rp; rp = rp->ai_next) {
+        fd = socket(rp->ai_family, rp->ai_socktype | SOCK_CLOEXEC, rp->ai_protocol);
+        if (fd < 0) continue;
+        int opt = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+        if (bind(fd, rp->ai_addr, rp->ai_addrlen) == 0 && listen(fd, 4) == 0) break;
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+    if (fd < 0) return -1;
+
+    g_repl.st = st;
+    g_repl.listen_fd = fd;
+    if (pthread_create(&g_repl.accept_tid, NULL, leader_accept_thread, NULL) != 0) {
+        close(fd);
+        g_repl.listen_fd = -1;
+        return -1;
+    }
+    g_repl.accept_started = true;
+    syslog(LOG_INFO, "Replication leader listening on port %s", port);
+    return 0;
+}
+
+// ---------- follower ----------
+
+static int connect_leader(void)
+{
+    struct addrinfo hints, *res = NULL, *rp;
+    int fd = -1;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(g_repl.host, g_repl.port, &hints, &res) != 0) return -1;
+    for (rp = res; rp; rp = rp->ai_next) {
+        fd = socket(rp->ai_family, rp->ai_socktype | SOCK_CLOEXEC, rp->ai_protocol);
+        if (fd < 0) continue;
+        if (connect(fd, rp->ai_addr, rp->ai_addrlen) == 0) break;
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+    if (fd >= 0) set_nodelay(fd);
+    return fd;
+}
+
+static void follow_stream(int fd, char *buf, off_t *applied)
+{
+    unsigned char msg[REPL_HELLO_LEN];
+
+    put_be32(msg, AESD_REPL_MAGIC);
+    put_be32(msg + 4, AESD_REPL_VERSION);
+    put_be64(msg + 8, (uint64_t)*applied);
+    if (aesd_send_all(fd, (const char *)msg, REPL_HELLO_LEN) != 0) return;
+    syslog(LOG_INFO, "Following %s:%s from offset %lld", g_repl.host, g_repl.port, (long long)*applied);
+
+    for (;;) {
+        if (read_full(fd, msg, REPL_HEADER_LEN) != 0) return;
+        off_t off = (off_t)get_be64(msg);
+        uint32_t len = get_be32(msg + 8);
+        if (off != *applied || len == 0 || len > AESD_REPL_MAX_FRAME) {
+            syslog(LOG_ERR, "bad frame from leader: offset %lld len %u, expected offset %lld",
+                   (long long)off, len, (long long)*applied);
+            return;
+        }
+        if (read_full(fd, buf, len) != 0) return;
+        if (aesd_store_append(g_repl.st, buf, len, NULL) != 0) {
+            syslog(LOG_ERR, "applying replicated frame failed: %s", strerror(errno));
+            return;
+        }
+        *applied += len;
+
+        put_be64(msg, (uint64_t)*applied);
+        if (aesd_send_all(fd, (const char *)msg, 8) != 0) return;
+    }
+}
+
+static void *follower_thread(void *arg)
+{
+    (void)arg;
+    char *buf = malloc(AESD_REPL_MAX_FRAME);
+    off_t applied = aesd_store_committed(g_repl.st);
+    bool warned = false;
+
+    if (!buf) {
+        syslog(LOG_ERR, "follower: malloc failed");
+        return NULL;
+    }
+    while (!atomic_load(&g_repl.stop)) {
+        int fd = connect_leader();
+        if (fd < 0) {
+            if (!warned) syslog(LOG_WARNING, "leader %s:%s unreachable, retrying", g_repl.host, g_repl.port);
+            warned = true;
+            nap(REPL_RETRY_MS);
+            continue;
+        }
+        warned = false;
+
+        pthread_mutex_lock(&g_repl.lock);
+        g_repl.follower_fd = fd;
+        pthread_mutex_unlock(&g_repl.lock);
+        if (!atomic_load(&g_repl.stop)) follow_stream(fd, buf, &applied);
+        pthread_mutex_lock(&g_repl.lock);
+        g_repl.follower_fd = -1;
+        pthread_mutex_unlock(&g_repl.lock);
+        close(fd);
+
+        if (!atomic_load(&g_repl.stop)) {
+            syslog(LOG_WARNING, "lost leader at offset %lld, reconnecting", (long long)applied);
+            nap(REPL_RETRY_MS);
+        }
+    }
+    free(buf);
+    return NULL;
+}
+
+int aesd_repl_follower_start(struct aesd_store *st, const char *leader)
+{
+    const char *colon = strrchr(leader, ':');
+    if (!colon || colon == leader || colon[1] == '\0' ||
+        (size_t)(colon - leader) >= sizeof(g_repl.host) || strlen(colon + 1) >= sizeof(g_repl.port)) {
+        errno = EINVAL;
+        return -1;
+    }
+    memcpy(g_repl.host, leader, (size_t)(colon - leader));
+    g_repl.host[colon - leader] = '\0';
+    strcpy(g_repl.port, colon + 1);
+
+    g_repl.st = st;
+    if (pthread_create(&g_repl.follower_tid, NULL, follower_thread, NULL) != 0) return -1;
+    g_repl.follower_started = true;
+    return 0;
+}
+
+// ---------- shutdown ----------
+
+void aesd_repl_stop(void)
+{
+    atomic_store(&g_repl.stop, true);
+
+    if (g_repl.accept_started) {
+        shutdown(g_repl.listen_fd, SHUT_RDWR);     // wakes accept()
+        pthread_join(g_repl.accept_tid, NULL);
+        g_repl.accept_started = false;
+    }
+    if (g_repl.listen_fd >= 0) {
+        close(g_repl.listen_fd);
+        g_repl.listen_fd = -1;
+    }
+
+    pthread_mutex_lock(&g_repl.lock);
+    struct repl_conn *it;
+    SLIST_FOREACH(it, &g_repl.conns, entries) shutdown(it->fd, SHUT_RDWR);
+    if (g_repl.follower_fd >= 0) shutdown(g_repl.follower_fd, SHUT_RDWR);
+    pthread_mutex_unlock(&g_repl.lock);
+
+    reap_conns(true);
+    if (g_repl.follower_started) {
+        pthread_join(g_repl.follower_tid, NULL);
+        g_repl.follower_started = false;
+    }
+}
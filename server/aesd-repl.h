@@ -0,0 +1,37 @@
+/*
+ * aesd-repl.h
+ *
+ * Leader/follower replication of an aesd store over TCP.  The leader
+ * streams every committed byte of its store to each follower; followers
+ * apply the stream to their own store and serve read-only replays.
+ *
+ * Wire format, all integers big endian:
+ *   follower -> leader  hello  { u32 magic, u32 version, u64 start offset }
+ *   leader -> follower  frame  { u64 offset, u32 len, len bytes }
+ *   follower -> leader  ack    { u64 offset applied }
+ *
+ * Frames are pipelined: the leader keeps sending while up to
+ * AESD_REPL_WINDOW bytes are unacknowledged, and each frame carries
+ * everything committed since the previous one (at most AESD_REPL_MAX_FRAME
+ * bytes).  A follower that reconnects sends the offset it has applied and
+ * the leader resumes from there.
+ */
+
+#ifndef AESD_REPL_H
+#define AESD_REPL_H
+
+#include "aesd-store.h"
+
+#define AESD_REPL_MAGIC     0x41455352u /* "AESR" */
+#define AESD_REPL_VERSION   1
+#define AESD_REPL_MAX_FRAME (1024 * 1024)
+#define AESD_REPL_WINDOW    (8 * 1024 * 1024)
+
+/* Accept followers on port and stream st to them from background threads */
+int  aesd_repl_leader_start(struct aesd_store *st, const char *port);
+/* Follow the leader at "host:port", applying its stream to st */
+int  aesd_repl_follower_start(struct aesd_store *st, const char *leader);
+/* Stop and join every replication thread; safe to call if none started */
+void aesd_repl_stop(void);
+
+#endif /* AESD_REPL_H */
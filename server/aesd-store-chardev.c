@@ -0,0 +1,192 @@
+/**
+ * aesd-store-chardev.c
+ *
+ * - Backend "chardev": records are written to /dev/aesdchar
+ * - The driver keeps the last AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED
+ *   commands, so offsets are only meaningful until the ring wraps and
+ *   replays always run to the end of the device
+ * - seek_cmd uses the AESDCHAR_IOCSEEKTO ioctl
+ * - The driver joins partial writes into one command until '\n', so
+ *   appends made of several write() calls hold write_lock to stay whole
+*/
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+#include "aesd_ioctl.h"
+#include "aesd-store.h"
+
+#define AESD_PATH "/dev/aesdchar"
+#define SEND_CHUNK 4096
+
+struct chardev_store {
+    int fd;
+    pthread_mutex_t seek_lock;  // ioctl/lseek move the shared f_pos
+    pthread_mutex_t write_lock; // keeps multi-write records from interleaving
+    atomic_uint_least64_t appends;
+    atomic_uint_least64_t replays;
+    atomic_uint_least64_t replay_bytes;
+};
+
+static int chardev_open(struct aesd_store *st, const char *path)
+{
+    struct chardev_store *cs = calloc(1, sizeof(*cs));
+    if (!cs) return -1;
+
+    cs->fd = open(path ? path : AESD_PATH, O_RDWR | O_CLOEXEC);
+    if (cs->fd < 0) {
+        free(cs);
+        return -1;
+    }
+    pthread_mutex_init(&cs->seek_lock, NULL);
+    pthread_mutex_init(&cs->write_lock, NULL);
+    st->priv = cs;
+    return 0;
+}
+
+static int chardev_append_batch(struct aesd_store *st, const struct iovec *iov, int iovcnt, off_t *end_rtn)
+{
+    struct chardev_store *cs = st->priv;
+    int rc = 0;
+
+    pthread_mutex_lock(&cs->write_lock);
+    for (int i = 0; i < iovcnt && rc == 0; i++) {
+        rc = aesd_write_all(cs->fd, iov[i].iov_base, iov[i].iov_len);
+    }
+    pthread_mutex_unlock(&cs->write_lock);
+    if (rc != 0) return -1;
+    atomic_fetch_add(&cs->appends, 1);
+    if (end_rtn) *end_rtn = -1;     // no stable offsets, replay to the end
+    return 0;
+}
+
+static int chardev_append_fd(struct aesd_store *st, int src_fd, off_t len, off_t *end_rtn)
+{
+    struct chardev_store *cs = st->priv;
+    char *buf = malloc(AESD_STORE_COPY_CHUNK);
+    int rc = 0;
+    if (!buf) return -1;
+
+    pthread_mutex_lock(&cs->write_lock);
+    for (off_t off = 0; off < len && rc == 0; ) {
+        size_t want = (size_t)(len - off) < AESD_STORE_COPY_CHUNK ? (size_t)(len - off) : AESD_STORE_COPY_CHUNK;
+        ssize_t r = pread(src_fd, buf, want, off);
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) {
+            if (r == 0) errno = EIO;
+            rc = -1;
+            break;
+        }
+        rc = aesd_write_all(cs->fd, buf, (size_t)r);
+        off += r;
+    }
+    pthread_mutex_unlock(&cs->write_lock);
+    free(buf);
+    if (rc != 0) return -1;
+    atomic_fetch_add(&cs->appends, 1);
+    if (end_rtn) *end_rtn = -1;
+    return 0;
+}
+
+static int chardev_append(struct aesd_store *st, const char *data, size_t len, off_t *end_rtn)
+{
+    struct iovec iov = { .iov_base = (void *)data, .iov_len = len };
+    return chardev_append_batch(st, &iov, 1, end_rtn);
+}
+
+static ssize_t chardev_read_at(struct aesd_store *st, off_t off, char *buf, size_t len)
+{
+    struct chardev_store *cs = st->priv;
+    for (;;) {
+        ssize_t r = pread(cs->fd, buf, len, off);
+        if (r < 0 && errno == EINTR) continue;
+        return r;
+    }
+}
+
+static int chardev_replay(struct aesd_store *st, off_t from, off_t to, int out_fd)
+{
+    struct chardev_store *cs = st->priv;
+    char buf[SEND_CHUNK];
+    uint64_t sent = 0;
+
+    (void)to;   // the ring may have moved on; read back everything until EOF
+    for (;;) {
+        ssize_t r = pread(cs->fd, buf, sizeof(buf), from);
+        if (r < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        if (r == 0) break; // EOF
+        if (aesd_send_all(out_fd, buf, (size_t)r) != 0) return -1;
+        from += r;
+        sent += (uint64_t)r;
+    }
+    atomic_fetch_add(&cs->replays, 1);
+    atomic_fetch_add(&cs->replay_bytes, sent);
+    return 0;
+}
+
+static int chardev_seek_cmd(struct aesd_store *st, uint32_t cmd, uint32_t cmd_offset, off_t *pos_rtn)
+{
+    struct chardev_store *cs = st->priv;
+    struct aesd_seekto seekto = { .write_cmd = cmd, .write_cmd_offset = cmd_offset };
+    int rc = 0;
+
+    pthread_mutex_lock(&cs->seek_lock);
+    if (ioctl(cs->fd, AESDCHAR_IOCSEEKTO, &seekto) == -1) {
+        rc = -1;
+    } else {
+        off_t pos = lseek(cs->fd, 0, SEEK_CUR);
+        if (pos == (off_t)-1) rc = -1;
+        else *pos_rtn = pos;
+    }
+    pthread_mutex_unlock(&cs->seek_lock);
+    return rc;
+}
+
+static void chardev_stats(struct aesd_store *st, struct aesd_store_stats *out)
+{
+    struct chardev_store *cs = st->priv;
+
+    pthread_mutex_lock(&cs->seek_lock);
+    off_t end = lseek(cs->fd, 0, SEEK_END);
+    pthread_mutex_unlock(&cs->seek_lock);
+
+    out->bytes = (end == (off_t)-1) ? 0 : (uint64_t)end;
+    out->appends = atomic_load(&cs->appends);
+    out->replays = atomic_load(&cs->replays);
+    out->replay_bytes = atomic_load(&cs->replay_bytes);
+}
+
+static void chardev_close(struct aesd_store *st)
+{
+    struct chardev_store *cs = st->priv;
+    if (!cs) return;
+    close(cs->fd);
+    pthread_mutex_destroy(&cs->seek_lock);
+    pthread_mutex_destroy(&cs->write_lock);
+    free(cs);
+}
+
+const struct aesd_store_ops aesd_store_chardev_ops = {
+    .name           = "chardev",
+    .timestamps     = false,
+    .stable_offsets = false,
+    .open           = chardev_open,
+    .append         = chardev_append,
+    .append_batch   = chardev_append_batch,
+    .append_fd      = chardev_append_fd,
+    .read_at        = chardev_read_at,
+    .replay_to_fd   = chardev_replay,
+    .seek_cmd       = chardev_seek_cmd,
+    .stats          = chardev_stats,
+    .close          = chardev_close,
+};
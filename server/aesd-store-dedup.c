@@ -0,0 +1,436 @@
+/**
+ * aesd-store-dedup.c
+ *
+ * - Backend "dedup": an in-memory store where identical records share one
+ *   copy of their bytes
+ * - Each unique payload is kept once, found through a hash table keyed by
+ *   aesd_hash64(); a hash hit is confirmed with memcmp(), so a collision can
+ *   only cost a second copy, never wrong output
+ * - The log itself is a table of (offset, payload) records.  Replays walk
+ *   it and copy payloads into a buffer that goes out in one send, so the
+ *   bytes on the wire are the same as with any other backend
+ * - Appends are serialized by a mutex.  Record chunks and payloads never
+ *   move once published, so readers run without any lock behind the
+ *   committed record count
+- stored_bytes counts a payload once, when the first record holding it is
+  published; payloads left by a failed batch stay shareable but uncounted
+ * - Record chunks and payload arenas are hugemem chunks (aesdsocket -H)
+ * - AESDCHAR_IOCSEEKTO indexes records directly while every record is one
+ *   line, and scans otherwise
+ * - A spilled record read back for hashing is charged to the memory budget
+ *   and refused with ENOMEM past the cap; replay buffers are charged too
+*/
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include "aesd-budget.h"
+#include "aesd-hash.h"
+#include "aesd-hugemem.h"
+#include "aesd-store.h"
+
+#define REC_SHIFT       17                      // records per table chunk
+#define REC_CHUNK       ((size_t)1 << REC_SHIFT)
+#define REC_MAX_CHUNKS  2048                    // 256M records
+#define ARENA_SIZE      AESD_HUGEMEM_CHUNK
+#define ARENA_BIG       (ARENA_SIZE / 4)        // bigger payloads get their own block
+#define SEND_CHUNK      65536
+
+struct payload {
+    uint64_t hash;
+    size_t len;
+    uint64_t refs;                      // published records holding it; lock held
+    char data[];
+};
+
+struct record {
+    uint64_t off;
+    struct payload *p;
+};
+
+_Static_assert(REC_CHUNK * sizeof(struct record) == AESD_HUGEMEM_CHUNK, "record chunk is one hugemem chunk");
+
+struct dedup_store {
+    _Atomic(struct record *) recs[REC_MAX_CHUNKS];
+    atomic_uint_least64_t nrecs;        // records visible to readers
+    atomic_uint_least64_t committed;    // logical bytes visible to readers
+    atomic_bool multiline;              // some record is not exactly one line
+
+    pthread_mutex_t lock;               // serializes appends, guards the rest
+    struct payload **table;             // open addressing, power of two
+    size_t table_cap;
+    size_t npayloads;                   // table entries, published or not
+    char *arena;
+    size_t arena_used;
+    void **blocks;                      // big payloads, free() on close
+    size_t nblocks;
+    size_t blocks_cap;
+    void **arenas;                      // aesd_hugemem_free() on close
+    size_t narenas;
+    size_t arenas_cap;
+    uint64_t stored;                    // bytes of payloads some published record holds
+    uint64_t appends;
+
+    atomic_uint_least64_t replays;
+    atomic_uint_least64_t replay_bytes;
+};
+
+static int dedup_open(struct aesd_store *st, const char *path)
+{
+    (void)path;
+    struct dedup_store *ds = calloc(1, sizeof(*ds));
+    if (!ds) return -1;
+    ds->table_cap = 1024;
+    ds->table = calloc(ds->table_cap, sizeof(*ds->table));
+    if (!ds->table) {
+        free(ds);
+        return -1;
+    }
+    pthread_mutex_init(&ds->lock, NULL);
+    st->priv = ds;
+    return 0;
+}
+
+// ---------- payloads (lock held) ----------
+
+static int reserve_slot(void ***v, size_t n, size_t *cap)
+{
+    if (n < *cap) return 0;
+    size_t grown = *cap ? *cap * 2 : 64;
+    void **p = realloc(*v, grown * sizeof(*p));
+    if (!p) return -1;
+    *v = p;
+    *cap = grown;
+    return 0;
+}
+
+static void *keep_block(struct dedup_store *ds, size_t size)
+{
+    if (reserve_slot(&ds->blocks, ds->nblocks, &ds->blocks_cap) != 0) return NULL;
+    void *b = malloc(size);
+    if (b) ds->blocks[ds->nblocks++] = b;
+    return b;
+}
+
+static void *keep_arena(struct dedup_store *ds)
+{
+    if (reserve_slot(&ds->arenas, ds->narenas, &ds->arenas_cap) != 0) return NULL;
+    void *b = aesd_hugemem_alloc();
+    if (b) ds->arenas[ds->narenas++] = b;
+    return b;
+}
+
+static struct payload *alloc_payload(struct dedup_store *ds, size_t len)
+{
+    size_t size = (sizeof(struct payload) + len + 7) & ~(size_t)7;
+    if (size > ARENA_BIG) return keep_block(ds, size);
+    if (!ds->arena || ds->arena_used + size > ARENA_SIZE) {
+        ds->arena = keep_arena(ds);
+        ds->arena_used = 0;
+        if (!ds->arena) return NULL;
+    }
+    struct payload *p = (struct payload *)(ds->arena + ds->arena_used);
+    ds->arena_used += size;
+    return p;
+}
+
+static int grow_table(struct dedup_store *ds)
+{
+    size_t cap = ds->table_cap * 2;
+    struct payload **t = calloc(cap, sizeof(*t));
+    if (!t) return -1;
+    for (size_t i = 0; i < ds->table_cap; i++) {
+        struct payload *p = ds->table[i];
+        if (!p) continue;
+        size_t j = (size_t)p->hash & (cap - 1);
+        while (t[j]) j = (j + 1) & (cap - 1);
+        t[j] = p;
+    }
+    free(ds->table);
+    ds->table = t;
+    ds->table_cap = cap;
+    return 0;
+}
+
+/* The shared copy of data, made if this is the first time it is seen.  It
+ * counts toward stored only once a record holding it is published */
+static struct payload *intern(struct dedup_store *ds, const char *data, size_t len)
+{
+    uint64_t h = aesd_hash64(data, len);
+    size_t j = (size_t)h & (ds->table_cap - 1);
+    for (struct payload *p; (p = ds->table[j]) != NULL; j = (j + 1) & (ds->table_cap - 1)) {
+        if (p->hash == h && p->len == len && memcmp(p->data, data, len) == 0) return p;
+    }
+
+    // Keep probes short.  A failed grow just leaves the table fuller, but
+    // its last empty slot is never taken: probes for new data end there
+    if ((ds->npayloads + 1) * 2 > ds->table_cap) {
+        if (grow_table(ds) == 0) {
+            for (j = (size_t)h & (ds->table_cap - 1); ds->table[j]; j = (j + 1) & (ds->table_cap - 1)) {
+            }
+        } else if (ds->npayloads + 1 >= ds->table_cap) {
+            syslog(LOG_ERR, "dedup store: payload table full and cannot grow");
+            errno = ENOMEM;
+            return NULL;
+        }
+    }
+
+    struct payload *p = alloc_payload(ds, len);
+    if (!p) return NULL;
+    p->hash = h;
+    p->len = len;
+    p->refs = 0;
+    memcpy(p->data, data, len);
+    ds->table[j] = p;
+    ds->npayloads++;
+    return p;
+}
+
+// ---------- records ----------
+
+static struct record *rec_at(struct dedup_store *ds, uint64_t i)
+{
+    struct record *chunk = atomic_load_explicit(&ds->recs[i >> REC_SHIFT], memory_order_acquire);
+    return &chunk[i & (REC_CHUNK - 1)];
+}
+
+/* Add one record after the last; published by the caller. Lock held */
+static int add_record(struct dedup_store *ds, uint64_t n, uint64_t off, const char *data, size_t len)
+{
+    size_t idx = (size_t)(n >> REC_SHIFT);
+    if (idx >= REC_MAX_CHUNKS) {
+        errno = ENOSPC;
+        return -1;
+    }
+    if (!atomic_load_explicit(&ds->recs[idx], memory_order_relaxed)) {
+        struct record *chunk = aesd_hugemem_alloc();
+        if (!chunk) return -1;
+        atomic_store_explicit(&ds->recs[idx], chunk, memory_order_release);
+    }
+    struct payload *p = intern(ds, data, len);
+    if (!p) return -1;
+    if (len == 0 || memchr(data, '\n', len) != data + len - 1) atomic_store(&ds->multiline, true);
+    *rec_at(ds, n) = (struct record){ off, p };
+    return 0;
+}
+
+static int dedup_append_batch(struct aesd_store *st, const struct iovec *iov, int iovcnt, off_t *end_rtn)
+{
+    struct dedup_store *ds = st->priv;
+    int rc = 0;
+
+    pthread_mutex_lock(&ds->lock);
+    uint64_t n = atomic_load_explicit(&ds->nrecs, memory_order_relaxed);
+    uint64_t off = atomic_load_explicit(&ds->committed, memory_order_relaxed);
+    for (int i = 0; i < iovcnt && rc == 0; i++) {
+        rc = add_record(ds, n, off, iov[i].iov_base, iov[i].iov_len);
+        if (rc == 0) {
+            n++;
+            off += iov[i].iov_len;
+        }
+    }
+    // Publish only whole batches so a batch stays uninterleaved for readers.
+    // A failed batch leaves its new payloads in the table for later appends
+    // to share, unreferenced and uncounted
+    if (rc == 0) {
+        for (uint64_t i = atomic_load_explicit(&ds->nrecs, memory_order_relaxed); i < n; i++) {
+            struct payload *p = rec_at(ds, i)->p;
+            if (p->refs++ == 0) ds->stored += p->len;
+        }
+        atomic_store_explicit(&ds->nrecs, n, memory_order_release);
+        atomic_store_explicit(&ds->committed, off, memory_order_release);
+        ds->appends++;
+    }
+    if (end_rtn) *end_rtn = (off_t)atomic_load_explicit(&ds->committed, memory_order_relaxed);
+    pthread_mutex_unlock(&ds->lock);
+    return rc;
+}
+
+static int dedup_append(struct aesd_store *st, const char *data, size_t len, off_t *end_rtn)
+{
+    struct iovec iov = { .iov_base = (void *)data, .iov_len = len };
+    return dedup_append_batch(st, &iov, 1, end_rtn);
+}
+
+/* The whole record has to be in memory to be hashed */
+static int dedup_append_fd(struct aesd_store *st, int src_fd, off_t len, off_t *end_rtn)
+{
+    if (!aesd_budget_try_charge(AESD_BUDGET_PENDING, (size_t)len)) {
+        syslog(LOG_ERR, "dedup store: %lld byte record does not fit the memory cap", (long long)len);
+        errno = ENOMEM;
+        return -1;
+    }
+    char *buf = malloc((size_t)len);
+    int rc = -1;
+    if (!buf) goto out;
+    for (off_t off = 0; off < len; ) {
+        ssize_t r = pread(src_fd, buf + off, (size_t)(len - off), off);
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) {
+            syslog(LOG_ERR, "dedup store: reading spilled record failed");
+            if (r == 0) errno = EIO;
+            goto out;
+        }
+        off += r;
+    }
+    rc = dedup_append(st, buf, (size_t)len, end_rtn);
+out:
+    free(buf);
+    aesd_budget_release(AESD_BUDGET_PENDING, (size_t)len);
+    return rc;
+}
+
+/* Index of the record holding off; off must be below the committed end */
+static uint64_t find_record(struct dedup_store *ds, uint64_t nrecs, uint64_t off)
+{
+    uint64_t lo = 0, hi = nrecs;
+    while (hi - lo > 1) {
+        uint64_t mid = lo + (hi - lo) / 2;
+        if (rec_at(ds, mid)->off <= off) lo = mid;
+        else hi = mid;
+    }
+    return lo;
+}
+
+/* Copy [off, off+len) into buf; the range must be committed */
+static void copy_out(struct dedup_store *ds, uint64_t nrecs, uint64_t off, char *buf, size_t len)
+{
+    for (uint64_t i = find_record(ds, nrecs, off); len > 0; i++) {
+        const struct record *r = rec_at(ds, i);
+        size_t in_rec = (size_t)(off - r->off);
+        size_t n = r->p->len - in_rec;
+        if (n > len) n = len;
+        memcpy(buf, r->p->data + in_rec, n);
+        buf += n;
+        off += n;
+        len -= n;
+    }
+}
+
+static ssize_t dedup_read_at(struct aesd_store *st, off_t off, char *buf, size_t len)
+{
+    struct dedup_store *ds = st->priv;
+    // committed is stored after nrecs, so loading it first keeps the pair consistent
+    uint64_t committed = atomic_load_explicit(&ds->committed, memory_order_acquire);
+    uint64_t nrecs = atomic_load_explicit(&ds->nrecs, memory_order_acquire);
+
+    if ((uint64_t)off >= committed) return 0;
+    if (len > committed - (uint64_t)off) len = (size_t)(committed - (uint64_t)off);
+    copy_out(ds, nrecs, (uint64_t)off, buf, len);
+    return (ssize_t)len;
+}
+
+static int dedup_replay(struct aesd_store *st, off_t from, off_t to, int out_fd)
+{
+    struct dedup_store *ds = st->priv;
+    uint64_t committed = atomic_load_explicit(&ds->committed, memory_order_acquire);
+    uint64_t nrecs = atomic_load_explicit(&ds->nrecs, memory_order_acquire);
+    uint64_t end = (to < 0 || (uint64_t)to > committed) ? committed : (uint64_t)to;
+    uint64_t off = (uint64_t)from;
+    char *buf = malloc(SEND_CHUNK);
+    if (!buf) return -1;
+    aesd_budget_charge(AESD_BUDGET_OUTPUT, SEND_CHUNK);
+
+    int rc = 0;
+    while (rc == 0 && off < end) {
+        size_t n = end - off < SEND_CHUNK ? (size_t)(end - off) : SEND_CHUNK;
+        copy_out(ds, nrecs, off, buf, n);
+        rc = aesd_send_all(out_fd, buf, n);
+        if (rc == 0) off += n;
+    }
+    free(buf);
+    aesd_budget_release(AESD_BUDGET_OUTPUT, SEND_CHUNK);
+    if (rc != 0) return -1;
+    atomic_fetch_add_explicit(&ds->replays, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&ds->replay_bytes, off > (uint64_t)from ? off - (uint64_t)from : 0,
+                              memory_order_relaxed);
+    return 0;
+}
+
+/* Line cmd by counting '\n' through the payloads, for logs with multi-line records */
+static int seek_cmd_scan(struct dedup_store *ds, uint64_t nrecs, uint32_t cmd, off_t *start, off_t *end)
+{
+    uint32_t line = 0;
+    *start = cmd == 0 ? 0 : -1;
+    for (uint64_t i = 0; i < nrecs; i++) {
+        const struct record *r = rec_at(ds, i);
+        for (const char *p = r->p->data, *e = p + r->p->len; (p = memchr(p, '\n', (size_t)(e - p))) != NULL; p++) {
+            off_t pos = (off_t)r->off + (p - r->p->data) + 1;
+            if (*start >= 0) {
+                *end = pos;
+                return 0;
+            }
+            if (++line == cmd) *start = pos;
+        }
+    }
+    return -1;
+}
+
+static int dedup_seek_cmd(struct aesd_store *st, uint32_t cmd, uint32_t cmd_offset, off_t *pos_rtn)
+{
+    struct dedup_store *ds = st->priv;
+    uint64_t nrecs = atomic_load_explicit(&ds->nrecs, memory_order_acquire);
+    off_t start = -1, end = -1;
+
+    if (atomic_load(&ds->multiline)) {
+        seek_cmd_scan(ds, nrecs, cmd, &start, &end);
+    } else if (cmd < nrecs) {
+        const struct record *r = rec_at(ds, cmd);
+        start = (off_t)r->off;
+        end = start + (off_t)r->p->len;
+    }
+    if (start < 0 || end < 0 || (off_t)cmd_offset >= end - start) {
+        errno = EINVAL;
+        return -1;
+    }
+    *pos_rtn = start + (off_t)cmd_offset;
+    return 0;
+}
+
+static void dedup_stats(struct aesd_store *st, struct aesd_store_stats *out)
+{
+    struct dedup_store *ds = st->priv;
+    pthread_mutex_lock(&ds->lock);
+    out->bytes = atomic_load(&ds->committed);
+    out->stored_bytes = ds->stored;
+    out->appends = ds->appends;
+    pthread_mutex_unlock(&ds->lock);
+    out->replays = atomic_load(&ds->replays);
+    out->replay_bytes = atomic_load(&ds->replay_bytes);
+}
+
+static void dedup_close(struct aesd_store *st)
+{
+    struct dedup_store *ds = st->priv;
+    if (!ds) return;
+    for (size_t i = 0; i < REC_MAX_CHUNKS; i++) aesd_hugemem_free(atomic_load(&ds->recs[i]));
+    for (size_t i = 0; i < ds->narenas; i++) aesd_hugemem_free(ds->arenas[i]);
+    for (size_t i = 0; i < ds->nblocks; i++) free(ds->blocks[i]);
+    free(ds->arenas);
+    free(ds->blocks);
+    free(ds->table);
+    pthread_mutex_destroy(&ds->lock);
+    free(ds);
+}
+
+const struct aesd_store_ops aesd_store_dedup_ops = {
+    .name           = "dedup",
+    .timestamps     = true,
+    .stable_offsets = true,
+    .open           = dedup_open,
+    .append         = dedup_append,
+    .append_batch   = dedup_append_batch,
+    .append_fd      = dedup_append_fd,
+    .read_at        = dedup_read_at,
+    .replay_to_fd   = dedup_replay,
+    .seek_cmd       = dedup_seek_cmd,
+    .stats          = dedup_stats,
+    .close          = dedup_close,
+};
@@ -0,0 +1,576 @@
+/**
+ * aesd-store-file.c
+ *
+ * - Backend "file": records are appended to /var/tmp/aesdsocketdata
+ * - Appends are serialized by a mutex; the file is opened O_APPEND
+ * - Replays use sendfile() from the file straight to the socket and need
+ *   no lock, since bytes below the committed size never change
+ * - The file is truncated on open and removed on close, unless opened with
+ *   AESD_STORE_KEEP: then it is reused, cut back to its last complete line
+ *   (or last valid frame), and left in place
+ * - Appends also record their line starts in an aesd-lineindex, so seeking
+ *   to packet N is a lookup; the index is rebuilt by the scan or validation
+ *   that reopening does anyway, so it is not persisted.  Should it break
+ *   (out of memory, failed write), seeks go back to scanning the file
+ * - AESD_STORE_CRC writes a 16-byte frame (length, CRC-32C, CRC of the
+ *   frame) per record to a sidecar file, so the data file stays plain text
+ *   and replays still go out with sendfile().  The data is written before
+ *   its frame, and a record whose frame cannot be written is cut off again,
+ *   so frame k always describes record k.  Reopening such a store with an
+ *   empty sidecar (last written unframed) frames its lines as one record;
+ *   keeping a store without AESD_STORE_CRC removes its sidecar
+*/
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include "aesd-hash.h"
+#include "aesd-lineindex.h"
+#include "aesd-store.h"
+
+#define DATAFILE "/var/tmp/aesdsocketdata"
+#define SEND_CHUNK 4096
+#define SCAN_CHUNK 65536
+#define RECOVER_CHUNK (1024 * 1024)
+
+/* Host byte order; check covers the fields before it */
+struct crc_frame {
+    uint64_t len;
+    uint32_t crc;
+    uint32_t check;
+};
+
+struct file_store {
+    int fd;
+    int crc_fd;                 // frames, -1 unless AESD_STORE_CRC
+    bool keep;
+    char *path;
+    char *crc_path;
+    pthread_mutex_t lock;       // serializes appends, protects size
+    off_t size;                 // committed bytes
+    struct aesd_lineindex lines;    // line starts below size, under lock
+    uint64_t frames;            // frames in crc_fd, under lock
+    uint64_t appends;
+    atomic_uint_least64_t replays;
+    atomic_uint_least64_t replay_bytes;
+};
+
+static off_t committed_size(struct file_store *fs)
+{
+    pthread_mutex_lock(&fs->lock);
+    off_t size = fs->size;
+    pthread_mutex_unlock(&fs->lock);
+    return size;
+}
+
+// ---------- reopening ----------
+
+/* A read-ahead window over one file, for walking it in small steps */
+struct reader {
+    int fd;
+    char *buf;
+    off_t start;
+    size_t len;
+};
+
+/* Point *p at up to want bytes at off, refilling the window as needed; 0 at EOF */
+static ssize_t reader_at(struct reader *r, off_t off, size_t want, const char **p)
+{
+    bool inside = off >= r->start && off < r->start + (off_t)r->len;
+    if (!inside || (r->start + (off_t)r->len - off < (off_t)want && r->start != off)) {
+        ssize_t n;
+        do {
+            n = pread(r->fd, r->buf, RECOVER_CHUNK, off);
+        } while (n < 0 && errno == EINTR);
+        if (n <= 0) return n;
+        r->start = off;
+        r->len = (size_t)n;
+    }
+    size_t avail = r->len - (size_t)(off - r->start);
+    *p = r->buf + (off - r->start);
+    return (ssize_t)(avail < want ? avail : want);
+}
+
+/*
+ * Keep the longest prefix of records whose frames are intact and match
+ * their data, indexing lines as it goes.  Returns the bytes to keep and
+ * sets *nframes; -1 only for I/O errors.
+ */
+static off_t recover_framed(struct file_store *fs, off_t data_size, uint64_t *nframes)
+{
+    struct reader data = { .fd = fs->fd }, frames = { .fd = fs->crc_fd };
+    off_t good = 0;
+    const char *p;
+    ssize_t n;
+
+    *nframes = 0;
+    data.buf = malloc(RECOVER_CHUNK);
+    frames.buf = malloc(RECOVER_CHUNK);
+    if (!data.buf || !frames.buf) goto fail;
+
+    while ((n = reader_at(&frames, (off_t)(*nframes * sizeof(struct crc_frame)), sizeof(struct crc_frame), &p)) ==
+           (ssize_t)sizeof(struct crc_frame)) {
+        struct crc_frame f;
+        memcpy(&f, p, sizeof(f));
+        if (f.check != aesd_crc32c(0, &f, offsetof(struct crc_frame, check)) ||
+            f.len > (uint64_t)(data_size - good)) break;
+
+        uint64_t starts = fs->lines.starts;
+        uint32_t crc = 0;
+        for (uint64_t done = 0; done < f.len; done += (uint64_t)n) {
+            uint64_t left = f.len - done;
+            n = reader_at(&data, good + (off_t)done, left < RECOVER_CHUNK ? (size_t)left : RECOVER_CHUNK, &p);
+            if (n <= 0) {
+                if (n == 0) errno = EIO;
+                goto fail;
+            }
+            crc = aesd_crc32c(crc, p, (size_t)n);
+            aesd_lineindex_scan(&fs->lines, good + (off_t)done, p, (size_t)n);
+        }
+        if (crc != f.crc) {
+            aesd_lineindex_truncate(&fs->lines, starts);
+            break;
+        }
+        good += (off_t)f.len;
+        (*nframes)++;
+    }
+    if (n < 0) goto fail;
+    free(data.buf);
+    free(frames.buf);
+    return good;
+
+fail:
+    free(data.buf);
+    free(frames.buf);
+    return -1;
+}
+
+/*
+ * Without frames all that can be checked is that the last line is complete.
+ * With crc_rtn, also sets it to the CRC-32C of the bytes kept.
+ */
+static off_t recover_text(struct file_store *fs, off_t data_size, uint32_t *crc_rtn)
+{
+    struct reader data = { .fd = fs->fd };
+    off_t good = 0;
+    uint32_t crc = 0, good_crc = 0;
+    const char *p;
+
+    data.buf = malloc(RECOVER_CHUNK);
+    if (!data.buf) return -1;
+    for (off_t off = 0; off < data_size; ) {
+        ssize_t n = reader_at(&data, off, RECOVER_CHUNK, &p);
+        if (n <= 0) {
+            if (n == 0) errno = EIO;
+            free(data.buf);
+            return -1;
+        }
+        aesd_lineindex_scan(&fs->lines, off, p, (size_t)n);
+        const char *nl = memrchr(p, '\n', (size_t)n);
+        if (nl) good = off + (nl - p) + 1;
+        if (crc_rtn) {
+            if (nl) good_crc = aesd_crc32c(crc, p, (size_t)(nl - p) + 1);
+            crc = aesd_crc32c(crc, p, (size_t)n);
+        }
+        off += n;
+    }
+    free(data.buf);
+    if (crc_rtn) *crc_rtn = good_crc;
+    return good;
+}
+
+static int write_frame(struct file_store *fs, uint64_t len, uint32_t crc);
+
+/*
+ * A store last written without frames gets an empty sidecar.  Validating
+ * against that would drop every byte, so the complete lines are kept as
+ * they would be unframed and framed as a single record.
+ */
+static off_t frame_unframed(struct file_store *fs, off_t data_size)
+{
+    uint32_t crc;
+    off_t good = recover_text(fs, data_size, &crc);
+    if (good <= 0) return good;
+    if (write_frame(fs, (uint64_t)good, crc) != 0) return -1;
+    syslog(LOG_WARNING, "file store: %s had no frames, framed its %lld bytes as one record",
+           fs->path, (long long)good);
+    return good;
+}
+
+/* Reopen the last run's store, cut back to what checks out */
+static int recover(struct file_store *fs)
+{
+    struct stat sb, crc_sb;
+    uint64_t nframes = 0;
+    off_t good;
+
+    if (fstat(fs->fd, &sb) != 0) return -1;
+    if (fs->crc_fd >= 0 && fstat(fs->crc_fd, &crc_sb) != 0) return -1;
+    if (fs->crc_fd < 0) {
+        good = recover_text(fs, sb.st_size, NULL);
+    } else if (crc_sb.st_size == 0 && sb.st_size > 0) {
+        good = frame_unframed(fs, sb.st_size);
+        nframes = fs->frames;
+    } else {
+        good = recover_framed(fs, sb.st_size, &nframes);
+    }
+    if (good < 0) return -1;
+    if (good < sb.st_size && ftruncate(fs->fd, good) != 0) return -1;
+    if (fs->crc_fd >= 0 && ftruncate(fs->crc_fd, (off_t)(nframes * sizeof(struct crc_frame))) != 0) return -1;
+    fs->size = good;
+    fs->frames = nframes;
+
+    syslog(good < sb.st_size ? LOG_WARNING : LOG_INFO,
+           "file store: kept %lld bytes of %s (%s), dropped %lld", (long long)good, fs->path,
+           fs->crc_fd >= 0 ? "crc32c validated" : "unframed", (long long)(sb.st_size - good));
+    return 0;
+}
+
+static int file_open(struct aesd_store *st, const char *path)
+{
+    struct file_store *fs = calloc(1, sizeof(*fs));
+    int saved;
+    if (!fs) return -1;
+
+    fs->fd = -1;
+    fs->crc_fd = -1;
+    fs->keep = st->flags & AESD_STORE_KEEP;
+    fs->path = strdup(path ? path : DATAFILE);
+    if (!fs->path) goto fail;
+    // O_APPEND ensures kernel appends are atomic among writers.
+    fs->fd = open(fs->path, O_CREAT | O_RDWR | O_APPEND | O_CLOEXEC, 0644);
+    if (fs->fd < 0) goto fail;
+    if (st->flags & AESD_STORE_CRC) {
+        if (asprintf(&fs->crc_path, "%s" AESD_STORE_CRC_SUFFIX, fs->path) < 0) {
+            fs->crc_path = NULL;
+            goto fail;
+        }
+        fs->crc_fd = open(fs->crc_path, O_CREAT | O_RDWR | O_APPEND | O_CLOEXEC, 0644);
+        if (fs->crc_fd < 0) goto fail;
+    } else if (fs->keep) {
+        // Records appended now get no frames, so those a past -c run left
+        // would stop describing the data and cut these records away on the
+        // next -c reopen.  With no sidecar that reopen frames them afresh
+        char *crc_path;
+        if (asprintf(&crc_path, "%s" AESD_STORE_CRC_SUFFIX, fs->path) < 0) goto fail;
+        if (unlink(crc_path) == 0) syslog(LOG_INFO, "file store: dropped stale frames %s", crc_path);
+        free(crc_path);
+    }
+    if (aesd_lineindex_init(&fs->lines) != 0) goto fail;
+
+    if (fs->keep) {
+        if (recover(fs) != 0) goto fail;
+    } else {
+        // Ensure we start with a clean file for each run
+        if (ftruncate(fs->fd, 0) != 0) goto fail;
+        if (fs->crc_fd >= 0 && ftruncate(fs->crc_fd, 0) != 0) goto fail;
+    }
+
+    pthread_mutex_init(&fs->lock, NULL);
+    st->priv = fs;
+    return 0;
+
+fail:
+    saved = errno;
+    if (fs->fd >= 0) close(fs->fd);
+    if (fs->crc_fd >= 0) close(fs->crc_fd);
+    aesd_lineindex_free(&fs->lines);
+    free(fs->path);
+    free(fs->crc_path);
+    free(fs);
+    errno = saved;
+    return -1;
+}
+
+// ---------- appends ----------
+
+static int write_frame(struct file_store *fs, uint64_t len, uint32_t crc)
+{
+    struct crc_frame f = { .len = len, .crc = crc };
+    f.check = aesd_crc32c(0, &f, offsetof(struct crc_frame, check));
+    if (aesd_write_all(fs->crc_fd, (const char *)&f, sizeof(f)) != 0) return -1;
+    fs->frames++;
+    return 0;
+}
+
+/*
+ * An append failed part way through the record at start, which had frames
+ * frames before it.  Framed stores cut both files back to keep data and
+ * frames in step (a short frame write may have landed too); if that fails,
+ * framing stops for this run (a later recovery keeps everything before).
+ * Unframed stores resync with what really landed.  Lock held.
+ */
+static void append_failed(struct file_store *fs, off_t start, uint64_t starts, uint64_t frames)
+{
+    int saved = errno;
+    if (fs->crc_fd >= 0) {
+        if (ftruncate(fs->fd, start) == 0 &&
+            ftruncate(fs->crc_fd, (off_t)(frames * sizeof(struct crc_frame))) == 0) {
+            fs->frames = frames;
+            fs->size = start;
+            aesd_lineindex_truncate(&fs->lines, starts);
+            errno = saved;
+            return;
+        }
+        syslog(LOG_ERR, "file store: cannot roll back a failed append, no more frames this run");
+        close(fs->crc_fd);
+        fs->crc_fd = -1;
+    }
+    struct stat sb;
+    if (fstat(fs->fd, &sb) == 0) fs->size = sb.st_size;
+    fs->lines.broken = true;
+    errno = saved;
+}
+
+static int file_append_batch(struct aesd_store *st, const struct iovec *iov, int iovcnt, off_t *end_rtn)
+{
+    struct file_store *fs = st->priv;
+    int rc = 0;
+
+    pthread_mutex_lock(&fs->lock);
+    uint64_t frames = fs->frames;
+    for (int i = 0; i < iovcnt && rc == 0; i++) {
+        frames = fs->frames;    // records before i stay
+        rc = aesd_write_all(fs->fd, iov[i].iov_base, iov[i].iov_len);
+        if (rc == 0 && fs->crc_fd >= 0) {
+            rc = write_frame(fs, iov[i].iov_len, aesd_crc32c(0, iov[i].iov_base, iov[i].iov_len));
+        }
+        if (rc == 0) {
+            aesd_lineindex_scan(&fs->lines, fs->size, iov[i].iov_base, iov[i].iov_len);
+            fs->size += (off_t)iov[i].iov_len;
+        }
+    }
+    if (rc != 0) {
+        // A short write may have landed
+        append_failed(fs, fs->size, fs->lines.starts, frames);
+    } else {
+        fs->appends++;
+    }
+    if (end_rtn) *end_rtn = fs->size;
+    pthread_mutex_unlock(&fs->lock);
+    return rc;
+}
+
+static int file_append(struct aesd_store *st, const char *data, size_t len, off_t *end_rtn)
+{
+    struct iovec iov = { .iov_base = (void *)data, .iov_len = len };
+    return file_append_batch(st, &iov, 1, end_rtn);
+}
+
+static int file_append_fd(struct aesd_store *st, int src_fd, off_t len, off_t *end_rtn)
+{
+    struct file_store *fs = st->priv;
+    char *buf = malloc(AESD_STORE_COPY_CHUNK);
+    uint32_t crc = 0;
+    int rc = 0;
+    if (!buf) return -1;
+
+    // O_APPEND rules out copy_file_range/sendfile, so copy through a buffer
+    pthread_mutex_lock(&fs->lock);
+    off_t start = fs->size;
+    uint64_t starts = fs->lines.starts;
+    uint64_t frames = fs->frames;
+    for (off_t off = 0; off < len && rc == 0; ) {
+        size_t want = (size_t)(len - off) < AESD_STORE_COPY_CHUNK ? (size_t)(len - off) : AESD_STORE_COPY_CHUNK;
+        ssize_t r = pread(src_fd, buf, want, off);
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) {
+            if (r == 0) errno = EIO;
+            rc = -1;
+            break;
+        }
+        rc = aesd_write_all(fs->fd, buf, (size_t)r);
+        if (rc == 0) {
+            if (fs->crc_fd >= 0) crc = aesd_crc32c(crc, buf, (size_t)r);
+            aesd_lineindex_scan(&fs->lines, fs->size, buf, (size_t)r);
+            fs->size += r;
+            off += r;
+        }
+    }
+    if (rc == 0 && fs->crc_fd >= 0) rc = write_frame(fs, (uint64_t)len, crc);
+    if (rc != 0) {
+        append_failed(fs, start, starts, frames);
+    } else {
+        fs->appends++;
+    }
+    if (end_rtn) *end_rtn = fs->size;
+    pthread_mutex_unlock(&fs->lock);
+    free(buf);
+    return rc;
+}
+
+static ssize_t file_read_at(struct aesd_store *st, off_t off, char *buf, size_t len)
+{
+    struct file_store *fs = st->priv;
+    off_t size = committed_size(fs);
+    if (off >= size) return 0;
+    if ((off_t)len > size - off) len = (size_t)(size - off);
+    for (;;) {
+        ssize_t r = pread(fs->fd, buf, len, off);
+        if (r < 0 && errno == EINTR) continue;
+        return r;
+    }
+}
+
+static int replay_with_pread(struct file_store *fs, off_t from, off_t to, int out_fd)
+{
+    char buf[SEND_CHUNK];
+    while (from < to) {
+        size_t want = (size_t)(to - from) < sizeof(buf) ? (size_t)(to - from) : sizeof(buf);
+        ssize_t r = pread(fs->fd, buf, want, from);
+        if (r < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        if (r == 0) break;
+        if (aesd_send_all(out_fd, buf, (size_t)r) != 0) return -1;
+        from += r;
+    }
+    return 0;
+}
+
+static int file_replay(struct aesd_store *st, off_t from, off_t to, int out_fd)
+{
+    struct file_store *fs = st->priv;
+    off_t start = from;
+
+    if (to < 0) to = committed_size(fs);
+    while (from < to) {
+        ssize_t s = sendfile(out_fd, fs->fd, &from, (size_t)(to - from));
+        if (s < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EINVAL || errno == ENOSYS) {
+                // out_fd does not support sendfile, copy through userspace
+                if (replay_with_pread(fs, from, to, out_fd) != 0) return -1;
+                from = to;
+                break;
+            }
+            return -1;
+        }
+        if (s == 0) break;
+    }
+    atomic_fetch_add(&fs->replays, 1);
+    atomic_fetch_add(&fs->replay_bytes, (uint64_t)(from - start));
+    return 0;
+}
+
+/*
+ * Find the start of line cmd by counting '\n' from the beginning of the
+ * file, then check cmd_offset falls inside that (complete) line.
+ */
+static int seek_cmd_scan(struct file_store *fs, uint32_t cmd, uint32_t cmd_offset, off_t *pos_rtn)
+{
+    off_t size = committed_size(fs);
+    off_t start = (cmd == 0) ? 0 : -1;
+    off_t end = -1;
+    uint32_t line = 0;
+    char buf[SCAN_CHUNK];
+
+    for (off_t pos = 0; pos < size && end < 0; ) {
+        size_t want = (size_t)(size - pos) < sizeof(buf) ? (size_t)(size - pos) : sizeof(buf);
+        ssize_t r = pread(fs->fd, buf, want, pos);
+        if (r < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        if (r == 0) break;
+        for (ssize_t i = 0; i < r; i++) {
+            if (buf[i] != '\n') continue;
+            if (start >= 0) { end = pos + i + 1; break; }
+            if (++line == cmd) start = pos + i + 1;
+        }
+        pos += r;
+    }
+
+    if (start < 0 || end < 0 || (off_t)cmd_offset >= end - start) {
+        errno = EINVAL;
+        return -1;
+    }
+    *pos_rtn = start + (off_t)cmd_offset;
+    return 0;
+}
+
+static int file_seek_cmd(struct aesd_store *st, uint32_t cmd, uint32_t cmd_offset, off_t *pos_rtn)
+{
+    struct file_store *fs = st->priv;
+    off_t start = -1, end = -1;
+
+    pthread_mutex_lock(&fs->lock);
+    bool broken = fs->lines.broken;
+    if (!broken && cmd < aesd_lineindex_lines(&fs->lines)) {
+        start = aesd_lineindex_start(&fs->lines, cmd);
+        end = aesd_lineindex_start(&fs->lines, (uint64_t)cmd + 1);
+    }
+    pthread_mutex_unlock(&fs->lock);
+
+    if (broken) return seek_cmd_scan(fs, cmd, cmd_offset, pos_rtn);
+    if (start < 0 || (off_t)cmd_offset >= end - start) {
+        errno = EINVAL;
+        return -1;
+    }
+    *pos_rtn = start + (off_t)cmd_offset;
+    return 0;
+}
+
+static void file_stats(struct aesd_store *st, struct aesd_store_stats *out)
+{
+    struct file_store *fs = st->priv;
+    pthread_mutex_lock(&fs->lock);
+    out->bytes = (uint64_t)fs->size;
+    out->appends = fs->appends;
+    pthread_mutex_unlock(&fs->lock);
+    out->replays = atomic_load(&fs->replays);
+    out->replay_bytes = atomic_load(&fs->replay_bytes);
+}
+
+static void file_close(struct aesd_store *st)
+{
+    struct file_store *fs = st->priv;
+    if (!fs) return;
+    if (fs->keep) {
+        // Left for the next run, which will validate it either way
+        fdatasync(fs->fd);
+        if (fs->crc_fd >= 0) fdatasync(fs->crc_fd);
+    }
+    close(fs->fd);
+    if (fs->crc_fd >= 0) close(fs->crc_fd);
+    if (!fs->keep && unlink(fs->path) != 0 && errno != ENOENT) {
+        syslog(LOG_ERR, "unlink(%s) failed: %s", fs->path, strerror(errno));
+    }
+    if (!fs->keep && fs->crc_path && unlink(fs->crc_path) != 0 && errno != ENOENT) {
+        syslog(LOG_ERR, "unlink(%s) failed: %s", fs->crc_path, strerror(errno));
+    }
+    pthread_mutex_destroy(&fs->lock);
+    aesd_lineindex_free(&fs->lines);
+    free(fs->path);
+    free(fs->crc_path);
+    free(fs);
+}
+
+const struct aesd_store_ops aesd_store_file_ops = {
+    .name           = "file",
+    .timestamps     = true,
+    .stable_offsets = true,
+    .flags          = AESD_STORE_CRC | AESD_STORE_KEEP,
+    .open           = file_open,
+    .append         = file_append,
+    .append_batch   = file_append_batch,
+    .append_fd      = file_append_fd,
+    .read_at        = file_read_at,
+    .replay_to_fd   = file_replay,
+    .seek_cmd       = file_seek_cmd,
+    .stats          = file_stats,
+    .close          = file_close,
+};
@@ -0,0 +1,345 @@
+/**
+ * aesd-store-mem.c
+ *
+ * - Backend "mem": records live in an append-only chunked log in memory
+ * - An append reserves its byte range with one atomic fetch-add on
+ *   'reserved', copies into the chunks with no lock held, then publishes by
+ *   advancing 'committed' once every earlier reservation has published;
+ *   an append that has to wait spins briefly, then sleeps on a futex slot
+ *   keyed by its start offset, so each publish wakes only the next append
+ * - Chunks are installed with compare-and-swap and never move or get freed
+ *   before close, so replays read committed bytes without any lock
+ * - A reservation is a compare-and-swap loop that installs the chunks its
+ *   range needs before taking it: a taken range must be published, so
+ *   running out of log or of memory has to be found out before
+ * - Chunks come from aesd_hugemem_alloc(), so aesdsocket -H decides whether
+ *   they are huge pages, prefaulted or locked
+*/
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include "aesd-hugemem.h"
+#include "aesd-store.h"
+
+#define MEM_CHUNK_SHIFT 21                      // 2 MiB chunks, one huge page each
+#define MEM_CHUNK_SIZE  ((size_t)1 << MEM_CHUNK_SHIFT)
+#define MEM_MAX_CHUNKS  8192                    // 16 GiB of log
+#define MEM_MAX_BYTES   ((uint64_t)MEM_MAX_CHUNKS * MEM_CHUNK_SIZE)
+#define COMMIT_SPINS    64                      // spins before sleeping on SMP
+#define COMMIT_SLOTS    64                      // futex slots, power of two
+
+struct commit_slot {
+    atomic_uint seq;                    // futex word, bumped when a publish lands here
+    atomic_uint waiters;                // appends sleeping on seq
+    char pad[56];                       // keep slots on separate cache lines
+};
+
+struct mem_store {
+    _Atomic(char *) chunks[MEM_MAX_CHUNKS];
+    atomic_uint_least64_t reserved;     // next free byte
+    atomic_uint_least64_t committed;    // bytes visible to readers
+    atomic_uint_least64_t appends;
+    atomic_uint_least64_t replays;
+    atomic_uint_least64_t replay_bytes;
+    struct commit_slot slots[COMMIT_SLOTS];
+    unsigned commit_spins;              // 0 on uniprocessors: spinning only delays the owner
+};
+
+static void futex_wait(atomic_uint *addr, unsigned expected)
+{
+    syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, expected, NULL, NULL, 0);
+}
+
+static void futex_wake_all(atomic_uint *addr)
+{
+    syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+}
+
+/* The slot an append starting at off sleeps on; collisions only cause extra wakeups */
+static struct commit_slot *slot_for(struct mem_store *ms, uint64_t off)
+{
+    return &ms->slots[(off * 0x9e3779b97f4a7c15ull) >> 58 & (COMMIT_SLOTS - 1)];
+}
+
+static int mem_open(struct aesd_store *st, const char *path)
+{
+    (void)path;
+    struct mem_store *ms = calloc(1, sizeof(*ms));
+    if (!ms) return -1;
+    ms->commit_spins = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? COMMIT_SPINS : 0;
+    st->priv = ms;
+    return 0;
+}
+
+/*
+ * Return chunk idx, installing a fresh one if nobody has yet; NULL if
+ * none can be allocated.  Losing the race just frees our copy.
+ */
+static char *get_chunk(struct mem_store *ms, size_t idx)
+{
+    char *chunk = atomic_load_explicit(&ms->chunks[idx], memory_order_acquire);
+    if (chunk) return chunk;
+
+    char *fresh = aesd_hugemem_alloc();
+    if (!fresh) return NULL;
+    char *expected = NULL;
+    if (atomic_compare_exchange_strong_explicit(&ms->chunks[idx], &expected, fresh,
+                                                memory_order_acq_rel, memory_order_acquire)) {
+        return fresh;
+    }
+    aesd_hugemem_free(fresh);
+    return expected;
+}
+
+static void copy_in(struct mem_store *ms, uint64_t off, const char *src, size_t len)
+{
+    while (len > 0) {
+        size_t idx = (size_t)(off >> MEM_CHUNK_SHIFT);
+        size_t in_chunk = (size_t)(off & (MEM_CHUNK_SIZE - 1));
+        size_t n = MEM_CHUNK_SIZE - in_chunk;
+        if (n > len) n = len;
+        memcpy(get_chunk(ms, idx) + in_chunk, src, n);
+        off += n;
+        src += n;
+        len -= n;
+    }
+}
+
+/*
+ * Take [start, start+total) of the log, its chunks already installed, so
+ * copying in cannot fail.  Fails with ENOSPC when the chunk table is full
+ * and ENOMEM when a chunk cannot be allocated; nothing is taken then.
+ */
+static int reserve(struct mem_store *ms, uint64_t total, uint64_t *start_rtn)
+{
+    uint64_t start = atomic_load_explicit(&ms->reserved, memory_order_relaxed);
+    do {
+        if (start + total > MEM_MAX_BYTES) {
+            errno = ENOSPC;
+            return -1;
+        }
+        // Chunks left over by a lost race are simply used by a later range
+        uint64_t last = total ? (start + total - 1) >> MEM_CHUNK_SHIFT : 0;
+        for (uint64_t idx = start >> MEM_CHUNK_SHIFT; total && idx <= last; idx++) {
+            if (!get_chunk(ms, (size_t)idx)) {
+                syslog(LOG_ERR, "mem store: chunk allocation failed");
+                errno = ENOMEM;
+                return -1;
+            }
+        }
+    } while (!atomic_compare_exchange_weak_explicit(&ms->reserved, &start, start + total,
+                                                    memory_order_relaxed, memory_order_relaxed));
+    *start_rtn = start;
+    return 0;
+}
+
+/* Make [start, start+total) visible once every earlier reservation is */
+static void publish(struct mem_store *ms, uint64_t start, uint64_t total)
+{
+    // Publish in reservation order: wait for everything before us
+    unsigned spins = 0;
+    while (atomic_load(&ms->committed) != start) {
+        if (++spins <= ms->commit_spins) continue;
+        struct commit_slot *slot = slot_for(ms, start);
+        unsigned seq = atomic_load(&slot->seq);
+        atomic_fetch_add(&slot->waiters, 1);
+        if (atomic_load(&ms->committed) != start) futex_wait(&slot->seq, seq);
+        atomic_fetch_sub(&slot->waiters, 1);
+        spins = 0;
+    }
+    atomic_store(&ms->committed, start + total);
+
+    // Wake whoever reserved the range starting where ours ends
+    struct commit_slot *next = slot_for(ms, start + total);
+    atomic_fetch_add(&next->seq, 1);
+    if (atomic_load(&next->waiters)) futex_wake_all(&next->seq);
+    atomic_fetch_add_explicit(&ms->appends, 1, memory_order_relaxed);
+}
+
+static int mem_append_batch(struct aesd_store *st, const struct iovec *iov, int iovcnt, off_t *end_rtn)
+{
+    struct mem_store *ms = st->priv;
+    uint64_t total = 0, start;
+    for (int i = 0; i < iovcnt; i++) total += iov[i].iov_len;
+
+    if (reserve(ms, total, &start) != 0) return -1;
+    uint64_t off = start;
+    for (int i = 0; i < iovcnt; i++) {
+        copy_in(ms, off, iov[i].iov_base, iov[i].iov_len);
+        off += iov[i].iov_len;
+    }
+    publish(ms, start, total);
+
+    if (end_rtn) *end_rtn = (off_t)(start + total);
+    return 0;
+}
+
+/*
+ * Read the record straight from src_fd into the reserved chunks.  The range
+ * must be published even if the read fails, so the unread remainder is
+ * blanked and ended with '\n' to keep the log line-structured.
+ */
+static int mem_append_fd(struct aesd_store *st, int src_fd, off_t len, off_t *end_rtn)
+{
+    struct mem_store *ms = st->priv;
+    uint64_t start;
+    int rc = 0;
+
+    if (reserve(ms, (uint64_t)len, &start) != 0) return -1;
+    uint64_t off = 0;
+    while (off < (uint64_t)len) {
+        uint64_t pos = start + off;
+        size_t in_chunk = (size_t)(pos & (MEM_CHUNK_SIZE - 1));
+        size_t n = MEM_CHUNK_SIZE - in_chunk;
+        if (n > (uint64_t)len - off) n = (size_t)((uint64_t)len - off);
+        char *dst = get_chunk(ms, (size_t)(pos >> MEM_CHUNK_SHIFT)) + in_chunk;
+        ssize_t r = pread(src_fd, dst, n, (off_t)off);
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) {
+            syslog(LOG_ERR, "mem store: reading spilled record failed");
+            rc = -1;
+            break;
+        }
+        off += (uint64_t)r;
+    }
+    if (rc != 0) {
+        int saved = errno ? errno : EIO;
+        for (; off < (uint64_t)len; off++) copy_in(ms, start + off, " ", 1);
+        copy_in(ms, start + (uint64_t)len - 1, "\n", 1);
+        errno = saved;
+    }
+    publish(ms, start, (uint64_t)len);
+
+    if (end_rtn) *end_rtn = (off_t)(start + (uint64_t)len);
+    return rc;
+}
+
+static int mem_append(struct aesd_store *st, const char *data, size_t len, off_t *end_rtn)
+{
+    struct iovec iov = { .iov_base = (void *)data, .iov_len = len };
+    return mem_append_batch(st, &iov, 1, end_rtn);
+}
+
+static ssize_t mem_read_at(struct aesd_store *st, off_t off, char *buf, size_t len)
+{
+    struct mem_store *ms = st->priv;
+    uint64_t committed = atomic_load_explicit(&ms->committed, memory_order_acquire);
+    uint64_t pos = (uint64_t)off;
+    size_t done = 0;
+
+    if (pos >= committed) return 0;
+    if (len > committed - pos) len = (size_t)(committed - pos);
+    while (done < len) {
+        size_t idx = (size_t)(pos >> MEM_CHUNK_SHIFT);
+        size_t in_chunk = (size_t)(pos & (MEM_CHUNK_SIZE - 1));
+        size_t n = MEM_CHUNK_SIZE - in_chunk;
+        if (n > len - done) n = len - done;
+        const char *chunk = atomic_load_explicit(&ms->chunks[idx], memory_order_acquire);
+        memcpy(buf + done, chunk + in_chunk, n);
+        done += n;
+        pos += n;
+    }
+    return (ssize_t)done;
+}
+
+static int mem_replay(struct aesd_store *st, off_t from, off_t to, int out_fd)
+{
+    struct mem_store *ms = st->priv;
+    uint64_t committed = atomic_load_explicit(&ms->committed, memory_order_acquire);
+    uint64_t end = (to < 0 || (uint64_t)to > committed) ? committed : (uint64_t)to;
+    uint64_t off = (uint64_t)from;
+
+    while (off < end) {
+        size_t idx = (size_t)(off >> MEM_CHUNK_SHIFT);
+        size_t in_chunk = (size_t)(off & (MEM_CHUNK_SIZE - 1));
+        size_t n = MEM_CHUNK_SIZE - in_chunk;
+        if (n > end - off) n = (size_t)(end - off);
+        const char *chunk = atomic_load_explicit(&ms->chunks[idx], memory_order_acquire);
+        if (aesd_send_all(out_fd, chunk + in_chunk, n) != 0) return -1;
+        off += n;
+    }
+    atomic_fetch_add_explicit(&ms->replays, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&ms->replay_bytes, off > (uint64_t)from ? off - (uint64_t)from : 0,
+                              memory_order_relaxed);
+    return 0;
+}
+
+/* memchr across chunk boundaries within [off, end); returns end if not found */
+static uint64_t find_newline(struct mem_store *ms, uint64_t off, uint64_t end)
+{
+    while (off < end) {
+        size_t idx = (size_t)(off >> MEM_CHUNK_SHIFT);
+        size_t in_chunk = (size_t)(off & (MEM_CHUNK_SIZE - 1));
+        size_t n = MEM_CHUNK_SIZE - in_chunk;
+        if (n > end - off) n = (size_t)(end - off);
+        const char *chunk = atomic_load_explicit(&ms->chunks[idx], memory_order_acquire);
+        const char *nl = memchr(chunk + in_chunk, '\n', n);
+        if (nl) return off + (uint64_t)(nl - (chunk + in_chunk));
+        off += n;
+    }
+    return end;
+}
+
+static int mem_seek_cmd(struct aesd_store *st, uint32_t cmd, uint32_t cmd_offset, off_t *pos_rtn)
+{
+    struct mem_store *ms = st->priv;
+    uint64_t end = atomic_load_explicit(&ms->committed, memory_order_acquire);
+    uint64_t start = 0;
+
+    for (uint32_t line = 0; line < cmd && start < end; line++) {
+        start = find_newline(ms, start, end) + 1;
+    }
+    if (start >= end) {
+        errno = EINVAL;
+        return -1;
+    }
+    uint64_t nl = find_newline(ms, start, end);
+    if (nl == end || (uint64_t)cmd_offset > nl - start) {
+        errno = EINVAL;
+        return -1;
+    }
+    *pos_rtn = (off_t)(start + cmd_offset);
+    return 0;
+}
+
+static void mem_stats(struct aesd_store *st, struct aesd_store_stats *out)
+{
+    struct mem_store *ms = st->priv;
+    out->bytes = atomic_load(&ms->committed);
+    out->appends = atomic_load(&ms->appends);
+    out->replays = atomic_load(&ms->replays);
+    out->replay_bytes = atomic_load(&ms->replay_bytes);
+}
+
+static void mem_close(struct aesd_store *st)
+{
+    struct mem_store *ms = st->priv;
+    if (!ms) return;
+    for (size_t i = 0; i < MEM_MAX_CHUNKS; i++) aesd_hugemem_free(atomic_load(&ms->chunks[i]));
+    free(ms);
+}
+
+const struct aesd_store_ops aesd_store_mem_ops = {
+    .name           = "mem",
+    .timestamps     = true,
+    .stable_offsets = true,
+    .open           = mem_open,
+    .append         = mem_append,
+    .append_batch   = mem_append_batch,
+    .append_fd      = mem_append_fd,
+    .read_at        = mem_read_at,
+    .replay_to_fd   = mem_replay,
+    .seek_cmd       = mem_seek_cmd,
+    .stats          = mem_stats,
+    .close          = mem_close,
+};
@@ -0,0 +1,345 @@
+/**
+ * aesd-store.c
+ *
+ * - Backend registry and the front-end wrappers the server calls
+ * - Wrappers are the single place to hook behaviour common to all backends
+ * - The time index is fed from the commit path: the first commit in a new
+ *   wall clock second records where the committed end stood before it, so
+ *   timestamp lines and packets are indexed alike and the cost per commit
+ *   is one vDSO clock read
+ * - A kept store's index is rebuilt from its timestamp lines on open,
+ *   rounded down a line interval so SINCE errs towards replaying more
+*/
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "aesd-store.h"
+
+#define TIME_SCAN_CHUNK 65536
+
+static const struct aesd_store_ops *const g_backends[] = {
+    &aesd_store_file_ops,
+    &aesd_store_chardev_ops,
+    &aesd_store_mem_ops,
+    &aesd_store_dedup_ops,
+};
+
+#define NUM_BACKENDS (sizeof(g_backends) / sizeof(g_backends[0]))
+
+const struct aesd_store_ops *aesd_store_lookup(const char *name)
+{
+    for (size_t i = 0; i < NUM_BACKENDS; i++) {
+        if (strcmp(g_backends[i]->name, name) == 0) return g_backends[i];
+    }
+    return NULL;
+}
+
+const char *aesd_store_names(void)
+{
+    static char names[64];
+    if (names[0] == '\0') {
+        for (size_t i = 0; i < NUM_BACKENDS; i++) {
+            if (i) strncat(names, " ", sizeof(names) - strlen(names) - 1);
+            strncat(names, g_backends[i]->name, sizeof(names) - strlen(names) - 1);
+        }
+    }
+    return names;
+}
+
+/* Append a mark, growing the index; false when out of memory.  time_lock held */
+static bool push_time_mark(struct aesd_store *st, int64_t sec, off_t off)
+{
+    if (st->ntime_marks == st->time_marks_cap) {
+        size_t cap = st->time_marks_cap ? st->time_marks_cap * 2 : 256;
+        struct aesd_time_mark *p = realloc(st->time_marks, cap * sizeof(*p));
+        if (!p) return false;
+        st->time_marks = p;
+        st->time_marks_cap = cap;
+    }
+    st->time_marks[st->ntime_marks++] = (struct aesd_time_mark){ sec, off };
+    atomic_store(&st->time_last, sec);
+    return true;
+}
+
+/* Seconds since the epoch for a timestamp line's text, -1 if it is not one */
+static int64_t parse_timestamp(const char *line, size_t len)
+{
+    char buf[128];
+    struct tm tm = { 0 };
+    size_t plen = strlen(AESD_TIMESTAMP_PREFIX);
+
+    if (len <= plen || len - plen >= sizeof(buf) || memcmp(line, AESD_TIMESTAMP_PREFIX, plen) != 0) return -1;
+    memcpy(buf, line + plen, len - plen);
+    buf[len - plen] = '\0';
+    const char *end = strptime(buf, AESD_TIMESTAMP_FORMAT, &tm);
+    if (!end || *end != '\0') return -1;
+    return (int64_t)timegm(&tm) - tm.tm_gmtoff;
+}
+
+/*
+ * Rebuild the time index of a kept store from the timestamp lines the last
+ * run wrote.  A line at off stamped t says everything before off was
+ * committed by t, but records between two lines could be from any second
+ * in between, so t is marked at the previous line's offset: SINCE rounds
+ * down to a timestamp interval, never past a record it asked for.  The
+ * tail after the last line is marked with the time of this open, and a
+ * store without timestamp lines replays whole.  Runs before any commit.
+ */
+static void recover_time_marks(struct aesd_store *st, off_t end)
+{
+    char *buf = malloc(TIME_SCAN_CHUNK);
+    off_t prev = 0, off = 0;
+    size_t found = 0;
+
+    if (!buf) return;
+    while (off < end) {
+        size_t want = end - off < TIME_SCAN_CHUNK ? (size_t)(end - off) : TIME_SCAN_CHUNK;
+        ssize_t n = aesd_store_read_at(st, off, buf, want);
+        if (n <= 0) break;
+        const char *line = buf, *nl;
+        while ((nl = memchr(line, '\n', (size_t)(buf + n - line)))) {
+            int64_t t = parse_timestamp(line, (size_t)(nl - line));
+            if (t > atomic_load(&st->time_last)) {
+                if (!push_time_mark(st, t, prev)) break;
+                prev = off + (line - buf);
+                found++;
+            }
+            line = nl + 1;
+        }
+        // Carry a partial last line over, unless no line fits the window
+        off += line > buf ? line - buf : n;
+    }
+    free(buf);
+
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    if ((int64_t)ts.tv_sec > atomic_load(&st->time_last)) push_time_mark(st, (int64_t)ts.tv_sec, prev);
+    syslog(LOG_INFO, "store: time index rebuilt from %zu timestamp lines", found);
+}
+
+int aesd_store_open(struct aesd_store *st, const struct aesd_store_ops *ops, const char *path, unsigned flags)
+{
+    pthread_condattr_t attr;
+
+    if (flags & ~ops->flags) {
+        errno = ENOTSUP;
+        return -1;
+    }
+    memset(st, 0, sizeof(*st));
+    st->ops = ops;
+    st->flags = flags;
+    atomic_init(&st->committed, 0);
+    atomic_init(&st->commit_waiters, 0);
+    atomic_init(&st->time_last, 0);
+    pthread_mutex_init(&st->commit_lock, NULL);
+    pthread_mutex_init(&st->time_lock, NULL);
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&st->commit_cond, &attr);
+    pthread_condattr_destroy(&attr);
+    if (ops->open(st, path) != 0) {
+        int saved = errno;
+        pthread_cond_destroy(&st->commit_cond);
+        pthread_mutex_destroy(&st->commit_lock);
+        pthread_mutex_destroy(&st->time_lock);
+        st->ops = NULL;
+        errno = saved;
+        return -1;
+    }
+    if (flags & AESD_STORE_KEEP) {
+        // Whatever the last run left is committed from the start
+        struct aesd_store_stats stats;
+        aesd_store_stats(st, &stats);
+        atomic_store(&st->committed, (int_least64_t)stats.bytes);
+        if (ops->stable_offsets) recover_time_marks(st, (off_t)stats.bytes);
+    }
+    return 0;
+}
+
+/*
+ * Called before a commit is published: every byte below the committed end
+ * was committed no later than now, and every byte above it will be
+ * committed no earlier.  Seconds only move forward in the index, so a
+ * clock stepping back just stretches the current mark.
+ */
+static void note_time(struct aesd_store *st)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);  // not _COARSE: it lags by a tick
+    int64_t now = (int64_t)ts.tv_sec;
+    if (now <= atomic_load(&st->time_last)) return;
+
+    pthread_mutex_lock(&st->time_lock);
+    // Out of memory leaves the index alone; SINCE just rounds down further
+    if (now > atomic_load(&st->time_last)) push_time_mark(st, now, aesd_store_committed(st));
+    pthread_mutex_unlock(&st->time_lock);
+}
+
+off_t aesd_store_since(struct aesd_store *st, time_t since)
+{
+    pthread_mutex_lock(&st->time_lock);
+    size_t lo = 0, hi = st->ntime_marks;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (st->time_marks[mid].sec < (int64_t)since) lo = mid + 1;
+        else hi = mid;
+    }
+    off_t off = lo < st->ntime_marks ? st->time_marks[lo].off : aesd_store_committed(st);
+    pthread_mutex_unlock(&st->time_lock);
+    return off;
+}
+
+/*
+ * Appends can return out of order, but a backend only reports an end once
+ * everything before it is in place, so the highest end seen is committed.
+ * The mutex is only taken when somebody is waiting, keeping the mem
+ * backend's append path lock-free otherwise.
+ */
+static void note_commit(struct aesd_store *st, int rc, off_t end)
+{
+    if (rc != 0 || end < 0) return;
+    if (st->ops->stable_offsets) note_time(st);
+    int_least64_t cur = atomic_load(&st->committed);
+    while (cur < end && !atomic_compare_exchange_weak(&st->committed, &cur, end)) {
+    }
+    if (atomic_load(&st->commit_waiters)) {
+        pthread_mutex_lock(&st->commit_lock);
+        pthread_cond_broadcast(&st->commit_cond);
+        pthread_mutex_unlock(&st->commit_lock);
+    }
+}
+
+int aesd_store_append(struct aesd_store *st, const char *data, size_t len, off_t *end_rtn)
+{
+    off_t end = -1;
+    int rc = st->ops->append(st, data, len, &end);
+    note_commit(st, rc, end);
+    if (end_rtn) *end_rtn = end;
+    return rc;
+}
+
+int aesd_store_append_batch(struct aesd_store *st, const struct iovec *iov, int iovcnt, off_t *end_rtn)
+{
+    off_t end = -1;
+    int rc = st->ops->append_batch(st, iov, iovcnt, &end);
+    note_commit(st, rc, end);
+    if (end_rtn) *end_rtn = end;
+    return rc;
+}
+
+int aesd_store_append_fd(struct aesd_store *st, int src_fd, off_t len, off_t *end_rtn)
+{
+    off_t end = -1;
+    int rc = st->ops->append_fd(st, src_fd, len, &end);
+    note_commit(st, rc, end);
+    if (end_rtn) *end_rtn = end;
+    return rc;
+}
+
+off_t aesd_store_wait_commit(struct aesd_store *st, off_t after, int timeout_ms)
+{
+    struct timespec deadline;
+    off_t cur = aesd_store_committed(st);
+    if (cur > after || timeout_ms <= 0) return cur;
+
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += timeout_ms / 1000;
+    deadline.tv_nsec += (long)(timeout_ms % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    atomic_fetch_add(&st->commit_waiters, 1);
+    pthread_mutex_lock(&st->commit_lock);
+    while ((cur = aesd_store_committed(st)) <= after && !atomic_load(&st->waking)) {
+        if (pthread_cond_timedwait(&st->commit_cond, &st->commit_lock, &deadline) == ETIMEDOUT) {
+            cur = aesd_store_committed(st);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&st->commit_lock);
+    atomic_fetch_sub(&st->commit_waiters, 1);
+    return cur;
+}
+
+void aesd_store_wake_waiters(struct aesd_store *st)
+{
+    pthread_mutex_lock(&st->commit_lock);
+    atomic_store(&st->waking, true);
+    pthread_cond_broadcast(&st->commit_cond);
+    pthread_mutex_unlock(&st->commit_lock);
+}
+
+ssize_t aesd_store_read_at(struct aesd_store *st, off_t off, char *buf, size_t len)
+{
+    return st->ops->read_at(st, off, buf, len);
+}
+
+int aesd_store_replay(struct aesd_store *st, off_t from, off_t to, int out_fd)
+{
+    return st->ops->replay_to_fd(st, from, to, out_fd);
+}
+
+int aesd_store_seek_cmd(struct aesd_store *st, uint32_t cmd, uint32_t cmd_offset, off_t *pos_rtn)
+{
+    return st->ops->seek_cmd(st, cmd, cmd_offset, pos_rtn);
+}
+
+void aesd_store_stats(struct aesd_store *st, struct aesd_store_stats *out)
+{
+    memset(out, 0, sizeof(*out));
+    st->ops->stats(st, out);
+}
+
+void aesd_store_close(struct aesd_store *st)
+{
+    if (!st->ops) return;
+    st->ops->close(st);
+    st->ops = NULL;
+    st->priv = NULL;
+    pthread_cond_destroy(&st->commit_cond);
+    pthread_mutex_destroy(&st->commit_lock);
+    pthread_mutex_destroy(&st->time_lock);
+    free(st->time_marks);
+    st->time_marks = NULL;
+    st->ntime_marks = st->time_marks_cap = 0;
+}
+
+// ---------- shared helpers ----------
+
+int aesd_write_all(int fd, const char *data, size_t len)
+{
+    size_t written = 0;
+    while (written < len) {
+        ssize_t w = write(fd, data + written, len - written);
+        if (w < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        written += (size_t)w;
+    }
+    return 0;
+}
+
+int aesd_send_all(int fd, const char *data, size_t len)
+{
+    size_t off = 0;
+    while (off < len) {
+        ssize_t s = send(fd, data + off, len - off, 0);
+        if (s < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        off += (size_t)s;
+    }
+    return 0;
+}
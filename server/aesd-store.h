@@ -0,0 +1,146 @@
+/*
+ * aesd-store.h
+ *
+ * Storage backends for aesdsocket.  A backend implements struct
+ * aesd_store_ops and the server picks one at startup with -b <name>, so the
+ * network code never needs to know where packets end up.
+ *
+ * Offsets are byte positions in the concatenation of every record appended
+ * so far.  All ops return 0 on success and -1 with errno set on failure.
+ */
+
+#ifndef AESD_STORE_H
+#define AESD_STORE_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+struct aesd_store;
+
+/* aesd_store_open() flags; a backend lists those it honours in ops->flags */
+#define AESD_STORE_CRC  0x1     /* frame every record with its length and CRC-32C */
+#define AESD_STORE_KEEP 0x2     /* reuse (and validate) the last run's store, leave it on close */
+
+/* strftime format of the server's timestamp lines, parsed back for a kept store */
+#define AESD_TIMESTAMP_PREFIX "timestamp:"
+#define AESD_TIMESTAMP_FORMAT "%a, %d %b %Y %H:%M:%S %z"
+
+/* Framed stores keep their frames next to the data, in path + this suffix */
+#define AESD_STORE_CRC_SUFFIX ".crc"
+
+struct aesd_store_stats {
+    uint64_t bytes;         /* bytes currently held by the store */
+    uint64_t stored_bytes;  /* bytes it takes to hold them, 0 unless deduplicated */
+    uint64_t appends;       /* records appended */
+    uint64_t replays;       /* replays served */
+    uint64_t replay_bytes;  /* bytes sent by replays */
+};
+
+struct aesd_store_ops {
+    /* Name used to select the backend on the command line */
+    const char *name;
+    /* True if the server should append the 10 s timestamp lines */
+    bool timestamps;
+    /* True if offsets never move once returned (not the case for a ring) */
+    bool stable_offsets;
+    /* AESD_STORE_* open flags supported */
+    unsigned flags;
+    /* Create an empty store; path NULL selects the backend default */
+    int  (*open)(struct aesd_store *st, const char *path);
+    /* Append one complete record; *end_rtn (if set) gets the offset past it */
+    int  (*append)(struct aesd_store *st, const char *data, size_t len, off_t *end_rtn);
+    /* Append several records as one contiguous, uninterleaved write */
+    int  (*append_batch)(struct aesd_store *st, const struct iovec *iov, int iovcnt, off_t *end_rtn);
+    /* Append one complete record of len bytes read from src_fd (from offset 0) */
+    int  (*append_fd)(struct aesd_store *st, int src_fd, off_t len, off_t *end_rtn);
+    /* Copy up to len committed bytes at off into buf; returns the count, 0 at the end */
+    ssize_t (*read_at)(struct aesd_store *st, off_t off, char *buf, size_t len);
+    /* Send bytes [from, to) to out_fd; to < 0 sends up to the current end */
+    int  (*replay_to_fd)(struct aesd_store *st, off_t from, off_t to, int out_fd);
+    /* Translate a zero referenced (write command, byte in command) into an offset */
+    int  (*seek_cmd)(struct aesd_store *st, uint32_t cmd, uint32_t cmd_offset, off_t *pos_rtn);
+    void (*stats)(struct aesd_store *st, struct aesd_store_stats *out);
+    void (*close)(struct aesd_store *st);
+};
+
+/* Everything at or after off was committed during second sec or later */
+struct aesd_time_mark {
+    int64_t sec;
+    off_t off;
+};
+
+struct aesd_store {
+    const struct aesd_store_ops *ops;
+    void *priv;             /* backend private state */
+    unsigned flags;         /* AESD_STORE_* given to aesd_store_open() */
+
+    /* Highest end offset returned by an append, see aesd_store_wait_commit() */
+    atomic_int_least64_t committed;
+    atomic_uint commit_waiters;
+    atomic_bool waking;     /* aesd_store_wake_waiters() was called: waits return at once */
+    pthread_mutex_t commit_lock;
+    pthread_cond_t commit_cond;
+
+    /* One mark per wall clock second with commits, see aesd_store_since() */
+    atomic_int_least64_t time_last;
+    pthread_mutex_t time_lock;
+    struct aesd_time_mark *time_marks;
+    size_t ntime_marks;
+    size_t time_marks_cap;
+};
+
+extern const struct aesd_store_ops aesd_store_file_ops;
+extern const struct aesd_store_ops aesd_store_chardev_ops;
+extern const struct aesd_store_ops aesd_store_mem_ops;
+extern const struct aesd_store_ops aesd_store_dedup_ops;
+
+/* Find a backend by name, NULL if there is none */
+const struct aesd_store_ops *aesd_store_lookup(const char *name);
+/* Space separated list of backend names for usage messages */
+const char *aesd_store_names(void);
+
+/* Fails with ENOTSUP if the backend does not honour every flag */
+int  aesd_store_open(struct aesd_store *st, const struct aesd_store_ops *ops, const char *path, unsigned flags);
+int  aesd_store_append(struct aesd_store *st, const char *data, size_t len, off_t *end_rtn);
+int  aesd_store_append_batch(struct aesd_store *st, const struct iovec *iov, int iovcnt, off_t *end_rtn);
+int  aesd_store_append_fd(struct aesd_store *st, int src_fd, off_t len, off_t *end_rtn);
+ssize_t aesd_store_read_at(struct aesd_store *st, off_t off, char *buf, size_t len);
+int  aesd_store_replay(struct aesd_store *st, off_t from, off_t to, int out_fd);
+int  aesd_store_seek_cmd(struct aesd_store *st, uint32_t cmd, uint32_t cmd_offset, off_t *pos_rtn);
+void aesd_store_stats(struct aesd_store *st, struct aesd_store_stats *out);
+void aesd_store_close(struct aesd_store *st);
+
+/*
+ * Every byte below the returned offset has been appended and will not
+ * change.  Backends without stable offsets (chardev) never advance it.
+ */
+static inline off_t aesd_store_committed(struct aesd_store *st)
+{
+    return (off_t)atomic_load(&st->committed);
+}
+/* Wait up to timeout_ms for the committed offset to pass after; returns it */
+off_t aesd_store_wait_commit(struct aesd_store *st, off_t after, int timeout_ms);
+/* Return every aesd_store_wait_commit() caller early, now and from then on (shutdown) */
+void aesd_store_wake_waiters(struct aesd_store *st);
+/*
+ * Offset of the first record committed at or after since (seconds since
+ * the epoch), found by binary search over the time index; the committed
+ * end if there is none.  Exact to the second, and only kept for backends
+ * with stable offsets (0 otherwise).  What a kept store held at open is
+ * indexed by its timestamp lines, so SINCE may start one interval early.
+ */
+off_t aesd_store_since(struct aesd_store *st, time_t since);
+
+/* Chunk size used when a backend copies a record in from a file */
+#define AESD_STORE_COPY_CHUNK (64 * 1024)
+
+/* Helpers shared by the backends: loop until everything is written/sent */
+int aesd_write_all(int fd, const char *data, size_t len);
+int aesd_send_all(int fd, const char *data, size_t len);
+
+#endif /* AESD_STORE_H */
@@ -0,0 +1,290 @@
+/**
+ * aesd-tls.c
+ *
+ * - One SSL_CTX for the process; SSL_OP_ENABLE_KTLS makes OpenSSL install
+ *   the session keys with setsockopt(TCP_ULP, "tls") once the handshake
+ *   is done, for each direction the kernel supports
+ * - Full kTLS: the server uses the socket as if it were plaintext
+ * - Otherwise a pump thread owns the SSL object: it decrypts into a
+ *   socketpair for the server to read and, in "user" mode, encrypts what
+ *   the server writes to it.  Decrypted data waits in the pump when the
+ *   server is busy writing, so a client pipelining large requests cannot
+ *   deadlock the pair
+*/
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#ifdef HAVE_OPENSSL
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+#endif
+
+#include "aesd-budget.h"
+#include "aesd-store.h"
+#include "aesd-tls.h"
+
+#ifdef HAVE_OPENSSL
+
+#define PUMP_CHUNK (64 * 1024)
+#define PUMP_STACK_SIZE (128 * 1024)
+#define PUMP_COST (PUMP_STACK_SIZE + 2 * PUMP_CHUNK)    // charged to the budget per pump
+#define HANDSHAKE_TIMEOUT_S 10
+
+struct aesd_tls {
+    SSL *ssl;
+    int fd;                 // TCP socket
+    int app_fd;             // server end of the socketpair, -1 under full kTLS
+    int pump_fd;            // pump end
+    bool ktls_tx;
+    bool ktls_rx;
+    pthread_t pump;
+    bool pump_started;
+};
+
+static SSL_CTX *g_ctx;
+static atomic_uint_least64_t g_sessions[3];     // full kTLS, kTLS tx only, userspace
+
+static void log_ssl_error(const char *what)
+{
+    char buf[256];
+    unsigned long e = ERR_get_error();
+    ERR_error_string_n(e, buf, sizeof(buf));
+    syslog(LOG_ERR, "%s: %s", what, e ? buf : strerror(errno));
+    ERR_clear_error();
+}
+
+int aesd_tls_init(const char *cert, const char *key, bool want_ktls)
+{
+    g_ctx = SSL_CTX_new(TLS_server_method());
+    if (!g_ctx) {
+        log_ssl_error("SSL_CTX_new");
+        return -1;
+    }
+    SSL_CTX_set_min_proto_version(g_ctx, TLS1_2_VERSION);
+    // TLS 1.2 suites the kernel can offload; the TLS 1.3 defaults all qualify
+    SSL_CTX_set_cipher_list(g_ctx, "ECDHE+AESGCM:ECDHE+CHACHA20");
+    if (want_ktls) SSL_CTX_set_options(g_ctx, SSL_OP_ENABLE_KTLS);
+    if (SSL_CTX_use_certificate_chain_file(g_ctx, cert) != 1 ||
+        SSL_CTX_use_PrivateKey_file(g_ctx, key, SSL_FILETYPE_PEM) != 1 ||
+        SSL_CTX_check_private_key(g_ctx) != 1) {
+        log_ssl_error("loading TLS certificate/key");
+        SSL_CTX_free(g_ctx);
+        g_ctx = NULL;
+        errno = EINVAL;
+        return -1;
+    }
+    return 0;
+}
+
+static int ssl_write_all(SSL *ssl, const char *buf, size_t len)
+{
+    while (len > 0) {
+        int n = SSL_write(ssl, buf, len > INT32_MAX ? INT32_MAX : (int)len);
+        if (n <= 0) return -1;
+        buf += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+static void *pump_thread(void *arg)
+{
+    struct aesd_tls *t = arg;
+    char *rx = malloc(PUMP_CHUNK), *tx = malloc(PUMP_CHUNK);
+    size_t rx_len = 0, rx_off = 0;
+    bool rx_open = true;
+
+    while (rx && tx) {
+        bool pending = rx_open && rx_len == 0 && SSL_pending(t->ssl) > 0;
+        struct pollfd pfd[2] = {
+            { .fd = t->fd, .events = (rx_open && rx_len == 0) ? POLLIN : 0 },
+            { .fd = t->pump_fd, .events = POLLIN | (rx_len ? POLLOUT : 0) },
+        };
+        if (!pending && poll(pfd, 2, -1) < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+
+        // Client -> server: decrypt one record's worth, then hand it over
+        if (pending || (pfd[0].revents & (POLLIN | POLLHUP | POLLERR))) {
+            int n = SSL_read(t->ssl, rx, PUMP_CHUNK);
+            if (n > 0) {
+                rx_len = (size_t)n;
+                rx_off = 0;
+            } else {
+                rx_open = false;    // close_notify, reset or shutdown by the server
+                shutdown(t->pump_fd, SHUT_WR);
+            }
+        }
+        if (rx_len) {
+            ssize_t w = send(t->pump_fd, rx + rx_off, rx_len - rx_off, MSG_DONTWAIT);
+            if (w < 0 && errno != EAGAIN && errno != EINTR) break;
+            if (w > 0) rx_off += (size_t)w;
+            if (rx_off == rx_len) rx_len = 0;
+        }
+
+        // Server -> client: only reaches the pump when the kernel does not send
+        if (pfd[1].revents & (POLLIN | POLLHUP | POLLERR)) {
+            ssize_t n = recv(t->pump_fd, tx, PUMP_CHUNK, MSG_DONTWAIT);
+            if (n < 0 && (errno == EAGAIN || errno == EINTR)) continue;
+            if (n <= 0) break;      // server is done with the connection
+            if (ssl_write_all(t->ssl, tx, (size_t)n) != 0) break;
+        }
+    }
+    // However the pump stopped, a server thread blocked on app_fd gets EOF/EPIPE
+    shutdown(t->pump_fd, SHUT_RDWR);
+    free(rx);
+    free(tx);
+    return NULL;
+}
+
+struct aesd_tls *aesd_tls_accept(int fd, int *rfd, int *wfd)
+{
+    struct aesd_tls *t = calloc(1, sizeof(*t));
+    struct timeval tv = { .tv_sec = HANDSHAKE_TIMEOUT_S, .tv_usec = 0 };
+    struct timeval none = { 0 };
+    pthread_attr_t attr;
+    int sv[2];
+
+    if (!t || !g_ctx) {
+        free(t);
+        return NULL;
+    }
+    t->fd = fd;
+    t->app_fd = t->pump_fd = -1;
+    t->ssl = SSL_new(g_ctx);
+    if (!t->ssl || SSL_set_fd(t->ssl, fd) != 1) goto fail;
+
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    if (SSL_accept(t->ssl) != 1) {
+        log_ssl_error("TLS handshake");
+        goto fail;
+    }
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &none, sizeof(none));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &none, sizeof(none));
+
+    t->ktls_tx = BIO_get_ktls_send(SSL_get_wbio(t->ssl));
+    t->ktls_rx = BIO_get_ktls_recv(SSL_get_rbio(t->ssl));
+    if (t->ktls_tx && t->ktls_rx) {
+        atomic_fetch_add(&g_sessions[0], 1);
+        *rfd = *wfd = fd;
+        return t;
+    }
+
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) != 0) goto fail;
+    t->app_fd = sv[0];
+    t->pump_fd = sv[1];
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, PUMP_STACK_SIZE);
+    aesd_budget_charge(AESD_BUDGET_TLS, PUMP_COST);
+    t->pump_started = pthread_create(&t->pump, &attr, pump_thread, t) == 0;
+    pthread_attr_destroy(&attr);
+    if (!t->pump_started) {
+        aesd_budget_release(AESD_BUDGET_TLS, PUMP_COST);
+        goto fail;
+    }
+    atomic_fetch_add(&g_sessions[t->ktls_tx ? 1 : 2], 1);
+    *rfd = t->app_fd;
+    *wfd = t->ktls_tx ? fd : t->app_fd;
+    return t;
+
+fail:
+    if (t->app_fd >= 0) close(t->app_fd);
+    if (t->pump_fd >= 0) close(t->pump_fd);
+    SSL_free(t->ssl);
+    free(t);
+    return NULL;
+}
+
+size_t aesd_tls_pump_cost(void)
+{
+    return PUMP_COST;
+}
+
+const char *aesd_tls_mode(const struct aesd_tls *t)
+{
+    if (t->ktls_tx && t->ktls_rx) return "ktls";
+    return t->ktls_tx ? "ktls-tx" : "user";
+}
+
+void aesd_tls_close(struct aesd_tls *t)
+{
+    if (!t) return;
+    if (t->pump_started) {
+        // EOF on the pair tells the pump the server is done
+        shutdown(t->app_fd, SHUT_RDWR);
+        pthread_join(t->pump, NULL);
+        aesd_budget_release(AESD_BUDGET_TLS, PUMP_COST);
+    }
+    if (t->app_fd >= 0) close(t->app_fd);
+    if (t->pump_fd >= 0) close(t->pump_fd);
+    SSL_shutdown(t->ssl);
+    SSL_free(t->ssl);
+    ERR_clear_error();
+    free(t);
+}
+
+void aesd_tls_cleanup(void)
+{
+    if (!g_ctx) return;
+    syslog(LOG_INFO, "TLS sessions: %llu kTLS, %llu kTLS send only, %llu userspace",
+           (unsigned long long)atomic_load(&g_sessions[0]),
+           (unsigned long long)atomic_load(&g_sessions[1]),
+           (unsigned long long)atomic_load(&g_sessions[2]));
+    SSL_CTX_free(g_ctx);
+    g_ctx = NULL;
+}
+
+#else /* !HAVE_OPENSSL */
+
+int aesd_tls_init(const char *cert, const char *key, bool want_ktls)
+{
+    (void)cert;
+    (void)key;
+    (void)want_ktls;
+    errno = ENOTSUP;
+    return -1;
+}
+
+struct aesd_tls *aesd_tls_accept(int fd, int *rfd, int *wfd)
+{
+    (void)fd;
+    (void)rfd;
+    (void)wfd;
+    return NULL;
+}
+
+size_t aesd_tls_pump_cost(void)
+{
+    return 0;
+}
+
+const char *aesd_tls_mode(const struct aesd_tls *t)
+{
+    (void)t;
+    return "none";
+}
+
+void aesd_tls_close(struct aesd_tls *t)
+{
+    (void)t;
+}
+
+void aesd_tls_cleanup(void)
+{
+}
+
+#endif /* HAVE_OPENSSL */
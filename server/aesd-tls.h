@@ -0,0 +1,36 @@
+/*
+ * aesd-tls.h
+ *
+ * Optional TLS for aesdsocket connections (OpenSSL, HAVE_OPENSSL).  After
+ * the handshake OpenSSL is asked to hand the record layer to the kernel
+ * (kTLS, TCP_ULP "tls").  Where the kernel does the crypto the server keeps
+ * using the socket directly, so replays still go out with sendfile();
+ * otherwise a pump thread moves plaintext between the TLS session and a
+ * socketpair that the rest of the server reads and writes instead.
+ */
+
+#ifndef AESD_TLS_H
+#define AESD_TLS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+struct aesd_tls;
+
+/* Load the server certificate and key; ENOTSUP when built without OpenSSL */
+int  aesd_tls_init(const char *cert, const char *key, bool want_ktls);
+/*
+ * Handshake on fd.  *rfd and *wfd get the descriptors to read and write
+ * plaintext on: fd itself for each direction the kernel handles, a
+ * socketpair end otherwise.  NULL on failure.
+ */
+struct aesd_tls *aesd_tls_accept(int fd, int *rfd, int *wfd);
+/* "ktls", "ktls-tx" (kernel sends, OpenSSL receives) or "user" */
+const char *aesd_tls_mode(const struct aesd_tls *t);
+/* Budget charged per pump thread (its stack and buffers); 0 without OpenSSL */
+size_t aesd_tls_pump_cost(void);
+/* Stop the pump, send close_notify and free the session; fd stays open */
+void aesd_tls_close(struct aesd_tls *t);
+void aesd_tls_cleanup(void);
+
+#endif /* AESD_TLS_H */
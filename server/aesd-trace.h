@@ -0,0 +1,42 @@
+/*
+ * aesd-trace.h
+ *
+ * USDT probes (provider "aesdsocket") for tracing a running server with
+ * bpftrace or perf instead of adding syslog lines.  With HAVE_SDT, which
+ * the Makefile sets when <sys/sdt.h> is found (systemtap-sdt-dev), each
+ * probe is a single nop plus a note describing where its arguments live;
+ * arguments are values already in registers or on the stack, so a probe
+ * nobody attached to costs nothing measurable.  Without it they compile
+ * to nothing.
+ *
+ * Probes and arguments ("fd" is always the accepted socket):
+ *   accept        fd, tls
+ *   frame         fd, len, spilled        a complete packet, before handling
+ *   append_start  fd, len, records
+ *   append_end    fd, len, end offset, rc
+ *   replay_start  fd, from, to            to < 0: up to the committed end
+ *   replay_end    fd, bytes, rc           bytes: store bytes sent; compressed and
+ *                                         chardev replies give the span asked
+ *                                         for, however much of it went out
+ *   close         fd, packets, lifetime in us
+ * Latencies are taken in the tracer from the start/end pairs, which always
+ * run on the same thread.  See server/trace/ for bpftrace scripts; with
+ * perf, "perf buildid-cache --add aesdsocket" then
+ * "perf probe sdt_aesdsocket:append_start" and so on makes them events.
+ */
+
+#ifndef AESD_TRACE_H
+#define AESD_TRACE_H
+
+#ifdef HAVE_SDT
+#include <sys/sdt.h>
+#define AESD_TRACE2(name, a, b)         DTRACE_PROBE2(aesdsocket, name, a, b)
+#define AESD_TRACE3(name, a, b, c)      DTRACE_PROBE3(aesdsocket, name, a, b, c)
+#define AESD_TRACE4(name, a, b, c, d)   DTRACE_PROBE4(aesdsocket, name, a, b, c, d)
+#else
+#define AESD_TRACE2(name, a, b)         do { } while (0)
+#define AESD_TRACE3(name, a, b, c)      do { } while (0)
+#define AESD_TRACE4(name, a, b, c, d)   do { } while (0)
+#endif
+
+#endif /* AESD_TRACE_H */
@@ -0,0 +1,485 @@
+/**
+ * aesd-zcache.c
+ *
+ * - Codecs: gzip (zlib, HAVE_ZLIB) and zstd (HAVE_ZSTD); the Makefile
+ *   enables whichever the toolchain has
+ * - The open segment is compressed with a sync flush after every catch-up,
+ *   so its bytes so far always end on a block boundary.  Appending an empty
+ *   final block (plus the gzip trailer) closes it into a valid frame
+ *   without touching the compressor
+ * - Catch-up runs under the cache lock when a compressed reply is asked
+ *   for; sending happens outside it from a snapshot, since sealed frames
+ *   never change and the open one is copied
+ * - With a wait hook sends do not block: on EAGAIN the caller waits for
+ *   the socket its own way (aesdsocket gives up its -q slot meanwhile)
+*/
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <syslog.h>
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "aesd-zcache.h"
+
+#define ZC_READ_CHUNK (64 * 1024)
+#define ZC_TAIL_MAX   16
+
+struct zbuf {
+    unsigned char *data;
+    size_t len;
+    size_t cap;
+};
+
+/* One compressor producing one frame at a time into out */
+struct zstream {
+    struct zbuf out;
+    uint64_t raw;           // raw bytes in the current frame
+#ifdef HAVE_ZLIB
+    z_stream zs;
+    uLong crc;
+#endif
+#ifdef HAVE_ZSTD
+    ZSTD_CCtx *cctx;
+#endif
+};
+
+struct zcodec {
+    const char *name;
+    int  (*init)(struct zstream *z);
+    /* Compress and flush to a block boundary */
+    int  (*feed)(struct zstream *z, const char *data, size_t len);
+    /* Finish the frame properly */
+    int  (*finish)(struct zstream *z);
+    /* Bytes that turn a flushed, unfinished frame into a complete one */
+    size_t (*tail)(const struct zstream *z, unsigned char *out);
+    void (*reset)(struct zstream *z);
+    void (*end)(struct zstream *z);
+};
+
+struct aesd_zcache {
+    const struct zcodec *codec;
+    struct aesd_store *st;
+    pthread_mutex_t lock;
+    off_t fed;              // raw bytes compressed so far
+    struct zbuf *segs;      // sealed frames, immutable once added
+    size_t nsegs;
+    size_t segs_cap;
+    uint64_t sealed_raw;
+    uint64_t sealed_len;
+    struct zstream open;    // current segment
+    char *readbuf;
+};
+
+static __attribute__((unused)) int zbuf_reserve(struct zbuf *b, size_t extra)
+{
+    if (b->len + extra <= b->cap) return 0;
+    size_t cap = b->cap ? b->cap : 4096;
+    while (cap < b->len + extra) cap *= 2;
+    unsigned char *tmp = realloc(b->data, cap);
+    if (!tmp) return -1;
+    b->data = tmp;
+    b->cap = cap;
+    return 0;
+}
+
+// ---------- gzip ----------
+
+#ifdef HAVE_ZLIB
+static int gz_init(struct zstream *z)
+{
+    memset(&z->zs, 0, sizeof(z->zs));
+    // windowBits 15 + 16 selects the gzip wrapper
+    if (deflateInit2(&z->zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        errno = ENOMEM;
+        return -1;
+    }
+    z->crc = crc32(0L, Z_NULL, 0);
+    return 0;
+}
+
+static int gz_run(struct zstream *z, const char *data, size_t len, int flush)
+{
+    z->zs.next_in = (Bytef *)data;
+    z->zs.avail_in = (uInt)len;
+    for (;;) {
+        if (zbuf_reserve(&z->out, 16384) != 0) return -1;
+        z->zs.next_out = z->out.data + z->out.len;
+        z->zs.avail_out = (uInt)(z->out.cap - z->out.len);
+        int rc = deflate(&z->zs, flush);
+        z->out.len = z->out.cap - z->zs.avail_out;
+        if (rc == Z_STREAM_END) return 0;
+        if (rc != Z_OK && rc != Z_BUF_ERROR) {
+            errno = EIO;
+            return -1;
+        }
+        // Done once all input is used and deflate had room to spare
+        if (z->zs.avail_in == 0 && z->zs.avail_out != 0 && flush != Z_FINISH) return 0;
+    }
+}
+
+static int gz_feed(struct zstream *z, const char *data, size_t len)
+{
+    z->crc = crc32(z->crc, (const Bytef *)data, (uInt)len);
+    z->raw += len;
+    return gz_run(z, data, len, Z_SYNC_FLUSH);
+}
+
+static int gz_finish(struct zstream *z)
+{
+    return gz_run(z, NULL, 0, Z_FINISH);
+}
+
+static void put_le32(unsigned char *p, uint32_t v)
+{
+    p[0] = (unsigned char)v;
+    p[1] = (unsigned char)(v >> 8);
+    p[2] = (unsigned char)(v >> 16);
+    p[3] = (unsigned char)(v >> 24);
+}
+
+static size_t gz_tail(const struct zstream *z, unsigned char *out)
+{
+    // Empty final fixed-Huffman block, then the gzip trailer: CRC32, ISIZE
+    out[0] = 0x03;
+    out[1] = 0x00;
+    put_le32(out + 2, (uint32_t)z->crc);
+    put_le32(out + 6, (uint32_t)z->raw);
+    return 10;
+}
+
+static void gz_reset(struct zstream *z)
+{
+    deflateReset(&z->zs);
+    z->crc = crc32(0L, Z_NULL, 0);
+}
+
+static void gz_end(struct zstream *z)
+{
+    deflateEnd(&z->zs);
+}
+
+static const struct zcodec gzip_codec = {
+    .name = "gzip", .init = gz_init, .feed = gz_feed, .finish = gz_finish,
+    .tail = gz_tail, .reset = gz_reset, .end = gz_end,
+};
+#endif
+
+// ---------- zstd ----------
+
+#ifdef HAVE_ZSTD
+static int zs_init(struct zstream *z)
+{
+    z->cctx = ZSTD_createCCtx();
+    if (!z->cctx) {
+        errno = ENOMEM;
+        return -1;
+    }
+    // No checksum, so an empty last block is all a flushed frame needs
+    ZSTD_CCtx_setParameter(z->cctx, ZSTD_c_compressionLevel, 3);
+    ZSTD_CCtx_setParameter(z->cctx, ZSTD_c_checksumFlag, 0);
+    return 0;
+}
+
+static int zs_run(struct zstream *z, const char *data, size_t len, ZSTD_EndDirective mode)
+{
+    ZSTD_inBuffer in = { .src = data, .size = len, .pos = 0 };
+    size_t remaining;
+    do {
+        if (zbuf_reserve(&z->out, ZSTD_CStreamOutSize()) != 0) return -1;
+        ZSTD_outBuffer out = { .dst = z->out.data + z->out.len, .size = z->out.cap - z->out.len, .pos = 0 };
+        remaining = ZSTD_compressStream2(z->cctx, &out, &in, mode);
+        if (ZSTD_isError(remaining)) {
+            errno = EIO;
+            return -1;
+        }
+        z->out.len += out.pos;
+    } while (remaining != 0 || in.pos < in.size);
+    return 0;
+}
+
+static int zs_feed(struct zstream *z, const char *data, size_t len)
+{
+    z->raw += len;
+    return zs_run(z, data, len, ZSTD_e_flush);
+}
+
+static int zs_finish(struct zstream *z)
+{
+    return zs_run(z, NULL, 0, ZSTD_e_end);
+}
+
+static size_t zs_tail(const struct zstream *z, unsigned char *out)
+{
+    (void)z;
+    // Block header: Last_Block=1, Block_Type=Raw, Block_Size=0
+    out[0] = 0x01;
+    out[1] = 0x00;
+    out[2] = 0x00;
+    return 3;
+}
+
+static void zs_reset(struct zstream *z)
+{
+    ZSTD_CCtx_reset(z->cctx, ZSTD_reset_session_only);
+}
+
+static void zs_end(struct zstream *z)
+{
+    ZSTD_freeCCtx(z->cctx);
+}
+
+static const struct zcodec zstd_codec = {
+    .name = "zstd", .init = zs_init, .feed = zs_feed, .finish = zs_finish,
+    .tail = zs_tail, .reset = zs_reset, .end = zs_end,
+};
+#endif
+
+static const struct zcodec *const g_codecs[] = {
+#ifdef HAVE_ZSTD
+    &zstd_codec,
+#endif
+#ifdef HAVE_ZLIB
+    &gzip_codec,
+#endif
+    NULL,
+};
+
+const char *aesd_zcache_codecs(void)
+{
+    static char names[32];
+    if (names[0] == '\0') {
+        for (size_t i = 0; g_codecs[i]; i++) {
+            if (i) strncat(names, " ", sizeof(names) - strlen(names) - 1);
+            strncat(names, g_codecs[i]->name, sizeof(names) - strlen(names) - 1);
+        }
+    }
+    return names;
+}
+
+// ---------- stream helpers ----------
+
+static int stream_open(const struct zcodec *codec, struct zstream *z)
+{
+    memset(z, 0, sizeof(*z));
+    return codec->init(z);
+}
+
+static void stream_close(const struct zcodec *codec, struct zstream *z)
+{
+    codec->end(z);
+    free(z->out.data);
+    memset(z, 0, sizeof(*z));
+}
+
+/* Where a reply goes, and how to wait when it would block */
+struct zout {
+    int fd;
+    aesd_zcache_wait_fn wait;
+    void *arg;
+};
+
+/*
+ * A reply goes out in several sends; MSG_MORE on all but the last keeps
+ * Nagle from holding the small tail back until the header is acked.
+ */
+static int send_part(const struct zout *dst, const void *data, size_t len, bool more)
+{
+    const char *p = data;
+    int flags = (more ? MSG_MORE : 0) | (dst->wait ? MSG_DONTWAIT : 0);
+    while (len > 0) {
+        ssize_t s = send(dst->fd, p, len, flags);
+        if (s < 0) {
+            if (errno == EINTR) continue;
+            if (dst->wait && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                if (dst->wait(dst->fd, dst->arg) != 0) return -1;
+                continue;
+            }
+            return -1;
+        }
+        p += s;
+        len -= (size_t)s;
+    }
+    return 0;
+}
+
+static int send_header(const struct zout *dst, uint64_t zlen, uint64_t raw)
+{
+    char hdr[64];
+    int n = snprintf(hdr, sizeof(hdr), "AESDZ %" PRIu64 " %" PRIu64 "\n", zlen, raw);
+    return send_part(dst, hdr, (size_t)n, zlen > 0);
+}
+
+// ---------- cache ----------
+
+struct aesd_zcache *aesd_zcache_new(struct aesd_store *st, const char *codec)
+{
+    const struct zcodec *c = NULL;
+    for (size_t i = 0; g_codecs[i]; i++) {
+        if (strcmp(g_codecs[i]->name, codec) == 0) c = g_codecs[i];
+    }
+    if (!c) {
+        errno = ENOTSUP;
+        return NULL;
+    }
+
+    struct aesd_zcache *zc = calloc(1, sizeof(*zc));
+    if (!zc) return NULL;
+    zc->codec = c;
+    zc->st = st;
+    zc->readbuf = malloc(ZC_READ_CHUNK);
+    if (!zc->readbuf || stream_open(c, &zc->open) != 0) {
+        free(zc->readbuf);
+        free(zc);
+        return NULL;
+    }
+    pthread_mutex_init(&zc->lock, NULL);
+    return zc;
+}
+
+const char *aesd_zcache_name(const struct aesd_zcache *zc)
+{
+    return zc->codec->name;
+}
+
+/* Move the finished open frame to the sealed list; caller holds the lock */
+static int seal(struct aesd_zcache *zc)
+{
+    if (zc->codec->finish(&zc->open) != 0) return -1;
+    if (zc->nsegs == zc->segs_cap) {
+        size_t cap = zc->segs_cap ? zc->segs_cap * 2 : 16;
+        struct zbuf *tmp = realloc(zc->segs, cap * sizeof(*tmp));
+        if (!tmp) return -1;
+        zc->segs = tmp;
+        zc->segs_cap = cap;
+    }
+    zc->segs[zc->nsegs++] = zc->open.out;
+    zc->sealed_raw += zc->open.raw;
+    zc->sealed_len += zc->open.out.len;
+    memset(&zc->open.out, 0, sizeof(zc->open.out));
+    zc->open.raw = 0;
+    zc->codec->reset(&zc->open);
+    return 0;
+}
+
+/* Compress whatever was committed since the last call; caller holds the lock */
+static int catch_up(struct aesd_zcache *zc)
+{
+    off_t end = aesd_store_committed(zc->st);
+    while (zc->fed < end) {
+        size_t want = (size_t)(end - zc->fed);
+        if (want > ZC_READ_CHUNK) want = ZC_READ_CHUNK;
+        if (want > AESD_ZCACHE_SEGMENT - zc->open.raw) want = (size_t)(AESD_ZCACHE_SEGMENT - zc->open.raw);
+        ssize_t r = aesd_store_read_at(zc->st, zc->fed, zc->readbuf, want);
+        if (r <= 0) {
+            if (r == 0) errno = EIO;
+            return -1;
+        }
+        if (zc->codec->feed(&zc->open, zc->readbuf, (size_t)r) != 0) return -1;
+        zc->fed += r;
+        if (zc->open.raw == AESD_ZCACHE_SEGMENT && seal(zc) != 0) return -1;
+    }
+    return 0;
+}
+
+int aesd_zcache_send(struct aesd_zcache *zc, int out_fd, aesd_zcache_wait_fn wait, void *arg)
+{
+    struct zout dst = { out_fd, wait, arg };
+    struct zbuf *segs = NULL;
+    unsigned char *open = NULL;
+    size_t nsegs, open_len = 0;
+    uint64_t zlen, raw;
+    int rc = -1;
+
+    pthread_mutex_lock(&zc->lock);
+    if (catch_up(zc) != 0) {
+        syslog(LOG_ERR, "%s cache: catching up failed: %s", zc->codec->name, strerror(errno));
+        pthread_mutex_unlock(&zc->lock);
+        return -1;
+    }
+    nsegs = zc->nsegs;
+    segs = malloc((nsegs ? nsegs : 1) * sizeof(*segs));
+    if (zc->open.raw > 0) open = malloc(zc->open.out.len + ZC_TAIL_MAX);
+    if (!segs || (zc->open.raw > 0 && !open)) {
+        pthread_mutex_unlock(&zc->lock);
+        goto out;
+    }
+    memcpy(segs, zc->segs, nsegs * sizeof(*segs));
+    if (open) {
+        memcpy(open, zc->open.out.data, zc->open.out.len);
+        open_len = zc->open.out.len + zc->codec->tail(&zc->open, open + zc->open.out.len);
+    }
+    zlen = zc->sealed_len + open_len;
+    raw = zc->sealed_raw + zc->open.raw;
+    pthread_mutex_unlock(&zc->lock);
+
+    if (send_header(&dst, zlen, raw) != 0) goto out;
+    for (size_t i = 0; i < nsegs; i++) {
+        if (send_part(&dst, segs[i].data, segs[i].len, i + 1 < nsegs || open_len) != 0) goto out;
+    }
+    if (open_len && send_part(&dst, open, open_len, false) != 0) goto out;
+    rc = 0;
+
+out:
+    free(open);
+    free(segs);
+    return rc;
+}
+
+int aesd_zcache_send_range(struct aesd_zcache *zc, off_t from, off_t to, int out_fd,
+                           aesd_zcache_wait_fn wait, void *arg)
+{
+    struct zout dst = { out_fd, wait, arg };
+    struct zstream z;
+    char *buf = malloc(ZC_READ_CHUNK);
+    int rc = -1;
+
+    if (!buf) return -1;
+    if (stream_open(zc->codec, &z) != 0) {
+        free(buf);
+        return -1;
+    }
+    while (to < 0 || from < to) {
+        size_t want = ZC_READ_CHUNK;
+        if (to >= 0 && (off_t)want > to - from) want = (size_t)(to - from);
+        ssize_t r = aesd_store_read_at(zc->st, from, buf, want);
+        if (r < 0) goto out;
+        if (r == 0) break;
+        if (zc->codec->feed(&z, buf, (size_t)r) != 0) goto out;
+        from += r;
+    }
+    if (zc->codec->finish(&z) != 0) goto out;
+    if (send_header(&dst, z.out.len, z.raw) != 0) goto out;
+    rc = send_part(&dst, z.out.data, z.out.len, false);
+
+out:
+    stream_close(zc->codec, &z);
+    free(buf);
+    return rc;
+}
+
+void aesd_zcache_free(struct aesd_zcache *zc)
+{
+    if (!zc) return;
+    syslog(LOG_INFO, "%s cache: %" PRIu64 " raw bytes in %zu sealed segments -> %" PRIu64 " bytes",
+           zc->codec->name, zc->sealed_raw, zc->nsegs, zc->sealed_len);
+    for (size_t i = 0; i < zc->nsegs; i++) free(zc->segs[i].data);
+    free(zc->segs);
+    stream_close(zc->codec, &zc->open);
+    free(zc->readbuf);
+    pthread_mutex_destroy(&zc->lock);
+    free(zc);
+}
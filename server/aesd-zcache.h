@@ -0,0 +1,43 @@
+/*
+ * aesd-zcache.h
+ *
+ * Compressed form of an aesd store for clients that negotiate compression.
+ * The store is compressed in segments of AESD_ZCACHE_SEGMENT raw bytes; a
+ * full segment is sealed into a standalone frame (gzip member or zstd
+ * frame) and kept, and the open segment is kept as a flushed stream that a
+ * few synthetic bytes turn into a complete frame.  Every stored byte is
+ * therefore compressed once, no matter how many replies include it, and a
+ * reply is the concatenation of the cached frames.
+ *
+ * Compressed replies are sent as "AESDZ <compressed len> <raw len>\n"
+ * followed by that many bytes of concatenated frames.
+ */
+
+#ifndef AESD_ZCACHE_H
+#define AESD_ZCACHE_H
+
+#include "aesd-store.h"
+
+#define AESD_ZCACHE_SEGMENT (256 * 1024)
+
+struct aesd_zcache;
+
+/*
+ * Called with the reply's descriptor when a send would block; returns 0
+ * once it takes more, -1 to abandon the reply.  With NULL sends block.
+ */
+typedef int (*aesd_zcache_wait_fn)(int fd, void *arg);
+
+/* Space separated codec names built into this binary, "" if none */
+const char *aesd_zcache_codecs(void);
+/* Cache for st using codec; NULL with errno ENOTSUP if it is not built in */
+struct aesd_zcache *aesd_zcache_new(struct aesd_store *st, const char *codec);
+const char *aesd_zcache_name(const struct aesd_zcache *zc);
+/* Send the whole committed store from the cache, compressing only new bytes */
+int  aesd_zcache_send(struct aesd_zcache *zc, int out_fd, aesd_zcache_wait_fn wait, void *arg);
+/* Compress [from, to) on the fly (to < 0: to the end) for ranged replies */
+int  aesd_zcache_send_range(struct aesd_zcache *zc, off_t from, off_t to, int out_fd,
+                            aesd_zcache_wait_fn wait, void *arg);
+void aesd_zcache_free(struct aesd_zcache *zc);
+
+#endif /* AESD_ZCACHE_H */
@@ -0,0 +1,616 @@
+/**
+ * aesdbench.c
+ *
+ * - Load generator for aesdsocket (port 9000 by default)
+ * - Each client thread opens one connection and sends -n packets of -s bytes
+ * - Every packet carries a unique tag; a request completes once the replay
+ *   containing that tag has been received
+ * - -z <codec> negotiates compressed replies; a request then completes
+ *   when the whole "AESDZ <len> <raw>" frame has arrived, and the result
+ *   reports wire bytes next to the raw bytes they stood for
+ * - -r (read mode) opens a connection per request, sends "\n", half-closes
+ *   and reads the replay to EOF; meant for read-only followers
+ * - -a asks for reply=ack: a request completes on its "AESDACK <end>"
+ *   line, so the numbers show the cost of storing rather than replaying
+ * - -T talks TLS to the server's TLS listener (no certificate checks, this
+ *   is a benchmark); combined with -r each request pays a full handshake
+ * - -w <ms> measures a cold start instead: it keeps trying to connect for
+ *   up to that long, sends one packet and reports the time from its own
+ *   start to the connection and to the reply (run it right as the server
+ *   or its activator is launched)
+ * - -k holds -c idle connections instead, each confirmed by a reply=ack
+ *   round trip so the server has taken it on, prints a line once they are
+ *   all open and exits when the server has closed every one of them
+ * - Prints a summary plus one "key=value" line so scripts can parse results
+*/
+
+#define _POSIX_C_SOURCE 200809L
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <netdb.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef HAVE_OPENSSL
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+#endif
+
+#define DEFAULT_HOST "127.0.0.1"
+#define DEFAULT_PORT "9000"
+#define RECV_CHUNK 65536
+#define RECV_TIMEOUT_S 10
+
+struct bench_config {
+    const char *host;
+    const char *port;
+    int clients;
+    int requests;
+    size_t size;
+    bool read_mode;
+    bool tls;
+    bool ack;
+    const char *codec;
+    int wait_ms;            // -w: first-reply mode
+    bool hold;              // -k: idle connections until the server closes them
+};
+
+/* A server connection, plain or TLS */
+struct conn {
+    int fd;
+#ifdef HAVE_OPENSSL
+    SSL *ssl;
+#endif
+};
+
+struct client_result {
+    int id;
+    const struct bench_config *cfg;
+    uint64_t *lat_ns;       // one entry per completed request
+    int completed;
+    int errors;
+    uint64_t bytes_sent;
+    uint64_t bytes_recv;
+    uint64_t bytes_raw;     // uncompressed size of the replies
+};
+
+#ifdef HAVE_OPENSSL
+static SSL_CTX *g_tls_ctx;
+#endif
+
+// ---------- utility ----------
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static int connect_to(const char *host, const char *port)
+{
+    struct addrinfo hints, *res = NULL, *rp;
+    int fd = -1;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    int rc = getaddrinfo(host, port, &hints, &res);
+    if (rc != 0) {
+        fprintf(stderr, "getaddrinfo(%s:%s): %s\n", host, port, gai_strerror(rc));
+        return -1;
+    }
+    for (rp = res; rp; rp = rp->ai_next) {
+        fd = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol);
+        if (fd < 0) continue;
+        if (connect(fd, rp->ai_addr, rp->ai_addrlen) == 0) break;
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+    if (fd < 0) return -1;
+
+    struct timeval tv = { .tv_sec = RECV_TIMEOUT_S, .tv_usec = 0 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    return fd;
+}
+
+// Connect, plus a TLS handshake when -T was given
+static int conn_open(struct conn *c, const struct bench_config *cfg)
+{
+    c->fd = connect_to(cfg->host, cfg->port);
+    if (c->fd < 0) return -1;
+#ifdef HAVE_OPENSSL
+    c->ssl = NULL;
+    if (cfg->tls) {
+        c->ssl = SSL_new(g_tls_ctx);
+        if (!c->ssl || SSL_set_fd(c->ssl, c->fd) != 1 || SSL_connect(c->ssl) != 1) {
+            ERR_print_errors_fp(stderr);
+            SSL_free(c->ssl);
+            close(c->fd);
+            return -1;
+        }
+    }
+#endif
+    return 0;
+}
+
+static void conn_close(struct conn *c)
+{
+#ifdef HAVE_OPENSSL
+    if (c->ssl) {
+        SSL_shutdown(c->ssl);
+        SSL_free(c->ssl);
+        c->ssl = NULL;
+    }
+#endif
+    close(c->fd);
+    c->fd = -1;
+}
+
+// recv() semantics over either transport: 0 at EOF, -1 with errno set
+static ssize_t conn_recv(struct conn *c, char *buf, size_t len)
+{
+#ifdef HAVE_OPENSSL
+    if (c->ssl) {
+        int r = SSL_read(c->ssl, buf, len > INT32_MAX ? INT32_MAX : (int)len);
+        if (r > 0) return r;
+        if (SSL_get_error(c->ssl, r) == SSL_ERROR_ZERO_RETURN) return 0;
+        errno = EIO;
+        return -1;
+    }
+#endif
+    return recv(c->fd, buf, len, 0);
+}
+
+// No more requests; TLS sends close_notify, which the server treats as EOF
+static int conn_shutdown_wr(struct conn *c)
+{
+#ifdef HAVE_OPENSSL
+    if (c->ssl) return SSL_shutdown(c->ssl) < 0 ? -1 : 0;
+#endif
+    return shutdown(c->fd, SHUT_WR);
+}
+
+static int send_all(struct conn *c, const char *buf, size_t len)
+{
+    size_t off = 0;
+    while (off < len) {
+#ifdef HAVE_OPENSSL
+        if (c->ssl) {
+            int s = SSL_write(c->ssl, buf + off, (int)(len - off));
+            if (s <= 0) return -1;
+            off += (size_t)s;
+            continue;
+        }
+#endif
+        ssize_t s = send(c->fd, buf + off, len - off, 0);
+        if (s < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        off += (size_t)s;
+    }
+    return 0;
+}
+
+// Build "c<id> r<seq> xxxx...\n" of exactly len bytes (len >= 2)
+static void make_packet(char *pkt, size_t len, int id, int seq)
+{
+    int n = snprintf(pkt, len, "c%04d r%08d ", id, seq);
+    size_t used = (n > 0 && (size_t)n < len) ? (size_t)n : len - 1;
+    memset(pkt + used, 'x', len - 1 - used);
+    pkt[len - 1] = '\n';
+}
+
+/*
+ * Read from c until the packet pkt (including its '\n') has been seen.
+ * The last pkt_len-1 bytes of each chunk are carried over so a tag split
+ * across two recv() calls is still found.
+ */
+static int wait_for_packet(struct conn *c, const char *pkt, size_t pkt_len, char *win, uint64_t *recvd)
+{
+    size_t carry = 0;
+    for (;;) {
+        ssize_t r = conn_recv(c, win + carry, RECV_CHUNK);
+        if (r < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        if (r == 0) return -1;
+        *recvd += (uint64_t)r;
+
+        size_t have = carry + (size_t)r;
+        if (memmem(win, have, pkt, pkt_len)) return 0;
+
+        carry = (have >= pkt_len) ? pkt_len - 1 : have;
+        memmove(win, win + have - carry, carry);
+    }
+}
+
+// Read one '\n' terminated line of at most cap-1 bytes, byte by byte
+static int recv_line(struct conn *c, char *line, size_t cap, uint64_t *recvd)
+{
+    size_t n = 0;
+    while (n + 1 < cap) {
+        ssize_t r = conn_recv(c, line + n, 1);
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) return -1;
+        *recvd += 1;
+        if (line[n++] == '\n') {
+            line[n] = '\0';
+            return 0;
+        }
+    }
+    return -1;
+}
+
+// Set option key to value; the server echoes the value it settled on
+static int negotiate(struct conn *c, const char *key, const char *value)
+{
+    char line[128], want[128];
+    uint64_t ignored = 0;
+    int n = snprintf(line, sizeof(line), "AESDSOCKET_OPTION:%s=%s\n", key, value);
+    snprintf(want, sizeof(want), "%s=%s\n", key, value);
+    if (send_all(c, line, (size_t)n) != 0 || recv_line(c, line, sizeof(line), &ignored) != 0) return -1;
+    if (!strstr(line, want)) {
+        fprintf(stderr, "server does not support %s=%s\n", key, value);
+        return -1;
+    }
+    return 0;
+}
+
+// Read one compressed reply: header line, then exactly its payload
+static int wait_for_frame(struct conn *c, char *win, uint64_t *recvd, uint64_t *raw)
+{
+    char line[96];
+    unsigned long long zlen, rlen;
+    if (recv_line(c, line, sizeof(line), recvd) != 0 ||
+        sscanf(line, "AESDZ %llu %llu", &zlen, &rlen) != 2) {
+        return -1;
+    }
+    while (zlen > 0) {
+        ssize_t r = conn_recv(c, win, zlen < RECV_CHUNK ? (size_t)zlen : RECV_CHUNK);
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) return -1;
+        *recvd += (uint64_t)r;
+        zlen -= (uint64_t)r;
+    }
+    *raw += rlen;
+    return 0;
+}
+
+// One read request: the server replays, then closes once it sees our EOF
+static int read_request(const struct bench_config *cfg, char *win, uint64_t *recvd)
+{
+    struct conn c;
+    if (conn_open(&c, cfg) != 0) return -1;
+    int rc = send_all(&c, "\n", 1);
+    if (rc == 0) rc = conn_shutdown_wr(&c);
+    while (rc == 0) {
+        ssize_t r = conn_recv(&c, win, RECV_CHUNK);
+        if (r < 0 && errno == EINTR) continue;
+        if (r < 0) rc = -1;
+        if (r <= 0) break;
+        *recvd += (uint64_t)r;
+    }
+    conn_close(&c);
+    return rc;
+}
+
+// ---------- client thread ----------
+
+static void *client_thread(void *arg)
+{
+    struct client_result *res = (struct client_result *)arg;
+    const struct bench_config *cfg = res->cfg;
+
+    char *pkt = malloc(cfg->size);
+    char *win = malloc(RECV_CHUNK + cfg->size);
+    struct conn c = { .fd = -1 };
+
+    if (cfg->read_mode) {
+        for (int seq = 0; win && seq < cfg->requests; seq++) {
+            uint64_t t0 = now_ns();
+            if (read_request(cfg, win, &res->bytes_recv) != 0) {
+                res->errors++;
+                break;
+            }
+            res->lat_ns[res->completed++] = now_ns() - t0;
+            res->bytes_sent += 1;
+        }
+        goto out;
+    }
+
+    if (conn_open(&c, cfg) == 0 && ((cfg->codec && negotiate(&c, "compress", cfg->codec) != 0) ||
+                                    (cfg->ack && negotiate(&c, "reply", "ack") != 0))) {
+        conn_close(&c);
+    }
+    if (!pkt || !win || c.fd < 0) {
+        fprintf(stderr, "client %d: setup failed\n", res->id);
+        res->errors++;
+        goto out;
+    }
+
+    for (int seq = 0; seq < cfg->requests; seq++) {
+        make_packet(pkt, cfg->size, res->id, seq);
+        uint64_t t0 = now_ns();
+        int rc = send_all(&c, pkt, cfg->size);
+        if (rc == 0 && cfg->ack) rc = recv_line(&c, win, RECV_CHUNK, &res->bytes_recv);
+        else if (rc == 0 && cfg->codec) rc = wait_for_frame(&c, win, &res->bytes_recv, &res->bytes_raw);
+        else if (rc == 0) rc = wait_for_packet(&c, pkt, cfg->size, win, &res->bytes_recv);
+        if (rc != 0) {
+            res->errors++;
+            break;
+        }
+        res->lat_ns[res->completed++] = now_ns() - t0;
+        res->bytes_sent += cfg->size;
+    }
+
+out:
+    if (c.fd >= 0) conn_close(&c);
+    free(win);
+    free(pkt);
+    return NULL;
+}
+
+// ---------- first reply ----------
+
+/*
+ * Time to first reply: connection refused means the listener is not up
+ * yet, so retry every millisecond until wait_ms has passed.  A socket
+ * activated server accepts right away and the wait moves to the reply.
+ */
+static int first_reply(const struct bench_config *cfg, uint64_t t0)
+{
+    struct conn c = { .fd = -1 };
+    int attempts = 0;
+    while (conn_open(&c, cfg) != 0) {
+        attempts++;
+        if (now_ns() - t0 > (uint64_t)cfg->wait_ms * 1000000ull) {
+            fprintf(stderr, "no listener after %d ms\n", cfg->wait_ms);
+            return -1;
+        }
+        struct timespec ts = { .tv_sec = 0, .tv_nsec = 1000000 };
+        nanosleep(&ts, NULL);
+    }
+    uint64_t connected = now_ns();
+
+    char *pkt = malloc(cfg->size);
+    char *win = malloc(RECV_CHUNK + cfg->size);
+    uint64_t recvd = 0;
+    int rc = -1;
+    if (pkt && win) {
+        make_packet(pkt, cfg->size, 0, 0);
+        rc = send_all(&c, pkt, cfg->size);
+        if (rc == 0) rc = wait_for_packet(&c, pkt, cfg->size, win, &recvd);
+    }
+    uint64_t replied = now_ns();
+    conn_close(&c);
+    free(win);
+    free(pkt);
+    if (rc != 0) {
+        fprintf(stderr, "no reply to the first packet\n");
+        return -1;
+    }
+    printf("connected after %.2f ms (%d refused), first reply after %.2f ms\n",
+           (double)(connected - t0) / 1e6, attempts, (double)(replied - t0) / 1e6);
+    printf("RESULT mode=first connect_ms=%.2f first_reply_ms=%.2f refused=%d recv_bytes=%llu%s\n",
+           (double)(connected - t0) / 1e6, (double)(replied - t0) / 1e6, attempts,
+           (unsigned long long)recvd, cfg->tls ? " tls=1" : "");
+    return 0;
+}
+
+// ---------- hold ----------
+
+/* Open cfg->clients idle connections, then wait for the server to close them all */
+static int hold_connections(const struct bench_config *cfg)
+{
+    struct pollfd *pfds = calloc((size_t)cfg->clients, sizeof(*pfds));
+    if (!pfds) return -1;
+
+    uint64_t t0 = now_ns();
+    int open_conns = 0;
+    for (; open_conns < cfg->clients; open_conns++) {
+        struct conn c;
+        if (conn_open(&c, cfg) != 0) break;
+        if (negotiate(&c, "reply", "ack") != 0) {
+            conn_close(&c);
+            break;
+        }
+        pfds[open_conns] = (struct pollfd){ .fd = c.fd, .events = POLLIN };
+    }
+    printf("RESULT mode=hold connections=%d connect_s=%.3f\n", open_conns, (double)(now_ns() - t0) / 1e9);
+    fflush(stdout);
+
+    uint64_t first = 0, last = 0;
+    char junk[256];
+    for (int left = open_conns; left > 0;) {
+        if (poll(pfds, (nfds_t)open_conns, -1) < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        for (int i = 0; i < open_conns; i++) {
+            if (!pfds[i].revents) continue;
+            if (recv(pfds[i].fd, junk, sizeof(junk), MSG_DONTWAIT) > 0) continue;
+            close(pfds[i].fd);
+            pfds[i].fd = -1;
+            left--;
+            last = now_ns();
+            if (!first) first = last;
+        }
+    }
+    printf("RESULT mode=hold closed=%d close_spread_ms=%.1f\n", open_conns,
+           (double)(last - first) / 1e6);
+    free(pfds);
+    return open_conns == cfg->clients ? 0 : -1;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+static uint64_t percentile(const uint64_t *sorted, size_t n, double p)
+{
+    if (n == 0) return 0;
+    size_t idx = (size_t)(p * (double)(n - 1) + 0.5);
+    return sorted[idx];
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "Usage: %s [-H host] [-p port] [-c clients] [-n requests] [-s size] [-r] [-a] [-z codec] [-T] [-w ms] [-k]\n"
+            "  -H host      server address (default %s)\n"
+            "  -p port      server port (default %s)\n"
+            "  -c clients   concurrent connections (default 1)\n"
+            "  -n requests  packets sent per connection (default 200)\n"
+            "  -s size      bytes per packet including '\\n' (default 64)\n"
+            "  -r           read mode: one connection per request, no appends\n"
+            "  -a           ask for one-line acks instead of replays\n"
+            "  -z codec     ask for compressed replies (gzip, zstd)\n"
+            "  -T           use TLS (the server's -T port)\n"
+            "  -w ms        time one packet's first reply, retrying the connect for up to ms\n"
+            "  -k           hold -c idle connections until the server closes them\n",
+            prog, DEFAULT_HOST, DEFAULT_PORT);
+}
+
+// ---------- main ----------
+
+int main(int argc, char *argv[])
+{
+    struct bench_config cfg = {
+        .host = DEFAULT_HOST, .port = DEFAULT_PORT,
+        .clients = 1, .requests = 200, .size = 64,
+    };
+
+    uint64_t start = now_ns();
+    int opt;
+    while ((opt = getopt(argc, argv, "H:p:c:n:s:raz:Tw:kh")) != -1) {
+        switch (opt) {
+        case 'H': cfg.host = optarg; break;
+        case 'p': cfg.port = optarg; break;
+        case 'c': cfg.clients = atoi(optarg); break;
+        case 'n': cfg.requests = atoi(optarg); break;
+        case 's': cfg.size = (size_t)strtoul(optarg, NULL, 10); break;
+        case 'r': cfg.read_mode = true; break;
+        case 'z': cfg.codec = optarg; break;
+        case 'T': cfg.tls = true; break;
+        case 'a': cfg.ack = true; break;
+        case 'w': cfg.wait_ms = atoi(optarg); break;
+        case 'k': cfg.hold = true; break;
+        default: usage(argv[0]); return EXIT_FAILURE;
+        }
+    }
+    if (cfg.clients < 1 || cfg.requests < 1 || cfg.size < 16) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    signal(SIGPIPE, SIG_IGN);
+    if (cfg.tls) {
+#ifdef HAVE_OPENSSL
+        g_tls_ctx = SSL_CTX_new(TLS_client_method());
+        if (!g_tls_ctx) {
+            ERR_print_errors_fp(stderr);
+            return EXIT_FAILURE;
+        }
+        SSL_CTX_set_verify(g_tls_ctx, SSL_VERIFY_NONE, NULL);
+        // The server may close without close_notify after a read-mode replay
+        SSL_CTX_set_options(g_tls_ctx, SSL_OP_IGNORE_UNEXPECTED_EOF);
+#else
+        fprintf(stderr, "built without OpenSSL, -T is not available\n");
+        return EXIT_FAILURE;
+#endif
+    }
+    if (cfg.wait_ms > 0) return first_reply(&cfg, start) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+    if (cfg.hold && cfg.tls) {
+        fprintf(stderr, "-k holds plain connections only\n");
+        return EXIT_FAILURE;
+    }
+    if (cfg.hold) return hold_connections(&cfg) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+
+    struct client_result *res = calloc((size_t)cfg.clients, sizeof(*res));
+    pthread_t *tids = calloc((size_t)cfg.clients, sizeof(*tids));
+    if (!res || !tids) {
+        fprintf(stderr, "calloc failed\n");
+        return EXIT_FAILURE;
+    }
+
+    uint64_t t0 = now_ns();
+    for (int i = 0; i < cfg.clients; i++) {
+        res[i].id = i;
+        res[i].cfg = &cfg;
+        res[i].lat_ns = calloc((size_t)cfg.requests, sizeof(uint64_t));
+        if (!res[i].lat_ns || pthread_create(&tids[i], NULL, client_thread, &res[i]) != 0) {
+            fprintf(stderr, "client %d: start failed\n", i);
+            return EXIT_FAILURE;
+        }
+    }
+    for (int i = 0; i < cfg.clients; i++) pthread_join(tids[i], NULL);
+    double elapsed = (double)(now_ns() - t0) / 1e9;
+
+    size_t total = 0;
+    int errors = 0;
+    uint64_t sent = 0, recvd = 0, raw = 0;
+    for (int i = 0; i < cfg.clients; i++) {
+        total += (size_t)res[i].completed;
+        errors += res[i].errors;
+        sent += res[i].bytes_sent;
+        recvd += res[i].bytes_recv;
+        raw += res[i].bytes_raw;
+    }
+    uint64_t *all = malloc((total ? total : 1) * sizeof(uint64_t));
+    if (!all) {
+        fprintf(stderr, "malloc failed\n");
+        return EXIT_FAILURE;
+    }
+    size_t k = 0;
+    for (int i = 0; i < cfg.clients; i++) {
+        memcpy(all + k, res[i].lat_ns, (size_t)res[i].completed * sizeof(uint64_t));
+        k += (size_t)res[i].completed;
+    }
+    qsort(all, total, sizeof(uint64_t), cmp_u64);
+
+    double rps = elapsed > 0 ? (double)total / elapsed : 0.0;
+    double mbps = elapsed > 0 ? (double)recvd / elapsed / 1e6 : 0.0;
+    printf("%zu requests from %d clients in %.3f s: %.1f req/s, %.2f MB/s replayed\n",
+           total, cfg.clients, elapsed, rps, mbps);
+    printf("latency p50 %.1f us, p99 %.1f us, max %.1f us, errors %d\n",
+           percentile(all, total, 0.50) / 1e3, percentile(all, total, 0.99) / 1e3,
+           (total ? all[total - 1] : 0) / 1e3, errors);
+    printf("RESULT mode=%s clients=%d requests=%zu size=%zu elapsed_s=%.3f req_per_s=%.1f "
+           "recv_mb_per_s=%.2f lat_p50_us=%.1f lat_p99_us=%.1f lat_max_us=%.1f errors=%d",
+           cfg.read_mode ? "read" : cfg.ack ? "ack" : "load", cfg.clients, total, cfg.size, elapsed, rps, mbps,
+           percentile(all, total, 0.50) / 1e3, percentile(all, total, 0.99) / 1e3,
+           (total ? all[total - 1] : 0) / 1e3, errors);
+    if (cfg.codec) {
+        // recv_mb_per_s counts wire bytes; raw is what they decompress to
+        printf(" codec=%s raw_mb_per_s=%.2f wire_ratio=%.3f", cfg.codec,
+               elapsed > 0 ? (double)raw / elapsed / 1e6 : 0.0, raw ? (double)recvd / (double)raw : 0.0);
+    }
+    if (cfg.tls) printf(" tls=1");
+    printf("\n");
+
+    for (int i = 0; i < cfg.clients; i++) free(res[i].lat_ns);
+    free(all);
+    free(tids);
+    free(res);
+#ifdef HAVE_OPENSSL
+    SSL_CTX_free(g_tls_ctx);
+#endif
+    return errors ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -3,12 +3,55 @@
  *
  * - Building from assignment —> Assignment 6 multi-threaded server
  * - Multi-client TCP server on port 9000
- * - Packet = bytes up to and including '\n'
- * - For each packet: append to /var/tmp/aesdsocketdata, then send the entire file back
+ * - Packet = bytes up to and including '\n'; packets longer than
+ *   AESD_PENDING_INLINE_MAX are spilled to a temp file while they arrive
+ * - For each packet: append to the store, then send the entire store back
+ * - Store backend chosen at startup with -b (file, chardev, mem, dedup; see aesd-store.h)
  * - Timestamp thread appends "timestamp:<RFC2822>\n" every 10 seconds
- * - All file operations are protected by a mutex
+ *   for backends that want them
  * - Uses singly linked list to manage threads; joins on shutdown
  * - Graceful exit on SIGINT/SIGTERM; -d for daemon mode
+ * - "AESDSOCKET_SUBSCRIBE\n" turns a connection into a push-only tail of
+ *   the store: full replay first, then every newly committed byte
+ * - "AESDSOCKET_OPTION:compress=<codec>\n" switches the connection's
+ *   replies to compressed frames served from a per-codec cache (see
+ *   aesd-zcache.h); the server answers with the codec it accepted or "none"
+ * - "AESDSOCKET_OPTION:reply=framed\n" prefixes every replay with
+ *   "AESDR <len>\n"; "reply=ack" answers each append with just
+ *   "AESDACK <end offset>\n" and stores the complete lines of one recv()
+ *   with a single batched append (see client/aesdclient.h)
+ * - -L <port> makes this instance a replication leader; -F <host:port>
+ *   makes it a read-only follower of one (see aesd-repl.h)
+ * - -T <port> -C <cert> -K <key> adds a TLS listener speaking the same
+ *   protocol; sessions move to kTLS when the kernel allows it so replays
+ *   keep using sendfile (-u: OpenSSL only, see aesd-tls.h)
+ * - "LINES:<first>,<count>\n" replays just those packets (zero referenced),
+ *   located with the backend's seek, which the file backend indexes
+ * - "SINCE:<epoch>\n" replays from the first record committed at or after
+ *   that second, located through the store's time index
+ * - "FILTER:<pattern>\n" replays only the lines containing pattern, or
+ *   starting with it after a leading '^' (see aesd-filter.h)
+ * - -c frames every stored record with its length and CRC-32C; -k keeps the
+ *   store across runs, validating it on start (file backend, see aesd-store.h)
+ * - -l <bytes/s>[,<packets/s>] rate-limits each connection; -q <slots>[,<quantum>]
+ *   runs appends and replays through a deficit round robin scheduler with
+ *   that many concurrent slots (see aesd-fair.h)
+ * - -H <spec> backs the mem and dedup stores with huge pages, prefaulted
+ *   and optionally locked or reserved up front (see aesd-hugemem.h)
+ * - Listening sockets passed with the systemd LISTEN_FDS protocol replace
+ *   -p and -T (see aesd-listenfds.h and aesdsocket.socket); -i opens the
+ *   store only once the first client is accepted
+ * - SIGINT/SIGTERM arrive through a signalfd polled with the listeners; one
+ *   eventfd write then wakes every waiting thread, and connections get -g
+ *   <ms> (default 5000) to finish the packets they sent before being cut
+ * - Thread stacks, TLS buffers, partial packets and reply buffers are
+ *   charged to a process-wide budget (see aesd-budget.h); with -M <MiB>
+ *   the accept loop stops accepting while another client thread would not
+ *   fit, and readers pause near the cap so TCP pushes back on clients
+ * - "METRICS\n" answers with that usage by category and the number of
+ *   live connections, one "name value" line each
+ * - USDT probes at accept, complete packet, append, replay and close, for
+ *   bpftrace/perf (see aesd-trace.h and trace/)
 */
 
 #define _POSIX_C_SOURCE 200809L
@@ -16,7 +59,9 @@
 #include <arpa/inet.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <linux/sockios.h>
 #include <netdb.h>
+#include <poll.h>
 #include <pthread.h>
 #include <signal.h>
 #include <stdbool.h>
@@ -24,45 +69,87 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdatomic.h>
 #include <string.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
 #include <sys/queue.h>
+#include <sys/signalfd.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
-#include <sys/ioctl.h>
 #include <syslog.h>
 #include <time.h>
 #include <unistd.h>
-#include "aesd_ioctl.h"
+#include "aesd-budget.h"
+#include "aesd-fair.h"
+#include "aesd-filter.h"
+#include "aesd-hugemem.h"
+#include "aesd-listenfds.h"
+#include "aesd-pending.h"
+#include "aesd-repl.h"
+#include "aesd-store.h"
+#include "aesd-tls.h"
+#include "aesd-trace.h"
+#include "aesd-zcache.h"
 
 #define SERVER_PORT "9000"
-#define DATAFILE "/var/tmp/aesdsocketdata"
-#define BACKLOG 10
+#define BACKLOG SOMAXCONN   // bursts of thousands of connects are not dropped
 #define RECV_CHUNK 4096
-#define SEND_CHUNK 4096
 
 #ifndef USE_AESD_CHAR_DEVICE
 #define USE_AESD_CHAR_DEVICE 1
 #endif
 
+// Backend used when -b is not given; the build flag keeps its old meaning
 #if USE_AESD_CHAR_DEVICE
-#define AESD_PATH "/dev/aesdchar"
+#define DEFAULT_BACKEND "chardev"
 #else
-#define AESD_PATH "/var/tmp/aesdsocketdata"
+#define DEFAULT_BACKEND "file"
 #endif
 
-static volatile sig_atomic_t g_exit_requested = 0;
+#define SEEKTO_PREFIX "AESDCHAR_IOCSEEKTO:"
+#define SUBSCRIBE_CMD "AESDSOCKET_SUBSCRIBE\n"
+#define SUBSCRIBE_POLL_MS 500
+#define OPTION_PREFIX "AESDSOCKET_OPTION:"
+#define FILTER_PREFIX "FILTER:"
+#define SINCE_PREFIX "SINCE:"
+#define LINES_PREFIX "LINES:"
+#define METRICS_CMD "METRICS\n"
+#define MAX_ZCACHES 4
+#define ACK_BATCH 64
+#define THROTTLE_SLICE_NS 100000000ull    // longest single throttling sleep
+#define MIN_SLICE 4096                      // replay slice once the socket polls writable
+#define DEFAULT_DRAIN_MS 5000
+#define CLIENT_STACK_SIZE (256 * 1024)   // charged to the budget per client thread
+#define ACCEPT_RETRY_MS 50                // recheck for room while not accepting
+#define PRESSURE_SLICE_MS 100
+#define PRESSURE_SLICES 10                // a reader pauses at most this many slices per recv
+
+static atomic_bool g_exit_requested = false;
+static int g_signal_fd = -1;        // SIGINT/SIGTERM, read by the accept loop
+static int g_shutdown_fd = -1;      // eventfd, written once to wake every waiter
+static int g_drain_ms = DEFAULT_DRAIN_MS;
 static int g_listen_fd = -1;
+static int g_tls_listen_fd = -1;
 
-#if !USE_AESD_CHAR_DEVICE
-static int g_data_fd = -1;
+static struct aesd_store g_store;
+static bool g_store_ready = false;  // -i opens it when the first client connects
+static struct timespec g_start;     // CLOCK_MONOTONIC at startup
 static pthread_t g_time_tid;
-#endif
+static bool g_time_started = false;
+static bool g_follower = false;    // read-only replica: packets are not stored
+static struct aesd_zcache *g_zcache[MAX_ZCACHES];
+static size_t g_nzcache = 0;
+static struct aesd_filter *g_filter = NULL;   // NULL: backend can't be filtered
+static struct aesd_fair g_fair;
+static bool g_fair_on = false;
+static double g_limit_bytes = 0;   // per connection, 0: unlimited
+static double g_limit_packets = 0;
 
-#if !USE_AESD_CHAR_DEVICE
-static pthread_mutex_t g_file_mutex = PTHREAD_MUTEX_INITIALIZER;
-#endif
 static pthread_mutex_t g_list_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_list_cond = PTHREAD_COND_INITIALIZER;     // a client thread finished
+static size_t g_live = 0;           // client threads not done yet, under g_list_mutex
 
 struct client_thread {
     pthread_t tid;
@@ -85,57 +172,27 @@ static void fatal_log(const char *fmt, ...)
     syslog(LOG_ERR, "%s", buf);
 }
 
-static void signal_handler(int signo)
+/*
+ * Shutdown is one broadcast: the flag for loops that check it between
+ * steps, and an eventfd that is never read, so it stays readable and every
+ * poll() on it, now or later, returns at once.
+ */
+static void request_shutdown(void)
 {
-    (void)signo;
-    g_exit_requested = 1;
+    uint64_t one = 1;
+    atomic_store(&g_exit_requested, true);
+    if (write(g_shutdown_fd, &one, sizeof(one)) < 0) fatal_log("shutdown eventfd: %s", strerror(errno));
+    if (g_store.ops) aesd_store_wake_waiters(&g_store);
 }
 
-#if !USE_AESD_CHAR_DEVICE
-static int open_data_file(void)
+/* Sleep up to ms (-1: forever); returns true, early, once shutdown is requested */
+static bool wait_shutdown(int ms)
 {
-    // O_APPEND ensures kernel appends are atomic among writers.
-    return open(DATAFILE, O_CREAT | O_RDWR | O_APPEND, 0644);
-}
-
-static int send_file_contents_locked(int out_fd, int file_fd)
-{
-    // Precondition: caller holds g_file_mutex
-    if (lseek(file_fd, 0, SEEK_SET) == (off_t)-1) return -1;
-
-    char buf[SEND_CHUNK];
-    ssize_t r;
-    while ((r = read(file_fd, buf, sizeof(buf))) > 0) {
-        ssize_t off = 0;
-        while (off < r) {
-            ssize_t s = send(out_fd, buf + off, (size_t)(r - off), 0);
-            if (s < 0) {
-                if (errno == EINTR) continue;
-                return -1;
-            }
-            off += s;
-        }
-    }
-    return (r < 0) ? -1 : 0;
-}
-
-static int append_to_file_locked(int file_fd, const char *data, size_t len)
-{
-    // Precondition: caller holds g_file_mutex; file opened with O_APPEND
-    size_t written = 0;
-    while (written < len) {
-        ssize_t w = write(file_fd, data + written, len - written);
-        if (w < 0) {
-            if (errno == EINTR) continue;
-            return -1;
-        }
-        written += (size_t)w;
-    }
-    return 0;
+    struct pollfd pfd = { .fd = g_shutdown_fd, .events = POLLIN };
+    return poll(&pfd, 1, ms) > 0 || g_exit_requested;
 }
-#endif
 
-static int make_listen_socket(void)
+static int make_listen_socket(const char *port)
 {
     int sfd = -1;
     struct addrinfo hints, *res = NULL, *rp = NULL;
@@ -144,7 +201,7 @@ static int make_listen_socket(void)
     hints.ai_socktype = SOCK_STREAM;
     hints.ai_flags    = AI_PASSIVE;
 
-    int rc = getaddrinfo(NULL, SERVER_PORT, &hints, &res);
+    int rc = getaddrinfo(NULL, port, &hints, &res);
     if (rc != 0) {
         fatal_log("getaddrinfo: %s", gai_strerror(rc));
         return -1;
@@ -208,17 +265,10 @@ static void daemonize(void)
 }
 
 // ---------- timestamp thread ----------
-#if !USE_AESD_CHAR_DEVICE
 static void *timestamp_thread(void *arg)
 {
     (void)arg;
-    while (!g_exit_requested) {
-        // Sleep in 1-second chunks to respond quickly to exit
-        for (int i = 0; i < 10 && !g_exit_requested; i++) {
-            struct timespec ts = {.tv_sec = 1, .tv_nsec = 0};
-            nanosleep(&ts, NULL);
-        }
-        if (g_exit_requested) break;
+    while (!wait_shutdown(10000)) {
 
         time_t now = time(NULL);
         struct tm tminfo;
@@ -226,26 +276,498 @@ static void *timestamp_thread(void *arg)
 
         char tbuf[128];
         // RFC 2822-compatible example: "Mon, 02 Jan 2006 15:04:05 -0700"
-        if (strftime(tbuf, sizeof(tbuf), "%a, %d %b %Y %H:%M:%S %z", &tminfo) == 0) {
+        if (strftime(tbuf, sizeof(tbuf), AESD_TIMESTAMP_FORMAT, &tminfo) == 0) {
             continue;
         }
 
         char line[192];
-        int n = snprintf(line, sizeof(line), "timestamp:%s\n", tbuf);
+        int n = snprintf(line, sizeof(line), AESD_TIMESTAMP_PREFIX "%s\n", tbuf);
         if (n <= 0) continue;
 
-        pthread_mutex_lock(&g_file_mutex);
-        (void)append_to_file_locked(g_data_fd, line, (size_t)n);
-        pthread_mutex_unlock(&g_file_mutex);
+        if (aesd_store_append(&g_store, line, (size_t)n, NULL) != 0) {
+            fatal_log("timestamp append failed: %s", strerror(errno));
+        }
     }
     return NULL;
 }
-#endif
 
 // ---------- client thread ----------
 
+enum reply_mode {
+    REPLY_FULL,         // raw replay, the original protocol
+    REPLY_FRAMED,       // "AESDR <len>\n" + replay
+    REPLY_ACK,          // appends get "AESDACK <end>\n", other replies are framed
+};
+
+/* Per-connection state a client can negotiate */
+struct client_conn {
+    int sock;                       // the accepted socket, which probes identify connections by
+    int fd;                         // replies; the socket itself unless TLS needs a pump
+    int rfd;                        // requests, likewise
+    struct aesd_zcache *zcache;     // NULL: replies are sent raw
+    enum reply_mode reply;
+    struct aesd_bucket bytes;       // -l limits, charged per stored/replayed byte
+    struct aesd_bucket packets;
+    struct aesd_fair_flow flow;     // -q scheduling
+    uint64_t throttled_ns;
+    uint64_t npackets;              // complete packets received
+};
+
+/* A store operation of cost bytes waits for this connection's DRR turn */
+static void op_begin(struct client_conn *conn, uint64_t cost)
+{
+    if (g_fair_on) aesd_fair_enter(&g_fair, &conn->flow, cost);
+}
+
+/* ... and is charged to the connection's byte bucket when it is done */
+static void op_end(struct client_conn *conn, uint64_t cost)
+{
+    if (g_fair_on) aesd_fair_leave(&g_fair);
+    aesd_bucket_charge(&conn->bytes, (double)cost);
+}
+
+/* Sleep off rate-limit debt before reading more, so TCP pushes back */
+static void throttle(struct client_conn *conn)
+{
+    while (!g_exit_requested) {
+        uint64_t ns = aesd_bucket_wait_ns(&conn->bytes);
+        uint64_t pns = aesd_bucket_wait_ns(&conn->packets);
+        if (pns > ns) ns = pns;
+        if (ns == 0) return;
+        if (ns > THROTTLE_SLICE_NS) ns = THROTTLE_SLICE_NS;
+        conn->throttled_ns += ns;
+        if (wait_shutdown((int)((ns + 999999) / 1000000))) return;
+    }
+}
+
+/*
+ * Wait for fd to take more bytes: 1 once it does, -1 if it failed.  Until
+ * shutdown is requested that also ends the wait, returning 0; after it
+ * only the socket counts, and the drain's -g deadline bounds the wait.
+ */
+static int wait_writable(int fd)
+{
+    struct pollfd pfd[2] = {
+        { .fd = fd, .events = POLLOUT },
+        { .fd = g_shutdown_fd, .events = POLLIN },
+    };
+    while (poll(pfd, g_exit_requested ? 1 : 2, -1) < 0) {
+        if (errno != EINTR) return -1;
+    }
+    if (pfd[0].revents & (POLLERR | POLLHUP)) return -1;
+    return (pfd[0].revents & POLLOUT) ? 1 : 0;
+}
+
+/*
+ * Under -q a raw replay slice must not block in send while it holds a
+ * slot, or a client that stops reading stalls every flow queued behind it.
+ * So the wait for the socket happens here, outside the slot, and the slice
+ * is cut to what the send buffer still takes: half of SO_SNDBUF is payload
+ * (the kernel doubles the setting for overhead), less what is queued.
+ * Returns want as is when the socket cannot be asked, has failed, or
+ * shutdown is requested meanwhile; the send then blocks, within -g.
+ */
+static off_t sendable(int fd, off_t want)
+{
+    int sndbuf, queued;
+    socklen_t len = sizeof(sndbuf);
+
+    if (getsockopt(fd, SOL_SOCKET, SO_SNDBUF, &sndbuf, &len) != 0 || ioctl(fd, SIOCOUTQ, &queued) != 0) {
+        return want;
+    }
+    off_t room = (off_t)(sndbuf / 2) - queued;
+    if (room <= 0) {
+        if (wait_writable(fd) <= 0) return want;
+        // Writable: a page at least fits, and more if the queue drained further
+        room = ioctl(fd, SIOCOUTQ, &queued) == 0 ? (off_t)(sndbuf / 2) - queued : 0;
+        if (room < MIN_SLICE) room = MIN_SLICE;
+    }
+    return room < want ? room : want;
+}
+
+/* aesd_zcache wait hook: the -q slot is given up while the client's socket is full */
+static int yield_slot(int fd, void *arg)
+{
+    struct client_conn *conn = arg;
+    int w;
+
+    aesd_fair_leave(&g_fair);
+    while ((w = wait_writable(fd)) == 0) {
+    }
+    aesd_fair_enter(&g_fair, &conn->flow, g_fair.quantum);
+    return w > 0 ? 0 : -1;
+}
+
+/* A compressed reply, the whole cache or [from, to), as one -q operation of cost bytes */
+static int send_compressed(struct client_conn *conn, off_t from, off_t to, bool whole, uint64_t cost)
+{
+    aesd_zcache_wait_fn wait = g_fair_on ? yield_slot : NULL;
+    op_begin(conn, cost);
+    int rc = whole ? aesd_zcache_send(conn->zcache, conn->fd, wait, conn)
+                   : aesd_zcache_send_range(conn->zcache, from, to, conn->fd, wait, conn);
+    op_end(conn, cost);
+    return rc;
+}
+
+/* "AESDR <len>\n" ahead of a framed replay */
+static int send_frame_header(struct client_conn *conn, off_t len)
+{
+    char hdr[48];
+    int n = snprintf(hdr, sizeof(hdr), "AESDR %lld\n", (long long)len);
+    for (int off = 0; off < n;) {
+        ssize_t s = send(conn->fd, hdr + off, (size_t)(n - off), len > 0 ? MSG_MORE : 0);
+        if (s < 0 && errno == EINTR) continue;
+        if (s < 0) return -1;
+        off += (int)s;
+    }
+    return 0;
+}
+
+/*
+ * Send [from, to) of the store in the form this connection asked for.
+ * Under -q a raw replay is scheduled one quantum at a time, so a light
+ * client waits for at most one slice of someone else's big replay, and
+ * -l limits are applied between slices.  Slices are also cut to what the
+ * socket takes without blocking (see sendable()).
+ * Compressed replies are one operation each, which gives its slot up
+ * whenever the socket is full (see yield_slot()).  Chardev replays, whose
+ * end is not known up front (costed at 0), are one operation that only
+ * waits for the socket to be writable before taking its slot: it can
+ * still block inside it.
+ */
+static int send_reply(struct client_conn *conn, off_t from, off_t to)
+{
+    int rc = 0;
+
+    AESD_TRACE3(replay_start, conn->sock, from, to);
+    if (conn->zcache || !g_store.ops->stable_offsets) {
+        off_t end = to < 0 ? aesd_store_committed(&g_store) : to;
+        uint64_t cost = end > from ? (uint64_t)(end - from) : 0;
+        if (conn->zcache) {
+            // The cache holds [0, committed), which ends at or after 'to'
+            rc = send_compressed(conn, from, to, from == 0 && g_store.ops->stable_offsets, cost);
+        } else {
+            if (g_fair_on) sendable(conn->fd, 1);
+            op_begin(conn, cost);
+            rc = aesd_store_replay(&g_store, from, to, conn->fd);
+            op_end(conn, cost);
+        }
+        AESD_TRACE3(replay_end, conn->sock, cost, rc);
+        return rc;
+    }
+
+    if (to < 0) to = aesd_store_committed(&g_store);
+    if (conn->reply != REPLY_FULL && send_frame_header(conn, to - from) != 0) {
+        AESD_TRACE3(replay_end, conn->sock, 0, -1);
+        return -1;
+    }
+    off_t step = g_fair_on ? (off_t)g_fair.quantum
+               : g_limit_bytes > 0 ? AESD_FAIR_DEFAULT_QUANTUM : to - from;
+    off_t off = from;
+    for (off_t end; rc == 0 && off < to; off = end) {
+        end = to - off > step ? off + step : to;
+        if (off > from) throttle(conn);     // -l paces long replays too
+        if (g_fair_on) end = off + sendable(conn->fd, end - off);
+        op_begin(conn, (uint64_t)(end - off));
+        rc = aesd_store_replay(&g_store, off, end, conn->fd);
+        op_end(conn, (uint64_t)(end - off));
+    }
+    AESD_TRACE3(replay_end, conn->sock, (off < to ? off : to) - from, rc);
+    return rc;
+}
+
+/* "reply=full|framed|ack"; anything else leaves the mode as it was */
+static int set_reply_mode(struct client_conn *conn, const char *mode)
+{
+    static const char *const names[] = { "full", "framed", "ack" };
+    char reply[64];
+
+    for (size_t i = 0; g_store.ops->stable_offsets && i < sizeof(names) / sizeof(names[0]); i++) {
+        if (strcmp(mode, names[i]) == 0) conn->reply = (enum reply_mode)i;
+    }
+    int n = snprintf(reply, sizeof(reply), OPTION_PREFIX "reply=%s\n", names[conn->reply]);
+    return aesd_send_all(conn->fd, reply, (size_t)n);
+}
+
+/*
+ * "compress=<codec>": pick a cache, or go back to raw replies.
+ * "reply=<mode>": see set_reply_mode().
+ */
+static int handle_option(struct client_conn *conn, const char *pkt, size_t len)
+{
+    char opt[64], reply[96];
+    size_t n = strlen(OPTION_PREFIX);
+    size_t olen = len - n - 1;                  // drop prefix and '\n'
+    if (olen >= sizeof(opt)) olen = sizeof(opt) - 1;
+    memcpy(opt, pkt + n, olen);
+    opt[olen] = '\0';
+
+    if (strncmp(opt, "reply=", 6) == 0) return set_reply_mode(conn, opt + 6);
+    if (strncmp(opt, "compress=", 9) != 0) {
+        n = (size_t)snprintf(reply, sizeof(reply), OPTION_PREFIX "%s=unsupported\n", opt);
+        return aesd_send_all(conn->fd, reply, n);
+    }
+    conn->zcache = NULL;
+    for (size_t i = 0; i < g_nzcache; i++) {
+        if (strcmp(aesd_zcache_name(g_zcache[i]), opt + 9) == 0) conn->zcache = g_zcache[i];
+    }
+    n = (size_t)snprintf(reply, sizeof(reply), OPTION_PREFIX "compress=%s\n",
+                         conn->zcache ? aesd_zcache_name(conn->zcache) : "none");
+    return aesd_send_all(conn->fd, reply, n);
+}
+
+/*
+ * Replay the matching lines of everything committed so far.  Framed
+ * connections get the length first, which takes a counting pass; the
+ * second pass is cheap because the line cache is warm by then.  Filter
+ * replies are never compressed, and are not scheduled under -q.
+ */
+static int filter_reply(struct client_conn *conn, const char *pkt, size_t len)
+{
+    const char *pat = pkt + strlen(FILTER_PREFIX);
+    size_t plen = len - strlen(FILTER_PREFIX) - 1;     // drop the '\n'
+    off_t end = aesd_store_committed(&g_store);
+
+    if (!g_filter) {
+        fatal_log("FILTER needs a backend with stable offsets, not %s", g_store.ops->name);
+        return conn->reply != REPLY_FULL ? send_frame_header(conn, 0) : 0;
+    }
+    if (conn->reply != REPLY_FULL) {
+        off_t n = aesd_filter_send(g_filter, pat, plen, end, -1);
+        if (n < 0 || send_frame_header(conn, n) != 0) return -1;
+    }
+    if (aesd_filter_send(g_filter, pat, plen, end, conn->fd) < 0) {
+        fatal_log("filter replay failed: %s", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Tail the store to a subscriber.  The store itself is the broadcast
+ * buffer and each subscriber only keeps a cursor into it: a commit wakes
+ * every subscriber, which sends [cursor, committed) with a single replay
+ * (sendfile for the file backend), so a line is stored once however many
+ * subscribers there are.  Pushes are never compressed.  Returns -1 when
+ * the subscriber goes away, which also ends the connection.
+ */
+static int subscribe(struct client_conn *conn)
+{
+    int cfd = conn->fd;
+    off_t cursor = 0;
+    struct pollfd pfd = { .fd = conn->rfd, .events = POLLIN };
+    char junk[256];
+
+    if (!g_store.ops->stable_offsets) {
+        fatal_log("subscribe needs a backend with stable offsets, not %s", g_store.ops->name);
+        return -1;
+    }
+    syslog(LOG_INFO, "Subscriber attached on fd %d", cfd);
+    while (!g_exit_requested) {
+        off_t end = aesd_store_wait_commit(&g_store, cursor, SUBSCRIBE_POLL_MS);
+        if (end > cursor) {
+            if (aesd_store_replay(&g_store, cursor, end, cfd) != 0) break;
+            cursor = end;
+        }
+        // The subscriber has nothing more to say; anything it sends is dropped
+        if (poll(&pfd, 1, 0) > 0) {
+            ssize_t r = recv(conn->rfd, junk, sizeof(junk), MSG_DONTWAIT);
+            if (r == 0 || (r < 0 && errno != EAGAIN && errno != EINTR)) break;
+        }
+    }
+    syslog(LOG_INFO, "Subscriber on fd %d detached at offset %lld", cfd, (long long)cursor);
+    return -1;
+}
+
+/* Commands are answered but never stored */
+static bool is_command(const char *pkt, size_t len)
+{
+    return (len > strlen(SEEKTO_PREFIX) && strncmp(pkt, SEEKTO_PREFIX, strlen(SEEKTO_PREFIX)) == 0) ||
+           (len == strlen(SUBSCRIBE_CMD) && memcmp(pkt, SUBSCRIBE_CMD, len) == 0) ||
+           (len > strlen(OPTION_PREFIX) && strncmp(pkt, OPTION_PREFIX, strlen(OPTION_PREFIX)) == 0) ||
+           (len > strlen(FILTER_PREFIX) && strncmp(pkt, FILTER_PREFIX, strlen(FILTER_PREFIX)) == 0) ||
+           (len > strlen(SINCE_PREFIX) && strncmp(pkt, SINCE_PREFIX, strlen(SINCE_PREFIX)) == 0) ||
+           (len > strlen(LINES_PREFIX) && strncmp(pkt, LINES_PREFIX, strlen(LINES_PREFIX)) == 0) ||
+           (len == strlen(METRICS_CMD) && memcmp(pkt, METRICS_CMD, len) == 0);
+}
+
+/* Memory usage by category and live connections; framed like a replay unless reply=full */
+static int send_metrics(struct client_conn *conn)
+{
+    struct aesd_budget_stats bs;
+    char buf[512];
+    int n = 0;
+
+    aesd_budget_stats(&bs);
+    pthread_mutex_lock(&g_list_mutex);
+    size_t live = g_live;
+    pthread_mutex_unlock(&g_list_mutex);
+    for (int i = 0; i < AESD_BUDGET_NCATS; i++) {
+        n += snprintf(buf + n, sizeof(buf) - (size_t)n, "mem.%s %llu\n",
+                      aesd_budget_name((enum aesd_budget_cat)i), (unsigned long long)bs.used[i]);
+    }
+    n += snprintf(buf + n, sizeof(buf) - (size_t)n,
+                  "mem.total %llu\nmem.peak %llu\nmem.cap %llu\nmem.pressure_waits %llu\n"
+                  "mem.refused %llu\nconnections %zu\n",
+                  (unsigned long long)bs.total, (unsigned long long)bs.peak, (unsigned long long)bs.cap,
+                  (unsigned long long)bs.pressure_waits, (unsigned long long)bs.refused, live);
+    if (conn->reply != REPLY_FULL && send_frame_header(conn, n) != 0) return -1;
+    return aesd_send_all(conn->fd, buf, (size_t)n);
+}
+
+/* Reply to an append that ended the store at 'to' */
+static int reply_appended(struct client_conn *conn, off_t to)
+{
+    char ack[32];
+    if (conn->reply != REPLY_ACK) return send_reply(conn, 0, to);
+    int n = snprintf(ack, sizeof(ack), "AESDACK %lld\n", (long long)to);
+    return aesd_send_all(conn->fd, ack, (size_t)n);
+}
+
+/*
+ * Lines a reply=ack client pipelined into one recv(): stored with one
+ * append_batch and answered with one send.  The batch is contiguous, so
+ * each line's end offset follows from the last one.
+ */
+struct ack_batch {
+    struct iovec iov[ACK_BATCH];
+    int n;
+};
+
+static int flush_ack_batch(struct client_conn *conn, struct ack_batch *b)
+{
+    char acks[ACK_BATCH * 32];
+    size_t alen = 0;
+    off_t end = -1;
+    uint64_t cost = 0;
+
+    if (b->n == 0) return 0;
+    for (int i = 0; i < b->n; i++) cost += b->iov[i].iov_len;
+    op_begin(conn, cost);
+    AESD_TRACE3(append_start, conn->sock, cost, b->n);
+    int rc = aesd_store_append_batch(&g_store, b->iov, b->n, &end);
+    AESD_TRACE4(append_end, conn->sock, cost, end, rc);
+    op_end(conn, cost);
+    if (rc != 0) {
+        fatal_log("batched append of %d lines failed: %s", b->n, strerror(errno));
+        return -1;
+    }
+    off_t line_end = end;
+    for (int i = b->n - 1; i > 0; i--) line_end -= (off_t)b->iov[i].iov_len;
+    for (int i = 0; i < b->n; i++) {
+        if (i > 0) line_end += (off_t)b->iov[i].iov_len;
+        alen += (size_t)snprintf(acks + alen, sizeof(acks) - alen, "AESDACK %lld\n", (long long)line_end);
+    }
+    b->n = 0;
+    return aesd_send_all(conn->fd, acks, alen);
+}
+
+/*
+ * Handle one complete packet (including its '\n').  A seek command moves the
+ * replay start and is not stored; anything else is appended.  Either way the
+ * store is then sent back, ending with this packet for backends with stable
+ * offsets.  A follower stores nothing and just replays what it has, and a
+ * subscribe command never returns to the read loop.  Returns -1 when the
+ * connection should be dropped.
+ */
+static int handle_packet(struct client_conn *conn, const char *pkt, size_t len)
+{
+    off_t from = 0, to = -1;
+
+    if (len > strlen(SEEKTO_PREFIX) && strncmp(pkt, SEEKTO_PREFIX, strlen(SEEKTO_PREFIX)) == 0) {
+        // NUL-terminate a copy for sscanf
+        char cmd[64];
+        unsigned int X, Y;
+        size_t n = len < sizeof(cmd) ? len : sizeof(cmd) - 1;
+        memcpy(cmd, pkt, n);
+        cmd[n] = '\0';
+        if (sscanf(cmd, SEEKTO_PREFIX "%u,%u", &X, &Y) == 2) {
+            // do NOT write this string to the store
+            if (aesd_store_seek_cmd(&g_store, X, Y, &from) != 0) {
+                fatal_log("seek to %u,%u failed: %s", X, Y, strerror(errno));
+                return 0;
+            }
+            return send_reply(conn, from, -1);
+        }
+    }
+
+    if (len == strlen(SUBSCRIBE_CMD) && memcmp(pkt, SUBSCRIBE_CMD, len) == 0) return subscribe(conn);
+    if (len == strlen(METRICS_CMD) && memcmp(pkt, METRICS_CMD, len) == 0) return send_metrics(conn);
+    if (len > strlen(OPTION_PREFIX) && strncmp(pkt, OPTION_PREFIX, strlen(OPTION_PREFIX)) == 0) {
+        return handle_option(conn, pkt, len);
+    }
+    if (len > strlen(FILTER_PREFIX) && strncmp(pkt, FILTER_PREFIX, strlen(FILTER_PREFIX)) == 0) {
+        return filter_reply(conn, pkt, len);
+    }
+    if (len > strlen(SINCE_PREFIX) && strncmp(pkt, SINCE_PREFIX, strlen(SINCE_PREFIX)) == 0) {
+        char cmd[64];
+        long long since;
+        size_t n = len < sizeof(cmd) ? len : sizeof(cmd) - 1;
+        memcpy(cmd, pkt, n);
+        cmd[n] = '\0';
+        if (sscanf(cmd, SINCE_PREFIX "%lld", &since) != 1 || !g_store.ops->stable_offsets) {
+            fatal_log("bad SINCE command or no time index for %s", g_store.ops->name);
+            return conn->reply != REPLY_FULL ? send_frame_header(conn, 0) : 0;
+        }
+        return send_reply(conn, aesd_store_since(&g_store, (time_t)since), -1);
+    }
+    if (len > strlen(LINES_PREFIX) && strncmp(pkt, LINES_PREFIX, strlen(LINES_PREFIX)) == 0) {
+        char cmd[64];
+        unsigned int first, count;
+        size_t n = len < sizeof(cmd) ? len : sizeof(cmd) - 1;
+        memcpy(cmd, pkt, n);
+        cmd[n] = '\0';
+        if (sscanf(cmd, LINES_PREFIX "%u,%u", &first, &count) != 2 || !g_store.ops->stable_offsets ||
+            aesd_store_seek_cmd(&g_store, first, 0, &from) != 0) {
+            fatal_log("bad LINES command or no such packet");
+            return conn->reply != REPLY_FULL ? send_frame_header(conn, 0) : 0;
+        }
+        // A range running past the last packet ends with the store
+        if (count == 0) to = from;
+        else if ((uint64_t)first + count > UINT32_MAX ||
+                 aesd_store_seek_cmd(&g_store, first + count, 0, &to) != 0) to = -1;
+        if (!conn->zcache) return send_reply(conn, from, to);
+        // send_reply() would hand out the whole cache for from == 0
+        return send_compressed(conn, from, to, false, to < 0 ? 0 : (uint64_t)(to - from));
+    }
+
+    if (g_follower) return send_reply(conn, 0, -1);
+
+    op_begin(conn, len);
+    AESD_TRACE3(append_start, conn->sock, len, 1);
+    int rc = aesd_store_append(&g_store, pkt, len, &to);
+    AESD_TRACE4(append_end, conn->sock, len, to, rc);
+    op_end(conn, len);
+    if (rc != 0) {
+        fatal_log("append failed: %s", strerror(errno));
+        return -1;
+    }
+    return reply_appended(conn, to);
+}
+
+/* Append a packet that was spilled to pending->spill_fd, then reply as usual */
+static int handle_spilled_packet(struct client_conn *conn, const struct aesd_pending *pending)
+{
+    off_t to = -1;
+
+    if (g_follower) return send_reply(conn, 0, -1);
+
+    op_begin(conn, (uint64_t)pending->spill_len);
+    AESD_TRACE3(append_start, conn->sock, pending->spill_len, 1);
+    int rc = aesd_store_append_fd(&g_store, pending->spill_fd, pending->spill_len, &to);
+    AESD_TRACE4(append_end, conn->sock, pending->spill_len, to, rc);
+    op_end(conn, (uint64_t)pending->spill_len);
+    if (rc != 0) {
+        fatal_log("append of %lld byte packet failed: %s",
+                  (long long)pending->spill_len, strerror(errno));
+        return -1;
+    }
+    return reply_appended(conn, to);
+}
+
 struct client_args {
     int cfd;
+    bool tls;
     struct sockaddr_in caddr;
     struct client_thread *self;
 };
@@ -261,175 +783,458 @@ static void *handle_client_thread(void *arg)
     inet_ntop(AF_INET, &caddr->sin_addr, client_ip, sizeof(client_ip));
     syslog(LOG_INFO, "Accepted connection from %s", client_ip);
 
-    char *line_buf = NULL;
-    size_t line_cap = 0;
-    size_t line_len = 0;
+    struct client_conn conn = { .sock = cfd, .fd = cfd, .rfd = cfd, .zcache = NULL, .reply = REPLY_FULL };
+    struct timespec started;
+    clock_gettime(CLOCK_MONOTONIC, &started);
+    struct ack_batch batch = { .n = 0 };
+    struct aesd_tls *tls = NULL;
+    struct aesd_pending pending;
+    aesd_pending_init(&pending);
+    aesd_bucket_init(&conn.bytes, g_limit_bytes, 0);
+    aesd_bucket_init(&conn.packets, g_limit_packets, 0);
+    aesd_fair_flow_init(&conn.flow);
+    conn.throttled_ns = 0;
     char recvbuf[RECV_CHUNK];
 
-#if USE_AESD_CHAR_DEVICE
-    int devfd = open(AESD_PATH, O_RDWR | O_CLOEXEC);
-    if (devfd < 0) {
-        fatal_log("open(%s,O_RDWR) failed: %s", AESD_PATH, strerror(errno));
-        goto out;
+    if (pargs->tls) {
+        tls = aesd_tls_accept(cfd, &conn.rfd, &conn.fd);
+        if (!tls) goto out;
+        syslog(LOG_INFO, "TLS session with %s (%s)", client_ip, aesd_tls_mode(tls));
     }
-#endif
 
     while (!g_exit_requested) {
-        ssize_t n = recv(cfd, recvbuf, sizeof(recvbuf), 0);
+        throttle(&conn);
+        if (aesd_budget_pressure()) {
+            // Near the cap: give back the partial packet and stop reading for a while.
+            // Bounded, since an idle client may hold memory nobody else can free
+            if (aesd_pending_shed(&pending) != 0) {
+                fatal_log("spilling packet from %s failed: %s", client_ip, strerror(errno));
+                break;
+            }
+            for (int i = 0; i < PRESSURE_SLICES && !g_exit_requested; i++) {
+                if (aesd_budget_wait_room(PRESSURE_SLICE_MS)) break;
+            }
+        }
+        // Block in poll() only when nothing is queued, so idle connections see the shutdown broadcast
+        ssize_t n = recv(conn.rfd, recvbuf, sizeof(recvbuf), MSG_DONTWAIT);
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            struct pollfd pfds[2] = {
+                { .fd = conn.rfd, .events = POLLIN },
+                { .fd = g_shutdown_fd, .events = POLLIN },
+            };
+            if (poll(pfds, 2, -1) < 0 && errno != EINTR) break;
+            if (pfds[1].revents & POLLIN) break;
+            continue;
+        }
         if (n < 0) { if (errno == EINTR) continue; break; }
         if (n == 0) break;
 
-        for (ssize_t i = 0; i < n; i++) {
-            if (line_len + 1 > line_cap) {
-                size_t new_cap = line_cap ? line_cap * 2 : 1024;
-                char *tmp = realloc(line_buf, new_cap);
-                if (!tmp) { fatal_log("malloc failed; dropping fragment"); free(line_buf); line_buf=NULL; line_cap=0; line_len=0; continue; }
-                line_buf = tmp; line_cap = new_cap;
+        const char *p = recvbuf, *end = recvbuf + n;
+        while (p < end) {
+            const char *nl = memchr(p, '\n', (size_t)(end - p));
+            size_t span = nl ? (size_t)(nl - p) + 1 : (size_t)(end - p);
+            int rc = 0;
+
+            if (nl) {
+                aesd_bucket_charge(&conn.packets, 1);
+                conn.npackets++;
+                AESD_TRACE3(frame, cfd, pending.len + (size_t)pending.spill_len + span,
+                            aesd_pending_spilled(&pending));
             }
-            line_buf[line_len++] = recvbuf[i];
 
-            if (recvbuf[i] == '\n') {
-#if USE_AESD_CHAR_DEVICE
-                // NUL-terminate a copy for sscanf
-                char *z = malloc(line_len + 1);
-                if (!z) { fatal_log("malloc failed"); goto dev_out; }
-                memcpy(z, line_buf, line_len);
-                z[line_len] = '\0';
-
-                unsigned int X, Y;
-                bool is_cmd = false;
-                if (sscanf(z, "AESDCHAR_IOCSEEKTO:%u,%u", &X, &Y) == 2) {
-                    struct aesd_seekto st = { .write_cmd = X, .write_cmd_offset = Y };
-                    if (ioctl(devfd, AESDCHAR_IOCSEEKTO, &st) == -1) {
-                        fatal_log("ioctl AESDCHAR_IOCSEEKTO failed: %s", strerror(errno));
-                        // Still treat as is_cmd=true per spec (do not write the string)
-                    }
-                    is_cmd = true;           // do NOT write this string to the device
-                } else {
-                    // Normal line: write it to the device
-                    size_t off = 0;
-                    while (off < line_len) {
-                        ssize_t w = write(devfd, line_buf + off, line_len - off);
-                        if (w < 0) { if (errno == EINTR) continue; free(z); goto dev_out; }
-                        off += (size_t)w;
-                    }
-                    // Reset to beginning so we send the full device contents back
-                    if (lseek(devfd, 0, SEEK_SET) == (off_t)-1) {
-                        fatal_log("lseek to start failed: %s", strerror(errno));
-                        free(z);
-                        goto dev_out;
-                    }
-                }
-
-                // Read back and send EVERYTHING until EOF
-                for (;;) {
-                    char buf[SEND_CHUNK];
-                    ssize_t r = read(devfd, buf, sizeof buf);
-                    if (r < 0) {
-                        if (errno == EINTR) continue;
-                        free(z);
-                        goto dev_out;
-                    }
-                    if (r == 0) break; // EOF
-
-                    for (ssize_t off = 0; off < r; ) {
-                        ssize_t s = send(cfd, buf + off, (size_t)(r - off), 0);
-                        if (s < 0) { if (errno == EINTR) continue; free(z); goto dev_out; }
-                        off += s;
-                    }
-                }
-
-                free(z);
-                line_len = 0; // next line
-#else
-                pthread_mutex_lock(&g_file_mutex);
-                if (append_to_file_locked(g_data_fd, line_buf, line_len) != 0) {
-                    fatal_log("write failed: %s", strerror(errno));
-                    pthread_mutex_unlock(&g_file_mutex);
-                    goto out;
-                }
-                if (send_file_contents_locked(cfd, g_data_fd) != 0) {
-                    pthread_mutex_unlock(&g_file_mutex);
-                    goto out;
-                }
-                pthread_mutex_unlock(&g_file_mutex);
-                line_len = 0;
-#endif
+            if (nl && aesd_pending_empty(&pending) && conn.reply == REPLY_ACK && !g_follower &&
+                !is_command(p, span)) {
+                // recvbuf stays put until the batch is flushed below
+                batch.iov[batch.n].iov_base = (void *)p;
+                batch.iov[batch.n].iov_len = span;
+                if (++batch.n == ACK_BATCH) rc = flush_ack_batch(&conn, &batch);
+                if (rc != 0) goto out;
+                p += span;
+                continue;
             }
+            // Anything else is answered after the lines queued before it
+            if (flush_ack_batch(&conn, &batch) != 0) goto out;
+
+            if (nl && aesd_pending_empty(&pending)) {
+                // Whole packet in this chunk: no copy needed
+                rc = handle_packet(&conn, p, span);
+            } else if (aesd_pending_add(&pending, p, span) != 0) {
+                fatal_log("buffering packet from %s failed: %s", client_ip, strerror(errno));
+                goto out;
+            } else if (nl) {
+                if (aesd_pending_spilled(&pending)) rc = handle_spilled_packet(&conn, &pending);
+                else rc = handle_packet(&conn, pending.buf, pending.len);
+                aesd_pending_reset(&pending);
+            }
+            if (rc != 0) goto out;
+            p += span;
         }
+        if (flush_ack_batch(&conn, &batch) != 0) break;
     }
 
-#if USE_AESD_CHAR_DEVICE
-dev_out:
-    if (devfd >= 0) close(devfd);
-#endif
 out:
-    free(line_buf);
+    aesd_pending_free(&pending);
+    aesd_tls_close(tls);
+    if (conn.flow.queued || conn.throttled_ns) {
+        syslog(LOG_INFO, "%s waited for its turn %llu times (%.1f ms), throttled %.1f ms",
+               client_ip, (unsigned long long)conn.flow.queued, (double)conn.flow.wait_ns / 1e6,
+               (double)conn.throttled_ns / 1e6);
+    }
+    aesd_fair_flow_destroy(&conn.flow);
+    struct timespec ended;
+    clock_gettime(CLOCK_MONOTONIC, &ended);
+    AESD_TRACE3(close, cfd, conn.npackets,
+                (ended.tv_sec - started.tv_sec) * 1000000LL + (ended.tv_nsec - started.tv_nsec) / 1000);
     syslog(LOG_INFO, "Closed connection from %s", client_ip);
-    self->done = true;
+    // Closed under the lock, so the drain never shuts down a reused descriptor
+    pthread_mutex_lock(&g_list_mutex);
     close(cfd);
+    self->done = true;
+    g_live--;
+    pthread_cond_signal(&g_list_cond);
+    pthread_mutex_unlock(&g_list_mutex);
     free(pargs);
     return NULL;
 }
 
+// ---------- store startup ----------
+
+struct store_setup {
+    const struct aesd_store_ops *ops;
+    const char *path;
+    unsigned flags;
+    const char *hugemem;
+    const char *leader_port;
+    const char *follow;
+};
+
+static double ms_since_start(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)(ts.tv_sec - g_start.tv_sec) * 1e3 + (double)(ts.tv_nsec - g_start.tv_nsec) / 1e6;
+}
+
+/*
+ * Open the store and everything hanging off it: caches, filter,
+ * replication and the timestamp thread.  Runs before the accept loop, or
+ * with -i once the first client is accepted, so that client's wait is
+ * the whole cold start.  Everything started here is undone on failure.
+ */
+static int open_store(const struct store_setup *ss)
+{
+    // After the fork: neither locks nor a prefaulted reserve survive into the child
+    if (ss->hugemem && aesd_hugemem_configure(ss->hugemem) != 0) {
+        fatal_log("bad -H '%s': %s", ss->hugemem, strerror(errno));
+        return -1;
+    }
+
+    if (aesd_store_open(&g_store, ss->ops, ss->path, ss->flags) != 0) {
+        fatal_log("open %s store failed: %s", ss->ops->name, strerror(errno));
+        return -1;
+    }
+
+    // One compressed cache per built-in codec; nothing is compressed until asked
+    char codecs[64];
+    char *save = NULL;
+    snprintf(codecs, sizeof(codecs), "%s", aesd_zcache_codecs());
+    for (char *name = strtok_r(codecs, " ", &save); name && g_nzcache < MAX_ZCACHES;
+         name = strtok_r(NULL, " ", &save)) {
+        struct aesd_zcache *zc = aesd_zcache_new(&g_store, name);
+        if (zc) g_zcache[g_nzcache++] = zc;
+        else fatal_log("%s cache unavailable: %s", name, strerror(errno));
+    }
+
+    g_filter = aesd_filter_new(&g_store);
+
+    if ((ss->leader_port && aesd_repl_leader_start(&g_store, ss->leader_port) != 0) ||
+        (ss->follow && aesd_repl_follower_start(&g_store, ss->follow) != 0)) {
+        fatal_log("starting replication failed: %s", strerror(errno));
+        goto fail;
+    }
+
+    // A follower gets the leader's timestamps through the stream
+    if (ss->ops->timestamps && !g_follower) {
+        if (pthread_create(&g_time_tid, NULL, timestamp_thread, NULL) != 0) {
+            fatal_log("timestamp thread create failed");
+            goto fail;
+        }
+        g_time_started = true;
+    }
+
+    g_store_ready = true;
+    syslog(LOG_INFO, "Using %s store, %s chunks, ready %.1f ms after start",
+           ss->ops->name, aesd_hugemem_describe(), ms_since_start());
+    return 0;
+
+fail:
+    aesd_repl_stop();
+    for (size_t i = 0; i < g_nzcache; i++) aesd_zcache_free(g_zcache[i]);
+    g_nzcache = 0;
+    aesd_filter_free(g_filter);
+    g_filter = NULL;
+    aesd_store_close(&g_store);
+    return -1;
+}
+
 // ---------- main ----------
 
+/* Join the client threads that have finished, giving back their stacks */
+static void reap_finished(void)
+{
+    pthread_mutex_lock(&g_list_mutex);
+    struct client_thread *it = SLIST_FIRST(&g_thread_head);
+    struct client_thread *next;
+    while (it) {
+        next = SLIST_NEXT(it, entries);
+        if (it->done) {
+            pthread_t tid = it->tid;
+            SLIST_REMOVE(&g_thread_head, it, client_thread, entries);
+            pthread_mutex_unlock(&g_list_mutex);
+            pthread_join(tid, NULL);
+            aesd_budget_release(AESD_BUDGET_STACK, CLIENT_STACK_SIZE);
+            // Client fd closed in thread
+            free(it);
+            pthread_mutex_lock(&g_list_mutex);
+        }
+        it = next;
+    }
+    pthread_mutex_unlock(&g_list_mutex);
+}
+
 int main(int argc, char *argv[])
 {
+    clock_gettime(CLOCK_MONOTONIC, &g_start);
     openlog("aesdsocket", LOG_PID | LOG_CONS, LOG_USER);
-    signal(SIGINT,  signal_handler);
-    signal(SIGTERM, signal_handler);
     signal(SIGPIPE, SIG_IGN);
 
-    bool daemon_mode = false;
-    if (argc == 2 && strcmp(argv[1], "-d") == 0) daemon_mode = true;
+    // SIGINT/SIGTERM are only read from g_signal_fd; blocked before any thread exists so all inherit it
+    sigset_t stop_signals;
+    sigemptyset(&stop_signals);
+    sigaddset(&stop_signals, SIGINT);
+    sigaddset(&stop_signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &stop_signals, NULL);
+    g_signal_fd = signalfd(-1, &stop_signals, SFD_CLOEXEC);
+    g_shutdown_fd = eventfd(0, EFD_CLOEXEC);
+    if (g_signal_fd < 0 || g_shutdown_fd < 0) {
+        fprintf(stderr, "signalfd/eventfd: %s\n", strerror(errno));
+        closelog();
+        return EXIT_FAILURE;
+    }
 
-    g_listen_fd = make_listen_socket();
-    if (g_listen_fd < 0) {
+    bool daemon_mode = false;
+    const char *backend = DEFAULT_BACKEND;
+    const char *port = SERVER_PORT;
+    const char *store_path = NULL;
+    unsigned store_flags = 0;
+    const char *leader_port = NULL;
+    const char *follow = NULL;
+    const char *tls_port = NULL;
+    const char *tls_cert = NULL;
+    const char *tls_key = NULL;
+    bool want_ktls = true;
+    unsigned fair_slots = 0;
+    unsigned long long fair_quantum = AESD_FAIR_DEFAULT_QUANTUM;
+    const char *hugemem = NULL;
+    bool lazy = false;
+    unsigned long long mem_cap_mib = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "db:p:s:ckL:F:T:C:K:ul:q:H:ig:M:")) != -1) {
+        switch (opt) {
+        case 'd': daemon_mode = true; break;
+        case 'b': backend = optarg; break;
+        case 'p': port = optarg; break;
+        case 's': store_path = optarg; break;
+        case 'c': store_flags |= AESD_STORE_CRC; break;
+        case 'k': store_flags |= AESD_STORE_KEEP; break;
+        case 'L': leader_port = optarg; break;
+        case 'F': follow = optarg; break;
+        case 'T': tls_port = optarg; break;
+        case 'C': tls_cert = optarg; break;
+        case 'K': tls_key = optarg; break;
+        case 'u': want_ktls = false; break;
+        case 'l':
+            if (sscanf(optarg, "%lf,%lf", &g_limit_bytes, &g_limit_packets) < 1) goto usage;
+            break;
+        case 'q':
+            if (sscanf(optarg, "%u,%llu", &fair_slots, &fair_quantum) < 1) goto usage;
+            break;
+        case 'H': hugemem = optarg; break;
+        case 'i': lazy = true; break;
+        case 'g':
+            if (sscanf(optarg, "%d", &g_drain_ms) != 1 || g_drain_ms < 0) goto usage;
+            break;
+        case 'M':
+            if (sscanf(optarg, "%llu", &mem_cap_mib) != 1) goto usage;
+            break;
+        default:
+        usage:
+            fprintf(stderr, "Usage: %s [-d] [-b backend] [-p port] [-s store path] [-c] [-k]"
+                    " [-L repl port | -F leader:port] [-T tls port -C cert -K key [-u]]"
+                    " [-l bytes/s[,packets/s]] [-q slots[,quantum]] [-H hugemem spec] [-i] [-g drain ms]"
+                    " [-M memory cap MiB]"
+                    "\n  backends: %s (default %s)\n",
+                    argv[0], aesd_store_names(), DEFAULT_BACKEND);
+            closelog();
+            return EXIT_FAILURE;
+        }
+    }
+    const struct aesd_store_ops *store_ops = aesd_store_lookup(backend);
+    if (!store_ops) {
+        fprintf(stderr, "Unknown backend '%s', choose one of: %s\n", backend, aesd_store_names());
+        closelog();
+        return EXIT_FAILURE;
+    }
+    if (leader_port && follow) {
+        fprintf(stderr, "-L and -F are mutually exclusive\n");
+        closelog();
+        return EXIT_FAILURE;
+    }
+    if (follow && (store_flags & AESD_STORE_KEEP)) {
+        fprintf(stderr, "-k cannot be used with -F: a follower mirrors the leader from offset 0\n");
+        closelog();
+        return EXIT_FAILURE;
+    }
+    // Replication ships byte offsets, which the driver's ring does not keep
+    if ((leader_port || follow) && !store_ops->stable_offsets) {
+        fprintf(stderr, "Replication needs a backend with stable offsets, not %s\n", store_ops->name);
+        closelog();
+        return EXIT_FAILURE;
+    }
+    g_follower = (follow != NULL);
+    aesd_budget_init((uint64_t)mem_cap_mib << 20);
+    if (lazy && (leader_port || follow)) {
+        fprintf(stderr, "-i cannot be used with -L or -F: replication starts with the store\n");
         closelog();
         return EXIT_FAILURE;
     }
 
-    if (daemon_mode) daemonize();
+    // Sockets passed by systemd or a stand-in take the place of -p and -T
+    int passed[2];
+    const char *passed_names[2];
+    int npassed = aesd_listenfds(passed, passed_names, 2);
+    if (npassed < 0) {
+        fprintf(stderr, "Unusable passed sockets: %s\n", strerror(errno));
+        closelog();
+        return EXIT_FAILURE;
+    }
+    for (int i = 0; i < npassed; i++) {
+        // The one named "tls" (FileDescriptorName=tls), else the second, is the TLS listener
+        if (strcmp(passed_names[i], "tls") == 0 || g_listen_fd >= 0) g_tls_listen_fd = passed[i];
+        else g_listen_fd = passed[i];
+    }
+    if (npassed > 0 && g_listen_fd < 0) {
+        fprintf(stderr, "Passed sockets include no plain listener\n");
+        closelog();
+        return EXIT_FAILURE;
+    }
+    if (npassed > 0) {
+        syslog(LOG_INFO, "Socket activated: %d listener(s), TLS %s", npassed,
+               g_tls_listen_fd >= 0 ? "passed" : "off");
+        tls_port = g_tls_listen_fd >= 0 ? "passed" : NULL;
+    }
 
-    #if !USE_AESD_CHAR_DEVICE
-    g_data_fd = open_data_file();
-    if (g_data_fd < 0) {
-        fatal_log("open data file failed: %s", strerror(errno));
-        close(g_listen_fd);
+    if (tls_port && (!tls_cert || !tls_key)) {
+        fprintf(stderr, "-T needs -C <cert> and -K <key>\n");
+        closelog();
+        return EXIT_FAILURE;
+    }
+    if (fair_slots && aesd_fair_init(&g_fair, fair_slots, fair_quantum) != 0) {
+        fprintf(stderr, "-q needs at least one slot and a non-zero quantum\n");
+        closelog();
+        return EXIT_FAILURE;
+    }
+    g_fair_on = fair_slots > 0;
+    if (tls_port && aesd_tls_init(tls_cert, tls_key, want_ktls) != 0) {
+        fprintf(stderr, "TLS setup failed: %s\n", strerror(errno));
         closelog();
         return EXIT_FAILURE;
     }
 
-    // Ensure we start with a clean file for each run
-    if (ftruncate(g_data_fd, 0) != 0) {
-        fatal_log("ftruncate failed: %s", strerror(errno));
-        close(g_listen_fd);
-        close(g_data_fd);
+    if (npassed == 0) g_listen_fd = make_listen_socket(port);
+    if (npassed == 0 && tls_port && g_listen_fd >= 0) {
+        g_tls_listen_fd = make_listen_socket(tls_port);
+        if (g_tls_listen_fd < 0) {
+            close(g_listen_fd);
+            g_listen_fd = -1;
+        }
+    }
+    if (g_listen_fd < 0) {
+        aesd_tls_cleanup();
         closelog();
         return EXIT_FAILURE;
     }
 
-    if (pthread_create(&g_time_tid, NULL, timestamp_thread, NULL) != 0) {
-        fatal_log("timestamp thread create failed");
+    if (daemon_mode) daemonize();
+
+    struct store_setup setup = {
+        .ops = store_ops, .path = store_path, .flags = store_flags, .hugemem = hugemem,
+        .leader_port = leader_port, .follow = follow,
+    };
+    if (!lazy && open_store(&setup) != 0) {
         close(g_listen_fd);
-        close(g_data_fd);
+        if (g_tls_listen_fd >= 0) close(g_tls_listen_fd);
+        aesd_tls_cleanup();
         closelog();
         return EXIT_FAILURE;
     }
-    #endif
 
-    // Accept loop
+    // Client threads get a small fixed stack, so each one costs a known amount of the budget
+    pthread_attr_t client_attr;
+    pthread_attr_init(&client_attr);
+    pthread_attr_setstacksize(&client_attr, CLIENT_STACK_SIZE);
+
+    // Accept loop; the TLS listener (if any) and the stop signals are polled alongside the plain one
+    int rc = EXIT_SUCCESS;
+    bool accepting = true;
+    struct pollfd lfds[3] = {
+        { .fd = g_listen_fd, .events = POLLIN },
+        { .fd = g_tls_listen_fd, .events = POLLIN },    // -1 is skipped by poll()
+        { .fd = g_signal_fd, .events = POLLIN },
+    };
     while (!g_exit_requested) {
         struct sockaddr_in caddr;
         socklen_t clen = sizeof(caddr);
-        int cfd = accept(g_listen_fd, (struct sockaddr *)&caddr, &clen);
+        // Over the cap new clients wait in the backlog until a thread's stack is given back;
+        // a TLS client may need a pump thread on top
+        bool room = aesd_budget_room(CLIENT_STACK_SIZE);
+        bool tls_room = aesd_budget_room(CLIENT_STACK_SIZE + aesd_tls_pump_cost());
+        if (room != accepting) {
+            syslog(LOG_INFO, room ? "Memory back under the cap, accepting" :
+                   "Memory cap reached, not accepting new connections");
+            accepting = room;
+        }
+        lfds[0].events = room ? POLLIN : 0;
+        lfds[1].events = tls_room ? POLLIN : 0;
+        if (poll(lfds, 3, room && (tls_room || g_tls_listen_fd < 0) ? -1 : ACCEPT_RETRY_MS) < 0) {
+            if (errno == EINTR) continue;
+            fatal_log("poll on listeners failed: %s", strerror(errno));
+            break;
+        }
+        if (lfds[2].revents & POLLIN) {
+            struct signalfd_siginfo si;
+            if (read(g_signal_fd, &si, sizeof(si)) == (ssize_t)sizeof(si)) {
+                syslog(LOG_INFO, "Caught signal %u, exiting", si.ssi_signo);
+            }
+            break;
+        }
+        if (!((lfds[0].revents | lfds[1].revents) & POLLIN)) {
+            reap_finished();
+            continue;
+        }
+        bool tls = !(lfds[0].revents & POLLIN);
+        int cfd = accept(tls ? g_tls_listen_fd : g_listen_fd, (struct sockaddr *)&caddr, &clen);
         if (cfd < 0) {
-            if (errno == EINTR && g_exit_requested) break;
             if (errno == EINTR) continue;
             fatal_log("accept failed: %s", strerror(errno));
             continue;
         }
+        AESD_TRACE2(accept, cfd, tls);
+        if (!g_store_ready && open_store(&setup) != 0) {
+            close(cfd);
+            rc = EXIT_FAILURE;
+            break;
+        }
 
         struct client_thread *node = calloc(1, sizeof(*node));
         if (!node) {
@@ -449,11 +1254,20 @@ int main(int argc, char *argv[])
             continue;
         }
         args->cfd = cfd;
+        args->tls = tls;
         args->caddr = caddr;
         args->self = node;
 
-        if (pthread_create(&node->tid, NULL, handle_client_thread, args) != 0) {
+        pthread_mutex_lock(&g_list_mutex);
+        g_live++;
+        pthread_mutex_unlock(&g_list_mutex);
+        aesd_budget_charge(AESD_BUDGET_STACK, CLIENT_STACK_SIZE);
+        if (pthread_create(&node->tid, &client_attr, handle_client_thread, args) != 0) {
             fatal_log("pthread_create failed");
+            aesd_budget_release(AESD_BUDGET_STACK, CLIENT_STACK_SIZE);
+            pthread_mutex_lock(&g_list_mutex);
+            g_live--;
+            pthread_mutex_unlock(&g_list_mutex);
             close(cfd);
             free(args);
             free(node);
@@ -464,69 +1278,100 @@ int main(int argc, char *argv[])
         SLIST_INSERT_HEAD(&g_thread_head, node, entries);
         pthread_mutex_unlock(&g_list_mutex);
 
-        // Opportunistically reap finished threads using manual SAFE traversal
-        pthread_mutex_lock(&g_list_mutex);
-        struct client_thread *it = SLIST_FIRST(&g_thread_head);
-        struct client_thread *next;
-        while (it) {
-            next = SLIST_NEXT(it, entries);
-            if (it->done) {
-                pthread_t tid = it->tid;
-                SLIST_REMOVE(&g_thread_head, it, client_thread, entries);
-                pthread_mutex_unlock(&g_list_mutex);
-                pthread_join(tid, NULL);
-                // Client fd closed in thread
-                free(it);
-                pthread_mutex_lock(&g_list_mutex);
-            }
-            it = next;
-        }
-        pthread_mutex_unlock(&g_list_mutex);
+        // Opportunistically reap finished threads
+        reap_finished();
     }
+    pthread_attr_destroy(&client_attr);
 
-    // Shutdown
-    syslog(LOG_INFO, "Caught signal, exiting");
+    // Shutdown: one broadcast wakes every idle reader, subscriber and sleeper
+    pthread_mutex_lock(&g_list_mutex);
+    size_t draining = g_live;
+    pthread_mutex_unlock(&g_list_mutex);
+    double drain_start = ms_since_start();
+    request_shutdown();
 
     if (g_listen_fd >= 0) {
         close(g_listen_fd);
         g_listen_fd = -1;
     }
+    if (g_tls_listen_fd >= 0) {
+        close(g_tls_listen_fd);
+        g_tls_listen_fd = -1;
+    }
 
-    // Ask all clients to exit and join them
+    /*
+     * Drain: a client thread finishes the packets it has already received,
+     * replies included, then exits by itself.  Only threads still busy at
+     * the -g deadline, typically sending to a client that stopped reading,
+     * get their socket shut down.
+     */
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += g_drain_ms / 1000;
+    deadline.tv_nsec += (long)(g_drain_ms % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+    size_t cut = 0;
     pthread_mutex_lock(&g_list_mutex);
-    struct client_thread *it = SLIST_FIRST(&g_thread_head);
-    for (; it; it = SLIST_NEXT(it, entries)) {
-        shutdown(it->client_fd, SHUT_RDWR); // unblock recv()
+    while (g_live > 0 && pthread_cond_timedwait(&g_list_cond, &g_list_mutex, &deadline) != ETIMEDOUT) {
     }
-    it = SLIST_FIRST(&g_thread_head);
-    struct client_thread *next;
-    while (it) {
-        next = SLIST_NEXT(it, entries);
-        SLIST_REMOVE(&g_thread_head, it, client_thread, entries);
+    struct client_thread *it;
+    SLIST_FOREACH(it, &g_thread_head, entries) {
+        if (it->done) continue;
+        shutdown(it->client_fd, SHUT_RDWR);
+        cut++;
+    }
+    while ((it = SLIST_FIRST(&g_thread_head)) != NULL) {
+        SLIST_REMOVE_HEAD(&g_thread_head, entries);
         pthread_mutex_unlock(&g_list_mutex);
         pthread_join(it->tid, NULL);
-        close(it->client_fd);
+        aesd_budget_release(AESD_BUDGET_STACK, CLIENT_STACK_SIZE);
         free(it);
         pthread_mutex_lock(&g_list_mutex);
-        it = next;
     }
-    SLIST_INIT(&g_thread_head);
     pthread_mutex_unlock(&g_list_mutex);
+    syslog(LOG_INFO, "Drained %zu connections in %.1f ms, %zu cut off after %d ms",
+           draining, ms_since_start() - drain_start, cut, g_drain_ms);
 
-    #if !USE_AESD_CHAR_DEVICE
     // Stop timestamp thread
-    pthread_join(g_time_tid, NULL);
+    if (g_time_started) pthread_join(g_time_tid, NULL);
 
-    if (g_data_fd >= 0) {
-        close(g_data_fd);
-        g_data_fd = -1;
-    }
+    aesd_repl_stop();
 
-    if (unlink(DATAFILE) != 0 && errno != ENOENT) {
-        fatal_log("unlink(%s) failed: %s", DATAFILE, strerror(errno));
+    if (g_store_ready) {
+        struct aesd_store_stats stats;
+        aesd_store_stats(&g_store, &stats);
+        syslog(LOG_INFO, "%s store: %llu bytes, %llu appends, %llu replays (%llu bytes sent)",
+               store_ops->name, (unsigned long long)stats.bytes, (unsigned long long)stats.appends,
+               (unsigned long long)stats.replays, (unsigned long long)stats.replay_bytes);
+    }
+    struct aesd_budget_stats bs;
+    aesd_budget_stats(&bs);
+    syslog(LOG_INFO, "memory: peak %llu bytes of %llu cap, %llu pressure waits, %llu refused charges",
+           (unsigned long long)bs.peak, (unsigned long long)bs.cap,
+           (unsigned long long)bs.pressure_waits, (unsigned long long)bs.refused);
+    for (size_t i = 0; i < g_nzcache; i++) aesd_zcache_free(g_zcache[i]);
+    aesd_filter_free(g_filter);
+    if (hugemem) {
+        struct aesd_hugemem_stats hm;
+        aesd_hugemem_stats(&hm);
+        syslog(LOG_INFO, "hugemem: %llu chunks in use, %llu hugetlb, %llu pooled, %llu mlock failures",
+               (unsigned long long)hm.chunks, (unsigned long long)hm.hugetlb,
+               (unsigned long long)hm.pooled, (unsigned long long)hm.lock_failures);
+    }
+    aesd_store_close(&g_store);
+    aesd_hugemem_cleanup();
+    aesd_tls_cleanup();
+    if (g_fair_on) {
+        syslog(LOG_INFO, "fair scheduler: %llu operations, %llu waited for a slot",
+               (unsigned long long)g_fair.grants, (unsigned long long)g_fair.queued);
+        aesd_fair_destroy(&g_fair);
     }
-    #endif
 
+    close(g_signal_fd);
+    close(g_shutdown_fd);
     closelog();
-    return EXIT_SUCCESS;
+    return rc;
 }
@@ -0,0 +1,311 @@
+/**
+ * aesdstorebench.c
+ *
+ * - In-process benchmark of the aesdsocket storage backends
+ * - -t threads each append -n records of -s bytes to a fresh store, then the
+ *   whole store is replayed once into a socketpair drained by another thread
+ * - seek_us is the mean cost of seeking to a record spread evenly over the
+ *   store, the way AESDCHAR_IOCSEEKTO and LINES: find their start
+ * - Records start with "t<thread> n<index> " so -f has something to tell
+ *   apart; with -u each thread cycles through that many distinct records,
+ *   which is what the dedup backend feeds on; -f runs a filtered replay twice, with a cold and a warm line
+ *   cache, and reports the bytes scanned per second
+ * - Backends that deduplicate also get a "RESULT mode=dedup" line with the
+ *   space saved and the cost of hashing one record
+ * - -c opens backends that support it with AESD_STORE_CRC | AESD_STORE_KEEP,
+ *   then reopens the store and prints a "RESULT mode=crc" line with the
+ *   CRC-32C speed and how fast the reopen validated the whole store
+ * - -H <spec> configures aesd-hugemem.h before the first store opens, so
+ *   the mem and dedup numbers can be compared across page policies
+ * - Runs every backend given with -b (comma separated, default "file,mem")
+ *   and prints one "RESULT mode=store ..." line per backend
+*/
+
+#define _GNU_SOURCE
+
+#define SEEK_SAMPLES 200
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "aesd-filter.h"
+#include "aesd-hash.h"
+#include "aesd-hugemem.h"
+#include "aesd-store.h"
+
+struct bench_args {
+    struct aesd_store *store;
+    int id;
+    int records;
+    int distinct;
+    size_t size;
+    int failed;
+};
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static void *append_thread(void *arg)
+{
+    struct bench_args *a = arg;
+    char *rec = malloc(a->size);
+    if (!rec) {
+        a->failed = 1;
+        return NULL;
+    }
+    memset(rec, 'r', a->size - 1);
+    rec[a->size - 1] = '\n';
+    for (int i = 0; i < a->records; i++) {
+        char tag[32];
+        int n = snprintf(tag, sizeof(tag), "t%02d n%08d ", a->id, i % a->distinct);
+        memcpy(rec, tag, (size_t)n < a->size - 1 ? (size_t)n : a->size - 1);
+        if (aesd_store_append(a->store, rec, a->size, NULL) != 0) {
+            a->failed = 1;
+            break;
+        }
+    }
+    free(rec);
+    return NULL;
+}
+
+static void *drain_thread(void *arg)
+{
+    int fd = *(int *)arg;
+    char buf[65536];
+    while (read(fd, buf, sizeof(buf)) > 0) {
+    }
+    return NULL;
+}
+
+// One filtered replay of [0, end) into a drained socketpair; seconds, or -1
+static double filter_once(struct aesd_filter *f, const char *pattern, off_t end, off_t *matched)
+{
+    int sv[2];
+    pthread_t drain;
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0) return -1;
+    pthread_create(&drain, NULL, drain_thread, &sv[1]);
+    uint64_t t0 = now_ns();
+    *matched = aesd_filter_send(f, pattern, strlen(pattern), end, sv[0]);
+    double s = (double)(now_ns() - t0) / 1e9;
+    shutdown(sv[0], SHUT_WR);
+    pthread_join(drain, NULL);
+    close(sv[0]);
+    close(sv[1]);
+    return *matched < 0 ? -1 : s;
+}
+
+static int run_filter(const char *name, struct aesd_store *store, const char *pattern)
+{
+    struct aesd_filter *f = aesd_filter_new(store);
+    if (!f) {
+        printf("RESULT mode=filter backend=%s skipped=%s\n", name, strerror(errno));
+        return 0;
+    }
+    off_t end = aesd_store_committed(store), matched = 0;
+    double cold = filter_once(f, pattern, end, &matched);
+    double warm = filter_once(f, pattern, end, &matched);
+    aesd_filter_free(f);
+    if (cold <= 0 || warm <= 0) {
+        fprintf(stderr, "filter on %s failed: %s\n", name, strerror(errno));
+        return -1;
+    }
+    printf("RESULT mode=filter backend=%s impl=%s pattern=%s store_bytes=%lld matched_bytes=%lld "
+           "filter_gb_per_s_cold=%.2f filter_gb_per_s_warm=%.2f\n",
+           name, aesd_filter_impl(), pattern, (long long)end, (long long)matched,
+           (double)end / cold / 1e9, (double)end / warm / 1e9);
+    return 0;
+}
+
+static void report_dedup(const char *name, const struct aesd_store_stats *stats, size_t size)
+{
+    char *rec = malloc(size);
+    if (!rec) return;
+    memset(rec, 'r', size);
+    volatile uint64_t sink = 0;     // keeps the loop from being optimized out
+    int n = 100000;
+    uint64_t t0 = now_ns();
+    for (int i = 0; i < n; i++) {
+        rec[i % size] = (char)i;
+        sink += aesd_hash64(rec, size);
+    }
+    double ns = (double)(now_ns() - t0) / n;
+    free(rec);
+
+    printf("RESULT mode=dedup backend=%s hash=%s logical_bytes=%llu stored_bytes=%llu saved_pct=%.1f "
+           "hash_ns_per_record=%.1f hash_gb_per_s=%.2f\n",
+           name, aesd_hash64_impl(), (unsigned long long)stats->bytes,
+           (unsigned long long)stats->stored_bytes,
+           stats->bytes ? 100.0 * (1.0 - (double)stats->stored_bytes / (double)stats->bytes) : 0.0,
+           ns, (double)size / ns);
+}
+
+/* Reopen a kept store and time its validation; it must come back whole */
+static int run_recover(const char *name, const struct aesd_store_ops *ops, const char *path,
+                       unsigned flags, uint64_t expect)
+{
+    struct aesd_store store;
+    struct aesd_store_stats stats;
+    uint64_t t0 = now_ns();
+    if (aesd_store_open(&store, ops, path, flags) != 0) {
+        fprintf(stderr, "reopen %s failed: %s\n", name, strerror(errno));
+        return -1;
+    }
+    double recover_s = (double)(now_ns() - t0) / 1e9;
+    aesd_store_stats(&store, &stats);
+    aesd_store_close(&store);
+
+    size_t len = 1024 * 1024;
+    char *buf = malloc(len);
+    if (!buf) return -1;
+    memset(buf, 'r', len);
+    uint32_t crc = 0;
+    t0 = now_ns();
+    for (int i = 0; i < 1000; i++) crc = aesd_crc32c(crc, buf, len);
+    double crc_s = (double)(now_ns() - t0) / 1e9;
+    free(buf);
+
+    printf("RESULT mode=crc backend=%s impl=%s crc_gb_per_s=%.2f recovered_bytes=%llu "
+           "recover_gb_per_s=%.2f errors=%d\n",
+           name, aesd_crc32c_impl(), 1000.0 * (double)len / crc_s / 1e9,
+           (unsigned long long)stats.bytes, (double)stats.bytes / recover_s / 1e9,
+           stats.bytes != expect);
+    return stats.bytes == expect ? 0 : -1;
+}
+
+static int run_backend(const char *name, int threads, int records, int distinct, size_t size,
+                       const char *pattern, bool crc)
+{
+    const struct aesd_store_ops *ops = aesd_store_lookup(name);
+    struct aesd_store store;
+    char path[64], crc_path[80];
+    if (!ops) {
+        fprintf(stderr, "unknown backend %s\n", name);
+        return -1;
+    }
+    // A kept store must not pick up anything an earlier run left behind
+    unsigned flags = crc ? ops->flags & (AESD_STORE_CRC | AESD_STORE_KEEP) : 0;
+    snprintf(path, sizeof(path), "/var/tmp/aesdstorebench-%d", (int)getpid());
+    snprintf(crc_path, sizeof(crc_path), "%s" AESD_STORE_CRC_SUFFIX, path);
+    if (flags) {
+        unlink(path);
+        unlink(crc_path);
+    }
+    if (aesd_store_open(&store, ops, flags ? path : NULL, flags) != 0) {
+        fprintf(stderr, "open %s failed: %s\n", name, strerror(errno));
+        return -1;
+    }
+
+    pthread_t *tids = calloc((size_t)threads, sizeof(*tids));
+    struct bench_args *args = calloc((size_t)threads, sizeof(*args));
+    if (!tids || !args) return -1;
+
+    uint64_t t0 = now_ns();
+    for (int i = 0; i < threads; i++) {
+        args[i] = (struct bench_args){ .store = &store, .id = i, .records = records,
+                                    .distinct = distinct, .size = size };
+        pthread_create(&tids[i], NULL, append_thread, &args[i]);
+    }
+    int failed = 0;
+    for (int i = 0; i < threads; i++) {
+        pthread_join(tids[i], NULL);
+        failed |= args[i].failed;
+    }
+    double append_s = (double)(now_ns() - t0) / 1e9;
+
+    // Replay everything through a socket, like a client reply
+    int sv[2];
+    pthread_t drain;
+    double replay_s = 0;
+    struct aesd_store_stats stats;
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0) {
+        pthread_create(&drain, NULL, drain_thread, &sv[1]);
+        t0 = now_ns();
+        if (aesd_store_replay(&store, 0, -1, sv[0]) != 0) failed = 1;
+        replay_s = (double)(now_ns() - t0) / 1e9;
+        shutdown(sv[0], SHUT_WR);
+        pthread_join(drain, NULL);
+        close(sv[0]);
+        close(sv[1]);
+    }
+    // Spread the seeks over the whole store so scanning backends pay on average
+    t0 = now_ns();
+    for (int i = 0; i < SEEK_SAMPLES; i++) {
+        off_t pos;
+        uint32_t cmd = (uint32_t)((uint64_t)threads * records * (2 * i + 1) / (2 * SEEK_SAMPLES));
+        if (aesd_store_seek_cmd(&store, cmd, 0, &pos) != 0 || pos != (off_t)cmd * (off_t)size) failed = 1;
+    }
+    double seek_us = (double)(now_ns() - t0) / 1e3 / SEEK_SAMPLES;
+
+    aesd_store_stats(&store, &stats);
+    if (stats.stored_bytes) report_dedup(name, &stats, size);
+    if (pattern && run_filter(name, &store, pattern) != 0) failed = 1;
+    aesd_store_close(&store);
+    if (flags) {
+        if (run_recover(name, ops, path, flags, stats.bytes) != 0) failed = 1;
+        unlink(path);
+        unlink(crc_path);
+    }
+
+    double total = (double)threads * records;
+    printf("RESULT mode=store backend=%s threads=%d records=%.0f size=%zu appends_per_s=%.0f "
+           "append_mb_per_s=%.1f replay_mb_per_s=%.1f seek_us=%.2f errors=%d\n",
+           name, threads, total, size, total / append_s,
+           total * (double)size / append_s / 1e6,
+           replay_s > 0 ? (double)stats.bytes / replay_s / 1e6 : 0.0, seek_us, failed);
+    free(tids);
+    free(args);
+    return failed ? -1 : 0;
+}
+
+int main(int argc, char *argv[])
+{
+    char backends[128] = "file,mem";
+    int threads = 4, records = 100000, distinct = 0;
+    size_t size = 64;
+    const char *pattern = NULL;
+    bool crc = false;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "b:t:n:s:u:f:cH:")) != -1) {
+        switch (opt) {
+        case 'b': snprintf(backends, sizeof(backends), "%s", optarg); break;
+        case 't': threads = atoi(optarg); break;
+        case 'n': records = atoi(optarg); break;
+        case 's': size = (size_t)strtoul(optarg, NULL, 10); break;
+        case 'u': distinct = atoi(optarg); break;
+        case 'f': pattern = optarg; break;
+        case 'c': crc = true; break;
+        case 'H':
+            if (aesd_hugemem_configure(optarg) != 0) {
+                fprintf(stderr, "bad -H '%s': %s\n", optarg, strerror(errno));
+                return EXIT_FAILURE;
+            }
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-b backend,...] [-t threads] [-n records] [-s size] [-u distinct] [-f pattern] [-c]"
+                    " [-H hugemem spec]\n"
+                    "  backends: %s\n", argv[0], aesd_store_names());
+            return EXIT_FAILURE;
+        }
+    }
+    if (threads < 1 || records < 1 || size < 2) return EXIT_FAILURE;
+    if (distinct < 1 || distinct > records) distinct = records;
+
+    int rc = EXIT_SUCCESS;
+    char *save = NULL;
+    for (char *name = strtok_r(backends, ",", &save); name; name = strtok_r(NULL, ",", &save)) {
+        if (run_backend(name, threads, records, distinct, size, pattern, crc) != 0) rc = EXIT_FAILURE;
+    }
+    aesd_hugemem_cleanup();
+    return rc;
+}
@@ -0,0 +1,140 @@
+#include "unity.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../../aesd-char-driver/aesd-circular-buffer.h"
+
+/**
+* Randomized model based test of the circular buffer.
+* Thousands of random add_entry/find_entry_offset_for_fpos sequences are run
+* against a plain array model of the last AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED
+* writes, and every result (entry pointer, byte offset, NULL past the end,
+* in_offs/out_offs/full bookkeeping) must match the model.
+* Set AESD_TEST_SEED in the environment to replay a specific sequence.
+*/
+
+#define MODEL_SEQUENCES 2000
+#define MODEL_OPS_PER_SEQUENCE 200
+#define MODEL_MAX_ENTRY_SIZE 24
+#define RING AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED
+
+/* Every added entry points at a distinct byte of this pool so entries can be told apart */
+static char model_pool[MODEL_OPS_PER_SEQUENCE];
+
+struct model {
+	struct aesd_buffer_entry entries[RING];  /* oldest first */
+	size_t count;
+	size_t total;
+	size_t adds;
+};
+
+static uint64_t model_rng;
+
+static uint32_t model_rand(void)
+{
+	model_rng ^= model_rng << 13;
+	model_rng ^= model_rng >> 7;
+	model_rng ^= model_rng << 17;
+	return (uint32_t)(model_rng >> 32);
+}
+
+static void model_add(struct model *m, const struct aesd_buffer_entry *e)
+{
+	if (m->count == RING) {
+		m->total -= m->entries[0].size;
+		memmove(&m->entries[0], &m->entries[1], (RING - 1) * sizeof(m->entries[0]));
+		m->count--;
+	}
+	m->entries[m->count++] = *e;
+	m->total += e->size;
+	m->adds++;
+}
+
+/* Reference lookup: walk oldest to newest, zero sized entries never match */
+static const struct aesd_buffer_entry *model_find(const struct model *m, size_t offset, size_t *entry_offset)
+{
+	size_t i;
+	for (i = 0; i < m->count; i++) {
+		if (offset < m->entries[i].size) {
+			*entry_offset = offset;
+			return &m->entries[i];
+		}
+		offset -= m->entries[i].size;
+	}
+	return NULL;
+}
+
+static void check_find(struct aesd_circular_buffer *buffer, const struct model *m, size_t offset, char *msg)
+{
+	size_t expected_offset = 0, actual_offset = (size_t)-1;
+	const struct aesd_buffer_entry *expected = model_find(m, offset, &expected_offset);
+	struct aesd_buffer_entry *actual =
+		aesd_circular_buffer_find_entry_offset_for_fpos(buffer, offset, &actual_offset);
+
+	if (!expected) {
+		TEST_ASSERT_NULL_MESSAGE(actual, msg);
+		return;
+	}
+	TEST_ASSERT_NOT_NULL_MESSAGE(actual, msg);
+	TEST_ASSERT_EQUAL_PTR_MESSAGE(expected->buffptr, actual->buffptr, msg);
+	TEST_ASSERT_EQUAL_UINT_MESSAGE(expected->size, actual->size, msg);
+	TEST_ASSERT_EQUAL_UINT_MESSAGE(expected_offset, actual_offset, msg);
+}
+
+static void run_sequence(unsigned long seed)
+{
+	struct aesd_circular_buffer buffer;
+	struct model m;
+	char msg[96];
+	int op;
+
+	aesd_circular_buffer_init(&buffer);
+	memset(&m, 0, sizeof(m));
+
+	for (op = 0; op < MODEL_OPS_PER_SEQUENCE; op++) {
+		snprintf(msg, sizeof(msg), "seed %lu op %d", seed, op);
+		if (model_rand() % 3 == 0) {
+			/* Mostly non-empty writes, with the occasional zero length one */
+			struct aesd_buffer_entry e;
+			e.buffptr = &model_pool[m.adds];
+			e.size = (model_rand() % 8 == 0) ? 0 : 1 + model_rand() % MODEL_MAX_ENTRY_SIZE;
+			aesd_circular_buffer_add_entry(&buffer, &e);
+			model_add(&m, &e);
+
+			TEST_ASSERT_EQUAL_MESSAGE(m.count == RING, buffer.full, msg);
+			TEST_ASSERT_EQUAL_UINT_MESSAGE(m.adds % RING, buffer.in_offs, msg);
+			TEST_ASSERT_EQUAL_UINT_MESSAGE(m.count == RING ? m.adds % RING : 0, buffer.out_offs, msg);
+		} else {
+			/* Offsets up to a few bytes past the end so misses are covered too */
+			size_t offset = model_rand() % (m.total + 4);
+			check_find(&buffer, &m, offset, msg);
+		}
+	}
+
+	/* Finish with an exhaustive sweep over every offset of the final state */
+	{
+		size_t offset;
+		for (offset = 0; offset <= m.total; offset++) {
+			snprintf(msg, sizeof(msg), "seed %lu final offset %zu", seed, offset);
+			check_find(&buffer, &m, offset, msg);
+		}
+	}
+}
+
+void test_circular_buffer_random_model()
+{
+	unsigned long base_seed = 0x5eed;
+	unsigned long s;
+	const char *env = getenv("AESD_TEST_SEED");
+
+	if (env) {
+		base_seed = strtoul(env, NULL, 0);
+	}
+	for (s = 0; s < MODEL_SEQUENCES; s++) {
+		/* xorshift must not start from zero */
+		model_rng = ((uint64_t)(base_seed + s) << 1) | 1;
+		run_sequence(base_seed + s);
+	}
+}
@@ -0,0 +1,159 @@
+/**
+ * @file stress_circular_buffer.c
+ * @brief Multi-threaded stress test of the circular buffer behind a mutex
+ *
+ * Uses the buffer the way the aesdchar driver does: writers allocate each
+ * entry, add it under the lock and free whatever entry it displaced after
+ * unlocking; readers look up random offsets under the lock and check the
+ * returned bytes.  Built with AddressSanitizer and ThreadSanitizer by CMake
+ * (stress_circular_buffer target) so use-after-free or unlocked access in a
+ * reworked buffer shows up here instead of as a kernel oops.
+ *
+ * Usage: stress_circular_buffer_<asan|tsan> [writers] [readers] [ops per thread]
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "aesd-circular-buffer.h"
+
+#define STRESS_MAX_ENTRY_SIZE 256
+
+static struct aesd_circular_buffer g_buffer;
+static size_t g_total_size;
+static pthread_mutex_t g_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned long g_ops = 20000;
+static volatile int g_failed;
+
+static uint32_t next_rand(uint64_t *s)
+{
+    uint64_t x = *s;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    *s = x;
+    return (uint32_t)(x >> 32);
+}
+
+static void fail(const char *what, size_t offset)
+{
+    fprintf(stderr, "stress: %s at offset %zu\n", what, offset);
+    g_failed = 1;
+}
+
+/* Entries are a run of one fill byte terminated by '\n', like a written line */
+static void *writer_thread(void *arg)
+{
+    uint64_t rng = (uintptr_t)arg * 0x9e3779b97f4a7c15ull + 1;
+    unsigned long i;
+
+    for (i = 0; i < g_ops && !g_failed; i++) {
+        struct aesd_buffer_entry add, old = { NULL, 0 };
+        size_t size = 1 + next_rand(&rng) % STRESS_MAX_ENTRY_SIZE;
+        char *buf = malloc(size);
+
+        if (!buf) {
+            fail("malloc failed", 0);
+            break;
+        }
+        memset(buf, 'a' + (int)(i % 26), size - 1);
+        buf[size - 1] = '\n';
+        add.buffptr = buf;
+        add.size = size;
+
+        pthread_mutex_lock(&g_lock);
+        if (g_buffer.full) {
+            old = g_buffer.entry[g_buffer.in_offs];
+        }
+        aesd_circular_buffer_add_entry(&g_buffer, &add);
+        g_total_size += size - old.size;
+        pthread_mutex_unlock(&g_lock);
+
+        free((void *)old.buffptr);
+    }
+    return NULL;
+}
+
+static void *reader_thread(void *arg)
+{
+    uint64_t rng = (uintptr_t)arg * 0xda942042e4dd58b5ull + 1;
+    unsigned long i;
+
+    for (i = 0; i < g_ops && !g_failed; i++) {
+        struct aesd_buffer_entry *e, *it;
+        size_t offset, entry_offset = 0, sum = 0;
+        uint8_t index;
+
+        pthread_mutex_lock(&g_lock);
+        AESD_CIRCULAR_BUFFER_FOREACH(it, &g_buffer, index) {
+            sum += it->size;
+        }
+        if (sum != g_total_size) {
+            fail("entry sizes do not add up to the total", sum);
+        }
+        if (g_total_size > 0) {
+            offset = next_rand(&rng) % g_total_size;
+            e = aesd_circular_buffer_find_entry_offset_for_fpos(&g_buffer, offset, &entry_offset);
+            if (!e) {
+                fail("offset inside the buffer not found", offset);
+            } else if (entry_offset >= e->size) {
+                fail("entry offset past the end of the entry", offset);
+            } else {
+                char expect = (entry_offset == e->size - 1) ? '\n' : e->buffptr[0];
+                if (e->buffptr[entry_offset] != expect || e->buffptr[e->size - 1] != '\n') {
+                    fail("entry contents corrupted", offset);
+                }
+            }
+            if (aesd_circular_buffer_find_entry_offset_for_fpos(&g_buffer, g_total_size, &entry_offset)) {
+                fail("offset past the end returned an entry", g_total_size);
+            }
+        }
+        pthread_mutex_unlock(&g_lock);
+    }
+    return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned long writers = 4, readers = 4, i;
+    pthread_t *tids;
+    struct aesd_buffer_entry *e;
+    uint8_t index;
+
+    if (argc > 1) writers = strtoul(argv[1], NULL, 10);
+    if (argc > 2) readers = strtoul(argv[2], NULL, 10);
+    if (argc > 3) g_ops = strtoul(argv[3], NULL, 10);
+    if (writers == 0 || g_ops == 0) {
+        fprintf(stderr, "Usage: %s [writers] [readers] [ops per thread]\n", argv[0]);
+        return 1;
+    }
+
+    aesd_circular_buffer_init(&g_buffer);
+    tids = calloc(writers + readers, sizeof(*tids));
+    if (!tids) return 1;
+
+    for (i = 0; i < writers + readers; i++) {
+        void *(*fn)(void *) = (i < writers) ? writer_thread : reader_thread;
+        if (pthread_create(&tids[i], NULL, fn, (void *)(uintptr_t)(i + 1)) != 0) {
+            fprintf(stderr, "stress: pthread_create failed\n");
+            return 1;
+        }
+    }
+    for (i = 0; i < writers + readers; i++) {
+        pthread_join(tids[i], NULL);
+    }
+
+    AESD_CIRCULAR_BUFFER_FOREACH(e, &g_buffer, index) {
+        free((void *)e->buffptr);
+    }
+    free(tids);
+
+    printf("stress: %lu writers, %lu readers, %lu ops each: %s\n",
+           writers, readers, g_ops, g_failed ? "FAILED" : "passed");
+    return g_failed ? 1 : 0;
+}